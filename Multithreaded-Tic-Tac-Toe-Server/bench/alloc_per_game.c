@@ -0,0 +1,174 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+
+#include "protocol.h"
+#include "session.h"
+#include "proto_decoder.h"
+#include "jeux_globals.h"
+#include "users_cache.h"
+
+/*
+ * Count the heap allocations made by the server per game played.
+ *
+ * Two sessions are opened on socketpairs and driven directly through
+ * jeux_session_dispatch(), as a service thread or reactor would after
+ * decoding packets: both log in once, then play the same five-move game
+ * over and over (INVITE, ACCEPT, MOVE x 5, which also ends the game).
+ * The binary is linked with --wrap for malloc, calloc, realloc and free,
+ * so every call the server makes is counted, and the counts taken while
+ * playing are divided by the number of games and moves.  Build with
+ * "make bench NO_POOL=1" (after "make clean") to compare with plain malloc.
+ *
+ * usage: alloc_per_game [games]
+ */
+
+#ifdef DEBUG
+int _debug_packets_ = 0;
+#endif
+
+#define WARMUP_GAMES 100        // games played before counting starts
+
+static long num_mallocs;        // malloc, calloc and realloc calls
+static long num_frees;
+
+void *__real_malloc(size_t size);
+void *__real_calloc(size_t nmemb, size_t size);
+void *__real_realloc(void *ptr, size_t size);
+void __real_free(void *ptr);
+
+void *__wrap_malloc(size_t size){
+    num_mallocs++;
+    return __real_malloc(size);
+}
+
+void *__wrap_calloc(size_t nmemb, size_t size){
+    num_mallocs++;
+    return __real_calloc(nmemb, size);
+}
+
+void *__wrap_realloc(void *ptr, size_t size){
+    num_mallocs++;
+    return __real_realloc(ptr, size);
+}
+
+void __wrap_free(void *ptr){
+    if(ptr != NULL){
+        num_frees++;
+    }
+    __real_free(ptr);
+}
+
+typedef struct peer {
+    JEUX_SESSION session;       // server side of the connection
+    int fd;                     // client side of the connection
+    PROTO_DECODER decoder;      // for the packets the server sent
+} PEER;
+
+static int num_ended;           // ENDED packets received by either peer
+static int num_nacks;
+
+// hand one packet to the server, as if it had just been decoded
+static void send_request(PEER *peer, JEUX_PACKET_TYPE type, int id, int role, char *payload){
+    JEUX_PACKET_HEADER hdr;
+    memset(&hdr, 0, sizeof(hdr));
+    hdr.type = type;
+    hdr.id = id;
+    hdr.role = role;
+    hdr.size = payload != NULL ? strlen(payload) : 0;
+    jeux_session_dispatch(&peer->session, &hdr, payload);
+}
+
+// read and tally whatever the server has sent to a peer
+static void drain(PEER *peer){
+    JEUX_PACKET_HEADER hdr;
+    void *payload;
+    while(proto_decoder_fill(&peer->decoder, peer->fd, MSG_DONTWAIT) > 0){
+        while(proto_decoder_next(&peer->decoder, &hdr, &payload) == 1){
+            if(hdr.type == JEUX_ENDED_PKT)
+                num_ended++;
+            else if(hdr.type == JEUX_NACK_PKT)
+                num_nacks++;
+        }
+    }
+}
+
+static int open_peer(PEER *peer, char *name){
+    int sv[2];
+    if(socketpair(AF_UNIX, SOCK_STREAM, 0, sv) == -1){
+        perror("socketpair");
+        return -1;
+    }
+    peer->fd = sv[1];
+    if(jeux_session_open(&peer->session, sv[0]) == -1 || proto_decoder_init(&peer->decoder, 0) == -1){
+        fprintf(stderr, "cannot open a session\n");
+        return -1;
+    }
+    send_request(peer, JEUX_LOGIN_PKT, 0, 0, name);
+    return 0;
+}
+
+/*
+ * X (alice, the source) wins along the top row.  Each side's ID for the
+ * invitation is 0, since the previous game's invitation has been removed.
+ */
+static void play_game(PEER *alice, PEER *bob){
+    send_request(alice, JEUX_INVITE_PKT, 0, SECOND_PLAYER_ROLE, "bob");
+    send_request(bob, JEUX_ACCEPT_PKT, 0, 0, NULL);
+    send_request(alice, JEUX_MOVE_PKT, 0, 0, "1");
+    send_request(bob, JEUX_MOVE_PKT, 0, 0, "4");
+    send_request(alice, JEUX_MOVE_PKT, 0, 0, "2");
+    send_request(bob, JEUX_MOVE_PKT, 0, 0, "5");
+    send_request(alice, JEUX_MOVE_PKT, 0, 0, "3");
+    drain(alice);
+    drain(bob);
+}
+
+int main(int argc, char *argv[]){
+    int games = argc > 1 ? atoi(argv[1]) : 10000;
+    PEER alice, bob;
+
+    if(games <= 0){
+        fprintf(stderr, "usage: %s [games]\n", argv[0]);
+        exit(EXIT_FAILURE);
+    }
+    client_registry = creg_init();
+    player_registry = preg_init();
+    if(open_peer(&alice, "alice") == -1 || open_peer(&bob, "bob") == -1){
+        exit(EXIT_FAILURE);
+    }
+    for(int i = 0; i < WARMUP_GAMES; i++){
+        play_game(&alice, &bob);
+    }
+
+    num_ended = num_nacks = 0;
+    long mallocs = num_mallocs, frees = num_frees;
+    for(int i = 0; i < games; i++){
+        play_game(&alice, &bob);
+    }
+    mallocs = num_mallocs - mallocs;
+    frees = num_frees - frees;
+
+    if(num_ended != 2 * games || num_nacks != 0){
+        fprintf(stderr, "games did not go as scripted: %d ENDED, %d NACK for %d games\n",
+                num_ended, num_nacks, games);
+        exit(EXIT_FAILURE);
+    }
+    printf("games: %d, moves: %d\n", games, 5 * games);
+    printf("allocations: %ld (%.3f per game, %.3f per move)\n",
+           mallocs, (double) mallocs / games, (double) mallocs / (5 * games));
+    printf("frees: %ld (%.3f per game)\n", frees, (double) frees / games);
+
+    jeux_session_close(&alice.session);
+    jeux_session_close(&bob.session);
+    proto_decoder_fini(&alice.decoder);
+    proto_decoder_fini(&bob.decoder);
+    close(alice.fd);
+    close(bob.fd);
+    creg_fini(client_registry);
+    preg_fini(player_registry);
+    users_cache_fini();
+    return 0;
+}
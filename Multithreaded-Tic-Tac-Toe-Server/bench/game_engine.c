@@ -0,0 +1,276 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "game.h"
+#include "game_ext.h"
+
+/*
+ * Compare the bitboard GAME engine with the array-based one it replaced.
+ *
+ * The same random games (random orders of the nine squares, played until
+ * someone wins or the board is full) are played with both engines: the
+ * real one through game_apply_move() and game_get_winner(), and a copy of
+ * the former implementation below, with its int board[9] and its eight
+ * three-way comparisons after every move.  Both take the game's mutex
+ * per move, as they do in the server.  The results must agree game by
+ * game; the time per move and the size of a game are reported.
+ *
+ * Then random games on the larger boards, gomoku and qubic, are played
+ * with the kernels that look for lines with AVX2 and with those that use
+ * plain 64-bit words, which must agree game by game, and the time per
+ * move of each is reported.
+ *
+ * usage: game_engine [games]
+ */
+
+#ifdef DEBUG
+int _debug_packets_ = 0;
+#endif
+
+#define NUM_ORDERS 1024         // distinct random games, played round robin
+
+// the GAME of the former implementation
+typedef struct array_game {
+    int turn_X;
+    int num_turns;
+    int board[9];
+    GAME_ROLE winner;
+    int terminated;
+    pthread_mutex_t lock;
+    int ref_count;
+} ARRAY_GAME;
+
+static int array_win(ARRAY_GAME *game, int player){
+    return ((game->board[0] == player && game->board[1] == player && game->board[2] == player) ||
+        (game->board[3] == player && game->board[4] == player && game->board[5] == player) ||
+        (game->board[6] == player && game->board[7] == player && game->board[8] == player) ||
+        (game->board[0] == player && game->board[3] == player && game->board[6] == player) ||
+        (game->board[1] == player && game->board[4] == player && game->board[7] == player) ||
+        (game->board[2] == player && game->board[5] == player && game->board[8] == player) ||
+        (game->board[0] == player && game->board[4] == player && game->board[8] == player) ||
+        (game->board[2] == player && game->board[4] == player && game->board[6] == player))
+    ? 1 : 0;
+}
+
+static void array_init(ARRAY_GAME *game){
+    memset(game, 0, sizeof(ARRAY_GAME));
+    pthread_mutex_init(&game->lock, NULL);
+    game->turn_X = 1;
+    game->ref_count = 1;
+}
+
+static int array_apply_move(ARRAY_GAME *game, int player, int square){
+    pthread_mutex_lock(&game->lock);
+    if (square < 1 || square > 9 || game->board[square - 1] != 0
+        || (player == 1 && game->turn_X != 1)
+        || (player == 2 && game->turn_X != 0)
+        || game->terminated) {
+        pthread_mutex_unlock(&game->lock);
+        return -1;
+    }
+    game->board[square - 1] = player;
+    game->turn_X = game->turn_X ? 0 : 1;
+    if(array_win(game, 1)){
+        game->winner = FIRST_PLAYER_ROLE;
+        game->terminated = 1;
+    }
+    if(array_win(game, 2)){
+        game->winner = SECOND_PLAYER_ROLE;
+        game->terminated = 1;
+    }
+    game->num_turns++;
+    if(game->num_turns >= 9){
+        game->terminated = 1;
+    }
+    pthread_mutex_unlock(&game->lock);
+    return 0;
+}
+
+static double now(void){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int orders[NUM_ORDERS][9];
+static GAME_MOVE *moves[3][10];         // moves[player][square]
+
+static void make_orders(void){
+    srand(1);
+    for(int g = 0; g < NUM_ORDERS; g++){
+        for(int i = 0; i < 9; i++){
+            orders[g][i] = i + 1;
+        }
+        for(int i = 8; i > 0; i--){
+            int j = rand() % (i + 1);
+            int t = orders[g][i];
+            orders[g][i] = orders[g][j];
+            orders[g][j] = t;
+        }
+    }
+}
+
+static void make_moves(void){
+    GAME *scratch = game_create();
+    char str[8];
+    for(int player = 1; player <= 2; player++){
+        for(int square = 1; square <= 9; square++){
+            snprintf(str, sizeof(str), "%d<-%c", square, player == 1 ? 'X' : 'O');
+            moves[player][square] = game_parse_move(scratch, NULL_ROLE, str);
+        }
+    }
+    game_unref(scratch, "moves parsed");
+}
+
+// play game number g with the bitboard engine; returns the winner, and the moves made in *nmoves
+static GAME_ROLE play_bitboard(int g, long *nmoves){
+    GAME *game = game_create();
+    for(int i = 0; i < 9 && !game_is_over(game); i++){
+        if(game_apply_move(game, moves[i % 2 + 1][orders[g][i]]) == -1){
+            fprintf(stderr, "move %d of game %d rejected\n", i, g);
+            exit(EXIT_FAILURE);
+        }
+        (*nmoves)++;
+    }
+    GAME_ROLE winner = game_get_winner(game);
+    game_unref(game, "game played");
+    return winner;
+}
+
+static GAME_ROLE play_array(int g, long *nmoves){
+    ARRAY_GAME game;
+    array_init(&game);
+    for(int i = 0; i < 9 && !game.terminated; i++){
+        if(array_apply_move(&game, i % 2 + 1, orders[g][i]) == -1){
+            fprintf(stderr, "move %d of game %d rejected\n", i, g);
+            exit(EXIT_FAILURE);
+        }
+        (*nmoves)++;
+    }
+    pthread_mutex_destroy(&game.lock);
+    return game.terminated ? game.winner : NULL_ROLE;
+}
+
+#define VARIANT_ORDERS 64        // random games on each of the larger boards
+
+static int variant_orders[VARIANT_ORDERS][GAME_MAX_SQUARES];
+static GAME_MOVE *variant_moves[2][GAME_MAX_SQUARES + 1];     // variant_moves[player - 1][square]
+
+// play random game g on board v; returns the winner, and the moves made in *nmoves
+static GAME_ROLE play_variant(const GAME_VARIANT *v, int g, long *nmoves){
+    int n = v->width * v->height * v->depth;
+    GAME *game = game_create_variant(v);
+    for(int i = 0; i < n && !game_is_over(game); i++){
+        if(game_apply_move(game, variant_moves[i % 2][variant_orders[g][i]]) == -1){
+            fprintf(stderr, "move %d of game %d rejected\n", i, g);
+            exit(EXIT_FAILURE);
+        }
+        (*nmoves)++;
+    }
+    GAME_ROLE winner = game_get_winner(game);
+    game_unref(game, "game played");
+    return winner;
+}
+
+// time games on a larger board with the AVX2 kernels and then the scalar ones
+static void bench_variant(const char *board, int games){
+    GAME_VARIANT v;
+    GAME_ROLE winners[VARIANT_ORDERS];
+    char str[16];
+    game_parse_variant(board, &v);
+    int n = v.width * v.height * v.depth;
+    GAME *scratch = game_create_variant(&v);
+    for(int square = 1; square <= n; square++){
+        for(int player = 1; player <= 2; player++){
+            snprintf(str, sizeof(str), "%d<-%c", square, player == 1 ? 'X' : 'O');
+            variant_moves[player - 1][square] = game_parse_move(scratch, NULL_ROLE, str);
+        }
+    }
+    game_unref(scratch, "moves parsed");
+    for(int g = 0; g < VARIANT_ORDERS; g++){
+        for(int i = 0; i < n; i++){
+            int j = rand() % (i + 1);
+            variant_orders[g][i] = variant_orders[g][j];
+            variant_orders[g][j] = i + 1;
+        }
+    }
+
+    int first = 1;
+    for(int avx2 = 1; avx2 >= 0; avx2--){
+        if(game_use_avx2(avx2) != avx2){
+            printf("%-8s avx2:   not supported\n", board);
+            continue;
+        }
+        long nmoves = 0;
+        double t0 = now();
+        for(int g = 0; g < games; g++){
+            GAME_ROLE winner = play_variant(&v, g % VARIANT_ORDERS, &nmoves);
+            if(g < VARIANT_ORDERS && first)
+                winners[g] = winner;
+            else if(g < VARIANT_ORDERS && winner != winners[g]){
+                fprintf(stderr, "kernels disagree about the winner of game %d on %s\n", g, board);
+                exit(EXIT_FAILURE);
+            }
+        }
+        double t1 = now();
+        first = 0;
+        printf("%-8s %s %.1f ns per move\n", board, avx2 ? "avx2:  " : "scalar:", (t1 - t0) * 1e9 / nmoves);
+    }
+    game_use_avx2(1);
+    for(int square = 1; square <= n; square++){
+        game_free_move(variant_moves[0][square]);
+        game_free_move(variant_moves[1][square]);
+    }
+}
+
+int main(int argc, char *argv[]){
+    int games = argc > 1 ? atoi(argv[1]) : 1000000;
+    if(games <= 0){
+        fprintf(stderr, "usage: %s [games]\n", argv[0]);
+        exit(EXIT_FAILURE);
+    }
+    make_orders();
+    make_moves();
+
+    for(int g = 0; g < NUM_ORDERS; g++){
+        long n = 0;
+        if(play_bitboard(g, &n) != play_array(g, &n)){
+            fprintf(stderr, "engines disagree about the winner of game %d\n", g);
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    long bit_moves = 0, array_moves = 0;
+    int bit_wins = 0, array_wins = 0;
+    double t0 = now();
+    for(int g = 0; g < games; g++){
+        bit_wins += play_bitboard(g % NUM_ORDERS, &bit_moves) != NULL_ROLE;
+    }
+    double t1 = now();
+    for(int g = 0; g < games; g++){
+        array_wins += play_array(g % NUM_ORDERS, &array_moves) != NULL_ROLE;
+    }
+    double t2 = now();
+
+    printf("games: %d, decisive: %d, moves: %ld\n", games, bit_wins, bit_moves);
+    printf("bitboard: %zu bytes per game, %.1f ns per move\n",
+           game_footprint(), (t1 - t0) * 1e9 / bit_moves);
+    printf("array:    %zu bytes per game, %.1f ns per move\n",
+           sizeof(ARRAY_GAME), (t2 - t1) * 1e9 / array_moves);
+    if(bit_wins != array_wins || bit_moves != array_moves){
+        fprintf(stderr, "engines disagree\n");
+        exit(EXIT_FAILURE);
+    }
+    for(int player = 1; player <= 2; player++){
+        for(int square = 1; square <= 9; square++){
+            game_free_move(moves[player][square]);
+        }
+    }
+
+    bench_variant("15x15,5", games / 20 > 0 ? games / 20 : 1);
+    bench_variant("4x4x4,4", games / 5 > 0 ? games / 5 : 1);
+    return 0;
+}
@@ -0,0 +1,446 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <getopt.h>
+#include <netdb.h>
+#include <pthread.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/resource.h>
+
+#include "protocol.h"
+#include "game.h"
+#include "proto_decoder.h"
+
+/*
+ * Load generator for a running Jeux server.
+ *
+ * Opens a number of connections, logs each in under its own name, and
+ * pairs them up: in each pair the first invites the second, which
+ * accepts, and they play one of a few scripted games (an X win, an O win
+ * and a draw, in turn) to the end, then start another.  New games are
+ * started at a target rate, spread over the threads, or as fast as the
+ * server allows.  Each thread drives its share of the pairs from its own
+ * epoll(7) set.
+ *
+ * The latency measured is from sending a MOVE to the opponent receiving
+ * the MOVED it causes.  MOVE headers are time-stamped with
+ * CLOCK_MONOTONIC when sent, as the server stamps every header it
+ * queues, so with the server on the same host the timestamp of the MOVED
+ * also gives the part of the latency spent before the server queued it.
+ *
+ * At the end one line of JSON is printed on stdout, with a summary for
+ * people on stderr.
+ *
+ * usage: loadgen -p <port> [-h <host>] [-c <connections>] [-t <threads>]
+ *                [-r <games per second>] [-d <seconds>] [-N]
+ */
+
+#ifdef DEBUG
+int _debug_packets_ = 0;
+#endif
+
+#define MAX_EVENTS 256
+#define DRAIN_SECS 2            // how long games in progress may take to finish at the end
+#define HIST_SUB_BITS 4         // 16 buckets per power of two: within about 6%
+#define HIST_SUB (1 << HIST_SUB_BITS)
+#define HIST_SIZE ((64 - HIST_SUB_BITS + 1) * HIST_SUB)
+
+// the squares of each scripted game, X first
+static const char *scripts[] = {
+    "14253",                    // X wins
+    "142596",                   // O wins
+    "123546879",                // draw
+};
+#define NUM_SCRIPTS (sizeof(scripts) / sizeof(scripts[0]))
+
+typedef struct histogram {
+    uint64_t counts[HIST_SIZE];     // of nanoseconds, in log-linear buckets
+    uint64_t total;
+    uint64_t max;
+} HISTOGRAM;
+
+struct pair;
+
+typedef struct conn {
+    int fd;
+    char name[32];              // logged in as
+    int side;                   // 0 for the inviter, who plays X, 1 for the other
+    int id;                     // invitation ID for the game in progress
+    struct pair *pair;
+    PROTO_DECODER decoder;
+} CONN;
+
+typedef struct pair {
+    CONN conns[2];
+    int playing;                // whether a game is in progress
+    const char *script;         // of the game in progress
+    int moves;                  // squares of the script played so far
+    int ended;                  // ENDED packets received for it
+    uint64_t sent;              // when the last MOVE was sent
+    struct pair *next_idle;
+} PAIR;
+
+typedef struct worker {
+    pthread_t tid;
+    int epfd;
+    PAIR *pairs;
+    int num_pairs;
+    PAIR *idle;                 // waiting for a game to be started
+    double rate;                // games per second for this thread, 0 for no limit
+    long started, games, moves, errors;
+    HISTOGRAM latency;          // MOVE sent to MOVED received
+    HISTOGRAM server;           // MOVE sent to MOVED queued by the server
+} WORKER;
+
+static char *host = "127.0.0.1";
+static char *port = NULL;
+static int num_conns = 100;
+static int num_threads = 1;
+static double target_rate = 0;
+static double duration = 10;
+static int nodelay = 0;
+static uint64_t start_time, stop_time;
+
+static uint64_t now_ns(void){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static int hist_index(uint64_t v){
+    if(v < HIST_SUB)
+        return v;
+    int msb = 63 - __builtin_clzll(v);
+    int shift = msb - HIST_SUB_BITS;
+    return (shift + 1) * HIST_SUB + (int) ((v >> shift) - HIST_SUB);
+}
+
+// the middle of a bucket
+static uint64_t hist_value(int i){
+    if(i < HIST_SUB)
+        return i;
+    int shift = i / HIST_SUB - 1;
+    uint64_t low = (uint64_t) (HIST_SUB + i % HIST_SUB) << shift;
+    return low + ((1ull << shift) >> 1);
+}
+
+static void hist_add(HISTOGRAM *h, uint64_t v){
+    h->counts[hist_index(v)]++;
+    h->total++;
+    if(v > h->max)
+        h->max = v;
+}
+
+static void hist_merge(HISTOGRAM *into, HISTOGRAM *h){
+    for(int i = 0; i < HIST_SIZE; i++)
+        into->counts[i] += h->counts[i];
+    into->total += h->total;
+    if(h->max > into->max)
+        into->max = h->max;
+}
+
+static uint64_t hist_percentile(HISTOGRAM *h, double p){
+    if(h->total == 0)
+        return 0;
+    uint64_t rank = (uint64_t) (p / 100 * h->total);
+    if(rank >= h->total)
+        rank = h->total - 1;
+    uint64_t seen = 0;
+    for(int i = 0; i < HIST_SIZE; i++){
+        seen += h->counts[i];
+        if(seen > rank)
+            return hist_value(i) < h->max ? hist_value(i) : h->max;
+    }
+    return h->max;
+}
+
+static int send_packet(CONN *conn, JEUX_PACKET_TYPE type, int id, int role, const char *payload){
+    char buf[sizeof(JEUX_PACKET_HEADER) + 64];
+    JEUX_PACKET_HEADER *hdr = (JEUX_PACKET_HEADER *) buf;
+    size_t size = payload != NULL ? strlen(payload) : 0;
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    memset(hdr, 0, sizeof(*hdr));
+    hdr->type = type;
+    hdr->id = id;
+    hdr->role = role;
+    hdr->size = htons(size);
+    hdr->timestamp_sec = htonl(ts.tv_sec);
+    hdr->timestamp_nsec = htonl(ts.tv_nsec);
+    memcpy(buf + sizeof(*hdr), payload, size);
+    // requests are small enough that the socket buffer takes them whole
+    size_t len = sizeof(*hdr) + size;
+    char *p = buf;
+    while(len > 0){
+        ssize_t n = send(conn->fd, p, len, MSG_NOSIGNAL);
+        if(n == -1){
+            if(errno == EINTR)
+                continue;
+            return -1;
+        }
+        p += n;
+        len -= n;
+    }
+    return 0;
+}
+
+static int open_conn(CONN *conn, struct addrinfo *addr){
+    conn->fd = socket(addr->ai_family, addr->ai_socktype, addr->ai_protocol);
+    if(conn->fd == -1 || connect(conn->fd, addr->ai_addr, addr->ai_addrlen) == -1)
+        return -1;
+    if(nodelay){
+        int one = 1;
+        setsockopt(conn->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    }
+    if(proto_decoder_init(&conn->decoder, 0) == -1 || send_packet(conn, JEUX_LOGIN_PKT, 0, 0, conn->name) == -1)
+        return -1;
+    // the LOGIN is answered before anything else can be sent to the connection
+    JEUX_PACKET_HEADER hdr;
+    void *payload;
+    while(proto_decoder_next(&conn->decoder, &hdr, &payload) == 0){
+        if(proto_decoder_fill(&conn->decoder, conn->fd, 0) <= 0)
+            return -1;
+    }
+    return hdr.type == JEUX_ACK_PKT ? 0 : -1;
+}
+
+static void send_move(WORKER *w, PAIR *pair){
+    CONN *mover = &pair->conns[pair->moves % 2];
+    char square[2] = { pair->script[pair->moves], '\0' };
+    pair->sent = now_ns();
+    if(send_packet(mover, JEUX_MOVE_PKT, mover->id, 0, square) == -1)
+        w->errors++;
+    pair->moves++;
+    w->moves++;
+}
+
+static void start_game(WORKER *w, PAIR *pair){
+    pair->playing = 1;
+    pair->script = scripts[w->started % NUM_SCRIPTS];
+    pair->moves = 0;
+    pair->ended = 0;
+    w->started++;
+    if(send_packet(&pair->conns[0], JEUX_INVITE_PKT, 0, SECOND_PLAYER_ROLE, pair->conns[1].name) == -1)
+        w->errors++;
+}
+
+static void game_over(WORKER *w, PAIR *pair){
+    pair->playing = 0;
+    w->games++;
+    pair->next_idle = w->idle;
+    w->idle = pair;
+}
+
+static void handle_packet(WORKER *w, CONN *conn, JEUX_PACKET_HEADER *hdr){
+    PAIR *pair = conn->pair;
+    switch(hdr->type){
+    case JEUX_ACK_PKT:
+        break;
+    case JEUX_INVITED_PKT:
+        conn->id = hdr->id;
+        if(send_packet(conn, JEUX_ACCEPT_PKT, hdr->id, 0, NULL) == -1)
+            w->errors++;
+        break;
+    case JEUX_ACCEPTED_PKT:
+        conn->id = hdr->id;
+        send_move(w, pair);
+        break;
+    case JEUX_MOVED_PKT: {
+        uint64_t now = now_ns();
+        uint64_t queued = (uint64_t) hdr->timestamp_sec * 1000000000 + hdr->timestamp_nsec;
+        hist_add(&w->latency, now - pair->sent);
+        hist_add(&w->server, queued > pair->sent ? queued - pair->sent : 0);
+        if(pair->script[pair->moves] != '\0')
+            send_move(w, pair);
+        break;
+    }
+    case JEUX_ENDED_PKT:
+        if(++pair->ended == 2)
+            game_over(w, pair);
+        break;
+    default:
+        // a NACK, or a game or invitation going away: the pair is out of step
+        w->errors++;
+        break;
+    }
+}
+
+// drain what a connection has received; -1 if it was closed
+static int handle_input(WORKER *w, CONN *conn){
+    JEUX_PACKET_HEADER hdr;
+    void *payload;
+    for(;;){
+        ssize_t n = proto_decoder_fill(&conn->decoder, conn->fd, MSG_DONTWAIT);
+        if(n == 0 || (n == -1 && errno != EAGAIN && errno != EINTR))
+            return -1;
+        while(proto_decoder_next(&conn->decoder, &hdr, &payload) == 1)
+            handle_packet(w, conn, &hdr);
+        if(n == -1)
+            return 0;
+    }
+}
+
+static void *worker_main(void *arg){
+    WORKER *w = arg;
+    struct epoll_event events[MAX_EVENTS];
+    uint64_t drain_until = stop_time + (uint64_t) DRAIN_SECS * 1000000000;
+    for(;;){
+        uint64_t now = now_ns();
+        int busy = w->idle == NULL || w->started > w->games;
+        if(now >= stop_time && (!busy || now >= drain_until))
+            break;
+        // start as many games as the rate allows by now
+        int timeout = 100;
+        while(now < stop_time && w->idle != NULL){
+            if(w->rate > 0){
+                double due = (now - start_time) / 1e9 * w->rate;
+                if(w->started >= due){
+                    timeout = (int) ((w->started + 1 - due) / w->rate * 1000) + 1;
+                    break;
+                }
+            }
+            PAIR *pair = w->idle;
+            w->idle = pair->next_idle;
+            start_game(w, pair);
+        }
+        int n = epoll_wait(w->epfd, events, MAX_EVENTS, timeout);
+        for(int i = 0; i < n; i++){
+            CONN *conn = events[i].data.ptr;
+            if(handle_input(w, conn) == -1){
+                epoll_ctl(w->epfd, EPOLL_CTL_DEL, conn->fd, NULL);
+                w->errors++;
+            }
+        }
+    }
+    return NULL;
+}
+
+static void raise_fd_limit(int needed){
+    struct rlimit rl;
+    if(getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < (rlim_t) needed){
+        rl.rlim_cur = rl.rlim_max < (rlim_t) needed ? rl.rlim_max : (rlim_t) needed;
+        setrlimit(RLIMIT_NOFILE, &rl);
+    }
+}
+
+static void print_hist(char *name, HISTOGRAM *h){
+    printf("\"%s\":{\"count\":%llu,\"p50\":%.1f,\"p99\":%.1f,\"p999\":%.1f,\"max\":%.1f}", name,
+           (unsigned long long) h->total, hist_percentile(h, 50) / 1e3, hist_percentile(h, 99) / 1e3,
+           hist_percentile(h, 99.9) / 1e3, h->max / 1e3);
+}
+
+static void usage(char *prog){
+    fprintf(stderr, "usage: %s -p <port> [-h <host>] [-c <connections>] [-t <threads>]\n"
+            "          [-r <games per second>] [-d <seconds>] [-N]\n", prog);
+    exit(EXIT_FAILURE);
+}
+
+int main(int argc, char *argv[]){
+    int opt;
+    while((opt = getopt(argc, argv, "h:p:c:t:r:d:N")) != -1){
+        switch(opt){
+        case 'h': host = optarg; break;
+        case 'p': port = optarg; break;
+        case 'c': num_conns = atoi(optarg); break;
+        case 't': num_threads = atoi(optarg); break;
+        case 'r': target_rate = atof(optarg); break;
+        case 'd': duration = atof(optarg); break;
+        case 'N': nodelay = 1; break;
+        default: usage(argv[0]);
+        }
+    }
+    int num_pairs = num_conns / 2;
+    if(port == NULL || num_pairs < 1 || num_threads < 1 || num_threads > num_pairs
+       || target_rate < 0 || duration <= 0)
+        usage(argv[0]);
+    raise_fd_limit(2 * num_pairs + num_threads + 16);
+
+    struct addrinfo hints = { .ai_family = AF_UNSPEC, .ai_socktype = SOCK_STREAM }, *addr;
+    int err = getaddrinfo(host, port, &hints, &addr);
+    if(err != 0){
+        fprintf(stderr, "%s:%s: %s\n", host, port, gai_strerror(err));
+        exit(EXIT_FAILURE);
+    }
+
+    // connect and log in everyone first, so that only games are timed
+    PAIR *pairs = calloc(num_pairs, sizeof(PAIR));
+    WORKER *workers = calloc(num_threads, sizeof(WORKER));
+    if(pairs == NULL || workers == NULL){
+        perror("calloc");
+        exit(EXIT_FAILURE);
+    }
+    for(int i = 0; i < num_pairs; i++){
+        for(int side = 0; side < 2; side++){
+            CONN *conn = &pairs[i].conns[side];
+            snprintf(conn->name, sizeof(conn->name), "lg%d.%d", (int) getpid(), 2 * i + side);
+            conn->side = side;
+            conn->pair = &pairs[i];
+            if(open_conn(conn, addr) == -1){
+                fprintf(stderr, "connection %d: %s\n", 2 * i + side, errno ? strerror(errno) : "LOGIN refused");
+                exit(EXIT_FAILURE);
+            }
+        }
+    }
+    freeaddrinfo(addr);
+    for(int t = 0; t < num_threads; t++){
+        WORKER *w = &workers[t];
+        w->pairs = pairs + (long) num_pairs * t / num_threads;
+        w->num_pairs = (long) num_pairs * (t + 1) / num_threads - (long) num_pairs * t / num_threads;
+        w->rate = target_rate / num_threads;
+        if((w->epfd = epoll_create1(0)) == -1){
+            perror("epoll_create1");
+            exit(EXIT_FAILURE);
+        }
+        for(int i = 0; i < w->num_pairs; i++){
+            PAIR *pair = &w->pairs[i];
+            for(int side = 0; side < 2; side++){
+                struct epoll_event ev = { .events = EPOLLIN, .data.ptr = &pair->conns[side] };
+                epoll_ctl(w->epfd, EPOLL_CTL_ADD, pair->conns[side].fd, &ev);
+            }
+            pair->next_idle = w->idle;
+            w->idle = pair;
+        }
+    }
+
+    start_time = now_ns();
+    stop_time = start_time + (uint64_t) (duration * 1e9);
+    for(int t = 0; t < num_threads; t++)
+        pthread_create(&workers[t].tid, NULL, worker_main, &workers[t]);
+    long started = 0, games = 0, moves = 0, errors = 0;
+    static HISTOGRAM latency, server;
+    for(int t = 0; t < num_threads; t++){
+        WORKER *w = &workers[t];
+        pthread_join(w->tid, NULL);
+        started += w->started;
+        games += w->games;
+        moves += w->moves;
+        errors += w->errors;
+        hist_merge(&latency, &w->latency);
+        hist_merge(&server, &w->server);
+    }
+    double elapsed = (now_ns() - start_time) / 1e9;
+    if(elapsed > duration)
+        elapsed = duration;     // games finished while draining count toward the run
+
+    printf("{\"connections\":%d,\"threads\":%d,\"target_rate\":%g,\"duration_s\":%g,"
+           "\"games_started\":%ld,\"games\":%ld,\"games_per_sec\":%.1f,\"moves\":%ld,\"errors\":%ld,",
+           2 * num_pairs, num_threads, target_rate, elapsed, started, games, games / elapsed, moves, errors);
+    print_hist("move_latency_us", &latency);
+    printf(",");
+    print_hist("server_latency_us", &server);
+    printf("}\n");
+    fprintf(stderr, "%ld games in %.1f s (%.1f/s), %ld moves, %ld errors\n"
+            "MOVE -> MOVED: p50 %.1f us, p99 %.1f us, p99.9 %.1f us, max %.1f us\n",
+            games, elapsed, games / elapsed, moves, errors,
+            hist_percentile(&latency, 50) / 1e3, hist_percentile(&latency, 99) / 1e3,
+            hist_percentile(&latency, 99.9) / 1e3, latency.max / 1e3);
+    return errors > 0 ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,264 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/socket.h>
+
+#include "protocol.h"
+#include "protocol_ext.h"
+#include "session.h"
+#include "proto_decoder.h"
+#include "jeux_globals.h"
+#include "users_cache.h"
+#include "ratings.h"
+#include "leaderboard.h"
+#include "matchmaker.h"
+#include "journal.h"
+#include "metrics.h"
+#include "timer.h"
+#include "client_ext.h"
+#include "trace.h"
+
+/*
+ * Stress the invitation and game paths from many threads at once, for
+ * ThreadSanitizer ("make tsan").
+ *
+ * Each thread drives one session, on a socketpair, through
+ * jeux_session_dispatch(), as its service thread would.  The players
+ * invite each other at random and then, on whatever IDs they may have,
+ * accept, decline, revoke, move and resign at random, so that the
+ * conflicting operations of the lock hierarchy in client.c (two players
+ * accepting each other's invitations, an accept racing a revoke, a
+ * resignation racing the final move) happen all the time, along with
+ * leaderboard queries while the ratings worker moves players and seekers
+ * being paired by the matchmaker while they log out, and players
+ * watching the games of others as they are played, ended and abandoned,
+ * and invitations and games expiring on the timer thread (with an
+ * invitation timeout and a move clock of a tick, which run out while a
+ * player now and then sleeps) as they are used.
+ * Players and results go to a journal in a temporary directory.  Every
+ * so often a thread closes its session, which logs out and abandons
+ * everything, and logs in again.  At the end all the sessions are
+ * closed and the client registry must become empty.  Tracing is on
+ * throughout, and the rings are dumped while the threads are still
+ * writing to them.
+ *
+ * usage: lock_stress [threads [operations]]
+ */
+
+#ifdef DEBUG
+int _debug_packets_ = 0;
+#endif
+
+#define MAX_THREADS 64
+#define NUM_IDS 4               // IDs tried for each operation on an invitation
+#define RELOGIN_EVERY 500       // operations between logouts, on average
+#define INVITE_TIMEOUT_MS 100
+#define MOVE_TIMEOUT_MS 100
+#define NAP_EVERY 4000          // operations between naps past the timeouts, on average
+#define NAP_US 150000
+
+typedef struct peer {
+    JEUX_SESSION session;       // server side of the connection
+    int fd;                     // client side of the connection
+    PROTO_DECODER decoder;      // for the packets the server sent
+    char name[16];
+    unsigned int seed;
+    long acks, nacks, ended;
+} PEER;
+
+static int num_threads = 8;
+static long num_ops = 20000;
+static PEER peers[MAX_THREADS];
+
+static void send_request(PEER *peer, JEUX_PACKET_TYPE type, int id, int role, char *payload){
+    JEUX_PACKET_HEADER hdr;
+    memset(&hdr, 0, sizeof(hdr));
+    hdr.type = type;
+    hdr.id = id;
+    hdr.role = role;
+    hdr.size = payload != NULL ? strlen(payload) : 0;
+    jeux_session_dispatch(&peer->session, &hdr, payload);
+}
+
+// read and tally whatever the server has sent, so that the queue never fills
+static void drain(PEER *peer){
+    JEUX_PACKET_HEADER hdr;
+    void *payload;
+    while(proto_decoder_fill(&peer->decoder, peer->fd, MSG_DONTWAIT) > 0){
+        while(proto_decoder_next(&peer->decoder, &hdr, &payload) == 1){
+            peer->acks += hdr.type == JEUX_ACK_PKT;
+            peer->nacks += hdr.type == JEUX_NACK_PKT;
+            peer->ended += hdr.type == JEUX_ENDED_PKT;
+        }
+    }
+}
+
+static int open_peer(PEER *peer){
+    int sv[2];
+    if(socketpair(AF_UNIX, SOCK_STREAM, 0, sv) == -1){
+        perror("socketpair");
+        return -1;
+    }
+    peer->fd = sv[1];
+    if(jeux_session_open(&peer->session, sv[0]) == -1){
+        fprintf(stderr, "cannot open a session\n");
+        return -1;
+    }
+    send_request(peer, JEUX_LOGIN_PKT, 0, JEUX_LOGIN_ANALYSIS, peer->name);
+    return 0;
+}
+
+static void close_peer(PEER *peer){
+    jeux_session_close(&peer->session);
+    drain(peer);
+    close(peer->fd);
+}
+
+static void *stress(void *arg){
+    PEER *peer = arg;
+    char square[2] = "1";
+    for(long i = 0; i < num_ops; i++){
+        int id = rand_r(&peer->seed) % NUM_IDS;
+        switch(rand_r(&peer->seed) % 9){
+        case 0:
+        case 1:
+            send_request(peer, JEUX_INVITE_PKT, 0, 1 + rand_r(&peer->seed) % 2,
+                         peers[rand_r(&peer->seed) % num_threads].name);
+            break;
+        case 2:
+            send_request(peer, JEUX_ACCEPT_PKT, id, 0, NULL);
+            break;
+        case 3:
+            send_request(peer, rand_r(&peer->seed) % 2 ? JEUX_DECLINE_PKT : JEUX_REVOKE_PKT, id, 0, NULL);
+            break;
+        case 4:
+        case 5:
+        case 6:
+            square[0] = '1' + rand_r(&peer->seed) % 9;
+            send_request(peer, JEUX_MOVE_PKT, id, 0, square);
+            break;
+        case 7:
+            switch(rand_r(&peer->seed) % 8){
+            case 0:
+                send_request(peer, JEUX_ANALYZE_PKT, id, 0, NULL);
+                break;
+            case 1:
+                send_request(peer, JEUX_STATS_PKT, 0, 0, NULL);
+                break;
+            case 2:
+                send_request(peer, JEUX_WATCH_PKT, 0, WATCH_START, peers[rand_r(&peer->seed) % num_threads].name);
+                break;
+            case 3:
+                send_request(peer, JEUX_WATCH_PKT, id, WATCH_STOP, NULL);
+                break;
+            default:
+                send_request(peer, JEUX_RESIGN_PKT, id, 0, NULL);
+                break;
+            }
+            break;
+        case 8:
+            if(rand_r(&peer->seed) % 2){
+                send_request(peer, JEUX_SEEK_PKT, 0, rand_r(&peer->seed) % 3 ? SEEK_JOIN : SEEK_CANCEL, NULL);
+                break;
+            }
+            send_request(peer, JEUX_LEADERBOARD_PKT, NUM_IDS, 0,
+                         rand_r(&peer->seed) % 2 ? peers[rand_r(&peer->seed) % num_threads].name : NULL);
+            break;
+        }
+        drain(peer);
+        // the opponents' clocks run out while a player thinks
+        if(rand_r(&peer->seed) % NAP_EVERY == 0){
+            usleep(NAP_US);
+        }
+        if(rand_r(&peer->seed) % RELOGIN_EVERY == 0){
+            close_peer(peer);
+            if(open_peer(peer) == -1)
+                exit(EXIT_FAILURE);
+        }
+    }
+    return NULL;
+}
+
+int main(int argc, char *argv[]){
+    if(argc > 1)
+        num_threads = atoi(argv[1]);
+    if(argc > 2)
+        num_ops = atol(argv[2]);
+    if(num_threads < 2 || num_threads > MAX_THREADS || num_ops <= 0){
+        fprintf(stderr, "usage: %s [threads [operations]]\n", argv[0]);
+        exit(EXIT_FAILURE);
+    }
+    client_registry = creg_init();
+    player_registry = preg_init();
+    char journal_dir[] = "/tmp/lock_stressXXXXXX";
+    if(mkdtemp(journal_dir) == NULL || journal_open(journal_dir, player_registry) == -1){
+        fprintf(stderr, "cannot open a journal in %s\n", journal_dir);
+        exit(EXIT_FAILURE);
+    }
+
+    client_timeouts.invite = INVITE_TIMEOUT_MS;
+    client_timeouts.move = MOVE_TIMEOUT_MS;
+    if(timers_start() == -1){
+        fprintf(stderr, "cannot start the timer thread\n");
+        exit(EXIT_FAILURE);
+    }
+    atomic_store(&trace_on, 1);
+    pthread_t tids[MAX_THREADS];
+    for(int t = 0; t < num_threads; t++){
+        PEER *peer = &peers[t];
+        snprintf(peer->name, sizeof(peer->name), "p%d", t);
+        peer->seed = t + 1;
+        if(proto_decoder_init(&peer->decoder, 0) == -1 || open_peer(peer) == -1)
+            exit(EXIT_FAILURE);
+    }
+    for(int t = 0; t < num_threads; t++){
+        pthread_create(&tids[t], NULL, stress, &peers[t]);
+    }
+    char trace_path[sizeof(journal_dir) + 16];
+    snprintf(trace_path, sizeof(trace_path), "%s/trace", journal_dir);
+    usleep(100000);
+    if(trace_dump(trace_path) == -1){
+        fprintf(stderr, "cannot dump the trace to %s\n", trace_path);
+        exit(EXIT_FAILURE);
+    }
+    unlink(trace_path);
+    long acks = 0, nacks = 0, ended = 0;
+    for(int t = 0; t < num_threads; t++){
+        pthread_join(tids[t], NULL);
+    }
+    for(int t = 0; t < num_threads; t++){
+        close_peer(&peers[t]);
+        proto_decoder_fini(&peers[t].decoder);
+        acks += peers[t].acks;
+        nacks += peers[t].nacks;
+        ended += peers[t].ended;
+    }
+    // every CLIENT must have been let go of by the invitations that referred to it
+    creg_wait_for_empty(client_registry);
+    matchmaker_fini();
+    // and everything they had going must have been counted out again
+    for(int g = 0; g < METRICS_NUM_GAUGES; g++){
+        if(metrics_gauge_get(g) != 0){
+            fprintf(stderr, "gauge %d is %ld with nobody connected\n", g, metrics_gauge_get(g));
+            exit(EXIT_FAILURE);
+        }
+    }
+    ratings_flush();
+    journal_fini();
+    leaderboard_fini();
+
+    printf("threads: %d, operations: %ld, ACK: %ld, NACK: %ld, ENDED: %ld\n",
+           num_threads, num_threads * num_ops, acks, nacks, ended);
+    creg_fini(client_registry);
+    preg_fini(player_registry);
+    users_cache_fini();
+    char path[sizeof(journal_dir) + 16];
+    snprintf(path, sizeof(path), "%s/snapshot", journal_dir);
+    unlink(path);
+    snprintf(path, sizeof(path), "%s/journal", journal_dir);
+    unlink(path);
+    rmdir(journal_dir);
+    return 0;
+}
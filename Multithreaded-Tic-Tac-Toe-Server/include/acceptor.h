@@ -0,0 +1,84 @@
+#ifndef ACCEPTOR_H
+#define ACCEPTOR_H
+
+#include <pthread.h>
+
+/*
+ * Accepting connections on several threads at once, for -a.
+ *
+ * Every acceptor thread has a listening socket of its own, bound to the
+ * same port with SO_REUSEPORT, so the kernel spreads new connections over
+ * the sockets and no two acceptors ever contend for one accept queue.
+ * Acceptor i runs on CPU slot i (see below), and a classic BPF program
+ * attached to the group steers each connection to the socket of the
+ * acceptor pinned on the CPU that took its SYN, whichever CPUs the process
+ * may run on, so that a connection is accepted where its packets are
+ * already being handled.  A CPU with no acceptor of its own sends it to
+ * the socket whose index is the CPU's number modulo the number of
+ * acceptors.  The acceptor then hands it to a service thread or a reactor
+ * on the same CPU.  Without the program, as on kernels that refuse it, the
+ * kernel's hash of the addresses picks the socket instead.
+ *
+ * CPU slots number the CPUs the server may run on, from 0, so that slot
+ * i % acceptor_cpus() always names one of them, whatever the affinity of
+ * the process.
+ */
+
+/*
+ * Hand a connection that was just accepted to whatever serves it.
+ *
+ * @param fd  The connection.
+ * @param slot  The CPU slot of the acceptor that accepted it.
+ */
+typedef void ACCEPTOR_HANDOFF(int fd, int slot);
+
+/*
+ * Get the number of CPUs the server may run on.
+ *
+ * @return  The number of CPU slots, at least 1.
+ */
+int acceptor_cpus(void);
+
+/*
+ * Make the threads created with some attributes run only on the CPU of
+ * a slot.
+ *
+ * @param attr  The attributes.
+ * @param slot  The slot, taken modulo acceptor_cpus().
+ * @return  0 if successful, -1 otherwise.
+ */
+int acceptor_pin(pthread_attr_t *attr, int slot);
+
+/*
+ * Accept the next connection.  Unlike csapp's Accept(), running out of
+ * descriptors or a connection aborted before it was accepted is not fatal:
+ * with thousands of clients, hitting the limit is a load condition to
+ * ride out, not a reason to take the whole server down.
+ *
+ * @param listenfd  The listening socket.
+ * @return  The connection, or -1 if the socket can accept no more.
+ */
+int accept_connection(int listenfd);
+
+/*
+ * Open n listening sockets on a port and start an acceptor thread for
+ * each, with SIGHUP blocked, that passes every connection it accepts to
+ * handoff.
+ *
+ * @param port  The port, as a string.
+ * @param n  The number of acceptors.
+ * @param handoff  What is done with each connection.
+ * @return  0 if all of the acceptors were started, otherwise -1, in which
+ * case none are left running.
+ */
+int acceptors_start(char *port, int n, ACCEPTOR_HANDOFF *handoff);
+
+/*
+ * Stop accepting connections: shut down the listening sockets, which
+ * wakes the acceptors, and wait for them to exit, so that none is still
+ * handing off a connection once this returns.  Does nothing if no
+ * acceptors were started.
+ */
+void acceptors_stop(void);
+
+#endif
@@ -0,0 +1,392 @@
+#ifndef CLIENT_EXT_H
+#define CLIENT_EXT_H
+
+#include <stdint.h>
+
+#include "client.h"
+#include "game_ext.h"
+#include "outq.h"
+
+/*
+ * Extensions to the CLIENT interface declared in client.h.
+ */
+
+/*
+ * Send several packets to a client as one batch.  The packets are
+ * appended to the client's outbound queue one after the other and then
+ * flushed together, so that notifications generated together (e.g. MOVED
+ * and ENDED) normally leave in the same system call and TCP segment.
+ *
+ * @param client  The CLIENT who should be sent the packets.
+ * @param hdrs  The headers of the packets to be sent.
+ * @param data  The payloads, with NULL entries for packets without one.
+ * @param count  The number of packets.
+ * @return 0 if all the packets were queued, -1 otherwise.
+ */
+int client_send_packets(CLIENT *client, JEUX_PACKET_HEADER **hdrs, void **data, int count);
+
+/*
+ * Send a client a packet whose payload is taken from a shared buffer
+ * rather than copied, as is done for the cached USERS listing.
+ *
+ * @param client  The CLIENT who should be sent the packet.
+ * @param pkt  The header of the packet to be sent; its size gives the
+ * length of the payload.
+ * @param buf  The buffer holding the payload, which gains a reference
+ * for as long as the packet is queued.
+ * @param off  Offset of the payload in buf.
+ * @return 0 if the packet was queued, -1 otherwise.
+ */
+int client_send_shared(CLIENT *client, JEUX_PACKET_HEADER *pkt, OUTQ_SHARED *buf, size_t off);
+
+/*
+ * Queue a packet whose payload is taken from a shared buffer, as
+ * client_send_shared() does, without writing anything to the connection
+ * yet.  The packet goes out at the next client_flush(), or with the next
+ * packet sent to the client.  This lets the packets for many clients be
+ * queued under a lock and written after it is released.
+ *
+ * @return 0 if the packet was queued, -1 otherwise.
+ */
+int client_queue_shared(CLIENT *client, JEUX_PACKET_HEADER *pkt, OUTQ_SHARED *buf, size_t off);
+
+/*
+ * Write out whatever is in a client's outbound queue, as far as the
+ * socket accepts it without blocking.  The rest is left to the writer
+ * thread, or to whoever else is writing to the client at the moment.
+ *
+ * @param client  The CLIENT.
+ */
+void client_flush(CLIENT *client);
+
+/*
+ * Set the options a client asked for in its LOGIN (see the LOGIN options
+ * in protocol_ext.h).  They must be set before the client is logged in,
+ * so that they apply to every game the client plays.
+ *
+ * @param client  The CLIENT whose options are to be set.
+ * @param options  A set of JEUX_LOGIN_* bits.
+ * @return 0 if the options were set, -1 if some of them are unknown.
+ */
+int client_set_options(CLIENT *client, int options);
+
+/*
+ * Get the options a client asked for in its LOGIN.  They do not change
+ * while the client is logged in, so no lock is taken.
+ *
+ * @param client  The CLIENT.
+ * @return  A set of JEUX_LOGIN_* bits.
+ */
+int client_get_options(CLIENT *client);
+
+/*
+ * Make the proxy of a user logged in at another node (see cluster.h): a
+ * CLIENT without a connection, logged in as the user's shadow PLAYER,
+ * whose packets are sent over the link to the user's node.  It is not
+ * registered, and its name is not bound in the client registry.
+ *
+ * @param node  The node of the user.
+ * @param player  The shadow of the user, which gains a reference.
+ * @param epoch  The login of the user at its node.
+ * @param options  The LOGIN options of that login.
+ * @return  The proxy, with a reference count of one, or NULL.
+ */
+CLIENT *client_create_remote(int node, PLAYER *player, uint32_t epoch, int options);
+
+/*
+ * Get the number a client's node gave its current login, which tells the
+ * logins of a user apart across nodes.  It is set at login, under the
+ * client's lock, before the name can be found.
+ *
+ * @param client  The CLIENT, or proxy.
+ * @return  The number of its login, 0 if it has never logged in.
+ */
+uint32_t client_get_epoch(CLIENT *client);
+
+/*
+ * Judge the moves made so far in a game in progress, in which the
+ * specified CLIENT is a participant, as described for the ANALYZE packet
+ * in protocol_ext.h.
+ *
+ * @param client  The CLIENT asking for the analysis.
+ * @param id  The ID assigned by the CLIENT to the INVITATION that
+ * contains the GAME, or to a game it is watching.
+ * @param buf  The buffer into which the NUL-terminated analysis is
+ * stored; ORACLE_ANALYSIS_MAX bytes are always sufficient.
+ * @param size  The size of buf.
+ * @return  The length of the analysis, or -1 if there is no game in
+ * progress with that ID or it is not played on the classic board.
+ */
+int client_analyze_game(CLIENT *client, int id, char *buf, size_t size);
+
+/*
+ * Accept an INVITATION, as client_accept_invitation() does, but store
+ * the payload of the ACK for the accepting client (the initial game
+ * state, in the client's board format, if it is the first player to
+ * move) in a caller-supplied buffer instead of malloc'ed storage.
+ *
+ * @param client  The CLIENT that is the target of the INVITATION.
+ * @param id  The ID assigned by the target to the INVITATION.
+ * @param buf  The buffer for the ACK payload; GAME_STATE_MAX bytes are
+ * always sufficient.
+ * @param size  The size of buf.
+ * @return  The length of the ACK payload, 0 if there is none, or -1 if
+ * the INVITATION was not accepted.
+ */
+int client_accept_invitation_into(CLIENT *client, int id, char *buf, size_t size);
+
+/*
+ * Tell whether a client is logged in, without taking its lock.  A client
+ * stops being logged in at the start of its logout, before it lets go of
+ * its invitations.
+ *
+ * @param client  The CLIENT.
+ * @return  Nonzero if the client is logged in and not logging out.
+ */
+int client_is_logged_in(CLIENT *client);
+
+/*
+ * Make a new invitation, as client_make_invitation() does, to a game on
+ * a given board.  Unless it is the classic one, the INVITED packet sent
+ * to the target has the board after the source's name, as described in
+ * protocol_ext.h.
+ *
+ * @param source  The CLIENT that is the source of the INVITATION.
+ * @param target  The CLIENT that is the target of the INVITATION.
+ * @param source_role  The GAME_ROLE to be played by the source of the INVITATION.
+ * @param target_role  The GAME_ROLE to be played by the target of the INVITATION.
+ * @param variant  The board on which the game is to be played.
+ * @return the ID assigned by the source to the INVITATION, if the operation
+ * is successful, otherwise -1.
+ */
+int client_make_variant_invitation(CLIENT *source, CLIENT *target, GAME_ROLE source_role,
+                                   GAME_ROLE target_role, const GAME_VARIANT *variant);
+
+/*
+ * Start a game between two clients paired by the matchmaker, as if the
+ * first had invited the second and the second had accepted: both get
+ * an ACCEPTED packet with the ID each has for the new invitation, and
+ * the first, who plays first, gets the initial game state with it.
+ *
+ * @param first  The CLIENT that is to play first.
+ * @param second  The CLIENT that is to play second.
+ * @return  0 if the game was started, -1 if it could not be, for
+ * instance because one of the clients is logging out.
+ */
+int client_start_matched_game(CLIENT *first, CLIENT *second);
+
+/*
+ * Start watching a game that another client is playing, as described for
+ * the WATCH packet in protocol_ext.h.  The watcher gives the game an ID
+ * from those of its invitations, and is sent the ACK, with that ID and
+ * the state of the game, by this function, so that it comes before the
+ * first MOVED.
+ *
+ * @param watcher  The logged-in CLIENT that is to watch.
+ * @param player  A CLIENT that is playing the game to be watched; if it
+ * is playing several, the one to which it has given the lowest ID.
+ * @return  The watcher's ID for the game, or -1 if the player is not
+ * playing a game, the watcher is a player in it or already watching it,
+ * or the watcher has no free ID.
+ */
+int client_watch_game(CLIENT *watcher, CLIENT *player);
+
+/*
+ * Stop watching a game.  Also done for every game watched on logout.
+ *
+ * @param watcher  The CLIENT that is watching the game.
+ * @param id  The ID the watcher has for the game.
+ * @return  0 if the watcher has been sent the last packet for the game,
+ * -1 if it was not watching a game with that ID, or if the game has
+ * ended, in which case ENDED has been or is about to be sent.
+ */
+int client_stop_watching(CLIENT *watcher, int id);
+
+/*
+ * Let go of the ID a watcher has for a game, and of its reference to the
+ * INVITATION, once it has been sent ENDED (see spectators.h).
+ *
+ * @param watcher  The CLIENT that was watching the game.
+ * @param id  Its ID for the game.
+ * @param inv  The INVITATION of the game.
+ */
+void client_end_watch(CLIENT *watcher, int id, INVITATION *inv);
+
+/*
+ * Stop sending to a client whose connection is being closed.  Packets
+ * still queued are written if the socket accepts them right away;
+ * otherwise the connection is shut down and they are discarded, so that
+ * the writer thread does not keep the CLIENT alive waiting for a peer
+ * that no longer reads.
+ *
+ * @param client  The CLIENT whose output is to be finished.
+ */
+void client_finish_output(CLIENT *client);
+
+/*
+ * The timeouts of -t, in milliseconds, each 0 if it is not enforced
+ * (the default).  They are kept by TIMERs (see timer.h), so they are
+ * enforced to the tick, and set before any client connects.
+ *
+ *   login   a connection that has not logged in this long after it was
+ *           accepted is shut down
+ *   idle    a connection from which no packet has come for this long is
+ *           shut down, whether it is logged in or not, so that a peer that
+ *           vanished without closing its connection (a half-open
+ *           connection) does not keep its thread or registry slot
+ *   invite  an invitation still open this long after it was made is
+ *           revoked, and both sides are sent REVOKED (see protocol_ext.h)
+ *   move    a player who has not moved this long after a game started or
+ *           the opponent moved resigns, as with client_resign_game()
+ */
+typedef struct client_timeouts {
+    unsigned login;
+    unsigned idle;
+    unsigned invite;
+    unsigned move;
+} CLIENT_TIMEOUTS;
+
+extern CLIENT_TIMEOUTS client_timeouts;
+
+/*
+ * Start enforcing the login and idle timeouts on a client whose session
+ * has just been opened.  Does nothing if neither is set.
+ *
+ * @param client  The CLIENT.
+ */
+void client_start_timeouts(CLIENT *client);
+
+/*
+ * Stop enforcing the timeouts on a client whose session is being closed,
+ * letting go of the reference the timer held.
+ *
+ * @param client  The CLIENT.
+ */
+void client_stop_timeouts(CLIENT *client);
+
+/*
+ * Note that a packet has come from a client, for the idle timeout.  This
+ * only reads the timer wheel's clock, so it is called for every packet.
+ *
+ * @param client  The CLIENT.
+ */
+void client_note_activity(CLIENT *client);
+
+/*
+ * Enforce the invitation timeout or the move clock on an invitation whose
+ * timer has expired (see invitation_ext.h): revoke it if it has been open
+ * too long, or resign the game for the player to move if that player has
+ * taken too long.
+ *
+ * @param inv  The INVITATION.
+ * @return  How many milliseconds from now to look at the invitation
+ * again, or 0 if there is nothing more to enforce for it.
+ */
+unsigned client_expire_invitation(INVITATION *inv);
+
+/*
+ * Get the number of bytes of memory taken by a CLIENT object, including
+ * its outbound queue when it is empty, for capacity planning.
+ */
+size_t client_footprint(void);
+
+/*
+ * What a hot upgrade (see upgrade.h) takes from the CLIENTs of one
+ * server and gives to those of the next.  A client has as many IDs for
+ * its invitations and the games it watches as fit in the id field of a
+ * packet header.
+ */
+#define CLIENT_MAX_IDS 256
+
+struct jeux_session;
+
+/*
+ * Record the session serving a client's connection (see session.h), or
+ * NULL once it is closed.
+ */
+void client_set_session(CLIENT *client, struct jeux_session *session);
+
+/*
+ * Get the session recorded by client_set_session().
+ */
+struct jeux_session *client_get_session(CLIENT *client);
+
+/*
+ * Take the send lock of a client, and keep it, and copy out what is
+ * waiting in its outbound queue (see outq_save()).  Nothing more is
+ * sent to the client until client_release_output().
+ *
+ * @param client  The CLIENT.
+ * @param lenp  Set to the length of the wire images returned.
+ * @param sentp  Set to how much of the first image has been sent.
+ * @return  The images, in malloc'ed storage, or NULL if there are none
+ * (or memory is exhausted, in which case errno is ENOMEM).
+ */
+char *client_save_output(CLIENT *client, size_t *lenp, size_t *sentp);
+
+/*
+ * Let go of the send lock taken by client_save_output(), and send what
+ * has been queued meanwhile.
+ */
+void client_release_output(CLIENT *client);
+
+/*
+ * Queue for a client the images saved by client_save_output() in the
+ * server it comes from.  They are sent by the next client_flush().
+ *
+ * @return  0 if the images were queued, -1 otherwise.
+ */
+int client_restore_output(CLIENT *client, const char *data, size_t len, size_t sent);
+
+/*
+ * Get a client's invitations and the games it watches.
+ *
+ * @param client  The CLIENT.
+ * @param invs  Array of CLIENT_MAX_IDS entries, set to the INVITATIONs,
+ * each with a reference for the caller.
+ * @param ids  Array of CLIENT_MAX_IDS entries, set to the client's IDs
+ * for them.
+ * @param others  Array of CLIENT_MAX_IDS entries, set to the IDs that
+ * the other client of each invitation has for it, or for a game watched
+ * the ID its source has (-1 for an ID given up already).
+ * @param watched  Array of CLIENT_MAX_IDS entries, each set to nonzero
+ * if the client watches the game of the invitation rather than plays.
+ * @return  The number of entries set.
+ */
+int client_get_invitations(CLIENT *client, INVITATION **invs, int *ids, int *others, int *watched);
+
+/*
+ * Remake an invitation of the server a hot upgrade comes from, with the
+ * same IDs at both sides and, if it was accepted, the same moves made in
+ * its game, without notifying anyone.  Its timer is armed afresh.
+ *
+ * @param source  The source, logged in.
+ * @param source_id  The source's ID for the invitation.
+ * @param target  The target, logged in.
+ * @param target_id  The target's ID for the invitation.
+ * @param source_role  The role of the source.
+ * @param target_role  The role of the target.
+ * @param variant  The board of the game.
+ * @param accepted  Nonzero if the game is in progress.
+ * @param squares  The moves made in the game, as for game_get_history().
+ * @param num_moves  The number of moves made.
+ * @return  0 if the invitation was remade, -1 otherwise.
+ */
+int client_restore_invitation(CLIENT *source, int source_id, CLIENT *target, int target_id,
+                              GAME_ROLE source_role, GAME_ROLE target_role,
+                              const GAME_VARIANT *variant, int accepted,
+                              const uint8_t *squares, int num_moves);
+
+/*
+ * Make a client watch again, under the same ID, a game it watched before
+ * a hot upgrade, without sending it an ACK.
+ *
+ * @param watcher  The watcher, logged in.
+ * @param id  The watcher's ID for the game.
+ * @param player  One of the players of the game.
+ * @param player_id  That player's ID for the invitation of the game.
+ * @return  0 if the watcher was added, -1 otherwise.
+ */
+int client_restore_watch(CLIENT *watcher, int id, CLIENT *player, int player_id);
+
+#endif
@@ -0,0 +1,76 @@
+#ifndef CLIENT_REGISTRY_EXT_H
+#define CLIENT_REGISTRY_EXT_H
+
+#include "client_registry.h"
+
+/*
+ * Extensions to the client registry interface declared in client_registry.h.
+ *
+ * Registered clients are kept in a slot array indexed by file descriptor,
+ * and logged-in clients are additionally indexed by username in a hash
+ * table, so that registration, unregistration and creg_lookup() take
+ * constant time.  Lookups only take the registry lock for reading.
+ * Both structures grow on demand, so the number of clients is limited
+ * only by the maximum set with creg_set_max_clients().
+ */
+
+/*
+ * Set the maximum number of simultaneously registered clients.
+ * Registrations beyond this limit fail.  The default is MAX_CLIENTS.
+ *
+ * @param cr  The client registry.
+ * @param max_clients  The new limit, which must be positive.
+ */
+void creg_set_max_clients(CLIENT_REGISTRY *cr, int max_clients);
+
+/*
+ * Reserve a username for a registered CLIENT that is logging in, and make
+ * the CLIENT findable under it by creg_lookup().  The check that nobody
+ * else is logged in under the name and the reservation happen under the
+ * registry's write lock, so this is the single duplicate-login test: it
+ * costs one hash probe, and of two concurrent LOGINs with the same name
+ * exactly one succeeds.  The name must remain valid until it is unbound
+ * (player names do, since the player registry keeps its PLAYERs).
+ *
+ * @param cr  The client registry.
+ * @param name  The username.
+ * @param client  The CLIENT that has logged in.
+ * @return 0 if the name was bound, or -1 if it is already bound to
+ * another CLIENT.
+ */
+int creg_bind_name(CLIENT_REGISTRY *cr, const char *name, CLIENT *client);
+
+/*
+ * Remove the binding made by creg_bind_name(), if the name is still bound
+ * to the specified CLIENT.
+ *
+ * @param cr  The client registry.
+ * @param name  The username.
+ * @param client  The CLIENT that is logging out.
+ */
+void creg_unbind_name(CLIENT_REGISTRY *cr, const char *name, CLIENT *client);
+
+/*
+ * Look up a username among the clients logged in at this server only.
+ * creg_lookup() does the same and, in cluster mode, then looks for the
+ * user at the other nodes, returning its proxy (see cluster.h).
+ *
+ * @param cr  The client registry.
+ * @param user  The username.
+ * @return  The CLIENT logged in under the name here, with a reference
+ * for the caller, or NULL.
+ */
+CLIENT *creg_lookup_local(CLIENT_REGISTRY *cr, const char *user);
+
+/*
+ * Get every registered CLIENT, logged in or not, as for a hot upgrade
+ * (see upgrade.h).
+ *
+ * @param cr  The client registry.
+ * @return  A malloc'ed, NULL-terminated array of references to the
+ * CLIENTs, in the order of their file descriptors, or NULL if memory is
+ * exhausted.
+ */
+CLIENT **creg_all_clients(CLIENT_REGISTRY *cr);
+
+#endif
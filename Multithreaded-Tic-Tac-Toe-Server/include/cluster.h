@@ -0,0 +1,213 @@
+#ifndef CLUSTER_H
+#define CLUSTER_H
+
+#include <stdint.h>
+
+#include "protocol.h"
+#include "player.h"
+#include "client_registry.h"
+#include "session.h"
+
+/*
+ * Cluster mode, for -C: several servers sharing their users.
+ *
+ * Every node is started with the same list of nodes, and knows itself by
+ * its index in it.  Usernames are spread over the nodes by consistent
+ * hashing: each node has CLUSTER_VNODES points on a ring of 32-bit
+ * hashes, and a name belongs to the node of the first point at or after
+ * the hash of the name, so that adding a node to the list only moves the
+ * names that now fall to it.  A user can log in only at the node it
+ * belongs to, which therefore alone decides duplicate logins and keeps
+ * the user's PLAYER, rating and journal; a LOGIN anywhere else is
+ * refused with the address of the right node (see protocol_ext.h).
+ *
+ * Nodes talk over links of their own, on a second port.  Each node dials
+ * every other and sends on the connection it dialed, and receives on
+ * those it accepted, so a pair of nodes has one connection each way and
+ * neither has to decide who dials.  What goes over a link:
+ *
+ *   - presence: every login, logout and rating change of a local user,
+ *     and all the local users whenever a link comes up.  The other nodes
+ *     keep a shadow PLAYER for every remote user they have heard of, with
+ *     the rating and whether the user is logged in.  USERS lists the
+ *     local users and the shadows of those logged in elsewhere.
+ *   - requests forwarded to the node that holds the invitation they are
+ *     about (ACCEPT, MOVE and so on), and the packets that node sends
+ *     back to the user, ACK and NACK included.
+ *   - the results of games between users of different nodes, which each
+ *     node applies to the rating of its own user.
+ *
+ * creg_lookup() of a user logged in at another node returns a proxy: a
+ * CLIENT with no connection, logged in as the shadow, that is made the
+ * first time it is looked up and kept until the user logs out.  Packets
+ * sent to a proxy go over the link to the user's node, which sends them
+ * on to the user.  An invitation between a local client and a proxy
+ * lives at the node that made it, with its GAME, and so do the games of
+ * matched players, which are always both local.
+ *
+ * The IDs of invitations are split among the nodes: a CLIENT, or a
+ * proxy, at node i gives out only the IDs of slice i (see
+ * cluster_id_range()), so that the node that holds an invitation can be
+ * told from the ID the user has for it.  A request about an invitation
+ * held elsewhere is forwarded there and run by its proxy, and the thread
+ * that got the request waits for it to be done, so that replies still
+ * come in the order of the requests; cluster mode therefore runs with a
+ * thread per connection, never on the reactors of the event loop.  A
+ * request not done within CLUSTER_FORWARD_TIMEOUT_MS is not refused, as
+ * it may still be run: the client is answered by the other node, or sent
+ * a NACK once that node says the request was not run.  Games can be watched only at the
+ * node that holds them, and seekers are matched only with seekers at
+ * their own node.
+ *
+ * If a link goes down, the users of the node at the other end are taken
+ * as logged out: their proxies log out, resigning their games, and the
+ * node keeps dialing until the link is back, when presence is sent anew.
+ * All nodes must run the same build, as link messages carry packet
+ * headers and numbers as they are laid out in memory.
+ */
+
+#define CLUSTER_MAX_NODES 8
+#define CLUSTER_VNODES 64                   // points of each node on the ring
+#define CLUSTER_IDS 256                     // invitation IDs, which travel in the 8-bit id field
+#define CLUSTER_FORWARD_TIMEOUT_MS 2000     // for a forwarded request to be done
+#define CLUSTER_REDIAL_MS 500               // between attempts to dial a node
+#define CLUSTER_DIAL_TIMEOUT_MS 1000        // for a node to take a connection
+
+/*
+ * Set up the ring from the list of nodes, before cluster_start().  The
+ * list has an entry "<host>:<port>:<link port>" for each node, separated
+ * by commas, in the same order at every node: <port> is where the node
+ * serves clients, and is what a refused LOGIN is told, and <link port>
+ * where it listens for the other nodes.
+ *
+ * @param list  The list of nodes.
+ * @param self  The index of this node in the list.
+ * @return  0 if the list is valid, -1 otherwise.
+ */
+int cluster_configure(const char *list, int self);
+
+/*
+ * Listen for the other nodes and start dialing them, each link with its
+ * threads, with SIGHUP blocked.
+ *
+ * @return  0 if successful, -1 if the link port cannot be listened on.
+ */
+int cluster_start(void);
+
+/*
+ * Tell whether the server is in cluster mode.
+ *
+ * @return  Nonzero once cluster_configure() has succeeded.
+ */
+int cluster_enabled(void);
+
+/*
+ * Get the node a username belongs to.
+ *
+ * @param name  The username.
+ * @return  The index of the node, 0 if not in cluster mode.
+ */
+int cluster_owner(const char *name);
+
+/*
+ * Get the slice of the invitation IDs this node gives out: [*lo, *hi).
+ * Without cluster mode, that is all CLUSTER_IDS of them.
+ */
+void cluster_id_range(int *lo, int *hi);
+
+/*
+ * Get the node whose slice an invitation ID is in.
+ *
+ * @param id  The ID.
+ * @return  The index of the node, or -1 if the ID is in no slice.
+ */
+int cluster_id_node(int id);
+
+/*
+ * Route a packet received from a client, before it is dispatched: a
+ * LOGIN as a user of another node is refused with that node's address,
+ * and a request about an invitation held by another node is forwarded
+ * there and waited for.
+ *
+ * @param session  The session the packet came on.
+ * @param hdr  The header, in host byte order.
+ * @param payload  The payload, or NULL.
+ * @return  1 if the packet has been dealt with, 0 if it is to be
+ * dispatched here.
+ */
+int cluster_route(JEUX_SESSION *session, JEUX_PACKET_HEADER *hdr, void *payload);
+
+/*
+ * Look up a user logged in at another node, for creg_lookup().
+ *
+ * @param name  The username.
+ * @return  The user's proxy, with a reference for the caller, or NULL if
+ * the user is not known to be logged in at another node.
+ */
+CLIENT *cluster_lookup(const char *name);
+
+/*
+ * Tell whether a user is logged in at another node, without making a
+ * proxy for it.
+ *
+ * @param name  The username.
+ * @return  Nonzero if it is.
+ */
+int cluster_is_remote(const char *name);
+
+/*
+ * Tell whether a PLAYER is the shadow of a user of another node, whose
+ * rating is that node's to change.
+ *
+ * @param player  The PLAYER.
+ * @return  Nonzero if it is; always zero outside cluster mode.
+ */
+int cluster_is_shadow(PLAYER *player);
+
+/*
+ * Get the shadows of the users logged in at other nodes, for the USERS
+ * listing, in the form returned by creg_all_players(): a malloc'ed,
+ * NULL-terminated array of references.
+ *
+ * @return  The array, or NULL if not in cluster mode or out of memory.
+ */
+PLAYER **cluster_all_players(void);
+
+/*
+ * Send the other nodes the state of a local player: whether it is logged
+ * in, its rating and its LOGIN options.  Called for every change noted
+ * in the USERS cache; does nothing for shadows or outside cluster mode.
+ *
+ * @param player  The PLAYER.
+ */
+void cluster_publish(PLAYER *player);
+
+/*
+ * Send packets to a user at another node, for a proxy.
+ *
+ * @param node  The user's node.
+ * @param epoch  The login of the user that the packets are for (see
+ * client_get_epoch()); they are dropped if the user has logged in again
+ * since.
+ * @param name  The username.
+ * @param hdrs  The headers, in network byte order.
+ * @param data  The payloads, with NULL entries for packets without one.
+ * @param count  The number of packets.
+ * @return  0 if the packets were sent on the link, -1 if it is down.
+ */
+int cluster_deliver(int node, uint32_t epoch, const char *name,
+                    JEUX_PACKET_HEADER **hdrs, void **data, int count);
+
+/*
+ * Have the node of a remote player rate it for the result of a game
+ * against a local one.  Called by player_post_result() for every game
+ * with a shadow in it, which rates the local player alone; does nothing
+ * for two local players.
+ *
+ * @param player1  One of the PLAYERs.
+ * @param player2  The other PLAYER.
+ * @param result  As for player_post_result().
+ */
+void cluster_post_result(PLAYER *player1, PLAYER *player2, int result);
+
+#endif
@@ -0,0 +1,79 @@
+#ifndef EVENT_LOOP_H
+#define EVENT_LOOP_H
+
+#include <stddef.h>
+
+/*
+ * Event-driven alternative to the thread-per-connection service model.
+ *
+ * A fixed number of reactor threads each own an epoll instance.  The
+ * main thread, or the acceptors of -a (see acceptor.h), accepts
+ * connections and hands each one to a reactor,
+ * which from then on reads from the socket only when epoll reports it
+ * readable, reassembles packets with a per-connection PROTO_DECODER and
+ * dispatches them through jeux_session_dispatch().  An idle connection
+ * therefore costs a small CONNECTION structure instead of a blocked
+ * thread and its stack.
+ *
+ * The reactors wait with epoll(7) unless evl_backend is EVL_URING, in
+ * which case they are those of uring_loop.h, if the kernel allows.
+ *
+ * Termination works exactly as in the threaded mode: creg_shutdown_all()
+ * shuts down the sockets, the reactors see EOF and close the sessions,
+ * and creg_wait_for_empty() returns once every client is unregistered.
+ */
+
+typedef enum evl_backend {
+    EVL_EPOLL,                  // readiness with epoll, then recv and send
+    EVL_URING                   // completions of multishot recvs and of sends
+} EVL_BACKEND;
+
+/* The backend of the reactors, set from the command line; EVL_EPOLL by default. */
+extern EVL_BACKEND evl_backend;
+
+/* Default number of reactor threads if none is specified (0 = one per CPU). */
+#define EVL_DEFAULT_REACTORS 0
+
+/*
+ * Start the reactor threads.
+ *
+ * @param nreactors  Number of reactor threads to start, or 0 to start
+ * one per online CPU.
+ * @param pin  Nonzero to run reactor i only on CPU slot i (see
+ * acceptor.h), for evl_add_connection_on().
+ * @return 0 if the reactors were started, otherwise -1.  If io_uring
+ * reactors cannot be started, epoll reactors are, and evl_backend is set
+ * to EVL_EPOLL.
+ */
+int evl_start(int nreactors, int pin);
+
+/*
+ * Hand a newly accepted connection to one of the reactors.  A session
+ * is opened for the connection and it is added to the reactor's epoll
+ * set.
+ *
+ * @param fd  File descriptor of the accepted connection.
+ * @return 0 if the connection was added, otherwise -1, in which case
+ * the connection has been closed.
+ */
+int evl_add_connection(int fd);
+
+/*
+ * Hand a newly accepted connection to a reactor on the CPU it was
+ * accepted on, if the reactors are pinned and one runs there, as
+ * evl_add_connection() does otherwise.
+ *
+ * @param fd  File descriptor of the accepted connection.
+ * @param slot  The CPU slot of the thread that accepted it.
+ * @return 0 if the connection was added, otherwise -1, in which case
+ * the connection has been closed.
+ */
+int evl_add_connection_on(int fd, int slot);
+
+/*
+ * Get the number of bytes of memory taken by the reactor's state for one
+ * idle connection, not counting the CLIENT and the decoder's ring buffer.
+ */
+size_t evl_connection_footprint(void);
+
+#endif
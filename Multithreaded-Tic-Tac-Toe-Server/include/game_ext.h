@@ -0,0 +1,176 @@
+#ifndef GAME_EXT_H
+#define GAME_EXT_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "game.h"
+
+/*
+ * Extensions to the GAME interface declared in game.h.
+ */
+
+/*
+ * The board a GAME is played on.  It has width by height squares, or
+ * depth such layers stacked up, and the first player to take k squares
+ * in a row wins: along a row, a column or a diagonal of a layer, or
+ * straight or diagonally through the layers.  Squares are numbered from
+ * 1 along the rows of the first layer, then those of the second, and so
+ * on.  game_create() makes the classic game, 3 by 3 with 3 in a row;
+ * gomoku is 15 by 15 with 5, and qubic 4 by 4 by 4 with 4.
+ */
+typedef struct game_variant {
+    uint8_t width;
+    uint8_t height;
+    uint8_t depth;              // 1 for a flat board
+    uint8_t k;                  // squares in a row to win
+} GAME_VARIANT;
+
+/* The longest side of a board.  A board of several layers must also fit
+ * in 256 bits with a spare column and row per layer: (width + 1) *
+ * (height + 1) * depth <= 256. */
+#define GAME_VARIANT_MAX_SIDE 15
+
+/* Size of a buffer that can hold any string made by game_unparse_variant(). */
+#define GAME_VARIANT_STR_MAX 16
+
+extern const GAME_VARIANT game_classic;
+
+/*
+ * Interpret a string of the form "<width>x<height>[x<depth>],<k>", such
+ * as "15x15,5" or "4x4x4,4", as a board.
+ *
+ * @param str  The string.
+ * @param variant  Set to the board described, if there is one.
+ * @return  0 if successful, -1 if str does not describe a board on
+ * which games can be played.
+ */
+int game_parse_variant(const char *str, GAME_VARIANT *variant);
+
+/*
+ * Describe a board in the form read by game_parse_variant(), leaving
+ * out the depth of a flat one.
+ *
+ * @param variant  The board.
+ * @param buf  The buffer into which the NUL-terminated description is stored.
+ * @param size  The size of buf; GAME_VARIANT_STR_MAX is always sufficient.
+ * @return  The length of the description, or -1 if it does not fit.
+ */
+int game_unparse_variant(const GAME_VARIANT *variant, char *buf, size_t size);
+
+/*
+ * @return  1 if variant is the board of the classic game, 0 otherwise.
+ */
+int game_variant_is_classic(const GAME_VARIANT *variant);
+
+/*
+ * Create a new game, as game_create() does, on a given board.
+ *
+ * @param variant  The board, which the game copies.
+ * @return  The newly created GAME, or NULL if the board is not one that
+ * game_parse_variant() accepts or memory is exhausted.
+ */
+GAME *game_create_variant(const GAME_VARIANT *variant);
+
+/*
+ * Get the board of a GAME, which never changes.
+ *
+ * @param game  The GAME.
+ * @return  The board, which lasts as long as the game.
+ */
+const GAME_VARIANT *game_get_variant(GAME *game);
+
+/*
+ * Choose how lines are looked for on the boards of the games created
+ * from now on, other than the classic one: with AVX2 if enable is
+ * nonzero and the CPU has it, which is the default, otherwise with
+ * plain 64-bit words.  This is for tests and benchmarks.
+ *
+ * @param enable  Whether to use AVX2.
+ * @return  1 if AVX2 is used from now on, 0 otherwise.
+ */
+int game_use_avx2(int enable);
+
+/* Size of a buffer that can hold any string made by game_unparse_state(). */
+#define GAME_STATE_MAX 1024
+
+/*
+ * Free a GAME_MOVE returned by game_parse_move().  Moves come from a
+ * pool rather than directly from malloc, so they must not be passed
+ * to free().
+ *
+ * @param move  The GAME_MOVE to be freed, or NULL.
+ */
+void game_free_move(GAME_MOVE *move);
+
+/*
+ * Apply a GAME_MOVE to a GAME, as game_apply_move() does, and tell
+ * whether it was this move that ended the game.  Since moves and
+ * resignations are serialized by the GAME's lock, exactly one caller
+ * learns that the game is over and is responsible for winding it up.
+ *
+ * @param game  The GAME to which the move is to be applied.
+ * @param move  The GAME_MOVE to be applied to the game.
+ * @return 1 if the move was made and ended the game, 0 if it was made
+ * and the game goes on, -1 if it is not legal.
+ */
+int game_apply_move_ending(GAME *game, GAME_MOVE *move);
+
+/*
+ * Describe the current GAME state, exactly as game_unparse_state() does,
+ * into a caller-supplied buffer instead of malloc'ed storage.
+ *
+ * @param game  The GAME for which the state description is to be obtained.
+ * @param buf  The buffer into which the NUL-terminated description is stored.
+ * @param size  The size of buf; GAME_STATE_MAX is always sufficient.
+ * @return  The length of the description, or -1 if it does not fit.
+ */
+int game_unparse_state_into(GAME *game, char *buf, size_t size);
+
+/* Length of the binary state description of a classic game. */
+#define GAME_STATE_BINARY_SIZE 4
+
+/* Maximum number of squares on a board. */
+#define GAME_MAX_SQUARES (GAME_VARIANT_MAX_SIDE * GAME_VARIANT_MAX_SIDE)
+
+/* Length of the longest binary state description. */
+#define GAME_STATE_BINARY_MAX (2 * ((GAME_MAX_SQUARES + 7) / 8))
+
+/*
+ * Describe the current GAME state compactly, for clients that parse it
+ * rather than show it: the squares taken by X and then those taken by O,
+ * each as a mask of (squares + 7) / 8 bytes, most significant first,
+ * whose bit i is set if square i+1 is taken.  For the classic game that
+ * is two 16-bit masks in network byte order.  X is to move when both
+ * have taken equally many squares.
+ *
+ * @param game  The GAME for which the state description is to be obtained.
+ * @param buf  The buffer into which the description is stored.
+ * @param size  The size of buf; GAME_STATE_BINARY_MAX is always sufficient.
+ * @return  The length of the description, GAME_STATE_BINARY_SIZE for
+ * the classic game, or -1 if it does not fit.
+ */
+int game_unparse_state_binary(GAME *game, char *buf, size_t size);
+
+/* Maximum number of moves in a GAME. */
+#define GAME_MAX_MOVES GAME_MAX_SQUARES
+
+/*
+ * Get the moves made so far in a GAME.  X made the moves at even
+ * positions, O those at odd positions.
+ *
+ * @param game  The GAME to be queried.
+ * @param squares  Array of GAME_MAX_MOVES entries into which the squares
+ * (from 1) are stored in the order they were taken.
+ * @return  The number of moves made.
+ */
+int game_get_history(GAME *game, uint8_t *squares);
+
+/*
+ * Get the number of bytes of memory taken by a GAME object, for capacity
+ * planning.  A game on a board other than the classic one takes the
+ * board as well, of a few hundred bytes.
+ */
+size_t game_footprint(void);
+
+#endif
@@ -0,0 +1,20 @@
+#ifndef HASH_H
+#define HASH_H
+
+#include <stdint.h>
+
+/*
+ * 32-bit FNV-1a hash of a NUL-terminated string, used for the username
+ * indexes.  Table sizes are powers of two, so callers reduce the hash
+ * with a mask.
+ */
+static inline uint32_t hash_string(const char *s){
+    uint32_t h = 2166136261u;
+    while(*s != '\0'){
+        h ^= (unsigned char) *s++;
+        h *= 16777619u;
+    }
+    return h;
+}
+
+#endif
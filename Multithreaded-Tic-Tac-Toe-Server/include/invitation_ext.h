@@ -0,0 +1,108 @@
+#ifndef INVITATION_EXT_H
+#define INVITATION_EXT_H
+
+#include "invitation.h"
+#include "game_ext.h"
+#include "spectators.h"
+#include "timer.h"
+
+/*
+ * Extensions to the INVITATION interface declared in invitation.h.
+ *
+ * An INVITATION remembers the ID that each of its two CLIENTs has given
+ * it, so that a CLIENT can find its ID for an invitation, and remove the
+ * invitation from its table, without a search.  Each ID belongs to its
+ * CLIENT: it is only set and read under that CLIENT's lock.
+ */
+
+/*
+ * Get the ID that the source or the target of an invitation has
+ * assigned to it.
+ *
+ * @param inv  The INVITATION.
+ * @param client  The source or the target of inv.
+ * @return  The ID, or -1 if client has not assigned one or is neither
+ * the source nor the target.
+ */
+int inv_get_client_id(INVITATION *inv, CLIENT *client);
+
+/*
+ * Record the ID that the source or the target of an invitation has
+ * assigned to it.
+ *
+ * @param inv  The INVITATION.
+ * @param client  The source or the target of inv.
+ * @param id  The ID, or -1 when the client lets go of the invitation.
+ * @return  0 if the ID was recorded, -1 if client is neither the source
+ * nor the target.
+ */
+int inv_set_client_id(INVITATION *inv, CLIENT *client, int id);
+
+/*
+ * Set the board on which the game of an invitation is to be played,
+ * which is the classic one unless this is called.  Called before the
+ * invitation is given to its source and target.
+ *
+ * @param inv  The INVITATION, still OPEN.
+ * @param variant  The board, which inv copies.
+ */
+void inv_set_variant(INVITATION *inv, const GAME_VARIANT *variant);
+
+/*
+ * Get the board on which the game of an invitation is played.
+ *
+ * @param inv  The INVITATION.
+ * @return  The board, which lasts as long as inv.
+ */
+const GAME_VARIANT *inv_get_variant(INVITATION *inv);
+
+/*
+ * Get the spectators of the game of an invitation (see spectators.h).
+ * They are made by the first WATCH, so that a game nobody watches costs
+ * nothing more than this call for each notification.
+ *
+ * @param inv  The INVITATION.
+ * @param create  Whether to make the set if there is none yet.
+ * @return  The set, which lasts as long as inv, or NULL if there is none
+ * (or it could not be made).
+ */
+SPECTATORS *inv_get_spectators(INVITATION *inv, int create);
+
+/*
+ * Arm the timer of an invitation, which holds a reference to it while
+ * armed (see timer.h).  When it expires, client_expire_invitation() says
+ * whether, and when, to look at the invitation again.  The timer is
+ * cancelled when the invitation is closed.
+ *
+ * @param inv  The INVITATION.
+ * @param ms  How many milliseconds from now the timer is to expire.
+ * @return  0 if the timer was armed, -1 if it was armed already or there
+ * are no timers.
+ */
+int inv_arm_timer(INVITATION *inv, unsigned ms);
+
+/*
+ * Cancel the timer of an invitation, if it is armed.
+ *
+ * @param inv  The INVITATION.
+ */
+void inv_cancel_timer(INVITATION *inv);
+
+/*
+ * Record that an invitation has just changed, for the timeouts: it is
+ * stamped when it is made, when it is accepted, and by every move made in
+ * its game.
+ *
+ * @param inv  The INVITATION.
+ */
+void inv_touch(INVITATION *inv);
+
+/*
+ * Get the time an invitation last changed.
+ *
+ * @param inv  The INVITATION.
+ * @return  The time, in ticks of timer_ticks().
+ */
+uint64_t inv_get_touched(INVITATION *inv);
+
+#endif
@@ -0,0 +1,89 @@
+#ifndef JOURNAL_H
+#define JOURNAL_H
+
+#include "player.h"
+#include "player_registry.h"
+
+/*
+ * Persistence of the players and their ratings across restarts (-j).
+ *
+ * A journal directory holds two files:
+ *
+ *   snapshot  every player, in the order they were created, with its
+ *             rating: a header, an array of fixed-size entries and the
+ *             names they point into, loaded with a single mmap(2)
+ *   journal   what has happened since the snapshot, as an append-only
+ *             sequence of records, each with a CRC-32 of its contents
+ *
+ * The records are the creation of a player (its first LOGIN; later
+ * logins change nothing that is kept) and the result of a game with the
+ * ratings of both players after it.  Players are known in the journal
+ * by their serial number, the order in which they were created.
+ *
+ * Appending a record only copies it into a buffer in memory.  A writer
+ * thread takes everything buffered so far, writes it with one write(2)
+ * and makes it durable with one fdatasync(2) (group commit), so no
+ * thread serving a client ever waits for the disk, unless more than
+ * JOURNAL_BUFFER_MAX bytes are waiting for the writer.
+ *
+ * At startup the snapshot is loaded and the journal replayed on top of
+ * it, up to the first record that is incomplete or fails its CRC (the
+ * tail of a crash), where the journal is cut.  The state is then written
+ * back as a new snapshot and the journal emptied, as it is again at
+ * shutdown.  Ratings are recorded as values, not changes, so replaying
+ * records already in the snapshot (after a crash between writing the
+ * snapshot and emptying the journal) ends in the same state.
+ */
+
+/* Bytes that may wait for the writer before appending blocks. */
+#define JOURNAL_BUFFER_MAX (1 << 20)
+
+/*
+ * Load the players saved in a journal directory into a player registry
+ * and start journaling.  The directory is created if need be.  Called
+ * once at startup, before any client is served.
+ *
+ * @param dir  The journal directory.
+ * @param preg  The PLAYER_REGISTRY to be filled.
+ * @return  The number of players loaded, or -1 if the directory cannot
+ * be used (in which case nothing is journaled).
+ */
+int journal_open(char *dir, PLAYER_REGISTRY *preg);
+
+/*
+ * Record the creation of a player.  Called by the player registry, with
+ * the player not yet visible to anyone else.  Does nothing unless the
+ * journal is open.
+ *
+ * @param player  The newly created PLAYER.
+ */
+void journal_log_player(PLAYER *player);
+
+/*
+ * Record the result of a game, with the players' ratings once it has
+ * been applied.  Called by the ratings worker.  Does nothing unless the
+ * journal is open.  A player the journal does not know, or a NULL
+ * player2 for a game rated on one side only (see ratings_post_against()),
+ * is left out of the record, and its rating is not restored on replay.
+ *
+ * @param player1  One of the PLAYERs.
+ * @param player2  The other PLAYER, or NULL.
+ * @param result  0 if draw, 1 if player1 won, 2 if player2 won.
+ * @param rating1  The rating of player1 after the game.
+ * @param rating2  The rating of player2 after the game.
+ */
+void journal_log_result(PLAYER *player1, PLAYER *player2, int result, double rating1, double rating2);
+
+/*
+ * Wait until every record appended before the call is on disk.
+ */
+void journal_sync(void);
+
+/*
+ * Stop the writer, save a snapshot and empty the journal.  Called once
+ * at server shutdown, after the ratings worker has finished and before
+ * the player registry is finalized.
+ */
+void journal_fini(void);
+
+#endif
@@ -0,0 +1,80 @@
+#ifndef LEADERBOARD_H
+#define LEADERBOARD_H
+
+#include <stddef.h>
+
+#include "player.h"
+
+/*
+ * Ranking of every player the player registry has ever created, logged
+ * in or not, for the LEADERBOARD packet (see protocol_ext.h).
+ *
+ * Players are kept in buckets by integer rating, each bucket a list,
+ * with a Fenwick tree over the bucket sizes.  The rank of a player is
+ * one more than the number of players in higher buckets, a prefix sum;
+ * the top K are found by walking down the non-empty buckets, each found
+ * by a descent of the tree.  Both take O(log B) per player returned,
+ * where B = LEADERBOARD_BUCKETS, and a lookup by name uses the
+ * leaderboard's own index, so no registry lock is taken.
+ *
+ * Each entry records the rating by which it is ranked, and the ratings
+ * worker moves all the players of a batch of results at once (see
+ * ratings.h), so a reply is always consistent with itself.
+ */
+
+/* Ratings are bucketed in [0, LEADERBOARD_BUCKETS); others are clamped. */
+#define LEADERBOARD_BUCKETS 4096
+
+/*
+ * Add a newly created player, at its current rating.  The leaderboard
+ * keeps no reference: the player registry holds one until shutdown.
+ *
+ * @param player  The PLAYER.
+ * @return  0 if the player was added, -1 if memory is exhausted.
+ */
+int leaderboard_add(PLAYER *player);
+
+/*
+ * Size the name index for a number of players, so that loading them
+ * (see journal.h) does not grow it over and over.
+ *
+ * @param n  The number of players expected.
+ */
+void leaderboard_reserve(int n);
+
+/*
+ * Move players to the buckets of their current ratings, as one change.
+ *
+ * @param players  The PLAYERs whose ratings have changed.
+ * @param n  The number of players.
+ */
+void leaderboard_update(PLAYER **players, int n);
+
+/*
+ * Get the players with the highest ratings.
+ *
+ * @param k  The number of players wanted.
+ * @param lenp  Variable into which is stored the length of the reply.
+ * @return  The lines described with the LEADERBOARD packet, in
+ * malloc'ed storage that the caller must free, or NULL if memory is
+ * exhausted.
+ */
+char *leaderboard_top(int k, size_t *lenp);
+
+/*
+ * Get the rank of a player.
+ *
+ * @param name  The username.
+ * @param lenp  Variable into which is stored the length of the reply.
+ * @return  The player's line, in malloc'ed storage that the caller must
+ * free, or NULL if there is no such player or memory is exhausted.
+ */
+char *leaderboard_rank(char *name, size_t *lenp);
+
+/*
+ * Free the leaderboard.  Called once at server shutdown, before the
+ * player registry is finalized.
+ */
+void leaderboard_fini(void);
+
+#endif
@@ -0,0 +1,81 @@
+#ifndef MATCHMAKER_H
+#define MATCHMAKER_H
+
+#include "client_registry.h"
+
+/*
+ * Server-side matchmaking, for the SEEK packet (see protocol_ext.h).
+ *
+ * Clients that seek a game wait in a pool, in bands of MATCH_BAND_WIDTH
+ * rating points, oldest first.  A matcher thread, started on first use,
+ * takes the pool's lock whenever seekers arrive and pairs as many as it
+ * can in one pass over the bands: two seekers are compatible if their
+ * ratings are at most as far apart as the longer waiter will go, which is
+ * MATCH_BAND_WIDTH points, and a band's width further every
+ * MATCH_WIDEN_SECS seconds.  The bands only order the search: seekers
+ * either side of a band's edge are as close as their ratings are.  The
+ * pairs are taken out of the pool, and their games are started after the
+ * lock has been released (see client_start_matched_game()); whoever
+ * sought first plays first.  Seekers that cannot be paired yet are looked at again when
+ * someone new arrives, or after a second.
+ *
+ * A seeker is found by the file descriptor of its connection, so joining
+ * and leaving the pool are constant time.
+ */
+
+/* Rating points per band of the pool. */
+#define MATCH_BAND_WIDTH 100
+
+/* Number of bands; ratings past the last band are in it. */
+#define MATCH_BANDS 64
+
+/* Seconds of waiting after which a seeker accepts opponents a band's width further away. */
+#define MATCH_WIDEN_SECS 5
+
+/* Most games started by one pass of the matcher. */
+#define MATCH_MAX_BATCH 256
+
+/*
+ * Put a logged-in client in the matchmaking pool.  A reference to the
+ * client is kept while it is there.
+ *
+ * @param client  The CLIENT.
+ * @return  0 if the client is now seeking a game, -1 if it was already,
+ * is not logged in, or memory is exhausted.
+ */
+int matchmaker_seek(CLIENT *client);
+
+/*
+ * Take a client out of the matchmaking pool.  Called by the client, and
+ * on logout.
+ *
+ * @param client  The CLIENT.
+ * @return  0 if the client was seeking a game, otherwise -1.
+ */
+int matchmaker_withdraw(CLIENT *client);
+
+/*
+ * Tell whether a client is in the matchmaking pool.
+ *
+ * @param client  The CLIENT.
+ * @return  Nonzero if it is seeking a game.
+ */
+int matchmaker_is_seeking(CLIENT *client);
+
+/*
+ * Tell whether two seekers may be paired.
+ *
+ * @param rating1  The rating of one seeker when it started seeking.
+ * @param rating2  The rating of the other.
+ * @param waited  How long the longer waiter of the two has been seeking,
+ * in seconds.
+ * @return  Nonzero if they may play each other.
+ */
+int matchmaker_compatible(int rating1, int rating2, double waited);
+
+/*
+ * Empty the pool.  Called once at server shutdown.
+ */
+void matchmaker_fini(void);
+
+#endif
@@ -0,0 +1,155 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <pthread.h>
+
+/*
+ * Counters, gauges and latency histograms describing the running server,
+ * reported by the STATS request (see protocol_ext.h) and, with -m, over
+ * HTTP in the Prometheus text format.
+ *
+ * Every thread that records something gets a shard of its own, so that
+ * recording is a few plain loads and stores to memory no other thread
+ * writes: no lock, no atomic read-modify-write, no shared cache line.
+ * A thread's shard is handed to the next thread that starts when it
+ * exits, so the totals survive the threads.  Once METRICS_MAX_SHARDS
+ * threads hold one, later threads share the existing shards, which then
+ * switch to atomic increments.  Reports add the shards up as they are,
+ * without stopping anyone.
+ *
+ * Latencies go into histograms of METRICS_HIST_SUB buckets per power of
+ * two nanoseconds, so that any percentile is within about 6% of the
+ * truth, as in an HDR histogram.  Longer than METRICS_HIST_MAX_NS counts
+ * as that long.
+ */
+
+#define METRICS_MAX_SHARDS 64
+#define METRICS_HIST_SUB_BITS 3
+#define METRICS_HIST_SUB (1 << METRICS_HIST_SUB_BITS)
+#define METRICS_HIST_MAX_BITS 32            // 2^32 ns, about 4 s
+#define METRICS_HIST_MAX_NS ((1ull << METRICS_HIST_MAX_BITS) - 1)
+#define METRICS_HIST_SIZE ((METRICS_HIST_MAX_BITS - METRICS_HIST_SUB_BITS + 1) * METRICS_HIST_SUB)
+
+/* The locks whose waits are timed. */
+typedef enum {
+    METRICS_LOCK_CREG,              // the client registry's
+    METRICS_LOCK_PREG,              // the player registry's (all shards)
+    METRICS_LOCK_CLIENT,            // the CLIENTs' (all of them)
+    METRICS_NUM_LOCKS
+} METRICS_LOCK;
+
+/* Numbers of things that exist now, changed as they come and go. */
+typedef enum {
+    METRICS_CLIENTS,                // connections registered
+    METRICS_PLAYERS,                // clients logged in
+    METRICS_INVITATIONS,            // invitations still open
+    METRICS_GAMES,                  // games in progress
+    METRICS_SPECTATORS,             // clients watching games, once for each game
+    METRICS_NUM_GAUGES
+} METRICS_GAUGE;
+
+/* The system calls made to move the clients' packets, counted by kind. */
+typedef enum {
+    METRICS_SYSCALL_RECV,           // recvmsg of a decoder's ring
+    METRICS_SYSCALL_SEND,           // sendmsg of an outbound queue
+    METRICS_SYSCALL_EPOLL_WAIT,     // of a reactor or the writer thread
+    METRICS_SYSCALL_URING_ENTER,    // of an io_uring reactor, which does all of the above
+    METRICS_NUM_SYSCALLS
+} METRICS_SYSCALL;
+
+// timeouts enforced (see client_ext.h)
+typedef enum {
+    METRICS_TIMEOUT_LOGIN,          // connections shut down before logging in
+    METRICS_TIMEOUT_IDLE,           // connections shut down for sending nothing
+    METRICS_TIMEOUT_INVITE,         // invitations revoked
+    METRICS_TIMEOUT_MOVE,           // games resigned for a player out of time
+    METRICS_NUM_TIMEOUTS
+} METRICS_TIMEOUT;
+
+/*
+ * Get the current time, to be passed to metrics_packet() once the
+ * packet has been handled.
+ *
+ * @return  CLOCK_MONOTONIC, in nanoseconds.
+ */
+uint64_t metrics_now(void);
+
+/*
+ * Count a request handled by the calling thread, with how long it took.
+ *
+ * @param type  The JEUX_PACKET_TYPE of the request.
+ * @param start  metrics_now() when handling it began.
+ */
+void metrics_packet(int type, uint64_t start);
+
+/*
+ * Count a system call made by the calling thread.
+ *
+ * @param call  What kind of call it was.
+ */
+void metrics_syscall(METRICS_SYSCALL call);
+
+/*
+ * Count a timeout enforced.  Only the timer thread does this, so the
+ * counts are not sharded.
+ *
+ * @param timeout  What timed out.
+ */
+void metrics_timeout(METRICS_TIMEOUT timeout);
+
+/*
+ * Change a gauge.
+ *
+ * @param gauge  The gauge.
+ * @param delta  What to add to it (negative to subtract).
+ */
+void metrics_gauge_add(METRICS_GAUGE gauge, int delta);
+
+/*
+ * Read a gauge.
+ *
+ * @param gauge  The gauge.
+ * @return  Its value.
+ */
+long metrics_gauge_get(METRICS_GAUGE gauge);
+
+/*
+ * Lock a mutex (or a reader-writer lock, for reading or for writing),
+ * counting the acquisition.  Only if the lock is not free at once is the
+ * wait timed, so an uncontended lock costs a trylock and a count.
+ *
+ * @param mutex  The lock.
+ * @param lock  Which of the timed locks it is.
+ */
+void metrics_mutex_lock(pthread_mutex_t *mutex, METRICS_LOCK lock);
+void metrics_rdlock(pthread_rwlock_t *rwlock, METRICS_LOCK lock);
+void metrics_wrlock(pthread_rwlock_t *rwlock, METRICS_LOCK lock);
+
+/*
+ * Report everything recorded since the server started, in the Prometheus
+ * text exposition format (version 0.0.4): by packet type, a summary of
+ * the time taken to handle requests (p50, p99 and p99.9, whose _count
+ * is the number of requests), the gauges, the system calls by kind, so
+ * that they can be set against the requests, and for each timed lock the
+ * number of acquisitions and a summary of the waits of those that could
+ * not take it at once.
+ *
+ * @param lenp  Where the length of the report is stored.
+ * @return  The report, in malloc'ed storage, or NULL if memory is
+ * exhausted.
+ */
+char *metrics_report(size_t *lenp);
+
+/*
+ * Serve metrics_report() over HTTP from a background thread: a GET of
+ * / or /metrics on the port is answered with the report, and the
+ * connection closed.
+ *
+ * @param port  The port on which to listen.
+ * @return  0 if the listener was started, -1 otherwise.
+ */
+int metrics_serve(char *port);
+
+#endif
@@ -0,0 +1,67 @@
+#ifndef ORACLE_H
+#define ORACLE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "game.h"
+
+/*
+ * Perfect-play oracle for tic-tac-toe.
+ *
+ * The outcome with perfect play and the optimal moves of every position
+ * reachable in a game (5478 of them) are computed once, by minimax, and
+ * kept in a table indexed by the position's two bitboards, as in GAME:
+ * bit i of x (resp. o) is set if X (resp. O) has taken square i+1.  The
+ * bitboards are turned into a base-3 index with two small lookup tables,
+ * so a query costs a few loads and no search.  This lets the server
+ * judge the quality of every move of a game as it is played (see the
+ * ANALYZE packet in protocol_ext.h) instead of having games replayed
+ * offline.
+ */
+
+/* Size of a buffer that can hold any analysis made by oracle_analyze(). */
+#define ORACLE_ANALYSIS_MAX 256
+
+/*
+ * Build the table.  This takes a fraction of a millisecond and is done
+ * by main() at startup; it is safe to call any number of times, from
+ * any thread, and the other functions call it themselves.
+ */
+void oracle_init(void);
+
+/*
+ * Get the outcome of a position with perfect play from both sides.
+ *
+ * @param x  Squares taken by X.
+ * @param o  Squares taken by O.
+ * @return  FIRST_PLAYER_ROLE if X wins, SECOND_PLAYER_ROLE if O wins,
+ * NULL_ROLE if the game is drawn, or -1 if the position cannot be
+ * reached in a game.
+ */
+int oracle_outcome(uint16_t x, uint16_t o);
+
+/*
+ * Get the moves that keep the best outcome for the player to move.
+ *
+ * @param x  Squares taken by X.
+ * @param o  Squares taken by O.
+ * @return  The optimal squares, as a mask like x and o; 0 if the game is
+ * over or the position cannot be reached in a game.
+ */
+uint16_t oracle_best_moves(uint16_t x, uint16_t o);
+
+/*
+ * Describe the quality of the moves of a game, as the text documented
+ * with the ANALYZE packet in protocol_ext.h.
+ *
+ * @param squares  The squares (1-9) taken, in order, X first.
+ * @param num_moves  The number of moves.
+ * @param buf  The buffer into which the NUL-terminated text is stored.
+ * @param size  The size of buf; ORACLE_ANALYSIS_MAX is always sufficient.
+ * @return  The length of the text, or -1 if the moves are not a legal
+ * game or the text does not fit.
+ */
+int oracle_analyze(const uint8_t *squares, int num_moves, char *buf, size_t size);
+
+#endif
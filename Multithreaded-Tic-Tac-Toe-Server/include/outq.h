@@ -0,0 +1,259 @@
+#ifndef OUTQ_H
+#define OUTQ_H
+
+#include <stddef.h>
+#include <stdatomic.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+#include "protocol.h"
+
+/*
+ * Bounded outbound packet queue, one per CLIENT.
+ *
+ * Any thread may push a packet for a client (multiple producers); the
+ * packets are linked into an intrusive lock-free MPSC queue and the
+ * pushing thread returns without waiting for the network.  Whoever holds
+ * the client's send lock is the single consumer: it moves queued packets
+ * to a private pending list and writes as much of that list as the
+ * socket accepts with one non-blocking sendmsg.  If the socket is full,
+ * the queue is marked blocked and handed to the writer thread, which
+ * waits for EPOLLOUT and resumes the flush, so no service thread or
+ * reactor ever sleeps in a send on behalf of a slow peer.
+ *
+ * A thread may instead hand its sends to an asynchronous backend, such
+ * as the io_uring reactors (see uring_loop.h), by setting outq_submit.
+ * The queue is then blocked until the backend reports with
+ * outq_complete() how much of the send went out, and the packets in
+ * flight stay where they are until it does.
+ *
+ * A client that falls too far behind is a slow consumer.  Under
+ * OUTQ_DROP, exceeding the configured limit is an error and the caller
+ * is expected to disconnect the client.  Under OUTQ_COALESCE, a MOVED
+ * packet supersedes a not yet transmitted MOVED for the same invitation
+ * (each carries the complete board), and only twice the limit is fatal.
+ */
+
+typedef enum outq_policy {
+    OUTQ_DROP,                  // disconnect a client whose queue overflows
+    OUTQ_COALESCE               // collapse superseded MOVED packets first
+} OUTQ_POLICY;
+
+/* Default maximum number of packets waiting for a single client. */
+#define OUTQ_DEFAULT_LIMIT 256
+
+/* Slow-consumer settings, shared by all queues (set from the command line). */
+extern int outq_limit;
+extern OUTQ_POLICY outq_policy;
+
+typedef struct outq OUTQ;
+
+typedef struct outq_node {
+    struct outq_node *_Atomic next;
+} OUTQ_NODE;
+
+/*
+ * A reference-counted, read-only payload that can be queued for any
+ * number of clients without being copied, e.g. the cached USERS listing.
+ * It is freed when the last reference is dropped, which happens once the
+ * creator and every queue holding it are done with it.
+ */
+typedef struct outq_shared {
+    atomic_int refs;            // creator's reference plus one per queued packet
+    size_t len;                 // size of data
+    char data[];                // contents, immutable once shared
+} OUTQ_SHARED;
+
+typedef struct out_packet {
+    OUTQ_NODE node;             // link in the MPSC queue (must be first)
+    struct out_packet *next;    // link in the consumer's pending list
+    size_t len;                 // size of the wire image
+    OUTQ_SHARED *shared;        // holder of the payload, or NULL if it is in data
+    const char *payload;        // payload inside shared, if there is one
+    char data[];                // header (network byte order) and, unless shared, payload
+} OUT_PACKET;
+
+/* Result of outq_flush(), besides -1 for an error. */
+#define OUTQ_DONE      0        // everything queued has been written
+#define OUTQ_BLOCKED   1        // the socket is full; wait for EPOLLOUT
+#define OUTQ_SUBMITTED 2        // a send was handed to outq_submit; wait for outq_complete()
+
+/*
+ * Start an asynchronous send of the iovecs, which only stay valid for
+ * the call, and report its result with outq_complete() once it is done.
+ * Returns 0 if the send was started, -1 if it was not.
+ */
+typedef int OUTQ_SUBMIT(OUTQ *q, int fd, struct iovec *iov, int iovcnt);
+
+/* How the calling thread sends, or NULL (the default) to send at once. */
+extern __thread OUTQ_SUBMIT *outq_submit;
+
+struct outq {
+    // producer side
+    OUTQ_NODE *_Atomic tail;    // most recently pushed node
+    atomic_int length;          // packets pushed and not yet freed
+    atomic_int queued;          // packets pushed and not yet moved to pending
+    atomic_int closed;          // nonzero once no more packets are accepted
+    // consumer side, protected by the owner's send lock
+    OUTQ_NODE *head;            // oldest node of the MPSC queue
+    OUTQ_NODE stub;             // permanent dummy node of the MPSC queue
+    OUT_PACKET *pending;        // packets taken from the queue, oldest first
+    OUT_PACKET **pending_tail;  // where the next pending packet is linked
+    size_t sent;                // bytes of the first pending packet already sent
+    int blocked;                // waiting for the writer thread
+    int failed;                 // a send has failed; everything is discarded
+    int registered;             // fd has been added to the writer's epoll set
+    int inflight;               // pending packets in a submitted send, or 0
+    ssize_t result;             // of the submitted send, once it is complete
+    void (*on_writable)(void *owner);   // called by the writer thread
+    void *owner;                // argument for on_writable
+};
+
+/*
+ * Initialize an empty queue.
+ *
+ * @param q  The queue to initialize.
+ * @param on_writable  Function called from the writer thread once a
+ * blocked queue's socket becomes writable again.
+ * @param owner  Argument passed to on_writable.
+ */
+void outq_init(OUTQ *q, void (*on_writable)(void *owner), void *owner);
+
+/*
+ * Free every packet still in the queue.  There must be no concurrent
+ * producers or consumer.
+ */
+void outq_fini(OUTQ *q);
+
+/*
+ * Append a packet to the queue.  The header is time-stamped and copied
+ * together with the payload, so both remain owned by the caller.  This
+ * never blocks.
+ *
+ * @param q  The queue.
+ * @param hdr  The packet header, with multi-byte fields in network byte order.
+ * @param data  The payload, or NULL if there is none.
+ * @return 0 if the packet was queued, otherwise -1 with errno set to
+ * ENOBUFS if the queue is over its limit (the client is a slow consumer),
+ * EPIPE if the queue has been closed, or EINVAL for a malformed packet.
+ */
+int outq_push(OUTQ *q, JEUX_PACKET_HEADER *hdr, void *data);
+
+/*
+ * Append a packet whose payload is part of a shared buffer.  Only the
+ * header is copied; the queue takes its own reference to the buffer,
+ * which it drops once the packet has been sent or discarded.
+ *
+ * @param q  The queue.
+ * @param hdr  The packet header, with multi-byte fields in network byte order.
+ * @param buf  The buffer holding the payload.
+ * @param off  Offset of the payload in buf; the payload is as long as
+ * the size in the header says.
+ * @return 0 if the packet was queued, otherwise -1 with errno set as
+ * for outq_push().
+ */
+int outq_push_shared(OUTQ *q, JEUX_PACKET_HEADER *hdr, OUTQ_SHARED *buf, size_t off);
+
+/*
+ * Allocate a shared buffer, with one reference held by the caller, who
+ * fills in the contents before queueing it.
+ *
+ * @param len  The size of the contents.
+ * @return  The buffer, or NULL if memory is exhausted.
+ */
+OUTQ_SHARED *outq_shared_create(size_t len);
+
+/*
+ * Take another reference to a shared buffer.
+ *
+ * @return  The same buffer.
+ */
+OUTQ_SHARED *outq_shared_ref(OUTQ_SHARED *buf);
+
+/*
+ * Drop a reference to a shared buffer, freeing it if it was the last.
+ *
+ * @param buf  The buffer, or NULL.
+ */
+void outq_shared_unref(OUTQ_SHARED *buf);
+
+/*
+ * Write queued packets to a socket without blocking.  Must be called by
+ * the single consumer, i.e. with the owner's send lock held.  A blocked
+ * queue is not written to until outq_unblock() is called.
+ *
+ * @param q  The queue.
+ * @param fd  The socket on which to send.
+ * @return OUTQ_DONE if the queue was emptied, OUTQ_BLOCKED if the socket
+ * is full, OUTQ_SUBMITTED if the calling thread's outq_submit has taken
+ * a send, or -1 if sending failed (the remaining packets are discarded
+ * and the queue is closed).
+ */
+int outq_flush(OUTQ *q, int fd);
+
+/*
+ * Clear the blocked state of a queue, as the writer thread does once the
+ * socket is writable again, and account for the send that was in flight,
+ * if any.  Must be called with the owner's send lock held.
+ */
+void outq_unblock(OUTQ *q);
+
+/*
+ * Report the result of a send started by an OUTQ_SUBMIT, which calls
+ * q->on_writable, as for a socket that has become writable.
+ *
+ * @param q  The queue.
+ * @param result  The number of bytes sent, or a negated errno.
+ */
+void outq_complete(OUTQ *q, ssize_t result);
+
+/*
+ * Ask the writer thread to call q->on_writable once fd becomes writable.
+ * The request is one-shot; it is normally made when outq_flush() returns
+ * OUTQ_BLOCKED.  The writer thread is started on first use.
+ *
+ * @return 0 on success, -1 on failure.
+ */
+int outq_arm(OUTQ *q, int fd);
+
+/*
+ * Determine whether packets have been pushed that the consumer has not
+ * yet taken.  The consumer calls this after releasing its lock, so that
+ * a producer whose attempt to take the lock failed is never stranded.
+ */
+int outq_has_queued(OUTQ *q);
+
+/*
+ * Stop accepting packets.  Packets already queued may still be flushed.
+ */
+void outq_close(OUTQ *q);
+
+/*
+ * Copy out the wire images of the packets not yet completely sent, for
+ * a hot upgrade (see upgrade.h).  Must be called with the owner's send
+ * lock held, and with no send in flight.
+ *
+ * @param q  The queue.
+ * @param lenp  Set to the length of the images.
+ * @param sentp  Set to how much of the first one has been sent already.
+ * @return  The images, in malloc'ed storage (NULL if there are none),
+ * or NULL with *lenp set to 0 and errno set to ENOMEM if memory is
+ * exhausted.
+ */
+char *outq_save(OUTQ *q, size_t *lenp, size_t *sentp);
+
+/*
+ * Queue wire images saved by outq_save() in another process, as they
+ * are: they are not time-stamped again and count against no limit.
+ * There must be no concurrent producers or consumer.
+ *
+ * @param q  An empty queue.
+ * @param data  The images.
+ * @param len  Their length.
+ * @param sent  How much of the first one has been sent already.
+ * @return 0 if the packets were queued, -1 if the images are malformed
+ * or memory is exhausted.
+ */
+int outq_adopt(OUTQ *q, const char *data, size_t len, size_t sent);
+
+#endif
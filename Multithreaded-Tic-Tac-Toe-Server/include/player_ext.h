@@ -0,0 +1,64 @@
+#ifndef PLAYER_EXT_H
+#define PLAYER_EXT_H
+
+#include <stdint.h>
+
+#include "player.h"
+
+/*
+ * Extensions to the PLAYER interface declared in player.h.
+ *
+ * The player registry creates exactly one PLAYER per username and never
+ * discards it, so a PLAYER pointer identifies a username: two players
+ * are the same user if and only if the pointers are equal, and the name
+ * returned by player_get_name() is interned.
+ */
+
+/*
+ * Get the hash of a player's username, as computed by hash_string()
+ * when the PLAYER was created.
+ *
+ * @param player  The PLAYER.
+ * @return  The hash of the player's username.
+ */
+uint32_t player_get_hash(PLAYER *player);
+
+/*
+ * Get the rating of a player, with the fraction that player_get_rating()
+ * drops.
+ *
+ * @param player  The PLAYER.
+ * @return  The rating.
+ */
+double player_get_exact_rating(PLAYER *player);
+
+/*
+ * Change the rating of a player.  Only the ratings worker does, inside
+ * the write section of the ratings sequence lock (see ratings.h), except
+ * that the rating of the shadow of a user of another node is also set
+ * as that node sends it (see cluster.h).
+ *
+ * @param player  The PLAYER.
+ * @param rating  The new rating.
+ */
+void player_set_rating(PLAYER *player, double rating);
+
+/*
+ * Get the serial number by which the journal knows a player (see
+ * journal.h).
+ *
+ * @param player  The PLAYER.
+ * @return  The serial number, or UINT32_MAX if the player has none.
+ */
+uint32_t player_get_serial(PLAYER *player);
+
+/*
+ * Set the serial number of a player.  Only the journal does, when the
+ * player is created or loaded.
+ *
+ * @param player  The PLAYER.
+ * @param serial  The serial number.
+ */
+void player_set_serial(PLAYER *player, uint32_t serial);
+
+#endif
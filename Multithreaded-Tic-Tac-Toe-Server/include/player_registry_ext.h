@@ -0,0 +1,47 @@
+#ifndef PLAYER_REGISTRY_EXT_H
+#define PLAYER_REGISTRY_EXT_H
+
+#include "player_registry.h"
+
+/*
+ * Extensions to the player registry interface declared in
+ * player_registry.h, for loading the players saved by the journal
+ * (see journal.h), or handed over by a hot upgrade (see upgrade.h),
+ * before any client is served.
+ */
+
+/*
+ * Register a player at a given rating, as preg_register() would register
+ * a new one, and rank it at that rating.  If the name is already
+ * registered, the existing player is returned and its rating is left
+ * alone.  No reference is added for the caller: the registry's keeps the
+ * player alive until preg_fini().
+ *
+ * @param preg  The PLAYER_REGISTRY.
+ * @param name  The player's user name, which is copied.
+ * @param rating  The rating of a new player.
+ * @return  The PLAYER, or NULL if memory is exhausted.
+ */
+PLAYER *preg_load(PLAYER_REGISTRY *preg, char *name, double rating);
+
+/*
+ * Size the registry's tables for a number of players, so that loading
+ * them does not grow the tables over and over.
+ *
+ * @param preg  The PLAYER_REGISTRY.
+ * @param n  The number of players expected.
+ */
+void preg_reserve(PLAYER_REGISTRY *preg, int n);
+
+/*
+ * Get every registered player.  No references are added, as for
+ * preg_load().
+ *
+ * @param preg  The PLAYER_REGISTRY.
+ * @param countp  Set to the number of players.
+ * @return  A malloc'ed array of the players, or NULL if there are none
+ * or memory is exhausted.
+ */
+PLAYER **preg_all_players(PLAYER_REGISTRY *preg, int *countp);
+
+#endif
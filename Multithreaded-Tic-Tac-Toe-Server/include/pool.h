@@ -0,0 +1,69 @@
+#ifndef POOL_H
+#define POOL_H
+
+#include <stddef.h>
+#include <stdatomic.h>
+#include <pthread.h>
+
+/*
+ * Fixed-size object pools for the small objects that the server
+ * creates and destroys on every request (games, invitations, list
+ * nodes, queued packets).
+ *
+ * Each thread keeps a private free list per pool, so pool_alloc() and
+ * pool_free() normally touch no lock and no shared cache line.  Objects
+ * are carved out of slabs of POOL_SLAB_OBJECTS allocated with a single
+ * malloc.  A thread whose free list grows past 2 * POOL_BATCH objects
+ * hands POOL_BATCH of them back to the pool's shared depot, and a thread
+ * whose list is empty takes a batch from the depot before carving a new
+ * slab, so objects freed by a thread other than the one that allocated
+ * them (e.g. a packet queued by one service thread and sent by another)
+ * circulate instead of piling up.  When a thread exits, its free lists
+ * are returned to the depots.  Slabs are never given back to malloc.
+ *
+ * Building with -DNO_POOL (make NO_POOL=1) turns pool_alloc() and
+ * pool_free() into plain malloc() and free(), which is what memory
+ * checkers such as ASan and valgrind need to see every object.
+ */
+
+#define POOL_SLAB_OBJECTS 64    // objects carved from one slab
+#define POOL_BATCH 32           // objects moved between a thread and the depot at once
+#define POOL_MAX 16             // pools that may exist in the program
+#define POOL_ALIGN 16           // alignment of every object
+
+typedef struct pool {
+    const char *name;           // for debugging printout
+    size_t size;                // object size, rounded up to POOL_ALIGN
+    atomic_int id;              // index of the per-thread free lists, or -1 until first use
+    pthread_mutex_t lock;       // protects depot and depot_count
+    void *depot;                // free objects not held by any thread
+    int depot_count;            // # of objects in depot
+} POOL;
+
+/*
+ * Static initializer for a pool of objects of a given size, e.g.
+ *
+ *     static POOL game_pool = POOL_INITIALIZER("game", sizeof(GAME));
+ */
+#define POOL_INITIALIZER(name, size) \
+    { (name), ((size) + POOL_ALIGN - 1) & ~(size_t) (POOL_ALIGN - 1), -1, \
+      PTHREAD_MUTEX_INITIALIZER, NULL, 0 }
+
+/*
+ * Allocate an object from a pool.  The contents are uninitialized.
+ *
+ * @param pool  The pool from which to allocate.
+ * @return  An object of pool->size bytes, or NULL if memory is exhausted.
+ */
+void *pool_alloc(POOL *pool);
+
+/*
+ * Return an object to the pool it was allocated from.  Any thread may
+ * free an object, not only the one that allocated it.
+ *
+ * @param pool  The pool from which obj was allocated.
+ * @param obj  The object, or NULL, in which case nothing is done.
+ */
+void pool_free(POOL *pool, void *obj);
+
+#endif
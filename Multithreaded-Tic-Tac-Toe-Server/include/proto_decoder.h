@@ -0,0 +1,103 @@
+#ifndef PROTO_DECODER_H
+#define PROTO_DECODER_H
+
+#include <stddef.h>
+#include <sys/types.h>
+
+#include "protocol.h"
+
+/*
+ * Incremental decoder for the Jeux packet framing.
+ *
+ * Unlike proto_recv_packet(), which blocks in two separate reads for the
+ * header and the payload of each packet, a PROTO_DECODER accepts whatever
+ * bytes the socket has available -- half a header, or several pipelined
+ * packets at once -- and keeps them in a per-connection ring buffer.
+ * Complete packets are then handed out one at a time as a header plus a
+ * view of the payload inside the ring, so that every packet received by
+ * a single recv can be decoded without further system calls or copies.
+ *
+ * Typical use:
+ *
+ *     while (proto_decoder_fill(&dec, fd, 0) > 0)
+ *         while (proto_decoder_next(&dec, &hdr, &payload) == 1)
+ *             handle(&hdr, payload);
+ */
+
+/* Initial ring capacity; the ring grows if a single packet needs more. */
+#define PROTO_DECODER_DEFAULT_CAPACITY 2048
+
+typedef struct proto_decoder {
+    char *buf;                  // ring storage
+    size_t capacity;            // size of buf, always a power of two
+    size_t head;                // position of the first undecoded byte
+    size_t tail;                // position one past the last byte received
+    char *spill;                // linear copy of a payload that wraps the ring
+    size_t spill_size;          // size of spill
+} PROTO_DECODER;
+
+/*
+ * Initialize a decoder.
+ *
+ * @param dec  The decoder to be initialized.
+ * @param capacity  Initial ring capacity in bytes (rounded up to a power
+ * of two), or 0 for PROTO_DECODER_DEFAULT_CAPACITY.
+ * @return 0 if successful, otherwise -1.
+ */
+int proto_decoder_init(PROTO_DECODER *dec, size_t capacity);
+
+/*
+ * Release the storage held by a decoder.
+ *
+ * @param dec  The decoder to be finalized.
+ */
+void proto_decoder_fini(PROTO_DECODER *dec);
+
+/*
+ * Receive into the free space of the ring with a single recvmsg(2).
+ *
+ * @param dec  The decoder.
+ * @param fd  The file descriptor from which to receive.
+ * @param flags  Flags for recvmsg(2), e.g. MSG_DONTWAIT.
+ * @return the number of bytes received, 0 on EOF, or -1 on error, in
+ * which case errno is set (EAGAIN if nothing was available on a
+ * non-blocking receive, EINTR if a signal came first).
+ */
+ssize_t proto_decoder_fill(PROTO_DECODER *dec, int fd, int flags);
+
+/*
+ * Append bytes that were obtained by some other means to the ring.
+ *
+ * @param dec  The decoder.
+ * @param data  The bytes to append.
+ * @param len  The number of bytes to append.
+ * @return 0 if successful, otherwise -1.
+ */
+int proto_decoder_feed(PROTO_DECODER *dec, const void *data, size_t len);
+
+/*
+ * Copy out the bytes received but not yet decoded, which are left in
+ * the ring.
+ *
+ * @param dec  The decoder.
+ * @param buf  Where to copy them.
+ * @param size  The size of buf; at most this many bytes are copied.
+ * @return the number of bytes not yet decoded, which may exceed size.
+ */
+size_t proto_decoder_unread(PROTO_DECODER *dec, void *buf, size_t size);
+
+/*
+ * Extract the next complete packet, if there is one.
+ *
+ * @param dec  The decoder.
+ * @param hdr  Caller-supplied storage for the header, which is returned
+ * with its multi-byte fields in host byte order.
+ * @param payloadp  Set to point at the hdr->size payload bytes, or to NULL
+ * if the packet has no payload.  The payload is NOT NUL-terminated and
+ * stays owned by the decoder: it remains valid only until the next call
+ * to proto_decoder_next(), proto_decoder_fill() or proto_decoder_feed().
+ * @return 1 if a packet was extracted, 0 if more bytes are needed.
+ */
+int proto_decoder_next(PROTO_DECODER *dec, JEUX_PACKET_HEADER *hdr, void **payloadp);
+
+#endif
@@ -0,0 +1,214 @@
+#ifndef PROTOCOL_EXT_H
+#define PROTOCOL_EXT_H
+
+#include "protocol.h"
+
+/*
+ * Extensions to the protocol layer declared in protocol.h.
+ */
+
+/* Maximum number of packets that proto_send_packets() sends in one call. */
+#define PROTO_MAX_BATCH 32
+
+/*
+ * Versioned USERS.  A USERS request without a payload is answered as it
+ * always was, with one "name\trating\n" line per logged-in user.  A USERS
+ * request whose payload is a decimal version number V asks for the users
+ * relative to V, and the ACK payload starts with one of the lines
+ *
+ *     "@<version>\tfull\n"   followed by the complete listing, or
+ *     "@<version>\tdelta\n"  followed by the users changed since V, as
+ *                            "+name\trating\n" for one who is logged in
+ *                            (newly, or with a new rating) and "-name\n"
+ *                            for one who has logged out.
+ *
+ * A client starts with V = 0, which always gets the full listing, and
+ * then sends the version of the last reply.  A delta is only sent if the
+ * server still remembers all the changes since V.
+ */
+#define USERS_FULL_TAG  "full"
+#define USERS_DELTA_TAG "delta"
+
+/*
+ * LOGIN options.  The role field of a LOGIN header, which is otherwise
+ * unused, is a set of the option bits below, which apply for the rest of
+ * the session.  Existing clients send 0, which asks for none of them;
+ * a LOGIN with any other bit set is refused.
+ *
+ * JEUX_LOGIN_BINARY_BOARD  Game states, in the payloads of MOVED and
+ *                          ACCEPTED and in the ACK of an ACCEPT, are the
+ *                          four bytes described at
+ *                          game_unparse_state_binary() in game_ext.h
+ *                          instead of the ASCII drawing of the board.
+ * JEUX_LOGIN_ANALYSIS      The payload of ENDED is the analysis of the
+ *                          game, as in the ACK of ANALYZE below.
+ */
+#define JEUX_LOGIN_BINARY_BOARD 0x1
+#define JEUX_LOGIN_ANALYSIS     0x2
+#define JEUX_LOGIN_OPTIONS      (JEUX_LOGIN_BINARY_BOARD | JEUX_LOGIN_ANALYSIS)
+
+/*
+ * Cluster mode (see cluster.h).  A user can log in only at the node its
+ * name belongs to.  A LOGIN at any other node gets a NACK whose payload is
+ * "<host>:<port>" of the right one, where the client is to connect and
+ * log in again; every other NACK still has no payload.  Once logged in,
+ * a client sees the users of all the nodes in USERS, and can invite any
+ * of them.  The IDs it is given come from the slices of the nodes where
+ * its invitations are held, and are used as always.
+ */
+
+/*
+ * ANALYZE     Sent by a client to have the moves of a game judged
+ *             Header: invitation ID of a game in progress
+ *
+ * The ACK payload has one line per move made,
+ *
+ *     "<X|O>\t<square>\t<ok|blunder>\t<optimal squares>\n"
+ *
+ * where a move is a blunder if it worsens the outcome its player could
+ * force, and the optimal squares (as digits) are the moves that would
+ * have kept that outcome; then a last line
+ *
+ *     "=\t<X|O|draw>\t<optimal squares>\n"
+ *
+ * with the outcome of the game with perfect play from now on, and the
+ * optimal moves of the player to move (none if the game is over).
+ */
+#define JEUX_ANALYZE_PKT (JEUX_ENDED_PKT + 1)
+
+/*
+ * LEADERBOARD Sent by a client to get the players with the best ratings
+ *             Header: id = the number K of players wanted, 0 for
+ *                     LEADERBOARD_DEFAULT_K
+ *             Payload: empty, or the username of one player
+ *
+ * Every player who has ever logged in is ranked, logged in or not.  The
+ * ACK payload has one line for each of the K best players, best first,
+ *
+ *     "<rank>\t<name>\t<rating>\n"
+ *
+ * where the rank is one more than the number of players rated higher,
+ * so that equal ratings share a rank.  With a username, the payload is
+ * that player's line alone (K is ignored), and a NACK is sent if no
+ * player of that name has ever logged in.
+ */
+#define JEUX_LEADERBOARD_PKT (JEUX_ANALYZE_PKT + 1)
+#define LEADERBOARD_DEFAULT_K 10
+
+/*
+ * SEEK        Sent by a client to be paired with an opponent by the server
+ *             Header: role = SEEK_JOIN, or SEEK_CANCEL to stop seeking
+ *
+ * The ACK or NACK comes at once: a NACK if the client was already
+ * seeking (SEEK_JOIN) or was not (SEEK_CANCEL).  Seekers are paired with
+ * players of similar ratings, the range widening the longer they wait
+ * (see matchmaker.h).  When a game is found, both get an ACCEPTED packet
+ * as if whoever sought first had invited the other, who accepted: its
+ * id is the client's ID for the new invitation, and the one who plays
+ * first gets the initial game state as its payload; if a game is found
+ * at once, the ACCEPTED may come before the ACK.  Seeking ends with the
+ * game, with SEEK_CANCEL, or with logout.
+ */
+#define JEUX_SEEK_PKT (JEUX_LEADERBOARD_PKT + 1)
+#define SEEK_JOIN 0
+#define SEEK_CANCEL 1
+
+/*
+ * STATS       Sent by a client to get the server's metrics
+ *
+ * The ACK payload is everything recorded since the server started, in
+ * the Prometheus text format described in metrics.h: how long requests
+ * of each type take, connected clients, logged-in players, open
+ * invitations, games in progress, and the waits for the most used locks.
+ * The same text is served over HTTP with the -m option.
+ */
+#define JEUX_STATS_PKT (JEUX_SEEK_PKT + 1)
+
+/*
+ * WATCH       Sent by a client to follow a game as a spectator
+ *             Header: role = WATCH_START, or WATCH_STOP to stop watching
+ *                     id = (WATCH_STOP) the client's ID for the game
+ *             Payload: (WATCH_START) username of a player in the game
+ *
+ * Any logged-in client other than the players can watch a game in
+ * progress.  The ACK of WATCH_START has as its id the ID the client is
+ * to know the game by, which is taken from the same IDs as those of its
+ * invitations, and the current game state as its payload, in the
+ * client's board format.  If the player is in several games, the one
+ * watched is the one to which that player has given the lowest ID.
+ * From then on the client is sent a MOVED after every move, with the
+ * client's ID for the game and, as its role, the GAME_ROLE of the player
+ * who moved, and finally an ENDED (with the analysis, if it was asked
+ * for at LOGIN), after which the ID is free again.  A board is never
+ * older than one sent before, but a watcher that falls behind may miss
+ * some.  A NACK to WATCH_STOP means the game has ended and the ENDED has
+ * been or is about to be sent; after an ACK, nothing more is.  Watching
+ * ends with logout.
+ */
+#define JEUX_WATCH_PKT (JEUX_STATS_PKT + 1)
+#define WATCH_START 0
+#define WATCH_STOP 1
+
+/*
+ * Timeouts.  A server started with -t (see client_ext.h) may act on its
+ * own, with no new packet types:
+ *
+ *   - A connection that does not log in in time, or that sends nothing
+ *     for too long, is closed.  Any request, even one that is refused,
+ *     counts as activity.
+ *   - An invitation that is still open when its time is up is revoked:
+ *     the target is sent REVOKED as if the source had revoked it, and
+ *     the source is sent REVOKED as well, with its own ID for it, after
+ *     which that ID may be given to a new invitation.
+ *   - A player who does not move in time resigns: the opponent is sent
+ *     RESIGNED and both are sent ENDED, as after a RESIGN.
+ */
+
+/*
+ * Boards.  A game may be played on a larger board than the classic one,
+ * with no new packet types (see GAME_VARIANT in game_ext.h):
+ *
+ *   - The payload of INVITE may have, after the username and a tab, the
+ *     board as "<width>x<height>[x<depth>],<k>": "15x15,5" for gomoku,
+ *     "4x4x4,4" for qubic.  Sides go up to 15.  A NACK is sent for a
+ *     board on which no game can be played.
+ *   - The payload of INVITED then has the board after the source's name
+ *     and a tab in the same way.  It has the name alone for the classic
+ *     board, which is what an INVITE without one asks for.
+ *   - A MOVE names a square by its number, from 1 along the rows of the
+ *     first layer, then those of the next.  Boards are drawn row by row
+ *     as the classic one is, with a blank line between layers.  The
+ *     binary board has a mask of (squares + 7) / 8 bytes for each player.
+ *   - Games are analyzed on the classic board only: an ANALYZE of any
+ *     other game is refused with a NACK, and its ENDED has no analysis.
+ *     The games made by SEEK are classic ones.
+ */
+
+/*
+ * Send several packets on the same file descriptor with a single
+ * writev(2) (looping only if the kernel accepts a short count).  Each
+ * header is time-stamped just like proto_send_packet() does.  This is
+ * used to flush notifications that are generated together for the same
+ * client, such as a MOVED followed by the ENDED it caused.
+ *
+ * @param fd  The file descriptor on which the packets are to be sent.
+ * @param hdrs  The packet headers, with multi-byte fields in network
+ * byte order.
+ * @param data  The payloads, with NULL entries for packets without one.
+ * @param count  The number of packets, at most PROTO_MAX_BATCH.
+ * @return  0 in case of successful transmission, -1 otherwise.
+ *   In the latter case, errno is set to indicate the error.
+ */
+int proto_send_packets(int fd, JEUX_PACKET_HEADER **hdrs, void **data, int count);
+
+/*
+ * Set the timestamp fields of a packet header to the current time, in
+ * network byte order.  proto_send_packet() does this itself; it is
+ * exported for code that assembles packets to be sent later.
+ *
+ * @param hdr  The header, whose other multi-byte fields are already in
+ * network byte order.
+ */
+void proto_stamp_header(JEUX_PACKET_HEADER *hdr);
+
+#endif
@@ -0,0 +1,98 @@
+#ifndef RATINGS_H
+#define RATINGS_H
+
+#include "player.h"
+
+/*
+ * The pipeline through which game results change the players' ratings.
+ *
+ * player_post_result() does not touch the ratings itself: it queues the
+ * result, with references to both players, and returns.  A single
+ * ratings worker, started on first use, takes every result queued so far
+ * as one batch and applies them in the order they were posted, so the
+ * ratings are the same as if the games had been rated one by one as they
+ * ended.  Being the only writer, the worker needs no per-player locks.
+ *
+ * Each batch is applied inside the write section of a sequence lock.  A
+ * reader that needs several ratings to agree (the USERS listing, for
+ * instance) reads them between ratings_read_begin() and
+ * ratings_read_retry() and starts over if a batch was applied meanwhile,
+ * so it never sees one side of a game rated and not the other.  The
+ * players of a batch are noted in the USERS cache, and moved in the
+ * leaderboard, once the whole batch has taken effect, so the cached
+ * listings and the leaderboard only ever reflect whole batches.
+ *
+ * The expected score of the Elo formula is looked up in a table indexed
+ * by the rating difference, rounded to an integer and clamped to
+ * +/-RATING_DIFF_MAX, instead of being computed with pow().
+ */
+
+/* Number of results that can wait for the worker; posting blocks beyond that. */
+#define RATINGS_QUEUE_SIZE 1024
+
+/* The rating difference beyond which the expected score no longer changes. */
+#define RATING_DIFF_MAX 800
+
+/* The Elo K-factor: the most a rating can change in one game. */
+#define RATING_K 32.0
+
+/*
+ * Queue the result of a game for the ratings worker.  References to the
+ * players are retained until the result has been applied.
+ *
+ * @param player1  One of the PLAYERs.
+ * @param player2  The other PLAYER.
+ * @param result  0 if draw, 1 if player1 won, 2 if player2 won.
+ * @return  0 if the result was queued (or, if the worker cannot run,
+ * applied at once), -1 if the arguments are invalid.
+ */
+int ratings_post(PLAYER *player1, PLAYER *player2, int result);
+
+/*
+ * Queue the result of a game that rates one player only, against an
+ * opponent whose rating is kept elsewhere: a user of another node in
+ * cluster mode, whose shadow takes its rating from that node alone.
+ *
+ * @param player  The PLAYER to be rated.
+ * @param opponent_rating  The opponent's rating when the game ended.
+ * @param result  0 if draw, 1 if player won, 2 if player lost.
+ * @return  0 if the result was queued (or applied), -1 if the arguments
+ * are invalid.
+ */
+int ratings_post_against(PLAYER *player, double opponent_rating, int result);
+
+/*
+ * Get the expected score of a player against an opponent, from the table.
+ *
+ * @param diff  The opponent's rating minus the player's.
+ * @return  The expected score, between 0 and 1.
+ */
+double ratings_expected_score(double diff);
+
+/*
+ * Wait until every result posted before the call has been applied.
+ */
+void ratings_flush(void);
+
+/*
+ * Start reading ratings that must be consistent with each other.
+ *
+ * @return  A sequence number to be passed to ratings_read_retry().
+ */
+unsigned ratings_read_begin(void);
+
+/*
+ * Finish reading ratings that must be consistent with each other.
+ *
+ * @param seq  The value returned by ratings_read_begin().
+ * @return  Nonzero if a batch was applied during the read, in which case
+ * what was read must be discarded and read again.
+ */
+int ratings_read_retry(unsigned seq);
+
+/*
+ * Apply the results still queued.  Called once at server shutdown.
+ */
+void ratings_fini(void);
+
+#endif
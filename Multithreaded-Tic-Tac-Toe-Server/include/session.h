@@ -0,0 +1,58 @@
+#ifndef SESSION_H
+#define SESSION_H
+
+#include "protocol.h"
+#include "client_registry.h"
+#include "proto_decoder.h"
+
+/*
+ * A JEUX_SESSION holds the per-connection state of the service loop:
+ * the CLIENT registered for the connection, whether it has logged in,
+ * and the decoder holding what has been received and not yet dispatched.
+ * The packet handlers in server.c operate on a session rather than on a
+ * thread, so that the same handlers can be driven either by a dedicated
+ * service thread (jeux_client_service) or by an event loop that
+ * multiplexes many connections over a few threads.
+ */
+typedef struct jeux_session {
+    CLIENT *client;             // CLIENT registered for this connection
+    int fd;                     // file descriptor of the connection
+    int logged_in;              // nonzero once a LOGIN has succeeded
+    PROTO_DECODER *decoder;     // of the service loop, set before the session is opened
+} JEUX_SESSION;
+
+/*
+ * Open a session for a newly accepted connection, registering a CLIENT
+ * for it in the client registry.  A connection handed over by a hot
+ * upgrade (see upgrade.h) takes up the CLIENT it had instead, and the
+ * input it had left is fed to session->decoder.
+ *
+ * @param session  Caller-supplied storage for the session, with its
+ * decoder set.
+ * @param fd  File descriptor of the connection.
+ * @return 0 if the client was registered, otherwise -1.
+ */
+int jeux_session_open(JEUX_SESSION *session, int fd);
+
+/*
+ * Dispatch one received packet to the handler for its type.
+ * Until the session has logged in, only LOGIN packets are honored.
+ *
+ * @param session  The session on which the packet was received.
+ * @param hdr  The packet header, with multi-byte fields in host byte order.
+ * @param payload  The packet payload (hdr->size bytes, not necessarily
+ * NUL-terminated), or NULL if there is none.  The payload remains owned
+ * by the caller and is only valid for the duration of the call.
+ */
+void jeux_session_dispatch(JEUX_SESSION *session, JEUX_PACKET_HEADER *hdr, void *payload);
+
+/*
+ * Close a session once EOF has been seen on its connection: the client
+ * is logged out (resigning or revoking anything outstanding) and
+ * unregistered from the client registry.
+ *
+ * @param session  The session to be closed.
+ */
+void jeux_session_close(JEUX_SESSION *session);
+
+#endif
@@ -0,0 +1,30 @@
+#ifndef SPAWN_H
+#define SPAWN_H
+
+#include <pthread.h>
+
+/*
+ * Starting the server's threads.
+ *
+ * SIGHUP must be taken by the main thread, which waits for it and then
+ * shuts the server down with the help of every other thread: the service
+ * threads and reactors drain the connections, and the workers apply what
+ * is still queued.  Every other thread is therefore started with SIGHUP
+ * blocked, which it keeps, and so does any thread it starts in turn.
+ */
+
+/*
+ * Start a thread with SIGHUP blocked.  The signal mask of the caller is
+ * left as it was.
+ *
+ * @param tid  Where to store the ID of the thread, or NULL to have it
+ * detached.
+ * @param attr  The attributes of the thread, or NULL for the defaults.
+ * @param start  The function the thread runs.
+ * @param arg  Its argument.
+ * @return  0 if the thread was started, otherwise the error number
+ * returned by pthread_create().
+ */
+int spawn(pthread_t *tid, const pthread_attr_t *attr, void *(*start)(void *), void *arg);
+
+#endif
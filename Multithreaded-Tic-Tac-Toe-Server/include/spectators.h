@@ -0,0 +1,99 @@
+#ifndef SPECTATORS_H
+#define SPECTATORS_H
+
+#include "client_registry.h"
+
+/*
+ * The clients watching a game, for the WATCH packet (see protocol_ext.h).
+ *
+ * Each state of the game is described once, in both board formats, into
+ * a shared buffer (see outq.h) that is queued for every watcher without
+ * being copied; only the header, with the watcher's own ID for the game,
+ * is per watcher.  The watchers are a reference-counted array that is
+ * never changed once made: a watcher that comes or goes makes a new one,
+ * so a notification holds the lock only for the pushes onto the queues,
+ * which never block, and writes to the sockets after letting go of it,
+ * with the array it used still alive.  Notifications are sent after the
+ * players' own packets, and a spectator whose queue overflows is
+ * disconnected like any slow consumer, so spectators never hold up the
+ * game.
+ *
+ * The lock of a SPECTATORS is taken with no other lock held; the GAME's
+ * lock is taken under it, to describe the state, and the send locks of
+ * the watchers are only tried.  Since every notification describes the
+ * state of the game at the time it holds the lock, and a state is only
+ * sent if it has more moves than the last, a watcher never sees the
+ * board go back, even if the players move faster than it is notified.
+ */
+
+typedef struct spectators SPECTATORS;
+
+/*
+ * Make an empty set of spectators, for the first WATCH of a game.
+ *
+ * @return  The set, or NULL if memory is exhausted.
+ */
+SPECTATORS *spectators_create(void);
+
+/*
+ * Free a set of spectators, along with the references of any watchers
+ * still in it.  Called when the INVITATION of the game is freed.
+ *
+ * @param s  The set, or NULL.
+ */
+void spectators_free(SPECTATORS *s);
+
+/*
+ * Add a watcher, who is sent the ACK of its WATCH, with its ID for the
+ * game and the current state in its board format, before any MOVED.
+ * A reference to the watcher is kept until it is removed or the game
+ * has ended.
+ *
+ * @param s  The spectators of the game.
+ * @param watcher  The CLIENT that is to watch the game.
+ * @param id  The ID the watcher has given the game.
+ * @param game  The GAME.
+ * @return  0 if the watcher was added, -1 if the game is over or memory
+ * is exhausted.
+ */
+int spectators_add(SPECTATORS *s, CLIENT *watcher, int id, GAME *game);
+
+/*
+ * Add a watcher that was watching the game before a hot upgrade (see
+ * upgrade.h), and has had its ACK already.
+ *
+ * @return  As for spectators_add().
+ */
+int spectators_restore(SPECTATORS *s, CLIENT *watcher, int id, GAME *game);
+
+/*
+ * Remove a watcher, who is sent nothing more for the game.
+ *
+ * @param s  The spectators of the game.
+ * @param watcher  The CLIENT.
+ * @return  0 if the watcher was removed, -1 if it was not watching, for
+ * instance because the game has ended and it has been sent ENDED.
+ */
+int spectators_remove(SPECTATORS *s, CLIENT *watcher);
+
+/*
+ * Send every watcher a MOVED with the current state of the game, unless
+ * it has been sent already.  Its role is that of the player who moved.
+ *
+ * @param s  The spectators of the game.
+ * @param game  The GAME.
+ */
+void spectators_moved(SPECTATORS *s, GAME *game);
+
+/*
+ * Send every watcher the ENDED of a game that is over, with the analysis
+ * of the game for those who asked for it at LOGIN, take no more watchers,
+ * and let go of them: client_end_watch() is called for each.
+ *
+ * @param s  The spectators of the game.
+ * @param game  The GAME, which is over.
+ * @param inv  The INVITATION of the game, for client_end_watch().
+ */
+void spectators_ended(SPECTATORS *s, GAME *game, INVITATION *inv);
+
+#endif
@@ -0,0 +1,94 @@
+#ifndef TIMER_H
+#define TIMER_H
+
+#include <stdint.h>
+
+/*
+ * Timers, for the timeouts of -t (see client_ext.h).
+ *
+ * The timers are kept in a hierarchical timing wheel serviced by a single
+ * thread: TIMER_LEVELS wheels of TIMER_SLOTS slots each, the first with a
+ * slot per tick of TIMER_TICK_MS, each of the others with a slot per turn
+ * of the one below.  A timer goes into the slot of the lowest wheel that
+ * reaches its expiry, on a doubly-linked list that it is itself a node of,
+ * so arming and cancelling a timer are constant time and allocate nothing,
+ * however many thousands of connections have one.  As the first wheel
+ * comes round, the timers in the next slot of the second are spread over
+ * it, and so on up, so each timer is moved at most TIMER_LEVELS - 1 times
+ * before it expires.  Timers expire on the tick after their time, at the
+ * latest; the longest a timer can be armed for is about 19 days.
+ *
+ * A timer is meant to be part of a reference-counted object, and an armed
+ * timer to hold a reference to it: whoever arms the timer gives it a
+ * reference, which the callback is handed when the timer expires, and
+ * which whoever cancels an armed timer gets back.  Since a timer can only
+ * be armed once it is no longer armed, there is never more than one such
+ * reference, and the object cannot be freed with its timer still in the
+ * wheel.
+ *
+ * The callbacks run on the timer thread, with no lock held, one after the
+ * other, so they must not block for long.  The wheel's lock is a leaf: a
+ * timer may be armed or cancelled under any other lock.
+ */
+
+#define TIMER_TICK_MS 100
+#define TIMER_SLOT_BITS 6
+#define TIMER_SLOTS (1 << TIMER_SLOT_BITS)
+#define TIMER_LEVELS 4
+
+typedef struct timer {
+    struct timer *next;
+    struct timer **pprev;       // the link that points at this timer, NULL if it is not armed
+    uint64_t expires;           // the tick at which it expires
+    void (*fire)(void *arg);    // called on the timer thread when it expires
+    void *arg;
+} TIMER;
+
+/*
+ * Initialize a timer, which is not armed.
+ *
+ * @param timer  The TIMER.
+ * @param fire  The function called when the timer expires.
+ * @param arg  What fire is called with.
+ */
+void timer_init(TIMER *timer, void (*fire)(void *arg), void *arg);
+
+/*
+ * Arm a timer that is not armed.  A reference to the object that the
+ * timer is part of passes to the timer if this succeeds.
+ *
+ * @param timer  The TIMER.
+ * @param ms  How many milliseconds from now it is to expire.
+ * @return  0 if the timer was armed, -1 if it was armed already or the
+ * timer thread is not running.
+ */
+int timer_arm(TIMER *timer, unsigned ms);
+
+/*
+ * Cancel a timer.  It does not expire, unless it is expiring already, in
+ * which case its callback runs regardless.
+ *
+ * @param timer  The TIMER.
+ * @return  1 if the timer was armed, in which case the reference it held
+ * passes to the caller, otherwise 0.
+ */
+int timer_cancel(TIMER *timer);
+
+/*
+ * Get the time, as a count of ticks of the wheel since it started.  This
+ * is a coarse clock that costs no system call, for timestamps that only
+ * timers look at.
+ *
+ * @return  The number of ticks, or 0 if the timer thread is not running.
+ */
+uint64_t timer_ticks(void);
+
+/*
+ * Start the timer thread, with SIGHUP blocked.  Nothing can be armed
+ * until it has started.
+ *
+ * @return  0 if the thread is running, otherwise -1.
+ */
+int timers_start(void);
+
+#endif
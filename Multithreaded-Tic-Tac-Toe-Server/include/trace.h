@@ -0,0 +1,115 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stdint.h>
+#include <stdatomic.h>
+
+/*
+ * Binary event tracing, for looking at what the threads did and in what
+ * order without the timing changes of formatted debug output.
+ *
+ * Every thread that records an event gets a ring of TRACE_RING_EVENTS
+ * fixed-size events of its own, where the newest overwrite the oldest.
+ * Recording takes no lock and touches no memory shared with another
+ * writer.  Rings outlive their threads: the ring of a thread that exits
+ * goes to the next thread that needs one, so a dump still holds the
+ * last events of threads that have gone.
+ *
+ * Tracing is off unless the server is started with -T, and SIGUSR1
+ * turns it on, or off again.  Turning it off, and shutting down with it
+ * on, dumps all the rings to a file (the one given to -T, otherwise
+ * jeux-<pid>.trace), which util/jtrace prints as a timeline.  While it
+ * is off, TRACE() costs a load and a branch that is not taken.
+ */
+
+#define TRACE_RING_EVENTS 2048              // per thread, a power of two
+#define TRACE_MAGIC "JEUXTRC1"
+
+/*
+ * What is recorded for each kind of event.  A packet's header fields are
+ * packed as id | role << 8 | size << 16; reasons are the why strings of
+ * the *_ref() and *_unref() functions, which must be literals.
+ */
+typedef enum {
+    TRACE_PACKET_IN = 1,        // arg: type, a: fd, b: header fields
+    TRACE_PACKET_OUT,           // queued or sent; arg: type, a: fd, b: header fields
+    TRACE_REF,                  // arg: TRACE_OBJECT, a: count after, b: object, c: reason
+    TRACE_UNREF,                // arg: TRACE_OBJECT, a: count after, b: object, c: reason
+    TRACE_LOCK,                 // arg: METRICS_LOCK, a: 0 mutex, 1 read, 2 write, b: lock,
+                                // c: nanoseconds waited
+} TRACE_KIND;
+
+typedef enum {
+    TRACE_CLIENT,
+    TRACE_PLAYER,
+    TRACE_GAME,
+    TRACE_INVITATION,
+} TRACE_OBJECT;
+
+typedef struct trace_event {
+    uint64_t time;              // CLOCK_MONOTONIC, in nanoseconds
+    uint16_t thread;            // threads are numbered as they first record
+    uint8_t kind;               // TRACE_KIND
+    uint8_t arg;
+    uint32_t a;
+    uint64_t b;
+    uint64_t c;
+} TRACE_EVENT;
+
+/*
+ * A dump is this header, then the events of all the rings in no
+ * particular order, then for each distinct reason the address it was
+ * recorded as, a uint16_t length and its characters.  Everything is in
+ * the byte order of the machine that wrote it.
+ */
+typedef struct trace_file_header {
+    char magic[8];              // TRACE_MAGIC
+    uint32_t num_events;
+    uint32_t num_strings;
+    int64_t realtime_offset;    // CLOCK_REALTIME minus CLOCK_MONOTONIC, in nanoseconds
+} TRACE_FILE_HEADER;
+
+extern atomic_int trace_on;
+
+/*
+ * Record an event if tracing is on.  The arguments are only evaluated if
+ * it is.
+ */
+#define TRACE(kind, arg, a, b, c)                                                       \
+    do {                                                                                \
+        if(__builtin_expect(atomic_load_explicit(&trace_on, memory_order_relaxed), 0))  \
+            trace_record((kind), (arg), (a), (uint64_t) (uintptr_t) (b),                \
+                         (uint64_t) (uintptr_t) (c));                                   \
+    } while(0)
+
+#define TRACE_HEADER_FIELDS(hdr, size) \
+    ((hdr)->id | (hdr)->role << 8 | (uint64_t) (size) << 16)
+
+void trace_record(int kind, int arg, uint32_t a, uint64_t b, uint64_t c);
+
+/*
+ * Set up tracing: start the thread that takes SIGUSR1.  Called by the
+ * main thread before it creates any other, since SIGUSR1 is blocked in
+ * the caller and must be in every thread that inherits its mask.
+ *
+ * @param path  Where dumps go, or NULL for jeux-<pid>.trace.
+ * @param on  Whether to start tracing at once.
+ * @return  0 if successful, -1 otherwise.
+ */
+int trace_init(char *path, int on);
+
+/*
+ * Write all the rings to a file, to be read by util/jtrace.  The file
+ * is written under a temporary name and renamed into place.
+ *
+ * @param path  The file.
+ * @return  The number of events written, or -1 on error.
+ */
+int trace_dump(char *path);
+
+/*
+ * Dump the rings if tracing is on.  Called at server shutdown.
+ */
+void trace_fini(void);
+
+#endif
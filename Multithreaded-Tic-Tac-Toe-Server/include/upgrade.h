@@ -0,0 +1,149 @@
+#ifndef UPGRADE_H
+#define UPGRADE_H
+
+#include "session.h"
+#include "acceptor.h"
+
+/*
+ * Hot upgrade, for -U: a new server takes over the clients of a running
+ * one, connections and all, without any of them reconnecting.
+ *
+ * A server started with -U <path> listens on a Unix socket at <path>,
+ * which its main thread watches along with the listening socket.  A new
+ * server started with the same -U connects to it before doing anything
+ * else, and then:
+ *
+ *   1. The old server stops.  Its service threads or reactors are
+ *      interrupted with SIGUSR2 and stop where they would block for
+ *      input, between packets; the timer thread and the matcher stop
+ *      between callbacks and batches, behind a gate they hold while
+ *      they work.  Results not yet rated are rated, and the journal
+ *      made durable, so that the journal the new server opens is whole.
+ *   2. The old server sends the listening socket and every client's
+ *      socket (SCM_RIGHTS, up to UPGRADE_FDS_PER_MSG at a time), and a
+ *      snapshot: every player with its rating, and for each client its
+ *      login and LOGIN options, the input received and not yet
+ *      dispatched, the packets queued and not yet sent (and how much of
+ *      the first has been), whether it is seeking a game, its
+ *      invitations with their IDs, boards and the moves of their games,
+ *      and the games it watches.  From then on it sends nothing to any
+ *      client.
+ *   3. The new server remakes all of that, quietly, and acknowledges.
+ *      The old server says goodbye and exits, leaving the sockets open
+ *      in the new one only.  The new server then sends what was queued,
+ *      puts the seekers back in the pool and serves the connections as
+ *      if it had accepted them.
+ *
+ * If anything fails before the acknowledgement, the new server exits
+ * and the old one carries on as if nothing had happened.  Timeouts are
+ * counted afresh from the upgrade, and so is the waiting of seekers.
+ * Both servers must run the same build, as the snapshot has numbers as
+ * they are laid out in memory, and neither may use -a, -C or io_uring.
+ */
+
+#define UPGRADE_FDS_PER_MSG 250         // descriptors in one message, within SCM_MAX_FD
+#define UPGRADE_CHUNK 65536             // bytes of the snapshot in one message
+#define UPGRADE_TIMEOUT_MS 10000        // for the other server to answer
+#define UPGRADE_STOP_RETRY_MS 1         // between the signals that stop the readers
+
+/*
+ * Set the path of the Unix socket for -U, and install the handler of
+ * SIGUSR2.  Called once at startup, before any other thread exists;
+ * without it, every other function here does nothing.
+ *
+ * @param path  The path of the socket.
+ * @return  0 if successful, -1 if the path is too long.
+ */
+int upgrade_configure(const char *path);
+
+/*
+ * Take over from the server listening at the path, if there is one:
+ * receive its sockets and the snapshot.  Called before the journal is
+ * opened.
+ *
+ * @param listenfdp  Set to the listening socket taken over.
+ * @return  1 if the sockets and the snapshot were received, 0 if there
+ * is no server to take over from, -1 if taking over failed.
+ */
+int upgrade_begin(int *listenfdp);
+
+/*
+ * Remake the state of the snapshot received by upgrade_begin(), wait
+ * for the old server to exit, and then send what was queued for the
+ * clients and put the seekers back in the pool.  Called once the
+ * modules are initialized and before any client is served.
+ *
+ * @return  0 if successful, -1 if the old server carries on instead, in
+ * which case this one must exit without touching the sockets.
+ */
+int upgrade_finish(void);
+
+/*
+ * Listen at the path for the next server.  Called before serving.
+ *
+ * @return  0 if successful, -1 otherwise.
+ */
+int upgrade_listen(void);
+
+/*
+ * Serve the connections taken over, as if they had just been accepted.
+ *
+ * @param serve  What to do with each of them, with a slot of -1.
+ */
+void upgrade_serve(ACCEPTOR_HANDOFF *serve);
+
+/*
+ * Take up, for a session being opened, the CLIENT its connection had
+ * in the old server, feeding the input left over to its decoder.
+ *
+ * @param session  The session, with its fd and decoder set.
+ * @return  1 if the connection was taken over and session->client and
+ * session->logged_in are set, 0 if it is a new connection.
+ */
+int upgrade_adopt(JEUX_SESSION *session);
+
+/*
+ * Accept a connection on the listening socket, as accept_connection()
+ * does, handing the clients over to a new server whenever one connects
+ * at the path meanwhile.  Called by the main thread only.
+ *
+ * @param listenfd  The listening socket.
+ * @return  The connection, or -1 if accepting failed.  Does not return
+ * if the clients were handed over.
+ */
+int upgrade_accept(int listenfd);
+
+/*
+ * Count a thread that reads from clients (a service thread or a
+ * reactor) about to be started, before starting it; the thread calls
+ * upgrade_reader_enter() first thing, or upgrade_reader_leave() is
+ * called for it if it could not be started.
+ */
+void upgrade_reader_expect(void);
+
+/*
+ * Make the calling thread one that a hot upgrade interrupts.
+ */
+void upgrade_reader_enter(void);
+
+/*
+ * Stop counting the calling thread, which no longer reads from clients.
+ */
+void upgrade_reader_leave(void);
+
+/*
+ * Stop here while a hot upgrade is in progress.  Called by a reader
+ * before every read, with nothing held, and again after a read that a
+ * signal interrupted.
+ */
+void upgrade_checkpoint(void);
+
+/*
+ * Hold off a hot upgrade while making changes outside any reader: the
+ * timer thread around the callbacks of a tick, the matcher around a
+ * batch.  Calls can nest in different threads but not in the same one.
+ */
+void upgrade_enter(void);
+void upgrade_leave(void);
+
+#endif
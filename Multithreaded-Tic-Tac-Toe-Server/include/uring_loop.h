@@ -0,0 +1,60 @@
+#ifndef URING_LOOP_H
+#define URING_LOOP_H
+
+#include <stddef.h>
+
+/*
+ * The io_uring backend of the event loop (see event_loop.h), for -b uring.
+ *
+ * Each reactor thread owns an io_uring, with a ring of provided buffers
+ * registered for receiving.  A connection is given one multishot recv
+ * when it arrives, so that from then on every chunk of bytes the client
+ * sends comes back as a completion, in one of the provided buffers,
+ * without anything being submitted again; the bytes are fed to the
+ * connection's PROTO_DECODER and the buffer goes back to the ring at
+ * once.  Sends go through the outbound queues as in the epoll backend,
+ * but a reactor sets outq_submit (see outq.h), so a flush on a reactor
+ * prepares a sendmsg of everything queued for the client instead of
+ * making it.  All the sends prepared while handling a batch of
+ * completions -- the ACK of a MOVE and the MOVED to the opponent, say --
+ * are submitted by the same io_uring_enter() that waits for the next
+ * batch: a whole turn costs at most one system call, and none at all
+ * when the next completions are already there.  Since a queue has only
+ * one send in flight, sends to a client never need to be linked to be
+ * kept in order.
+ *
+ * Connections are handed to a reactor through a list, and an eventfd
+ * that the reactor polls (multishot as well), since only the reactor
+ * may submit to its ring.  Multishot recv with provided-buffer rings
+ * needs Linux 6.0; on older kernels uring_start() fails and the server
+ * falls back to epoll.
+ */
+
+/*
+ * Start the io_uring reactor threads.
+ *
+ * @param nreactors  Number of reactor threads to start.
+ * @param pin  Nonzero to run reactor i only on CPU slot i (see acceptor.h).
+ * @return The number of reactors started, or -1 if io_uring cannot be
+ * used, in which case none are.
+ */
+int uring_start(int nreactors, int pin);
+
+/*
+ * Hand a newly accepted connection to a reactor.  A session is opened
+ * for the connection and the reactor starts receiving from it.
+ *
+ * @param reactor  Index of the reactor, less than uring_start() returned.
+ * @param fd  File descriptor of the accepted connection.
+ * @return 0 if the connection was added, otherwise -1, in which case
+ * the connection has been closed.
+ */
+int uring_add_connection(int reactor, int fd);
+
+/*
+ * Get the number of bytes of memory taken by the reactor's state for one
+ * idle connection, not counting the CLIENT and the decoder's ring buffer.
+ */
+size_t uring_connection_footprint(void);
+
+#endif
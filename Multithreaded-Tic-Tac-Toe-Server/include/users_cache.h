@@ -0,0 +1,83 @@
+#ifndef USERS_CACHE_H
+#define USERS_CACHE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "player.h"
+#include "outq.h"
+
+/*
+ * Cache of the payload sent in answer to USERS requests.
+ *
+ * Every login, logout and rating change bumps a version number and is
+ * recorded, by PLAYER, in a ring of the last USERS_HISTORY changes.
+ * The complete listing is serialized at most once per version, the first
+ * time it is asked for, into a shared buffer that is queued for every
+ * client asking for the same version without being copied.  A client
+ * that tells which version it already has is sent just the users that
+ * changed since then (see the versioned USERS format in protocol_ext.h),
+ * which costs nothing but a few lookups when nobody has come or gone.
+ *
+ * The changes are noted after they have taken effect in the client
+ * registry and the players, so that a listing or delta built after
+ * reading version V reflects at least every change up to V.  Ratings
+ * are read under the ratings sequence lock (see ratings.h), so both
+ * players of a game are always shown rated, or both not yet.
+ */
+
+/* Number of changes remembered for deltas. */
+#define USERS_HISTORY 256
+
+/*
+ * Record that a player has logged in, logged out or had its rating
+ * change.  PLAYERs are never freed by the player registry, so the cache
+ * keeps no reference.
+ *
+ * @param player  The PLAYER that changed.
+ */
+void users_cache_note(PLAYER *player);
+
+/*
+ * Get the complete listing as of the current version.  The buffer starts
+ * with the line "@<version>\tfull\n", which is sent only to clients that
+ * asked for a versioned reply; the rest is the traditional USERS payload.
+ *
+ * @param prefixp  Variable into which is stored the length of the first line.
+ * @return  A reference to the shared buffer, which the caller must drop
+ * with outq_shared_unref(), or NULL if memory is exhausted.
+ */
+OUTQ_SHARED *users_cache_snapshot(size_t *prefixp);
+
+/*
+ * Get the changes since an earlier version, as a versioned delta reply.
+ *
+ * @param since  The version the client has.
+ * @param lenp  Variable into which is stored the length of the reply.
+ * @return  The reply, in malloc'ed storage that the caller must free,
+ * or NULL if the changes since that version are no longer all known
+ * (or never were), in which case the full listing should be sent.
+ */
+char *users_cache_delta(uint32_t since, size_t *lenp);
+
+/*
+ * Get the current version, for a hot upgrade (see upgrade.h).
+ */
+uint32_t users_cache_version(void);
+
+/*
+ * Carry on from the version of the server that handed over its clients
+ * in a hot upgrade, after they have logged in here: the versions they
+ * may have are all made too old for a delta, so that each is sent the
+ * full listing next.
+ *
+ * @param version  The version reached by the other server.
+ */
+void users_cache_resume(uint32_t version);
+
+/*
+ * Free the cached listing.  Called once at server shutdown.
+ */
+void users_cache_fini(void);
+
+#endif
@@ -0,0 +1,212 @@
+#define _GNU_SOURCE                     // for the CPU affinity calls
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sched.h>
+#include <errno.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <linux/filter.h>
+
+#include "debug.h"
+#include "acceptor.h"
+#include "spawn.h"
+
+// csapp.h clashes with _GNU_SOURCE, so its LISTENQ is repeated here
+#define ACCEPTOR_BACKLOG 1024
+
+typedef struct acceptor {
+    int listenfd;                   // this acceptor's socket in the SO_REUSEPORT group
+    int slot;                       // the CPU slot it runs on
+    pthread_t tid;
+} ACCEPTOR;
+
+static ACCEPTOR *acceptors;
+static int num_acceptors;           // started, and to be stopped
+static ACCEPTOR_HANDOFF *handoff;
+
+static pthread_once_t cpus_once = PTHREAD_ONCE_INIT;
+static int *cpus;                   // the CPU of each slot
+static int num_cpus;
+
+static void find_cpus(void){
+    cpu_set_t set;
+    if(sched_getaffinity(0, sizeof(set), &set) == 0 && (cpus = malloc(CPU_COUNT(&set) * sizeof(int))) != NULL){
+        for(int cpu = 0; cpu < CPU_SETSIZE; cpu++){
+            if(CPU_ISSET(cpu, &set))
+                cpus[num_cpus++] = cpu;
+        }
+    }
+    if(num_cpus == 0){
+        debug("the CPUs could not be found; threads will not be pinned");
+    }
+}
+
+int acceptor_cpus(void){
+    pthread_once(&cpus_once, find_cpus);
+    return num_cpus > 0 ? num_cpus : 1;
+}
+
+int acceptor_pin(pthread_attr_t *attr, int slot){
+    pthread_once(&cpus_once, find_cpus);
+    if(num_cpus == 0){
+        return -1;
+    }
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpus[slot % num_cpus], &set);
+    return pthread_attr_setaffinity_np(attr, sizeof(set), &set) == 0 ? 0 : -1;
+}
+
+int accept_connection(int listenfd){
+    struct sockaddr_storage clientaddr;
+    while(1){
+        socklen_t clientlen = sizeof(struct sockaddr_storage);
+        int connfd = accept(listenfd, (struct sockaddr *)&clientaddr, &clientlen);
+        if(connfd >= 0){
+            return connfd;
+        }
+        if(errno == EMFILE || errno == ENFILE || errno == ENOBUFS || errno == ENOMEM){
+            debug("accept: %s; backing off", strerror(errno));
+            usleep(10000);
+        }
+        else if(errno != EINTR && errno != ECONNABORTED && errno != EPROTO){
+            return -1;
+        }
+    }
+}
+
+/*
+ * Open a listening socket that shares its port with the others of the
+ * group, as open_listenfd() does for a socket of its own.
+ */
+static int open_reuseport_listenfd(char *port){
+    struct addrinfo hints, *listp, *p;
+    int listenfd = -1, rc, optval = 1;
+
+    memset(&hints, 0, sizeof(struct addrinfo));
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = AI_PASSIVE | AI_ADDRCONFIG | AI_NUMERICSERV;
+    if((rc = getaddrinfo(NULL, port, &hints, &listp)) != 0){
+        fprintf(stderr, "getaddrinfo failed (port %s): %s\n", port, gai_strerror(rc));
+        return -1;
+    }
+    // every socket of the group walks the same list, so they all bind the same address
+    for(p = listp; p; p = p->ai_next){
+        if((listenfd = socket(p->ai_family, p->ai_socktype, p->ai_protocol)) < 0)
+            continue;
+        setsockopt(listenfd, SOL_SOCKET, SO_REUSEADDR, &optval, sizeof(int));
+        if(setsockopt(listenfd, SOL_SOCKET, SO_REUSEPORT, &optval, sizeof(int)) == 0
+           && bind(listenfd, p->ai_addr, p->ai_addrlen) == 0)
+            break;
+        close(listenfd);
+        listenfd = -1;
+    }
+    freeaddrinfo(listp);
+    if(listenfd >= 0 && listen(listenfd, ACCEPTOR_BACKLOG) < 0){
+        close(listenfd);
+        listenfd = -1;
+    }
+    return listenfd;
+}
+
+/*
+ * Steer each connection of the group to the socket of the acceptor
+ * pinned on the CPU that took its SYN: a chain of comparisons maps the
+ * CPU of each slot to the slot, and a CPU of none of them, which the
+ * process may not run on, goes to its number modulo the number of
+ * sockets.
+ */
+static void steer_by_cpu(int listenfd, int n){
+    pthread_once(&cpus_once, find_cpus);
+    int mapped = n < num_cpus ? n : num_cpus;
+    struct sock_filter code[2 * mapped + 3];
+    int len = 0;
+    code[len++] = (struct sock_filter) { BPF_LD | BPF_W | BPF_ABS, 0, 0, SKF_AD_OFF + SKF_AD_CPU };
+    for(int i = 0; i < mapped; i++){
+        code[len++] = (struct sock_filter) { BPF_JMP | BPF_JEQ | BPF_K, 0, 1, cpus[i] };
+        code[len++] = (struct sock_filter) { BPF_RET | BPF_K, 0, 0, i };
+    }
+    code[len++] = (struct sock_filter) { BPF_ALU | BPF_MOD | BPF_K, 0, 0, n };
+    code[len++] = (struct sock_filter) { BPF_RET | BPF_A, 0, 0, 0 };
+    struct sock_fprog prog = { .len = len, .filter = code };
+    if(setsockopt(listenfd, SOL_SOCKET, SO_ATTACH_REUSEPORT_CBPF, &prog, sizeof(prog)) == -1){
+        debug("SO_ATTACH_REUSEPORT_CBPF failed: %s; connections go by hash", strerror(errno));
+    }
+}
+
+static void *acceptor_main(void *arg){
+    ACCEPTOR *a = arg;
+    debug("acceptor %ld started (fd %d, CPU slot %d)", pthread_self(), a->listenfd, a->slot);
+    while(1){
+        int connfd = accept_connection(a->listenfd);
+        if(connfd < 0){
+            // as after acceptors_stop() shut the socket down
+            debug("acceptor on fd %d stopping: %s", a->listenfd, strerror(errno));
+            break;
+        }
+        handoff(connfd, a->slot);
+    }
+    return NULL;
+}
+
+int acceptors_start(char *port, int n, ACCEPTOR_HANDOFF *h){
+    if(n <= 0 || (acceptors = calloc(n, sizeof(ACCEPTOR))) == NULL){
+        return -1;
+    }
+    handoff = h;
+    // the sockets are all open before any is accepted from, so that the
+    // index of each in the group is that of its acceptor
+    for(int i = 0; i < n; i++){
+        acceptors[i].slot = i;
+        if((acceptors[i].listenfd = open_reuseport_listenfd(port)) < 0){
+            while(i-- > 0)
+                close(acceptors[i].listenfd);
+            free(acceptors);
+            acceptors = NULL;
+            return -1;
+        }
+    }
+    steer_by_cpu(acceptors[0].listenfd, n);
+
+    int started;
+    for(started = 0; started < n; started++){
+        ACCEPTOR *a = &acceptors[started];
+        pthread_attr_t attr;
+        pthread_attr_init(&attr);
+        if(acceptor_pin(&attr, a->slot) == -1){
+            debug("acceptor %d is not pinned", started);
+        }
+        int rc = spawn(&a->tid, &attr, acceptor_main, a);
+        pthread_attr_destroy(&attr);
+        if(rc != 0){
+            break;
+        }
+    }
+
+    num_acceptors = started;
+    for(int i = started; i < n; i++){
+        close(acceptors[i].listenfd);
+    }
+    if(started < n){
+        acceptors_stop();
+        return -1;
+    }
+    debug("started %d acceptors on port %s", n, port);
+    return 0;
+}
+
+void acceptors_stop(void){
+    for(int i = 0; i < num_acceptors; i++){
+        shutdown(acceptors[i].listenfd, SHUT_RDWR);
+    }
+    for(int i = 0; i < num_acceptors; i++){
+        pthread_join(acceptors[i].tid, NULL);
+        close(acceptors[i].listenfd);
+    }
+    num_acceptors = 0;
+    free(acceptors);
+    acceptors = NULL;
+}
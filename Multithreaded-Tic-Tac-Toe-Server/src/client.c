@@ -10,12 +10,28 @@
 #include <sys/socket.h>
 #include <getopt.h>
 #include <ctype.h>
+#include <stdatomic.h>
+#include <stdint.h>
 
 #include "protocol.h"
+#include "protocol_ext.h"
 #include "player.h"
 #include "client_registry.h"
+#include "client_registry_ext.h"
 #include "jeux_globals.h"
 #include "invitation.h"
+#include "invitation_ext.h"
+#include "client_ext.h"
+#include "game_ext.h"
+#include "outq.h"
+#include "users_cache.h"
+#include "oracle.h"
+#include "matchmaker.h"
+#include "spectators.h"
+#include "metrics.h"
+#include "timer.h"
+#include "trace.h"
+#include "cluster.h"
 #include "csapp.h"
 #include "debug.h"
 
@@ -40,48 +56,152 @@
  * that might be called concurrently are thread-safe.
  */
 
-typedef struct invitation_node {
-    INVITATION *invitation;
-    int id;
-    struct invitation_node *next;
-    struct invitation_node *prev;
-} INVITATION_NODE;
+/*
+ * The IDs of a client's invitations travel in the 8-bit id field of the
+ * packet header, so a client can have at most 256 of them.  They are
+ * kept in a table indexed by ID, with a bitmap of the free IDs in which
+ * the lowest one is found with a find-first-set on each of four words:
+ * giving out an ID, finding an invitation by ID and removing it are
+ * constant time however many invitations a client keeps open.  The
+ * reverse lookup, from an INVITATION to the client's ID for it, is kept
+ * in the INVITATION (see invitation_ext.h).  The games a client watches
+ * take their IDs from the same table, so that a MOVED for one can never
+ * be mistaken for a MOVED in a game of its own; they are marked in a
+ * second bitmap, and the operations on invitations do not find them.
+ * In cluster mode a server gives out only the IDs of its own slice (see
+ * cluster.h), the others never being free.
+ */
+#define MAX_INVITATIONS CLIENT_MAX_IDS
+#define ID_WORD_BITS 64
+#define ID_WORDS (MAX_INVITATIONS / ID_WORD_BITS)
 
 typedef struct client {
     int fd;                     // file descriptor of the client connection
-    int ref_count;              // reference count for managing the object's lifetime
-    int logged_in;              // boolean variable indicating if it's logged in or not
-    PLAYER *player;             // pointer to the player associated with the client, if any
-    INVITATION_NODE *invitations_head;   // pointer to the head of the invitation linked list
-    pthread_mutex_t lock;       // mutex for incrementing the reference count
+    atomic_int ref_count;       // reference count, changed without taking any lock
+    atomic_int logged_in;       // boolean variable indicating if it's logged in or not; set under the lock only
+    _Atomic(PLAYER *) player;   // the player logged in as, if any; set under the lock only
+    INVITATION *invitations[MAX_INVITATIONS];   // by ID, NULL for a free ID
+    uint64_t free_ids[ID_WORDS];    // bit i of word w is set if ID 64w+i is free
+    uint64_t watch_ids[ID_WORDS];   // bit i of word w is set if ID 64w+i is of a game watched
+    pthread_mutex_t lock;       // protects the login state and the invitations
+    pthread_mutex_t send_lock;  // held by whoever is writing the outbound queue
+    OUTQ outq;                  // packets waiting to be written to the connection
+    int options;                // JEUX_LOGIN_* bits asked for at LOGIN
+    TIMER timer;                // for the login and idle timeouts
+    uint64_t created;           // timer_ticks() when the CLIENT was made
+    _Atomic uint64_t active;    // timer_ticks() when the last packet came
+    atomic_int timeouts_stopped;    // set once the session is closing
+    int node;                   // for a proxy, the node of the user (see cluster.h); -1 otherwise
+    uint32_t epoch;             // which login of the user this is, as numbered by its node
+    struct jeux_session *session;   // serving the connection, for a hot upgrade (see upgrade.h)
 } CLIENT;
 
-// return 1 if exists, 0 otherwise
-int id_exists_in_client_invitation(CLIENT *client, int id){
-    // Acquire the lock associated with the client object
-    // Traverse the linked list of invitation nodes
-    INVITATION_NODE *curr_node = client->invitations_head;
-    while (curr_node != NULL) {
-        if (curr_node->id == id) {
-            // Release the lock associated with the client object
-            return 1;
-        }
-        curr_node = curr_node->next;
+// logins are numbered so that another node can tell them apart (see cluster.h)
+static atomic_uint next_epoch = 1;
+
+/*
+ * Locking.  Locks are only ever taken in this order, and never two of
+ * the same kind at once (in particular, never the locks of two CLIENTs):
+ *
+ *   1. CLIENT lock         the login state and the invitation table
+ *   2. registry locks      creg_bind_name() is called under the CLIENT lock;
+ *                          the leaderboard and journal locks, leaves,
+ *                          under the player registry's
+ *   3. INVITATION lock     the state of the invitation and its GAME pointer
+ *   4. GAME lock           the board; inv_close() resigns under lock 3
+ *   5. ratings queue lock  results waiting for the ratings worker; the
+ *                          leaderboard and USERS cache locks, leaves, may
+ *                          be taken under it
+ *   6. matchmaker lock     the pool of seekers, a leaf; games are started
+ *                          by the matcher after letting go of it
+ *
+ * The lock of the spectators of a game is outside this order: it is
+ * taken with none of these held, and the GAME lock under it (see
+ * spectators.h).  So are the locks of cluster mode (see cluster.c).  The
+ * timer wheel's lock is a leaf that may be taken under any of them, and
+ * the timeouts are enforced on the timer thread with none of them held,
+ * by the same operations a client would use.
+ *
+ * The send lock and the outbound queue are used only with none of these
+ * held: packets are built inside the critical sections, if at all, and
+ * queued after them.  Reference counts are atomic and take no lock, and
+ * so are ratings, which only the ratings worker changes.
+ *
+ * An operation on an invitation finds it, and retains it, under the lock
+ * of the CLIENT that asked, and lets go of that lock before looking up
+ * the opponent's ID for it under the opponent's lock.  What was checked
+ * under the first lock can therefore change before the operation takes
+ * effect, so conflicting operations are decided by the objects
+ * themselves: the state of the INVITATION, under its lock, between
+ * accepting, revoking, declining and resigning, and the GAME, under its
+ * lock, between a resignation and the move that ends the game.  Exactly
+ * one of them succeeds, and it alone sends the notifications and removes
+ * the invitation from both lists.
+ */
+
+CLIENT_TIMEOUTS client_timeouts;
+
+static void client_on_writable(void *arg);
+static void client_timer_fired(void *arg);
+
+// the IDs of word w that this server gives out: all of them, except in cluster mode
+static uint64_t id_slice(int w){
+    int lo, hi;
+    cluster_id_range(&lo, &hi);
+    lo -= w * ID_WORD_BITS;
+    hi -= w * ID_WORD_BITS;
+    if (hi <= 0 || lo >= ID_WORD_BITS) {
+        return 0;
     }
-    // Release the lock associated with the client object
-    return 0;
+    uint64_t below_hi = hi >= ID_WORD_BITS ? ~(uint64_t) 0 : ((uint64_t) 1 << hi) - 1;
+    uint64_t below_lo = lo <= 0 ? 0 : ((uint64_t) 1 << lo) - 1;
+    return below_hi & ~below_lo;
 }
 
-int find_lowest_id_availalble(CLIENT *client){
-    // Acquire the lock associated with the client object
-    int i = 0;
-    while(1){
-        if(!id_exists_in_client_invitation(client, i)){
-            break;
+// the lowest free ID, now taken, or -1 if all are in use; called with the client's lock held
+static int alloc_id(CLIENT *client){
+    for (int w = 0; w < ID_WORDS; w++) {
+        if (client->free_ids[w] != 0) {
+            int bit = __builtin_ctzll(client->free_ids[w]);
+            client->free_ids[w] &= ~((uint64_t) 1 << bit);
+            return w * ID_WORD_BITS + bit;
         }
-        i++;
     }
-    return i;
+    return -1;
+}
+
+static void free_id(CLIENT *client, int id){
+    client->free_ids[id / ID_WORD_BITS] |= (uint64_t) 1 << (id % ID_WORD_BITS);
+}
+
+static int is_watch_id(CLIENT *client, int id){
+    return (client->watch_ids[id / ID_WORD_BITS] >> (id % ID_WORD_BITS)) & 1;
+}
+
+// the invitation, or the game watched if watched is set, to which a client has assigned an ID,
+// retained, or NULL if there is none
+static INVITATION *lookup_id(CLIENT *client, int id, int watched){
+    if (id < 0 || id >= MAX_INVITATIONS) {
+        return NULL;
+    }
+    metrics_mutex_lock(&client->lock, METRICS_LOCK_CLIENT);
+    INVITATION *inv = is_watch_id(client, id) == watched ? client->invitations[id] : NULL;
+    inv_ref(inv, "looked up by ID");
+    pthread_mutex_unlock(&client->lock);
+    return inv;
+}
+
+// the invitation to which a client has assigned an ID, retained, or NULL if there is none
+static INVITATION *lookup_invitation(CLIENT *client, int id){
+    return lookup_id(client, id, 0);
+}
+
+// the ID a client has assigned to an invitation, or -1 if it is not in the client's list
+static int invitation_id(CLIENT *client, INVITATION *inv){
+    metrics_mutex_lock(&client->lock, METRICS_LOCK_CLIENT);
+    int id = inv_get_client_id(inv, client);
+    pthread_mutex_unlock(&client->lock);
+    return id;
 }
 
 /*
@@ -103,21 +223,54 @@ CLIENT *client_create(CLIENT_REGISTRY *creg, int fd){
 
     client->fd = fd;
     client->logged_in = 0;
-    client->ref_count = 1;
-    debug("increase client [%d -> %d] because newly created client", client->ref_count-1 ,client->ref_count);
-
-    client->player = NULL;
-    client->invitations_head = NULL;
+    atomic_init(&client->ref_count, 1);
+    debug("increase client [0 -> 1] because newly created client");
+
+    atomic_init(&client->player, NULL);
+    memset(client->invitations, 0, sizeof(client->invitations));
+    // the IDs outside this server's slice are never free
+    for (int w = 0; w < ID_WORDS; w++) {
+        client->free_ids[w] = id_slice(w);
+    }
+    memset(client->watch_ids, 0, sizeof(client->watch_ids));
+    client->options = 0;
+    timer_init(&client->timer, client_timer_fired, client);
+    client->created = timer_ticks();
+    atomic_init(&client->active, client->created);
+    atomic_init(&client->timeouts_stopped, 0);
+    client->node = -1;
+    client->epoch = 0;
+    client->session = NULL;
 
     if (pthread_mutex_init(&(client->lock), NULL) != 0) {
         free(client);
         return NULL;  // mutex initialization failed
     }
+    if (pthread_mutex_init(&(client->send_lock), NULL) != 0) {
+        pthread_mutex_destroy(&client->lock);
+        free(client);
+        return NULL;
+    }
+    outq_init(&client->outq, client_on_writable, client);
 
     debug("created client!");
     return client;
 }
 
+CLIENT *client_create_remote(int node, PLAYER *player, uint32_t epoch, int options){
+    CLIENT *client = client_create(client_registry, -1);
+    if (client == NULL) {
+        return NULL;
+    }
+    // logged in from the start, without claiming the name, which only the user's node holds
+    client->node = node;
+    client->epoch = epoch;
+    client->options = options;
+    client->logged_in = 1;
+    client->player = player_ref(player, "proxy logged in");
+    return client;
+}
+
 /*
  * Increase the reference count on a CLIENT by one.
  *
@@ -130,11 +283,9 @@ CLIENT *client_create(CLIENT_REGISTRY *creg, int fd){
 CLIENT *client_ref(CLIENT *client, char *why){
     if(client == NULL)
         return NULL;
-    pthread_mutex_lock(&client->lock);  // Acquire lock on INVITATION structure
-
-    client->ref_count++;
-    debug("increase client [%d -> %d] because %s", client->ref_count-1 ,client->ref_count, why);
-    pthread_mutex_unlock(&client->lock);
+    // a new reference is always made from an existing one, so no ordering is needed
+    int old __attribute__((unused)) = atomic_fetch_add_explicit(&client->ref_count, 1, memory_order_relaxed);
+    TRACE(TRACE_REF, TRACE_CLIENT, old + 1, client, why);
     return client;
 }
 
@@ -152,40 +303,29 @@ void client_unref(CLIENT *client, char *why){
     if(client == NULL)
         return;
 
-    pthread_mutex_lock(&client->lock);  // Acquire lock on GAME structure
-    client->ref_count--;  // Decrease reference count
-    if (client->ref_count == 0) {  // Reference count reached zero, free client contents
-        // Destroy the mutex
-        debug("DECREASED reference count for client from (1 - 0) %s", why);
+    // the last one to let go must see everything the others did to the CLIENT
+    int old = atomic_fetch_sub_explicit(&client->ref_count, 1, memory_order_acq_rel);
+    TRACE(TRACE_UNREF, TRACE_CLIENT, old - 1, client, why);
+    if (old == 1) {  // Reference count reached zero, free client contents
         debug("freed client");
 
         if(client->player){
             player_unref(client->player, "being client is being freed");
         }
+        // The CLIENT owns its connection: closing it only now ensures the
+        // descriptor cannot be reused while references to the CLIENT remain.
+        outq_fini(&client->outq);
+        if (client->fd >= 0) {
+            close(client->fd);
+        }
         // Free the client structure itself
+        pthread_mutex_destroy(&client->send_lock);
         pthread_mutex_destroy(&client->lock);
         free(client);
-        return;
-    } else {
-        debug("DECREASED reference count for client from (%d - %d) %s",
-            client->ref_count+1, client->ref_count, why);
     }
-    pthread_mutex_unlock(&client->lock);
 }
 
 
-int check_if_other_clients_logged_in_with_same_player(char *name){
-    PLAYER** player_list = creg_all_players(client_registry);
-    int result = 0;
-    for (int i = 0; player_list[i] != NULL; i++) {
-        player_unref(player_list[i], "Player remove from the player list");
-        if (strcmp(player_get_name(player_list[i]),name) == 0) {
-            result = 1;
-        }
-    }
-    free(player_list);
-    return result;
-}
 /*
  * Log in this CLIENT as a specified PLAYER.
  * The login fails if the CLIENT is already logged in or there is already
@@ -202,21 +342,33 @@ int check_if_other_clients_logged_in_with_same_player(char *name){
 int client_login(CLIENT *client, PLAYER *player){
     if(client == NULL)
         return -1;
-    pthread_mutex_lock(&client->lock);
-    if(client->logged_in || check_if_other_clients_logged_in_with_same_player(player_get_name(player))){
-        debug("client already logged in or client is already loggined in with the same player name");
+    metrics_mutex_lock(&client->lock, METRICS_LOCK_CLIENT);
+    if(client->logged_in){
+        debug("client already logged in");
+        pthread_mutex_unlock(&client->lock);
+        return -1;
+    }
+    // checking that nobody else is logged in under the name and claiming
+    // it is one atomic step, so of two concurrent LOGINs only one can win
+    if(creg_bind_name(client_registry, player_get_name(player), client) == -1){
+        debug("client is already loggined in with the same player name");
         pthread_mutex_unlock(&client->lock);
         return -1;
     }
     client->logged_in = 1;
     client->player = player;
+    client->epoch = atomic_fetch_add(&next_epoch, 1);
+    metrics_gauge_add(METRICS_PLAYERS, 1);
 
     // Increment the reference count of the PLAYER
     player_ref(player, "client retained reference to the player");
     pthread_mutex_unlock(&client->lock);
+    users_cache_note(player);
     return 0;
 }
 
+static void abandon_invitation(CLIENT *client, INVITATION *inv, int id);
+
 /*
  * Log out this CLIENT.  If the client was not logged in, then it is
  * an error.  The reference to the PLAYER that the CLIENT was logged
@@ -230,7 +382,7 @@ int client_login(CLIENT *client, PLAYER *player){
  * logged out, otherwise -1.
  */
 int client_logout(CLIENT *client){
-    pthread_mutex_lock(&(client->lock));        // this could cause a trouble
+    metrics_mutex_lock(&client->lock, METRICS_LOCK_CLIENT);  // this could cause a trouble
 
     if(!(client->logged_in)){
         debug("Failed to logout when client is not logged in");
@@ -239,28 +391,50 @@ int client_logout(CLIENT *client){
     }
     pthread_mutex_unlock(&(client->lock));
 
-    player_unref(client->player, "client loggout, so the player is discarded");
-    INVITATION_NODE *inv = client->invitations_head;
-    while(inv != NULL){
-        GAME *game;
-        INVITATION_NODE *next = inv->next;
-
-        if( (game = inv_get_game(inv->invitation)) != NULL){          // if there's a game in progress
-            debug("Resigning game due to logout");
-            client_resign_game(client, inv->id);
-        }
-        else{
-            if(inv_get_source(inv->invitation) == client){
-                debug("Revoking invitation due to logout");
-                client_revoke_invitation(client, inv->id);
-            }
-            else{
-                debug("Declining invitation due to logout");
-                client_decline_invitation(client, inv->id);
+    // no new invitations can find the client by name from this point on
+    creg_unbind_name(client_registry, player_get_name(client->player), client);
+    users_cache_note(client->player);
+    // the list can change under us, so the invitations are taken from a snapshot,
+    // after which client_add_invitation() refuses new ones
+    INVITATION *invs[MAX_INVITATIONS];
+    int ids[MAX_INVITATIONS];
+    int watched[MAX_INVITATIONS];
+    int count = 0, num_watched = 0;
+    metrics_mutex_lock(&client->lock, METRICS_LOCK_CLIENT);
+    client->logged_in = 0;
+    if (client->node == -1) {
+        metrics_gauge_add(METRICS_PLAYERS, -1);
+    }
+    for (int w = 0; w < ID_WORDS; w++) {
+        for (uint64_t used = ~client->free_ids[w] & id_slice(w); used != 0; used &= used - 1) {
+            int id = w * ID_WORD_BITS + __builtin_ctzll(used);
+            if (is_watch_id(client, id)) {
+                watched[num_watched++] = id;
+                continue;
             }
+            invs[count] = inv_ref(client->invitations[id], "abandoned on logout");
+            ids[count++] = id;
         }
-        inv = next;
     }
+    pthread_mutex_unlock(&client->lock);
+    // nor can the matchmaker pair it again, as it only takes back those logged in
+    matchmaker_withdraw(client);
+
+    for (int i = 0; i < count; i++) {
+        abandon_invitation(client, invs[i], ids[i]);
+        inv_unref(invs[i], "abandoned on logout");
+    }
+    // a game that has ended meanwhile has been let go of already
+    for (int i = 0; i < num_watched; i++) {
+        client_stop_watching(client, watched[i]);
+    }
+
+    // the player is still needed above, to post the results of resigned games
+    metrics_mutex_lock(&client->lock, METRICS_LOCK_CLIENT);
+    PLAYER *player = client->player;
+    client->player = NULL;
+    pthread_mutex_unlock(&(client->lock));
+    player_unref(player, "client loggout, so the player is discarded");
     return 0;
 }
 
@@ -278,9 +452,147 @@ int client_logout(CLIENT *client){
 PLAYER *client_get_player(CLIENT *client){
     if(client == NULL)
         return NULL;
-    if(client->logged_in)
-        return client->player;
-    return NULL;
+    // read without the lock, which callers such as creg_all_players() may not take;
+    // the player registry keeps every PLAYER alive, so the pointer stays valid
+    return atomic_load_explicit(&client->player, memory_order_acquire);
+}
+
+int client_is_logged_in(CLIENT *client){
+    return client != NULL && atomic_load(&client->logged_in);
+}
+
+int client_get_options(CLIENT *client){
+    return client->options;
+}
+
+uint32_t client_get_epoch(CLIENT *client){
+    return client->epoch;
+}
+
+int client_set_options(CLIENT *client, int options){
+    if(options & ~JEUX_LOGIN_OPTIONS){
+        debug("unknown LOGIN options %#x", options);
+        return -1;
+    }
+    metrics_mutex_lock(&client->lock, METRICS_LOCK_CLIENT);
+    client->options = options;
+    pthread_mutex_unlock(&client->lock);
+    return 0;
+}
+
+// describe the state of game into buf in the format the recipient asked for
+static int unparse_state_for(CLIENT *recipient, GAME *game, char *buf, size_t size){
+    if(recipient->options & JEUX_LOGIN_BINARY_BOARD)
+        return game_unparse_state_binary(game, buf, size);
+    return game_unparse_state_into(game, buf, size);
+}
+
+// judge the moves of a game; returns the length of the text in buf, or -1
+static int analyze_game(GAME *game, char *buf, size_t size){
+    uint8_t squares[GAME_MAX_MOVES];
+    // the oracle knows the classic board only
+    if (!game_variant_is_classic(game_get_variant(game))) {
+        return -1;
+    }
+    return oracle_analyze(squares, game_get_history(game, squares), buf, size);
+}
+
+int client_analyze_game(CLIENT *client, int id, char *buf, size_t size){
+    INVITATION *inv = lookup_invitation(client, id);
+    if(inv == NULL){
+        inv = lookup_id(client, id, 1);
+    }
+    // the game stays alive as long as the invitation is retained
+    GAME *game = inv_get_game(inv);
+    int len = game != NULL ? analyze_game(game, buf, size) : -1;
+    if(game == NULL){
+        debug("no game in progress with ID %d", id);
+    }
+    inv_unref(inv, "game analyzed");
+    return len;
+}
+
+// a timeout as a number of ticks of the timer wheel, rounded up
+static uint64_t timeout_ticks(unsigned ms){
+    return ((uint64_t) ms + TIMER_TICK_MS - 1) / TIMER_TICK_MS;
+}
+
+/*
+ * The timer of a client is armed for the nearer of its login and idle
+ * deadlines, and when it expires it looks at both again: a client that
+ * logged in or sent a packet in the meantime just moves the timer on, so
+ * that noting the activity of a client is a store, not a re-arm.
+ */
+static void client_timer_fired(void *arg){
+    CLIENT *client = arg;
+    if (atomic_load(&client->timeouts_stopped)) {
+        client_unref(client, "timeouts stopped");
+        return;
+    }
+    uint64_t now = timer_ticks();
+    uint64_t deadline = UINT64_MAX;
+    int expired = -1;
+    if (client_timeouts.login != 0 && !client->logged_in) {
+        uint64_t login_deadline = client->created + timeout_ticks(client_timeouts.login);
+        if (login_deadline <= now) {
+            expired = METRICS_TIMEOUT_LOGIN;
+        }
+        deadline = login_deadline;
+    }
+    if (client_timeouts.idle != 0 && expired == -1) {
+        uint64_t idle_deadline = atomic_load_explicit(&client->active, memory_order_relaxed)
+                                 + timeout_ticks(client_timeouts.idle);
+        if (idle_deadline <= now) {
+            expired = METRICS_TIMEOUT_IDLE;
+        }
+        if (idle_deadline < deadline) {
+            deadline = idle_deadline;
+        }
+    }
+    if (expired != -1) {
+        // the session sees EOF and is closed as if the peer had gone
+        debug("[%d] %s timeout; shutting the connection down", client->fd,
+              expired == METRICS_TIMEOUT_LOGIN ? "login" : "idle");
+        metrics_timeout(expired);
+        shutdown(client->fd, SHUT_RDWR);
+    }
+    else if (deadline != UINT64_MAX && timer_arm(&client->timer, (deadline - now) * TIMER_TICK_MS) == 0) {
+        // stopped while it was being armed again, after the cancel found nothing
+        if (atomic_load(&client->timeouts_stopped) && timer_cancel(&client->timer)) {
+            client_unref(client, "timeouts stopped");
+        }
+        return;
+    }
+    client_unref(client, "timeouts done");
+}
+
+void client_start_timeouts(CLIENT *client){
+    unsigned first = client_timeouts.login;
+    if (first == 0 || (client_timeouts.idle != 0 && client_timeouts.idle < first)) {
+        first = client_timeouts.idle;
+    }
+    if (first == 0) {
+        return;
+    }
+    client_ref(client, "held by its timer");
+    if (timer_arm(&client->timer, first) == -1) {
+        client_unref(client, "no timers");
+    }
+}
+
+void client_stop_timeouts(CLIENT *client){
+    atomic_store(&client->timeouts_stopped, 1);
+    if (timer_cancel(&client->timer)) {
+        client_unref(client, "timeouts stopped");
+    }
+}
+
+void client_note_activity(CLIENT *client){
+    atomic_store_explicit(&client->active, timer_ticks(), memory_order_relaxed);
+}
+
+size_t client_footprint(void){
+    return sizeof(CLIENT);
 }
 
 /*
@@ -296,6 +608,73 @@ int client_get_fd(CLIENT *client){
     return client->fd;
 }
 
+/*
+ * Write out whatever is in a client's outbound queue, without blocking.
+ * Only one thread at a time can be the consumer of the queue; a thread
+ * that finds the send lock taken simply leaves its packets to the holder,
+ * which looks at the queue again after releasing the lock.  If the socket
+ * is full, the writer thread is asked to resume the flush and holds a
+ * reference to the CLIENT until it has done so; so does an io_uring
+ * reactor that has taken the send, until it completes.
+ */
+void client_flush(CLIENT *client){
+    if (client->node != -1) {
+        return;     // a proxy's packets go straight to its node
+    }
+    do {
+        if (pthread_mutex_trylock(&client->send_lock) != 0) {
+            return;
+        }
+        int was_blocked = client->outq.blocked;
+        int res = outq_flush(&client->outq, client->fd);
+        if (res == OUTQ_SUBMITTED) {
+            client_ref(client, "waiting for a send to complete");
+        }
+        else if (res == OUTQ_BLOCKED && !was_blocked) {
+            client_ref(client, "waiting for the connection to become writable");
+            if (outq_arm(&client->outq, client->fd) == -1) {
+                shutdown(client->fd, SHUT_RDWR);
+                outq_unblock(&client->outq);
+                client_unref(client, "connection could not be watched for writability");
+            }
+        }
+        pthread_mutex_unlock(&client->send_lock);
+    } while (outq_has_queued(&client->outq));
+}
+
+// called from the writer thread once a blocked connection is writable,
+// or from an io_uring reactor once a send it took is complete
+static void client_on_writable(void *arg){
+    CLIENT *client = arg;
+    pthread_mutex_lock(&client->send_lock);
+    outq_unblock(&client->outq);
+    int res = outq_flush(&client->outq, client->fd);
+    if (res == OUTQ_SUBMITTED) {
+        // the reference passes to the next send
+        pthread_mutex_unlock(&client->send_lock);
+        return;
+    }
+    if (res == OUTQ_BLOCKED) {
+        if (outq_arm(&client->outq, client->fd) == 0) {
+            // still full: the writer thread keeps its reference
+            pthread_mutex_unlock(&client->send_lock);
+            return;
+        }
+        shutdown(client->fd, SHUT_RDWR);
+        outq_unblock(&client->outq);
+    }
+    pthread_mutex_unlock(&client->send_lock);
+    client_flush(client);
+    client_unref(client, "connection became writable");
+}
+
+// a client whose queue has overflowed is disconnected; its service loop sees EOF
+static void client_drop_slow_consumer(CLIENT *client){
+    debug("[%d] dropping slow consumer", client->fd);
+    outq_close(&client->outq);
+    shutdown(client->fd, SHUT_RDWR);
+}
+
 /*
  * Send a packet to a client.  Exclusive access to the network connection
  * is obtained for the duration of this operation, to prevent concurrent
@@ -303,37 +682,106 @@ int client_get_fd(CLIENT *client){
  * such interference, only this function should be used to send packets to
  * the client, rather than the lower-level proto_send_packet() function.
  *
+ * The packet is appended to the client's outbound queue and written out
+ * as far as the socket allows without blocking; the rest is left to the
+ * writer thread.  Packets are transmitted in the order they were queued.
+ *
  * @param client  The CLIENT who should be sent the packet.
  * @param pkt  The header of the packet to be sent.
  * @param data  Data payload to be sent, or NULL if none.
- * @return 0 if transmission succeeds, -1 otherwise.
+ * @return 0 if the packet was queued, -1 otherwise.
  */
 int client_send_packet(CLIENT *client, JEUX_PACKET_HEADER *pkt, void *data) {
+    return client_send_packets(client, &pkt, &data, 1);
+}
+
+int client_send_packets(CLIENT *client, JEUX_PACKET_HEADER **hdrs, void **data, int count) {
     if(client == NULL)
         return -1;
-    int res = -1;
-    pthread_mutex_lock(&client->lock);
-    if (proto_send_packet(client_get_fd(client), pkt, data) == 0) {
-        res = 0;
-    }
-    else{
-
+    if (client->node != -1) {
+        return cluster_deliver(client->node, client->epoch, player_get_name(client->player),
+                               hdrs, data, count);
+    }
+    int res = 0;
+    for (int i = 0; i < count; i++) {
+        if (outq_push(&client->outq, hdrs[i], data[i]) == -1) {
+            if (errno == ENOBUFS) {
+                client_drop_slow_consumer(client);
+            }
+            res = -1;
+            break;
+        }
+        TRACE(TRACE_PACKET_OUT, hdrs[i]->type, client->fd, TRACE_HEADER_FIELDS(hdrs[i], ntohs(hdrs[i]->size)), 0);
     }
+    client_flush(client);
+    return res;
+}
 
-    pthread_mutex_unlock(&client->lock);
+int client_send_shared(CLIENT *client, JEUX_PACKET_HEADER *pkt, OUTQ_SHARED *buf, size_t off) {
+    if(client == NULL)
+        return -1;
+    int res = client_queue_shared(client, pkt, buf, off);
+    client_flush(client);
     return res;
 }
 
-// return NULL if failed
-JEUX_PACKET_HEADER *make_packet(JEUX_PACKET_TYPE type, size_t size){
-    JEUX_PACKET_HEADER *pkt = malloc(sizeof(JEUX_PACKET_HEADER));
-    if(pkt == NULL){
-        return NULL;
+int client_queue_shared(CLIENT *client, JEUX_PACKET_HEADER *pkt, OUTQ_SHARED *buf, size_t off) {
+    if(client == NULL)
+        return -1;
+    if (client->node != -1) {
+        return client_send_packet(client, pkt, buf->data + off);
     }
+    if (outq_push_shared(&client->outq, pkt, buf, off) == -1) {
+        if (errno == ENOBUFS) {
+            client_drop_slow_consumer(client);
+        }
+        return -1;
+    }
+    TRACE(TRACE_PACKET_OUT, pkt->type, client->fd, TRACE_HEADER_FIELDS(pkt, ntohs(pkt->size)), 0);
+    return 0;
+}
+
+void client_finish_output(CLIENT *client){
+    outq_close(&client->outq);
+    pthread_mutex_lock(&client->send_lock);
+    int res = outq_flush(&client->outq, client->fd);
+    if (res == OUTQ_SUBMITTED) {
+        client_ref(client, "waiting for a send to complete");
+    }
+    pthread_mutex_unlock(&client->send_lock);
+    if (res == OUTQ_BLOCKED) {
+        // the writer thread is woken by the hangup and drops what is left
+        shutdown(client->fd, SHUT_RDWR);
+    }
+}
+
+// fill in a header on the caller's stack; outq_push() copies it
+static void init_packet(JEUX_PACKET_HEADER *pkt, JEUX_PACKET_TYPE type, size_t size){
     memset(pkt, 0, sizeof(JEUX_PACKET_HEADER));
     pkt->type = type;
     pkt->size = htons(size);
-    return pkt;
+}
+
+/*
+ * Set up the ENDED packet for a recipient, with the analysis of the game
+ * as its payload if the recipient asked for it.  The analysis is made
+ * the first time it is needed, into analysis, whose length is kept in
+ * *lenp (0 until then).
+ */
+static void *init_ended_packet(JEUX_PACKET_HEADER *pkt, CLIENT *recipient, int id, GAME *game,
+                               char *analysis, int *lenp){
+    init_packet(pkt, JEUX_ENDED_PKT, 0);
+    pkt->id = id;
+    pkt->role = game_get_winner(game);
+    if(!(recipient->options & JEUX_LOGIN_ANALYSIS))
+        return NULL;
+    if(*lenp == 0 && (*lenp = analyze_game(game, analysis, ORACLE_ANALYSIS_MAX)) == -1){
+        debug("the game could not be analyzed");
+        *lenp = 0;
+        return NULL;
+    }
+    pkt->size = htons(*lenp);
+    return analysis;
 }
 
 /*
@@ -347,16 +795,12 @@ JEUX_PACKET_HEADER *make_packet(JEUX_PACKET_TYPE type, size_t size){
  * @return 0 if transmission succeeds, -1 otherwise.
  */
 int client_send_ack(CLIENT *client, void *data, size_t datalen){
-    JEUX_PACKET_HEADER *ack_pkt = make_packet(JEUX_ACK_PKT, datalen);
-    if(ack_pkt == NULL){
-        return -1;
-    }
+    JEUX_PACKET_HEADER ack_pkt;
+    init_packet(&ack_pkt, JEUX_ACK_PKT, datalen);
     debug("Send out ACK packet: fd number is %d", client_get_fd(client));
-    if(client_send_packet(client, ack_pkt, data) == -1){
-        free(ack_pkt);
+    if(client_send_packet(client, &ack_pkt, data) == -1){
         return -1;
     }
-    free(ack_pkt);
     return 0;
 }
 
@@ -368,16 +812,12 @@ int client_send_ack(CLIENT *client, void *data, size_t datalen){
  * @return 0 if transmission succeeds, -1 otherwise.
  */
 int client_send_nack(CLIENT *client){
-    JEUX_PACKET_HEADER * nack_pkt = make_packet(JEUX_NACK_PKT, 0);
-    if(nack_pkt == NULL){
-        return -1;
-    }
+    JEUX_PACKET_HEADER nack_pkt;
+    init_packet(&nack_pkt, JEUX_NACK_PKT, 0);
     debug("Send out NACK packet: fd number is %d", client_get_fd(client));
-    if(client_send_packet(client, nack_pkt, NULL) == -1){
-        free(nack_pkt);
+    if(client_send_packet(client, &nack_pkt, NULL) == -1){
         return -1;
     }
-    free(nack_pkt);
     return 0;
 }
 
@@ -396,36 +836,19 @@ int client_send_nack(CLIENT *client){
 int client_add_invitation(CLIENT *client, INVITATION *inv){
     if(client == NULL || inv == NULL)
         return -1;
-    // Acquire the lock associated with the client object
-    pthread_mutex_lock(&client->lock);
-
-    // Create a new INVITATION_NODE and set its invitation field to inv
-    INVITATION_NODE *inv_node = malloc(sizeof(INVITATION_NODE));
-    if (!inv_node) {
+    metrics_mutex_lock(&client->lock, METRICS_LOCK_CLIENT);
+    // a client that is logging out has let go of its invitations for good
+    int id = client->logged_in ? alloc_id(client) : -1;
+    if (id == -1 || inv_set_client_id(inv, client, id) == -1) {
+        debug("No ID can be given to the invitation");
+        if (id != -1)
+            free_id(client, id);
         pthread_mutex_unlock(&client->lock);
         return -1;
     }
-    inv_node->invitation = inv;
-    inv_node->next = NULL;
-    inv_node->prev = NULL;
-    
-    // Assign a unique integer ID to the invitation node
-    inv_node->id = find_lowest_id_availalble(client);
-
-    // Add the new invitation node to the front of the linked list
-    inv_node->next = client->invitations_head;
-    if (client->invitations_head) {
-        client->invitations_head->prev = inv_node;
-    }
-    client->invitations_head = inv_node;
-    // Increment the reference count of the INVITATION object pointed to by inv
-    inv_ref(inv, "add invitation to the client's list");
-
-    // Release the lock associated with the client object
+    client->invitations[id] = inv_ref(inv, "add invitation to the client's table");
     pthread_mutex_unlock(&client->lock);
-
-    // Return the ID assigned to the invitation
-    return inv_node->id;
+    return id;
 }
 
 /*
@@ -439,51 +862,21 @@ int client_add_invitation(CLIENT *client, INVITATION *inv){
  * removed, otherwise -1.
  */
 int client_remove_invitation(CLIENT *client, INVITATION *inv) {
-    // Ensure the client and invitation pointers are not null
     if (client == NULL || inv == NULL) {
         return -1;
     }
-
-
-    // Acquire the client's lock
-    pthread_mutex_lock(&client->lock);
-
-    // Search for the invitation node in the list
-    INVITATION_NODE *curr = client->invitations_head;
-    while (curr != NULL) {
-
-        if (curr->invitation == inv) {
-            // Remove the invitation node from the list
-            if (curr->prev != NULL) {
-                curr->prev->next = curr->next;
-            } else {
-                client->invitations_head = curr->next;
-            }
-
-            if (curr->next != NULL) {
-                curr->next->prev = curr->prev;
-            }
-            pthread_mutex_unlock(&client->lock);
-
-            int inv_id = curr->id;
-            // Decrement the invitation's reference count
-            inv_unref(inv, "removing from the client's invitation list");
-
-            // Save the invitation ID before freeing the node
-
-            // Free the invitation node
-            free(curr);
-
-            // Release the client's lock and return the invitation ID
-            return inv_id;
-        }
-
-        curr = curr->next;
+    metrics_mutex_lock(&client->lock, METRICS_LOCK_CLIENT);
+    int id = inv_get_client_id(inv, client);
+    if (id == -1 || client->invitations[id] != inv) {
+        pthread_mutex_unlock(&client->lock);
+        return -1;
     }
-
-    // If the invitation was not found, release the client's lock and return -1
+    client->invitations[id] = NULL;
+    free_id(client, id);
+    inv_set_client_id(inv, client, -1);
     pthread_mutex_unlock(&client->lock);
-    return -1;
+    inv_unref(inv, "removing from the client's invitation table");
+    return id;
 }
 
 /*
@@ -502,13 +895,24 @@ int client_remove_invitation(CLIENT *client, INVITATION *inv) {
  * is successful, otherwise -1.
  */
 int client_make_invitation(CLIENT *source, CLIENT *target, GAME_ROLE source_role, GAME_ROLE target_role){
+    return client_make_variant_invitation(source, target, source_role, target_role, &game_classic);
+}
+
+int client_make_variant_invitation(CLIENT *source, CLIENT *target, GAME_ROLE source_role,
+                                   GAME_ROLE target_role, const GAME_VARIANT *variant){
         // Allocate memory for a new INVITATION object
     INVITATION *invitation;
 
+    // each side of an invitation has its own ID for it
+    if(source == target){
+        debug("A client cannot invite itself");
+        return -1;
+    }
     if( (invitation = inv_create(source, target, source_role, target_role)) == NULL){
         debug("Failed to make invitation");
         return -1;
     }
+    inv_set_variant(invitation, variant);
     // Add the invitation to the source and target client's lists of invitations
     int client_id;
     if( (client_id = client_add_invitation(source, invitation)) == -1){
@@ -519,30 +923,91 @@ int client_make_invitation(CLIENT *source, CLIENT *target, GAME_ROLE source_role
     int target_id;
     if( (target_id = client_add_invitation(target, invitation)) == -1){
         debug("added invitation to target failed");
+        client_remove_invitation(source, invitation);
         inv_unref(invitation, "The point to the invitation is now discarded");
         return -1;
     }
 
-    pthread_mutex_lock(&source->lock);
  // *             Header: invitation ID
  // *             Payload: user name of source
     // construct INVITATION PACKET AND SEND IT to the TARGET CLIENT
     char *source_name = player_get_name(client_get_player(source));
-    JEUX_PACKET_HEADER *invited_pkt = make_packet(JEUX_INVITED_PKT, strlen(source_name));
-    invited_pkt->id = target_id;
-    invited_pkt->role = target_role;
-    if(client_send_packet(target, invited_pkt, source_name) == -1){
+    // the board, unless it is the classic one, follows the name after a tab
+    char *payload = source_name;
+    size_t len = strlen(source_name);
+    if(!game_variant_is_classic(variant)){
+        char board[GAME_VARIANT_STR_MAX];
+        int board_len = game_unparse_variant(variant, board, sizeof(board));
+        if((payload = malloc(len + board_len + 2)) != NULL){
+            len = sprintf(payload, "%s\t%s", source_name, board);
+        }
+    }
+    JEUX_PACKET_HEADER invited_pkt;
+    init_packet(&invited_pkt, JEUX_INVITED_PKT, len);
+    invited_pkt.id = target_id;
+    invited_pkt.role = target_role;
+    int sent = payload != NULL && client_send_packet(target, &invited_pkt, payload) == 0;
+    if(payload != source_name){
+        free(payload);
+    }
+    if(!sent){
         debug("Failed to send the invite packet ot client");
-        free(invited_pkt);
-        pthread_mutex_unlock(&source->lock);
+        // the target never heard of it, so it is withdrawn from both lists
+        client_remove_invitation(source, invitation);
+        client_remove_invitation(target, invitation);
+        inv_unref(invitation, "The point to the invitation is now discarded");
         return -1;
     }
-    free(invited_pkt);
+    if (client_timeouts.invite != 0) {
+        inv_arm_timer(invitation, client_timeouts.invite);
+    }
     inv_unref(invitation, "The point to the invitation is now discarded");
-    pthread_mutex_unlock(&source->lock);
     return client_id;
 }
 
+int client_start_matched_game(CLIENT *first, CLIENT *second){
+    if (first == NULL || second == NULL || first == second) {
+        return -1;
+    }
+    INVITATION *inv = inv_create(first, second, FIRST_PLAYER_ROLE, SECOND_PLAYER_ROLE);
+    if (inv == NULL) {
+        return -1;
+    }
+    // accepted before either side can see it, so there is nothing to revoke or decline
+    if (inv_accept(inv) == -1) {
+        inv_unref(inv, "matched game not started");
+        return -1;
+    }
+    int first_id = client_add_invitation(first, inv);
+    int second_id = first_id == -1 ? -1 : client_add_invitation(second, inv);
+    if (second_id == -1) {
+        debug("A matched player is logging out or has no free ID");
+        client_remove_invitation(first, inv);
+        inv_unref(inv, "matched game not started");
+        return -1;
+    }
+
+    // as if the first had invited the second, who accepted
+    GAME *game = inv_get_game(inv);
+    char state_str[GAME_STATE_MAX];
+    JEUX_PACKET_HEADER accepted_pkt;
+    init_packet(&accepted_pkt, JEUX_ACCEPTED_PKT, unparse_state_for(first, game, state_str, sizeof(state_str)));
+    accepted_pkt.id = first_id;
+    if (client_send_packet(first, &accepted_pkt, state_str)) {
+        debug("failed to send the accepted packet to the first player");
+    }
+    init_packet(&accepted_pkt, JEUX_ACCEPTED_PKT, 0);
+    accepted_pkt.id = second_id;
+    if (client_send_packet(second, &accepted_pkt, NULL)) {
+        debug("failed to send the accepted packet to the second player");
+    }
+    if (client_timeouts.move != 0) {
+        inv_arm_timer(inv, client_timeouts.move);
+    }
+    inv_unref(inv, "matched game started");
+    return 0;
+}
+
 /*
  * Revoke an invitation for which the specified CLIENT is the source.
  * The invitation is removed from the lists of invitations of its source
@@ -560,71 +1025,59 @@ int client_make_invitation(CLIENT *source, CLIENT *target, GAME_ROLE source_role
  * revoked.
  * @return 0 if the invitation is successfully revoked, otherwise -1.
  */
-int client_revoke_invitation(CLIENT *client, int id) {
-    // Acquire the lock of the source CLIENT.
-    pthread_mutex_lock(&client->lock);
-
-    // Search for the INVITATION_NODE in the source CLIENT's list of outstanding invitations, corresponding to the given ID.
-    INVITATION_NODE *source_node = client->invitations_head;
-    while (source_node != NULL && source_node->id != id) {
-        source_node = source_node->next;
-    }
-
-    if (source_node == NULL) {
-        // The INVITATION_NODE is not found in the source CLIENT's list of outstanding invitations.
+static int revoke_invitation(CLIENT *client, int id, int expired) {
+    INVITATION *inv = lookup_invitation(client, id);
+    if (inv == NULL) {
         debug("FAILED to find the invitation associated with the ID in the invitation list");
-        pthread_mutex_unlock(&client->lock);
         return -1;
     }
-
-    INVITATION *inv = source_node->invitation;
-    if (inv_get_game(inv) != NULL) {
-        // The INVITATION is not in the "open" state, meaning there's a game currently going on and it can't be revoked.
-        debug("there's a game currently in progress and invitation can't be revoked");
-        pthread_mutex_unlock(&client->lock);
-        return -1;
-    }
-
-    CLIENT *source = inv_get_source(inv);
     // if the client is not the source of the invitation
-    if(source != client){
-        pthread_mutex_unlock(&client->lock);
+    if (inv_get_source(inv) != client) {
         debug("The client is not the source of the invitation, thus it can't be revoked");
+        inv_unref(inv, "invitation not revoked");
         return -1;
     }
-    pthread_mutex_unlock(&client->lock);
-
-    // Remove the INVITATION_NODE from the source CLIENT's list of outstanding invitations and decrement the INVITATION's reference count.
-    if(client_remove_invitation(client, inv) == -1){
-        debug("FAILED to remove invitation from the source's invitation list");
+    // this fails if the target has accepted the invitation in the meantime
+    if (inv_close(inv, NULL_ROLE) == -1) {
+        debug("there's a game currently in progress and invitation can't be revoked");
+        inv_unref(inv, "invitation not revoked");
         return -1;
     }
 
-    // Remove the INVITATION_NODE from the target CLIENT's list of outstanding invitations and decrement the INVITATION's reference count.
-    int target_id;
+    // Remove the INVITATION from both lists; the reference retained above keeps the target alive
     CLIENT *target = inv_get_target(inv);
-    if( (target_id =  client_remove_invitation(target, inv)) == -1){
-        debug("FAILED to remove invitation from the target's invitation list");
-        return -1;
+    // the server revokes an invitation that has expired, so the source is told too,
+    // before the ID is free to be given to another
+    if (expired) {
+        JEUX_PACKET_HEADER revoked_pkt;
+        init_packet(&revoked_pkt, JEUX_REVOKED_PKT, 0);
+        revoked_pkt.id = id;
+        if (client_send_packet(client, &revoked_pkt, NULL) == -1) {
+            debug("failed to send the source the REVOKED of an expired invitation");
+        }
     }
-
+    client_remove_invitation(client, inv);
+    int target_id = client_remove_invitation(target, inv);
 
  //  *   REVOKED   Sent when an invitation has been revoked by source
  //  *             Header: invitation ID assigned by target
     // Construct a REVOKED packet containing the target's ID of the revoked invitation and send it to the target CLIENT.
-    JEUX_PACKET_HEADER *revoked_pkt = make_packet(JEUX_REVOKED_PKT, 0);
-    revoked_pkt->id = target_id;
-    if(client_send_packet(target, revoked_pkt, NULL) == -1){
-        free(revoked_pkt);
-        debug("failed to send the client's packet");
-        return -1;
+    if (target_id != -1) {
+        JEUX_PACKET_HEADER revoked_pkt;
+        init_packet(&revoked_pkt, JEUX_REVOKED_PKT, 0);
+        revoked_pkt.id = target_id;
+        if (client_send_packet(target, &revoked_pkt, NULL) == -1) {
+            debug("failed to send the client's packet");
+        }
+        debug("Revoke packet sent!");
     }
-    free(revoked_pkt);
-    debug("Revoke packet sent!");
-
-    // Release the locks of both source and target CLIENTs.
+    inv_unref(inv, "invitation revoked");
     return 0;
 }
+
+int client_revoke_invitation(CLIENT *client, int id) {
+    return revoke_invitation(client, id, 0);
+}
 /*
  * Decline an invitation previously made with the specified CLIENT as target.  
  * The invitation is removed from the lists of invitations of its source
@@ -643,72 +1096,39 @@ int client_revoke_invitation(CLIENT *client, int id) {
  * @return 0 if the invitation is successfully declined, otherwise -1.
  */
 int client_decline_invitation(CLIENT *client, int id){
-    // Acquire the lock of the source CLIENT.
-    pthread_mutex_lock(&client->lock);
-
-    // Search for the INVITATION_NODE in the source CLIENT's list of outstanding invitations, corresponding to the given ID.
-    INVITATION_NODE *target_node = client->invitations_head;
-    while (target_node != NULL && target_node->id != id) {
-        target_node = target_node->next;
-    }
-
-    if (target_node == NULL) {
+    INVITATION *inv = lookup_invitation(client, id);
+    if (inv == NULL) {
         debug("FAILED to find the invitation associated with the ID in the invitation list");
-        pthread_mutex_unlock(&client->lock);
-        return -1;
-    }
-
-    INVITATION *inv = target_node->invitation;
-
-    if (inv_get_game(inv) != NULL) {
-        // The INVITATION is not in the "open" state, meaning there's a game currently going on and it can't be declined.
-        debug("there's a game currently in progress and invitation can't be declined");
-        pthread_mutex_unlock(&client->lock);
         return -1;
     }
-
-
-    // Search for the INVITATION_NODE in the target CLIENT's list of outstanding invitations, corresponding to the given ID.
-    CLIENT *target = inv_get_target(inv);
-    // if the client is not the source of the invitation
-    if(target != client){
+    // if the client is not the target of the invitation
+    if (inv_get_target(inv) != client) {
         debug("The client is not the target of the invitation, thus it can't be declined");
-        pthread_mutex_unlock(&client->lock);
+        inv_unref(inv, "invitation not declined");
         return -1;
     }
-    pthread_mutex_unlock(&client->lock);
-
-    // Remove the INVITATION_NODE from the source CLIENT's list of outstanding invitations and decrement the INVITATION's reference count.
-    if(client_remove_invitation(target, inv) == -1){
-        debug("FAILED to remove target's invitation from the invitation list");
+    // this fails if the invitation has been accepted or revoked in the meantime
+    if (inv_close(inv, NULL_ROLE) == -1) {
+        debug("there's a game currently in progress and invitation can't be declined");
+        inv_unref(inv, "invitation not declined");
         return -1;
     }
 
     CLIENT *source = inv_get_source(inv);
-    // Remove the INVITATION_NODE from the target CLIENT's list of outstanding invitations and decrement the INVITATION's reference count.
-    int source_id;
-    if( (source_id = client_remove_invitation(source, inv)) == -1){
-        debug("FAILED to remove source's invitation from the invitation list");
-        return -1;
-    }
-    pthread_mutex_lock(&client->lock);
-
+    client_remove_invitation(client, inv);
+    int source_id = client_remove_invitation(source, inv);
 
  // *   DECLINED  Sent when an invitation has been declined by target
  // *             Header: invitation ID assigned by source
-
-    // Construct a declined packet containing the target's ID of the declined invitation and send it to the target CLIENT.
-    JEUX_PACKET_HEADER *declined_pkt = make_packet(JEUX_DECLINED_PKT, 0);
-    declined_pkt->id = source_id;
-    if(client_send_packet(source, declined_pkt, NULL) ){
-        free(declined_pkt);
-        debug("failed to send the client's packet");
-        pthread_mutex_unlock(&client->lock);
-        return -1;
+    if (source_id != -1) {
+        JEUX_PACKET_HEADER declined_pkt;
+        init_packet(&declined_pkt, JEUX_DECLINED_PKT, 0);
+        declined_pkt.id = source_id;
+        if (client_send_packet(source, &declined_pkt, NULL)) {
+            debug("failed to send the client's packet");
+        }
     }
-    free(declined_pkt);
-
-    pthread_mutex_unlock(&client->lock);
+    inv_unref(inv, "invitation declined");
     return 0;
 }
 
@@ -736,98 +1156,68 @@ int client_decline_invitation(CLIENT *client, int id){
  * @return 0 if the INVITATION is successfully accepted, otherwise -1.
  */
 int client_accept_invitation(CLIENT *client, int id, char **strp) {
-    INVITATION *inv;
-    char *state_str;
-    pthread_mutex_lock(&client->lock);
-
-    /***STEP 1: FIND the invitation in the client's invitation list**/
-    INVITATION_NODE *target_node = client->invitations_head;
-    while (target_node != NULL && target_node->id != id) {
-        target_node = target_node->next;
-    }
-    if (target_node == NULL) {
-        debug("FAILED to find the invitation associated with the ID in the invitation list");
-        pthread_mutex_unlock(&client->lock);
+    char buf[GAME_STATE_MAX];
+    *strp = NULL;
+    int len = client_accept_invitation_into(client, id, buf, sizeof(buf));
+    if (len <= 0) {
+        return len;
+    }
+    if ((*strp = malloc(len + 1)) == NULL) {
+        debug("Error: memory allocation failed");
         return -1;
     }
-    inv = target_node->invitation;
-
-    CLIENT *target = inv_get_target(inv);
-    CLIENT *source = inv_get_source(inv);
+    memcpy(*strp, buf, len);
+    (*strp)[len] = '\0';
+    return 0;
+}
 
-    if(target != client){
-        debug("The client is not the target of the invitation, so it can't be accepted");
-        pthread_mutex_unlock(&client->lock);
+int client_accept_invitation_into(CLIENT *client, int id, char *buf, size_t size) {
+    INVITATION *inv = lookup_invitation(client, id);
+    if (inv == NULL) {
+        debug("FAILED to find the invitation associated with the ID in the invitation list");
         return -1;
     }
-
-    if (inv_get_game(inv) != NULL) {
-        debug("there's a game currently in progress and invitation can't be accepted");
-        pthread_mutex_unlock(&client->lock);
+    if (inv_get_target(inv) != client) {
+        debug("The client is not the target of the invitation, so it can't be accepted");
+        inv_unref(inv, "invitation not accepted");
         return -1;
     }
-    debug("stage 1");
-    /***STEP 2: ACCEPT THE PACKET CREATE A NEW GAME AND SAVE IT TO THE INVITATION**/
-    if( inv_accept(inv) == -1 ){
+    // this fails if the invitation was accepted, revoked or declined in the meantime
+    if (inv_accept(inv) == -1) {
         debug("failed to accept the invitation");
-        pthread_mutex_unlock(&client->lock);
-        return -1;
-    }
-    debug("stage 2");
-
-    /***STEP 3: DEALING WITH SENDING PACKETS & stuff**/
-
-    // Get the source client ID and initial state string
-    INVITATION_NODE *source_node = source->invitations_head;
-    while (source_node != NULL && source_node->invitation != inv) {
-        source_node = source_node->next;
-    }
-    if (source_node == NULL) {
-        debug("FAILED to find the invitation in the invitation list");
-        pthread_mutex_unlock(&client->lock);
+        inv_unref(inv, "invitation not accepted");
         return -1;
     }
-    int source_id = source_node->id;
 
 // *     ACCEPTED  Sent when an invitation has been accepted by target
 //  *             Header: invitation ID assigned by source
 //  *             Payload: string showing initial game state
-    // Construct a accepted packet containing the target's ID send it to the source CLIENT.
-    JEUX_PACKET_HEADER *accepted_pkt = make_packet(JEUX_ACCEPTED_PKT, 0);
-    accepted_pkt->id = source_id;
-    debug("stage 3");
+    CLIENT *source = inv_get_source(inv);
+    GAME *game = inv_get_game(inv);
+    JEUX_PACKET_HEADER accepted_pkt;
+    init_packet(&accepted_pkt, JEUX_ACCEPTED_PKT, 0);
+    accepted_pkt.id = invitation_id(source, inv);
 
+    int ack_len = 0;
+    char state_str[GAME_STATE_MAX];
+    void *accepted_data = NULL;
     if (inv_get_source_role(inv) == FIRST_PLAYER_ROLE){
-        strp = NULL;
-        state_str = game_unparse_state(inv_get_game(inv));
-        accepted_pkt->size = htons(strlen(state_str));
-        if(client_send_packet(source, accepted_pkt, state_str) ){
-            free(accepted_pkt);
-            free(state_str);
-            debug("failed to send the client's packet");
-            pthread_mutex_unlock(&client->lock);
-            return -1;
-        }
-        free(accepted_pkt);
-        free(state_str);
+        accepted_pkt.size = htons(unparse_state_for(source, game, state_str, sizeof(state_str)));
+        accepted_data = state_str;
     }
     else{
-        *strp = game_unparse_state(inv_get_game(inv));
-        if(client_send_packet(source, accepted_pkt, NULL) ){
-            free(accepted_pkt);
-            debug("failed to send the client's packet");
-            pthread_mutex_unlock(&client->lock);
-            return -1;
-        }
-        free(accepted_pkt);
+        ack_len = unparse_state_for(client, game, buf, size);
     }
-    pthread_mutex_unlock(&client->lock);
-    debug("stage 4");
-
-
-    // // Return a reference to the new game with its reference count incremented
-    // game_ref()  // I might have to do this
-    return 0;
+    // a source that is logging out has already dropped the invitation, and resigns the game
+    if (accepted_pkt.id != -1 && client_send_packet(source, &accepted_pkt, accepted_data)) {
+        debug("failed to send the client's packet");
+    }
+    // unless the timer of the invitation timeout is still armed, and sees to the clock when it expires
+    if (client_timeouts.move != 0) {
+        inv_arm_timer(inv, client_timeouts.move);
+    }
+    inv_unref(inv, "invitation accepted");
+    return ack_len;
 }
 
 /*
@@ -845,21 +1235,26 @@ int client_accept_invitation(CLIENT *client, int id, char **strp) {
  * the GAME to be resigned.
  * @return 0 if the game is successfully resigned, otherwise -1.
  */
-int client_resign_game(CLIENT *client, int id) {
-    INVITATION *inv;
-    pthread_mutex_lock(&client->lock);
-
-    // Find the invitation in the client's invitation list
-    INVITATION_NODE *inv_node = client->invitations_head;
-    while (inv_node != NULL && inv_node->id != id) {
-        inv_node = inv_node->next;
+// tell the spectators of a game, if it has any, of a move or of its end, once the players have been told
+static void notify_spectators(INVITATION *inv, GAME *game, int moved, int ended){
+    SPECTATORS *s = inv_get_spectators(inv, 0);
+    if (s == NULL) {
+        return;
+    }
+    if (moved) {
+        spectators_moved(s, game);
     }
-    if (inv_node == NULL) {
+    if (ended) {
+        spectators_ended(s, game, inv);
+    }
+}
+
+int client_resign_game(CLIENT *client, int id) {
+    INVITATION *inv = lookup_invitation(client, id);
+    if (inv == NULL) {
         debug("FAILED to find the invitation in the invitation list");
-        pthread_mutex_unlock(&client->lock);
         return -1;
     }
-    inv = inv_node->invitation;
 
     CLIENT *source = inv_get_source(inv);
     CLIENT *target = inv_get_target(inv);
@@ -867,92 +1262,124 @@ int client_resign_game(CLIENT *client, int id) {
     // Check that the game is in progress and that the client is either the source or target
     if (game == NULL || (source != client && target != client)) {
         debug("The invitation is not in the correct state or the client is not a player in the game");
-        pthread_mutex_unlock(&client->lock);
+        inv_unref(inv, "game not resigned");
         return -1;
     }
 
     GAME_ROLE client_role = (client == source) ? inv_get_source_role(inv): inv_get_target_role(inv);
-
+    // this fails if the game has ended in the meantime
     if(inv_close(inv, client_role) == -1){
         debug("failed to resign the game");
-        pthread_mutex_unlock(&client->lock);
+        inv_unref(inv, "game not resigned");
         return -1;
     }
 
-    // Construct and send the RESIGNED packet to the opponent
     CLIENT *opponent = (client == source) ? target : source;
-    INVITATION_NODE *opponent_node = opponent->invitations_head;
-    while (opponent_node != NULL && opponent_node ->invitation != inv) {
-        opponent_node  = opponent_node ->next;
-    }
-    if (opponent_node == NULL) {
-        debug("FAILED to find the invitation in the invitation list");
-        pthread_mutex_unlock(&client->lock);
-        return -1;
-    }
-    int opponent_id = opponent_node->id;
-
-    pthread_mutex_unlock(&client->lock);
+    int opponent_id = invitation_id(opponent, inv);
 
  // *   RESIGNED  Sent when the opponent has resigned
  // *             Header: invitation ID assigned by recipient
-    JEUX_PACKET_HEADER *resigned_pkt = make_packet(JEUX_RESIGNED_PKT, 0);
-    resigned_pkt->id = opponent_id;
-    if (client_send_packet(opponent, resigned_pkt, NULL)) {
-        free(resigned_pkt);
-        debug("failed to send the resigned packet to the opponent");
-        return -1;
-    }
-    free(resigned_pkt);
+    JEUX_PACKET_HEADER resigned_pkt;
+    init_packet(&resigned_pkt, JEUX_RESIGNED_PKT, 0);
+    resigned_pkt.id = opponent_id;
 
      /* Notify both players */
      // *   ENDED     Sent when a game has ended
      // *             Header: invitation ID assigned by recipient
      // *                     GAME_ROLE (none, first, second) of winner
-    JEUX_PACKET_HEADER *opp_ended_pkt = make_packet(JEUX_ENDED_PKT, 0);
-    opp_ended_pkt->id = opponent_id;
-    GAME_ROLE winner = game_get_winner(game);
-    opp_ended_pkt->role = winner;
-
-    if (client_send_packet(opponent, opp_ended_pkt, NULL)) {
-        free(opp_ended_pkt);
-        debug("failed to send the ended packet to the opponent");
-        return -1;
+    char analysis[ORACLE_ANALYSIS_MAX];
+    int analysis_len = 0;
+    JEUX_PACKET_HEADER opp_ended_pkt;
+    void *opp_ended_data = init_ended_packet(&opp_ended_pkt, opponent, opponent_id, game,
+                                             analysis, &analysis_len);
+
+    // the opponent gets RESIGNED and ENDED in one batch
+    JEUX_PACKET_HEADER *opp_pkts[] = { &resigned_pkt, &opp_ended_pkt };
+    void *opp_data[] = { NULL, opp_ended_data };
+    if (opponent_id != -1 && client_send_packets(opponent, opp_pkts, opp_data, 2)) {
+        debug("failed to send the resigned and ended packets to the opponent");
+    }
+
+    JEUX_PACKET_HEADER cli_ended_pkt;
+    void *cli_ended_data = init_ended_packet(&cli_ended_pkt, client, id, game, analysis, &analysis_len);
+    // the client may be resigning because its connection is gone
+    if (client_send_packet(client, &cli_ended_pkt, cli_ended_data)) {
+        debug("failed to send the ended packet to the player(AKA not opponent)");
     }
-    free(opp_ended_pkt);
 
-    JEUX_PACKET_HEADER *cli_ended_pkt = make_packet(JEUX_ENDED_PKT, 0);
-    cli_ended_pkt->id = id;
-    cli_ended_pkt->role = winner;
+    PLAYER *source_player = player_ref(client_get_player(source), "posting the result of a resigned game");
+    PLAYER *target_player = player_ref(client_get_player(target), "posting the result of a resigned game");
+    int result = client == source ? 2 : 1;
 
-    if (client_send_packet(client, cli_ended_pkt, NULL) && errno != EPIPE) {
-        free(cli_ended_pkt);
-        debug("failed to send the ended packet to the player(AKA not opponent)");
-        return -1;
+    /* Remove the INVITATION */
+    client_remove_invitation(source, inv);
+    client_remove_invitation(target, inv);
+
+    /* Update the ratings of both players */
+    if(source_player != NULL && target_player != NULL){
+        player_post_result(source_player, target_player, result);
     }
-    if(errno == EPIPE){
-        debug("SIGPIPE received");
+    player_unref(source_player, "result of a resigned game posted");
+    player_unref(target_player, "result of a resigned game posted");
+    notify_spectators(inv, game, 0, 1);
+    inv_unref(inv, "game resigned");
+    return 0;
+}
+
+// resign a game for the player whose move it is, who has run out of time
+static void expire_move(INVITATION *inv, GAME *game){
+    uint8_t squares[GAME_MAX_MOVES];
+    GAME_ROLE to_move = game_get_history(game, squares) % 2 == 0 ? FIRST_PLAYER_ROLE : SECOND_PLAYER_ROLE;
+    CLIENT *player = inv_get_source_role(inv) == to_move ? inv_get_source(inv) : inv_get_target(inv);
+    // a player that is logging out resigns anyway
+    int id = invitation_id(player, inv);
+    if (id != -1 && client_resign_game(player, id) == 0) {
+        debug("a player ran out of time; game resigned");
+        metrics_timeout(METRICS_TIMEOUT_MOVE);
     }
-    free(cli_ended_pkt);
+}
 
-    /* Remove the INVITATION */
-    if(client_remove_invitation(source, inv) == -1){
-        debug("FAILED to remove source's invitation from the invitation list");
-        return -1;
+unsigned client_expire_invitation(INVITATION *inv){
+    GAME *game = inv_get_game(inv);
+    unsigned timeout = game == NULL ? client_timeouts.invite : client_timeouts.move;
+    // a game ended by a move is left to be let go of
+    if (timeout == 0 || (game != NULL && game_is_over(game))) {
+        return 0;
     }
-    if(client_remove_invitation(target, inv) == -1){
-        debug("FAILED to remove target's invitation from the invitation list");
-        return -1;
+    uint64_t now = timer_ticks();
+    uint64_t deadline = inv_get_touched(inv) + timeout_ticks(timeout);
+    if (deadline > now) {
+        // it was accepted, or a move was made, since the timer was armed
+        return (deadline - now) * TIMER_TICK_MS;
+    }
+    if (game != NULL) {
+        expire_move(inv, game);
+        return 0;
+    }
+    CLIENT *source = inv_get_source(inv);
+    int id = invitation_id(source, inv);
+    // this fails if the invitation has been accepted or closed in the meantime
+    if (id != -1 && revoke_invitation(source, id, 1) == 0) {
+        debug("an invitation expired; revoked");
+        metrics_timeout(METRICS_TIMEOUT_INVITE);
     }
-
-    pthread_mutex_lock(&client->lock);
-    /* Update the ratings of both players */
-    player_post_result(client_get_player(source), client_get_player(target), client == source ? 2 : 1);
-
-    pthread_mutex_unlock(&client->lock);
     return 0;
 }
 
+// withdraw from an invitation on logout, by resigning its game or revoking or declining it
+static void abandon_invitation(CLIENT *client, INVITATION *inv, int id){
+    if (inv_get_game(inv) == NULL) {
+        int ret = inv_get_source(inv) == client ? client_revoke_invitation(client, id)
+                                                : client_decline_invitation(client, id);
+        // an open invitation can still be accepted until it is revoked or declined
+        if (ret == 0 || inv_get_game(inv) == NULL) {
+            return;
+        }
+    }
+    debug("Resigning game due to logout");
+    client_resign_game(client, id);
+}
+
 /*
  * Make a move in a game currently in progress, in which the specified
  * CLIENT is a participant.  The GAME in which the move is to be made is
@@ -978,132 +1405,334 @@ int client_resign_game(CLIENT *client, int id) {
  */
 
 int client_make_move(CLIENT *client, int id, char *move) {
-    pthread_mutex_lock(&client->lock);
     /* Find the INVITATION corresponding to the specified game ID */
-    INVITATION *inv;
-    // Find the invitation in the client's invitation list
-    INVITATION_NODE *inv_node = client->invitations_head;
-    while (inv_node != NULL && inv_node->id != id) {
-        inv_node = inv_node->next;
-    }
-    if (inv_node == NULL) {
+    INVITATION *inv = lookup_invitation(client, id);
+    if (inv == NULL) {
         debug("FAILED to find the invitation in the invitation list");
-        pthread_mutex_unlock(&client->lock);
         return -1;
     }
-    inv = inv_node->invitation;
     CLIENT *source = inv_get_source(inv);
     CLIENT *target = inv_get_target(inv);
     GAME *game = inv_get_game(inv);
     if (game == NULL) {
         debug("The game is not in progress");
-        pthread_mutex_unlock(&client->lock);
+        inv_unref(inv, "move not made");
         return -1;
     }
 
     GAME_ROLE client_role = client == source ? inv_get_source_role(inv) : inv_get_target_role(inv);
+    CLIENT *opponent = (client == source) ? target : source;
+    int opponent_id = invitation_id(opponent, inv);
     /* Parse the move string */
     GAME_MOVE * game_move;
     if ( (game_move = game_parse_move(game, client_role, move)) == NULL) {
         debug("The move could not be parsed");
-        pthread_mutex_unlock(&client->lock);
+        inv_unref(inv, "move not made");
         return -1;
     }
-    
-    /* Check if the move is legal in the current game state */
-    if (game_apply_move(game, game_move) == -1) {
-        free(game_move);
+
+    /* Check if the move is legal in the current game state; of the moves and resignations, one ends the game */
+    int game_over = game_apply_move_ending(game, game_move);
+    game_free_move(game_move);
+    if (game_over == -1) {
         debug("The move is not legal");
-        pthread_mutex_unlock(&client->lock);
+        inv_unref(inv, "move not made");
         return -1;
     }
-    free(game_move);
-
-
-    /* Notify the opponent of the CLIENT making the move */
-    CLIENT *opponent = (client == source) ? target : source;
-    INVITATION_NODE *opponent_node = opponent->invitations_head;
-
-    while (opponent_node != NULL && opponent_node ->invitation != inv) {
-        opponent_node  = opponent_node ->next;
+    // the opponent's clock starts, or the game is over and has no clock
+    if (game_over) {
+        inv_cancel_timer(inv);
     }
-    if (opponent_node == NULL) {
-        debug("FAILED to find the invitation in the invitation list");
-        pthread_mutex_unlock(&client->lock);
-        return -1;
+    else {
+        inv_touch(inv);
     }
-    int opponent_id = opponent_node->id;
 
      // *   MOVED     Sent when the opponent has made a move
      // *             Header: invitation ID
      // *             Payload: string showing game state after the move
-    char *state_str = game_unparse_state(game);
-    JEUX_PACKET_HEADER *moved_pkt = make_packet(JEUX_MOVED_PKT, strlen(state_str));
-    moved_pkt->id = opponent_id;
-
-    if (client_send_packet(opponent, moved_pkt, state_str)) {
-        free(moved_pkt);
-        free(state_str);
-        debug("failed to send the ended packet to the opponent");
-        pthread_mutex_unlock(&client->lock);
-        return -1;
-    }
-    free(moved_pkt);
-    free(state_str);
+    char state_str[GAME_STATE_MAX];
+    int state_len = unparse_state_for(opponent, game, state_str, sizeof(state_str));
+    JEUX_PACKET_HEADER moved_pkt;
+    init_packet(&moved_pkt, JEUX_MOVED_PKT, state_len);
+    moved_pkt.id = opponent_id;
 
+    /* If the move ends the game, the opponent's ENDED goes out in the same batch as MOVED */
+    GAME_ROLE winner = game_get_winner(game);
+    char analysis[ORACLE_ANALYSIS_MAX];
+    int analysis_len = 0;
+    JEUX_PACKET_HEADER opp_ended_pkt;
+    void *opp_ended_data = game_over ? init_ended_packet(&opp_ended_pkt, opponent, opponent_id, game,
+                                                         analysis, &analysis_len) : NULL;
+
+    JEUX_PACKET_HEADER *opp_pkts[] = { &moved_pkt, &opp_ended_pkt };
+    void *opp_data[] = { state_str, opp_ended_data };
+    if (opponent_id != -1 && client_send_packets(opponent, opp_pkts, opp_data, game_over ? 2 : 1)) {
+        debug("failed to send the moved packet to the opponent");
+    }
 
     /* If the move results in the game ending, notify both players and remove the INVITATION */
-    if (game_is_over(game)) {
+    if (game_over) {
         /* Notify both players */
          // *   ENDED     Sent when a game has ended
          // *             Header: invitation ID assigned by recipient
          // *                     GAME_ROLE (none, first, second) of winner
-        JEUX_PACKET_HEADER *opp_ended_pkt = make_packet(JEUX_ENDED_PKT, 0);
-        opp_ended_pkt->id = opponent_id;
-        GAME_ROLE winner = game_get_winner(game);
-        opp_ended_pkt->role = winner;
-
-        if (client_send_packet(opponent, opp_ended_pkt, NULL)) {
-            free(opp_ended_pkt);
+        JEUX_PACKET_HEADER cli_ended_pkt;
+        void *cli_ended_data = init_ended_packet(&cli_ended_pkt, client, id, game, analysis, &analysis_len);
+        if (client_send_packet(client, &cli_ended_pkt, cli_ended_data)) {
             debug("failed to send the ended packet to the opponent");
-            pthread_mutex_unlock(&client->lock);
-            return -1;
         }
-        free(opp_ended_pkt);
 
-        JEUX_PACKET_HEADER *cli_ended_pkt = make_packet(JEUX_ENDED_PKT, 0);
-        cli_ended_pkt->id = id;
-        cli_ended_pkt->role = winner;
+        PLAYER *mover = player_ref(client_get_player(client), "posting the result of a finished game");
+        PLAYER *other = player_ref(client_get_player(opponent), "posting the result of a finished game");
 
-        pthread_mutex_unlock(&client->lock);
+        /* Remove the INVITATION */
+        client_remove_invitation(source, inv);
+        client_remove_invitation(target, inv);
 
+        /* Update the ratings of both players */
+        // could be a win, a lose, or a draw; mover is player1
+        int result = winner == NULL_ROLE ? 0 : winner == client_role ? 1 : 2;
+        if(mover != NULL && other != NULL){
+            player_post_result(mover, other, result);
+        }
+        player_unref(mover, "result of a finished game posted");
+        player_unref(other, "result of a finished game posted");
+    }
+    notify_spectators(inv, game, 1, game_over);
+    inv_unref(inv, "move made");
+    return 0;
+}
 
-        if (client_send_packet(client, cli_ended_pkt, NULL)) {
-            free(cli_ended_pkt);
-            debug("failed to send the ended packet to the opponent");
-            return -1;
+// the invitation of a game in progress of a player, retained, or NULL if there is none
+static INVITATION *game_in_progress(CLIENT *player){
+    INVITATION *inv = NULL;
+    metrics_mutex_lock(&player->lock, METRICS_LOCK_CLIENT);
+    for (int w = 0; w < ID_WORDS && inv == NULL; w++) {
+        for (uint64_t used = ~player->free_ids[w] & ~player->watch_ids[w] & id_slice(w); used != 0; used &= used - 1) {
+            INVITATION *candidate = player->invitations[w * ID_WORD_BITS + __builtin_ctzll(used)];
+            if (inv_get_game(candidate) != NULL) {
+                inv = inv_ref(candidate, "game to be watched");
+                break;
+            }
         }
-        free(cli_ended_pkt);
+    }
+    pthread_mutex_unlock(&player->lock);
+    return inv;
+}
 
-        /* Remove the INVITATION */
-        if(client_remove_invitation(source, inv) == -1){
-            debug("FAILED to remove source's invitation from the invitation list");
-            return -1;
+// whether a client is watching the game of an invitation; called with the client's lock held
+static int is_watching(CLIENT *client, INVITATION *inv){
+    for (int w = 0; w < ID_WORDS; w++) {
+        for (uint64_t watched = client->watch_ids[w]; watched != 0; watched &= watched - 1) {
+            if (client->invitations[w * ID_WORD_BITS + __builtin_ctzll(watched)] == inv) {
+                return 1;
+            }
         }
-        if(client_remove_invitation(target, inv) == -1){
-            debug("FAILED to remove target's invitation from the invitation list");
-            return -1;
+    }
+    return 0;
+}
+
+/*
+ * A watcher is in two places: its table, which holds a reference to the
+ * INVITATION, and the spectators of the game, which hold a reference to
+ * the watcher.  Whoever takes it out of the spectators (client_stop_watching(),
+ * or spectators_ended() through client_end_watch()) also takes it out of
+ * its table, as does client_watch_game() if it never got in.
+ */
+int client_watch_game(CLIENT *watcher, CLIENT *player){
+    if (watcher == NULL || player == NULL || watcher == player) {
+        return -1;
+    }
+    INVITATION *inv = game_in_progress(player);
+    if (inv == NULL) {
+        debug("There is no game in progress to watch");
+        return -1;
+    }
+    if (inv_get_source(inv) == watcher || inv_get_target(inv) == watcher) {
+        debug("A player cannot watch its own game");
+        inv_unref(inv, "game not watched");
+        return -1;
+    }
+    metrics_mutex_lock(&watcher->lock, METRICS_LOCK_CLIENT);
+    int id = watcher->logged_in && !is_watching(watcher, inv) ? alloc_id(watcher) : -1;
+    if (id != -1) {
+        watcher->invitations[id] = inv_ref(inv, "add a game watched to the client's table");
+        watcher->watch_ids[id / ID_WORD_BITS] |= (uint64_t) 1 << (id % ID_WORD_BITS);
+    }
+    pthread_mutex_unlock(&watcher->lock);
+    if (id == -1) {
+        debug("No ID can be given to the game watched");
+        inv_unref(inv, "game not watched");
+        return -1;
+    }
+
+    SPECTATORS *s = inv_get_spectators(inv, 1);
+    if (s == NULL || spectators_add(s, watcher, id, inv_get_game(inv)) == -1) {
+        client_end_watch(watcher, id, inv);
+        inv_unref(inv, "game not watched");
+        return -1;
+    }
+    // a logout that began meanwhile may have looked for the watcher before it was added
+    if (!client_is_logged_in(watcher) && spectators_remove(s, watcher) == 0) {
+        client_end_watch(watcher, id, inv);
+    }
+    inv_unref(inv, "game watched");
+    return id;
+}
+
+int client_stop_watching(CLIENT *watcher, int id){
+    INVITATION *inv = lookup_id(watcher, id, 1);
+    SPECTATORS *s = inv_get_spectators(inv, 0);
+    if (s == NULL || spectators_remove(s, watcher) == -1) {
+        debug("No game watched with ID %d, or it has ended", id);
+        inv_unref(inv, "game not stopped being watched");
+        return -1;
+    }
+    client_end_watch(watcher, id, inv);
+    inv_unref(inv, "game stopped being watched");
+    return 0;
+}
+
+void client_end_watch(CLIENT *watcher, int id, INVITATION *inv){
+    metrics_mutex_lock(&watcher->lock, METRICS_LOCK_CLIENT);
+    if (!is_watch_id(watcher, id) || watcher->invitations[id] != inv) {
+        pthread_mutex_unlock(&watcher->lock);
+        return;
+    }
+    watcher->invitations[id] = NULL;
+    watcher->watch_ids[id / ID_WORD_BITS] &= ~((uint64_t) 1 << (id % ID_WORD_BITS));
+    free_id(watcher, id);
+    pthread_mutex_unlock(&watcher->lock);
+    inv_unref(inv, "removing a game watched from the client's table");
+}
+
+void client_set_session(CLIENT *client, struct jeux_session *session){
+    client->session = session;
+}
+
+struct jeux_session *client_get_session(CLIENT *client){
+    return client->session;
+}
+
+char *client_save_output(CLIENT *client, size_t *lenp, size_t *sentp){
+    pthread_mutex_lock(&client->send_lock);
+    return outq_save(&client->outq, lenp, sentp);
+}
+
+void client_release_output(CLIENT *client){
+    pthread_mutex_unlock(&client->send_lock);
+    client_flush(client);
+}
+
+int client_restore_output(CLIENT *client, const char *data, size_t len, size_t sent){
+    pthread_mutex_lock(&client->send_lock);
+    int ret = outq_adopt(&client->outq, data, len, sent);
+    pthread_mutex_unlock(&client->send_lock);
+    return ret;
+}
+
+int client_get_invitations(CLIENT *client, INVITATION **invs, int *ids, int *others, int *watched){
+    int count = 0;
+    metrics_mutex_lock(&client->lock, METRICS_LOCK_CLIENT);
+    for (int w = 0; w < ID_WORDS; w++) {
+        for (uint64_t used = ~client->free_ids[w] & id_slice(w); used != 0; used &= used - 1) {
+            int id = w * ID_WORD_BITS + __builtin_ctzll(used);
+            invs[count] = inv_ref(client->invitations[id], "handed over");
+            ids[count] = id;
+            watched[count++] = is_watch_id(client, id);
         }
-        pthread_mutex_lock(&client->lock);
+    }
+    pthread_mutex_unlock(&client->lock);
+    // the other IDs are read under the other clients' locks, not this one
+    for (int i = 0; i < count; i++) {
+        CLIENT *other = inv_get_source(invs[i]);
+        if (other == client && !watched[i]) {
+            other = inv_get_target(invs[i]);
+        }
+        others[i] = invitation_id(other, invs[i]);
+    }
+    return count;
+}
 
-        /* Update the ratings of both players */
-        // could be a win, a lose, or a draw
-        int result = winner == NULL_ROLE ? 0.5 : winner == FIRST_PLAYER_ROLE ? 1 : 2;
-        player_post_result(client == source ? client_get_player(source) : client_get_player(target),
-                           client == source ? client_get_player(target) : client_get_player(source),
-                           result);
+// give an invitation, or the game watched if watched is set, a chosen ID
+static int place_invitation(CLIENT *client, INVITATION *inv, int id, int watched){
+    if (id < 0 || id >= MAX_INVITATIONS) {
+        return -1;
     }
+    uint64_t bit = (uint64_t) 1 << (id % ID_WORD_BITS);
+    metrics_mutex_lock(&client->lock, METRICS_LOCK_CLIENT);
+    if (!client->logged_in || !(client->free_ids[id / ID_WORD_BITS] & bit)
+        || (!watched && inv_set_client_id(inv, client, id) == -1)) {
+        pthread_mutex_unlock(&client->lock);
+        return -1;
+    }
+    client->free_ids[id / ID_WORD_BITS] &= ~bit;
+    if (watched) {
+        client->watch_ids[id / ID_WORD_BITS] |= bit;
+    }
+    client->invitations[id] = inv_ref(inv, "restored to the client's table");
     pthread_mutex_unlock(&client->lock);
-    
+    return 0;
+}
+
+// make the moves of a game over again; none of them may end it
+static int replay_moves(GAME *game, const uint8_t *squares, int num_moves){
+    for (int i = 0; i < num_moves; i++) {
+        char move[4];
+        snprintf(move, sizeof(move), "%u", squares[i]);
+        GAME_MOVE *game_move = game_parse_move(game, i % 2 == 0 ? FIRST_PLAYER_ROLE : SECOND_PLAYER_ROLE, move);
+        int ended = game_move != NULL ? game_apply_move_ending(game, game_move) : -1;
+        game_free_move(game_move);
+        if (ended != 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+int client_restore_invitation(CLIENT *source, int source_id, CLIENT *target, int target_id,
+                              GAME_ROLE source_role, GAME_ROLE target_role,
+                              const GAME_VARIANT *variant, int accepted,
+                              const uint8_t *squares, int num_moves){
+    if (source == target) {
+        return -1;
+    }
+    INVITATION *inv = inv_create(source, target, source_role, target_role);
+    if (inv == NULL) {
+        return -1;
+    }
+    inv_set_variant(inv, variant);
+    if ((accepted && (inv_accept(inv) == -1 || replay_moves(inv_get_game(inv), squares, num_moves) == -1))
+        || place_invitation(source, inv, source_id, 0) == -1) {
+        inv_unref(inv, "invitation not restored");
+        return -1;
+    }
+    if (place_invitation(target, inv, target_id, 0) == -1) {
+        client_remove_invitation(source, inv);
+        inv_unref(inv, "invitation not restored");
+        return -1;
+    }
+    unsigned timeout = accepted ? client_timeouts.move : client_timeouts.invite;
+    if (timeout != 0) {
+        inv_arm_timer(inv, timeout);
+    }
+    inv_unref(inv, "invitation restored");
+    return 0;
+}
+
+int client_restore_watch(CLIENT *watcher, int id, CLIENT *player, int player_id){
+    INVITATION *inv = lookup_invitation(player, player_id);
+    GAME *game = inv_get_game(inv);
+    if (game == NULL || place_invitation(watcher, inv, id, 1) == -1) {
+        inv_unref(inv, "watch not restored");
+        return -1;
+    }
+    SPECTATORS *s = inv_get_spectators(inv, 1);
+    if (s == NULL || spectators_restore(s, watcher, id, game) == -1) {
+        client_end_watch(watcher, id, inv);
+        inv_unref(inv, "watch not restored");
+        return -1;
+    }
+    inv_unref(inv, "watch restored");
     return 0;
 }
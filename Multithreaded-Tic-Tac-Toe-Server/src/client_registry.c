@@ -15,74 +15,92 @@
 
 #include "debug.h"
 #include "client_registry.h"
+#include "client_registry_ext.h"
+#include "hash.h"
+#include "pool.h"
+#include "metrics.h"
+#include "cluster.h"
 #include "csapp.h"
 
 
-typedef struct client_node {
-    CLIENT *client;
-    struct client_node *prev;
-    struct client_node *next;
-} CLIENT_NODE;
+#define CREG_INITIAL_SLOTS 64            // fd slots allocated up front
+#define CREG_INITIAL_BUCKETS 64          // username buckets allocated up front
 
-// define the mutex
+typedef struct name_entry {
+    uint32_t hash;                       // hash_string() of name
+    const char *name;                    // username the client is logged in as
+    CLIENT *client;                      // the logged-in client
+    struct name_entry *next;             // next entry in the same bucket
+} NAME_ENTRY;
+
+static POOL name_entry_pool = POOL_INITIALIZER("name entry", sizeof(NAME_ENTRY));
+
+// define the registry
 typedef struct client_registry {
     int P_flag;                        // this flag is used for semaphores
-    CLIENT_NODE *head;                 // head of the doubly linked list
+    CLIENT **slots;                    // registered clients, indexed by fd
+    int num_slots;                     // size of slots
+    NAME_ENTRY **buckets;              // logged-in clients, hashed by username
+    int num_buckets;                   // size of buckets, a power of two
+    int num_names;                     // # of entries in buckets
     int client_count;                  // # of current clients
-    pthread_mutex_t mutex;             // mutex for incrementing the count
+    int max_clients;                   // registrations beyond this fail
+    pthread_rwlock_t lock;             // readers: lookups; writers: everything else
     sem_t semaphore;
 } CLIENT_REGISTRY;
 
-void insert_client(CLIENT_REGISTRY *cr, CLIENT *client) {
-    CLIENT_NODE *node = malloc(sizeof(CLIENT_NODE));
-    node->client = client;
-    node->prev = NULL;
-    node->next = cr->head;
-
-    if (cr->head != NULL) {
-        cr->head->prev = node;
+// make room in the slot array for a file descriptor; call with the write lock
+static int ensure_slot(CLIENT_REGISTRY *cr, int fd){
+    if(fd < cr->num_slots){
+        return 0;
     }
-
-    cr->head = node;
-    cr->client_count++;
-}
-
-void remove_client(CLIENT_REGISTRY *cr, CLIENT *client) {
-    CLIENT_NODE *node = cr->head;
-
-    while (node != NULL && node->client != client) {
-        node = node->next;
+    int num_slots = cr->num_slots;
+    while(num_slots <= fd){
+        num_slots *= 2;
     }
-
-    if (node == NULL) {
-        return;
+    CLIENT **slots = realloc(cr->slots, num_slots * sizeof(CLIENT *));
+    if(slots == NULL){
+        return -1;
     }
+    memset(slots + cr->num_slots, 0, (num_slots - cr->num_slots) * sizeof(CLIENT *));
+    cr->slots = slots;
+    cr->num_slots = num_slots;
+    return 0;
+}
 
-    if (node->prev != NULL) {
-        node->prev->next = node->next;
-    } else {
-        cr->head = node->next;
+// double the username table once it is fully loaded; call with the write lock
+static void grow_buckets(CLIENT_REGISTRY *cr){
+    int num_buckets = cr->num_buckets * 2;
+    NAME_ENTRY **buckets = calloc(num_buckets, sizeof(NAME_ENTRY *));
+    if(buckets == NULL){
+        return;         // keep the old table; chains just get longer
     }
-
-    if (node->next != NULL) {
-        node->next->prev = node->prev;
+    for(int i = 0; i < cr->num_buckets; i++){
+        NAME_ENTRY *entry = cr->buckets[i];
+        while(entry != NULL){
+            NAME_ENTRY *next = entry->next;
+            NAME_ENTRY **bucket = &buckets[entry->hash & (num_buckets - 1)];
+            entry->next = *bucket;
+            *bucket = entry;
+            entry = next;
+        }
     }
-
-    cr->client_count--;
-    free(node);
-    debug("removed clients");
+    free(cr->buckets);
+    cr->buckets = buckets;
+    cr->num_buckets = num_buckets;
 }
 
-void free_clients(CLIENT_NODE *node) {
-    CLIENT_NODE *next;
-
-    while (node != NULL) {
-        next = node->next;
-        free(node->client);
-        free(node);
-        node = next;
+// return the link that points to the entry for name, or to the NULL ending its chain
+static NAME_ENTRY **find_name(CLIENT_REGISTRY *cr, const char *name, uint32_t hash){
+    NAME_ENTRY **link = &cr->buckets[hash & (cr->num_buckets - 1)];
+    // bound names are the interned player names, so a pointer match is common
+    while(*link != NULL && (*link)->name != name
+          && ((*link)->hash != hash || strcmp((*link)->name, name) != 0)){
+        link = &(*link)->next;
     }
+    return link;
 }
+
 /*
  * Initialize a new client registry.
  *
@@ -90,17 +108,28 @@ void free_clients(CLIENT_NODE *node) {
  * fails.
  */
 CLIENT_REGISTRY *creg_init(){
-	CLIENT_REGISTRY *cr_ptr = malloc(sizeof(CLIENT_REGISTRY));
-	if(cr_ptr < 0){
+	CLIENT_REGISTRY *cr_ptr = calloc(1, sizeof(CLIENT_REGISTRY));
+	if(cr_ptr == NULL){
 		debug("malloc failed");
 		return NULL;
 	}
 	cr_ptr->client_count= 0;
+    cr_ptr->max_clients = MAX_CLIENTS;
     cr_ptr->P_flag = 0;
-    cr_ptr->head = NULL;
+    cr_ptr->num_slots = CREG_INITIAL_SLOTS;
+    cr_ptr->num_buckets = CREG_INITIAL_BUCKETS;
+    cr_ptr->slots = calloc(cr_ptr->num_slots, sizeof(CLIENT *));
+    cr_ptr->buckets = calloc(cr_ptr->num_buckets, sizeof(NAME_ENTRY *));
+    if(cr_ptr->slots == NULL || cr_ptr->buckets == NULL){
+        debug("malloc failed");
+        free(cr_ptr->slots);
+        free(cr_ptr->buckets);
+        free(cr_ptr);
+        return NULL;
+    }
 
-	if (pthread_mutex_init(&(cr_ptr->mutex), NULL) != 0) {
-        debug("create mutex lock counter failed");
+	if (pthread_rwlock_init(&(cr_ptr->lock), NULL) != 0) {
+        debug("create registry lock failed");
         return NULL;
     }
     if (sem_init(&cr_ptr->semaphore, 0, 0) < 0){
@@ -130,11 +159,29 @@ void creg_fini(CLIENT_REGISTRY *cr){
         debug("You should not finalize when there are registered clients");
         return;
     }
-    free_clients(cr->head);
-    pthread_mutex_destroy(&(cr->mutex));
+    for(int i = 0; i < cr->num_buckets; i++){
+        NAME_ENTRY *entry = cr->buckets[i];
+        while(entry != NULL){
+            NAME_ENTRY *next = entry->next;
+            pool_free(&name_entry_pool, entry);
+            entry = next;
+        }
+    }
+    free(cr->buckets);
+    free(cr->slots);
+    pthread_rwlock_destroy(&(cr->lock));
     sem_destroy(&(cr->semaphore));
     free(cr);
-    debug("destroying the mutex, semaphore, and freeing the client registry");
+    debug("destroying the lock, semaphore, and freeing the client registry");
+}
+
+void creg_set_max_clients(CLIENT_REGISTRY *cr, int max_clients){
+    if(cr == NULL || max_clients <= 0){
+        return;
+    }
+    metrics_wrlock(&cr->lock, METRICS_LOCK_CREG);
+    cr->max_clients = max_clients;
+    pthread_rwlock_unlock(&cr->lock);
 }
 
 /*
@@ -147,41 +194,31 @@ void creg_fini(CLIENT_REGISTRY *cr){
  * @return a reference to the newly registered CLIENT, if registration
  * is successful, otherwise NULL.
  */
-// 0 if already used, -1 if have not used
-int fd_already_used(CLIENT_REGISTRY *cr, int fd){
-    CLIENT_NODE *current = cr->head;
-    while(current != NULL){
-        if(client_get_fd(current->client) == fd){
-            return 0;
-        }
-        current = current->next;
-    }
-    return -1;
-}
-
 CLIENT *creg_register(CLIENT_REGISTRY *cr, int fd){
-    if(cr == NULL)
+    if(cr == NULL || fd < 0)
         return NULL;
-    pthread_mutex_lock(&(cr->mutex));
+    metrics_wrlock(&cr->lock, METRICS_LOCK_CREG);
     // if the client is already registered or you can't register any more clients
-    if(fd_already_used(cr, fd) == 0 || cr->client_count >= MAX_CLIENTS){
-        pthread_mutex_unlock(&(cr->mutex));
+    if(cr->client_count >= cr->max_clients || ensure_slot(cr, fd) == -1 || cr->slots[fd] != NULL){
+        pthread_rwlock_unlock(&(cr->lock));
         return NULL;
     }
 
     CLIENT *client_ptr = client_create(cr, fd);
     if(client_ptr == NULL){
-        pthread_mutex_unlock(&(cr->mutex));
+        pthread_rwlock_unlock(&(cr->lock));
         debug("create client failed");
         return NULL;
     }
-    insert_client(cr, client_ptr);
+    cr->slots[fd] = client_ptr;
+    cr->client_count++;
+    metrics_gauge_add(METRICS_CLIENTS, 1);
 
     debug("creg_register: client file descriptor %d (count number: %d), the default has a reference count of 1", 
         fd,
         cr->client_count);
 
-    pthread_mutex_unlock(&(cr->mutex));
+    pthread_rwlock_unlock(&(cr->lock));
     return client_ptr;
 }
 
@@ -204,24 +241,29 @@ int creg_unregister(CLIENT_REGISTRY *cr, CLIENT *client){
     if(cr == NULL || client == NULL){
         return -1;
     }
-    pthread_mutex_lock(&(cr->mutex));
+    metrics_wrlock(&cr->lock, METRICS_LOCK_CREG);
     int client_fd = client_get_fd(client);
 
     // if CLIENT is not currently registered when this function is called
-    if(fd_already_used(cr, client_fd) == -1){
+    if(client_fd < 0 || client_fd >= cr->num_slots || cr->slots[client_fd] != client){
+        pthread_rwlock_unlock(&(cr->lock));
         return -1;
     }
-    remove_client(cr, client);
+    cr->slots[client_fd] = NULL;
+    cr->client_count--;
+    metrics_gauge_add(METRICS_CLIENTS, -1);
 
     debug("unregister: client file descriptor %d (count number: %d)", client_fd, cr->client_count);
-    client_unref(client, "Client is being unregistered.");       // becareful. The client will be freed!
 
     if(cr->client_count == 0 && cr->P_flag == 1) {
 //        cr->P_flag = 0;
         debug("unregister: increment semaphore");
         V(&cr->semaphore);
     }
-    pthread_mutex_unlock(&(cr->mutex));
+    pthread_rwlock_unlock(&(cr->lock));
+    // the descriptor stays open until the last reference is gone, so its
+    // slot cannot be claimed by a new connection before this point
+    client_unref(client, "Client is being unregistered.");       // becareful. The client will be freed!
     return 0;
 }
 
@@ -236,28 +278,75 @@ int creg_unregister(CLIENT_REGISTRY *cr, CLIENT *client){
  * username, if there is one, otherwise NULL.
  */
 CLIENT *creg_lookup(CLIENT_REGISTRY *cr, char *user) {
+    CLIENT *client = creg_lookup_local(cr, user);
+    // in cluster mode, a user logged in at another node is found as its proxy
+    return client != NULL || cr == NULL || user == NULL ? client : cluster_lookup(user);
+}
+
+CLIENT *creg_lookup_local(CLIENT_REGISTRY *cr, const char *user) {
     if (cr == NULL || user == NULL) {
         return NULL;
     }
-    pthread_mutex_lock(&cr->mutex);
+    uint32_t hash = hash_string(user);
+    metrics_rdlock(&cr->lock, METRICS_LOCK_CREG);
     CLIENT *result = NULL;
 
-    CLIENT_NODE *node = cr->head;
-    while (node != NULL) {
-        if (node->client
-            && client_get_player(node->client)
-            && strcmp(player_get_name(client_get_player(node->client)), user) == 0) {
-            result = node->client;
-            client_ref(result, "for lookup"); // Increment reference count
-            break;
-        }
-        node = node->next;
+    NAME_ENTRY *entry = *find_name(cr, user, hash);
+    if (entry != NULL) {
+        result = entry->client;
+        client_ref(result, "for lookup"); // Increment reference count
     }
 
-    pthread_mutex_unlock(&cr->mutex);
+    pthread_rwlock_unlock(&cr->lock);
     return result;
 }
 
+int creg_bind_name(CLIENT_REGISTRY *cr, const char *name, CLIENT *client){
+    if(cr == NULL || name == NULL || client == NULL){
+        return -1;
+    }
+    uint32_t hash = hash_string(name);
+    metrics_wrlock(&cr->lock, METRICS_LOCK_CREG);
+    NAME_ENTRY **link = find_name(cr, name, hash);
+    if(*link != NULL){
+        int res = (*link)->client == client ? 0 : -1;
+        pthread_rwlock_unlock(&cr->lock);
+        return res;
+    }
+    NAME_ENTRY *entry = pool_alloc(&name_entry_pool);
+    if(entry == NULL){
+        pthread_rwlock_unlock(&cr->lock);
+        return -1;
+    }
+    entry->hash = hash;
+    entry->name = name;
+    entry->client = client;
+    entry->next = NULL;
+    *link = entry;
+    if(++cr->num_names > cr->num_buckets){
+        grow_buckets(cr);
+    }
+    pthread_rwlock_unlock(&cr->lock);
+    debug("bound name %s to client fd %d", name, client_get_fd(client));
+    return 0;
+}
+
+void creg_unbind_name(CLIENT_REGISTRY *cr, const char *name, CLIENT *client){
+    if(cr == NULL || name == NULL){
+        return;
+    }
+    uint32_t hash = hash_string(name);
+    metrics_wrlock(&cr->lock, METRICS_LOCK_CREG);
+    NAME_ENTRY **link = find_name(cr, name, hash);
+    NAME_ENTRY *entry = *link;
+    if(entry != NULL && entry->client == client){
+        *link = entry->next;
+        cr->num_names--;
+        pool_free(&name_entry_pool, entry);
+    }
+    pthread_rwlock_unlock(&cr->lock);
+}
+
 /*
  * Return a list of all currently logged in players.  The result is
  * returned as a malloc'ed array of PLAYER pointers, with a NULL
@@ -278,33 +367,53 @@ PLAYER **creg_all_players(CLIENT_REGISTRY *cr){
     if(cr == NULL){
         return NULL;
     }
-    pthread_mutex_lock(&cr->mutex);
+    metrics_rdlock(&cr->lock, METRICS_LOCK_CREG);
 
     // Allocate space for the maximum possible number of players, the # of player = # of clients
-    PLAYER **player_list = malloc(sizeof(PLAYER*) * (MAX_CLIENTS + 1)); // add 1 for the null ptr in the end
+    PLAYER **player_list = malloc(sizeof(PLAYER*) * (cr->client_count + 1)); // add 1 for the null ptr in the end
     if (player_list == NULL) {
-        pthread_mutex_unlock(&cr->mutex);
+        pthread_rwlock_unlock(&cr->lock);
         debug("Malloc for player list failed");
         return NULL;
     }
 
     // Copy the player pointers into the array
-    CLIENT_NODE *node = cr->head;
     int i = 0;
-    while (node != NULL && i < MAX_CLIENTS) {
-        if (node->client && client_get_player(node->client)) {
-            player_list[i] = client_get_player(node->client);
+    for (int fd = 0; fd < cr->num_slots && i < cr->client_count; fd++) {
+        CLIENT *client = cr->slots[fd];
+        if (client && client_get_player(client)) {
+            player_list[i] = client_get_player(client);
             player_ref(player_list[i], "Player added to the player list");
             i++;
         }
-        node = node->next;
     }
     // Null-terminate the array
     player_list[i] = NULL;
-    pthread_mutex_unlock(&cr->mutex);
+    pthread_rwlock_unlock(&cr->lock);
     return player_list;
 }
 
+CLIENT **creg_all_clients(CLIENT_REGISTRY *cr){
+    if(cr == NULL){
+        return NULL;
+    }
+    metrics_rdlock(&cr->lock, METRICS_LOCK_CREG);
+    CLIENT **clients = malloc(sizeof(CLIENT *) * (cr->client_count + 1));
+    if(clients == NULL){
+        pthread_rwlock_unlock(&cr->lock);
+        return NULL;
+    }
+    int i = 0;
+    for(int fd = 0; fd < cr->num_slots && i < cr->client_count; fd++){
+        if(cr->slots[fd] != NULL){
+            clients[i++] = client_ref(cr->slots[fd], "in the list of all clients");
+        }
+    }
+    clients[i] = NULL;
+    pthread_rwlock_unlock(&cr->lock);
+    return clients;
+}
+
 /*
  * A thread calling this function will block in the call until
  * the number of registered clients has reached zero, at which
@@ -340,14 +449,14 @@ void creg_shutdown_all(CLIENT_REGISTRY *cr){
     if(cr == NULL){
         return;
     }
-    // logic: loops through all the fd and shutdown registered clients
-    CLIENT_NODE *current = cr->head;
-    while(current != NULL){
-        shutdown(client_get_fd(current->client), SHUT_RD);
-        CLIENT_NODE *temp = current;
-        current = current->next;
-        client_logout(temp->client);
-        creg_unregister(cr, temp->client);
+    // logic: loops through all the fd and shutdown registered clients.
+    // The threads (or reactors) servicing them see EOF and unregister them.
+    metrics_rdlock(&cr->lock, METRICS_LOCK_CREG);
+    for(int fd = 0; fd < cr->num_slots; fd++){
+        if(cr->slots[fd] != NULL){
+            shutdown(fd, SHUT_RD);
+        }
     }
     debug("creg shutdown all, count number is %d", cr->client_count);
+    pthread_rwlock_unlock(&cr->lock);
 }
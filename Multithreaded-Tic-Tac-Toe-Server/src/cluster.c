@@ -0,0 +1,1060 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <poll.h>
+#include <time.h>
+#include <stdatomic.h>
+#include <sys/socket.h>
+
+#include "debug.h"
+#include "cluster.h"
+#include "client_ext.h"
+#include "client_registry_ext.h"
+#include "player_registry.h"
+#include "player_ext.h"
+#include "protocol_ext.h"
+#include "proto_decoder.h"
+#include "users_cache.h"
+#include "ratings.h"
+#include "jeux_globals.h"
+#include "hash.h"
+#include "csapp.h"
+#include "spawn.h"
+
+/*
+ * Locking.  The lock of the remote users is taken with none of the
+ * CLIENT, registry, INVITATION or GAME locks held, and nothing is taken
+ * under it; proxies are logged out after letting go of it.  The publish
+ * lock is taken with none of them held either, and the client registry's
+ * lock and then a link's send lock under it.  A link's send lock and the
+ * waiters' lock are leaves.  Nothing that waits on another node is done
+ * on a link's reader thread, which only ever writes to local clients,
+ * whose sends never block, so two nodes cannot end up each waiting for
+ * the other to read: whatever may send on a link is left to the worker
+ * of the link it came on.
+ */
+
+/* The messages between nodes, framed as packets. */
+typedef enum {
+    LINK_HELLO = 1,         // id: the index of the node that dialed
+    LINK_PRESENCE,          // PRESENCE_MSG
+    LINK_FORWARD,           // FORWARD_MSG
+    LINK_DELIVER,           // DELIVER_MSG
+    LINK_DONE,              // DONE_MSG; role: 1 if the request was run, 0 if it is to be refused
+    LINK_RESULT,            // RESULT_MSG
+    LINK_DOWN               // never sent: the link went down, for the worker
+} LINK_TYPE;
+
+// a local user logged in or out, or rated; the username follows
+typedef struct presence_msg {
+    uint32_t epoch;
+    double rating;
+    uint8_t online;
+    uint8_t options;
+} PRESENCE_MSG;
+
+// a request for a proxy; the NUL-terminated username and the payload follow
+typedef struct forward_msg {
+    uint32_t seq;
+    uint32_t epoch;
+    JEUX_PACKET_HEADER hdr;         // in host byte order
+} FORWARD_MSG;
+
+// a packet for a local user; the NUL-terminated username and the payload follow
+typedef struct deliver_msg {
+    uint32_t epoch;
+    JEUX_PACKET_HEADER hdr;         // in network byte order
+} DELIVER_MSG;
+
+typedef struct done_msg {
+    uint32_t seq;
+} DONE_MSG;
+
+// a game between a user of the receiver and one of the sender; both names follow, NUL-terminated
+typedef struct result_msg {
+    double rating;                  // of the sender's user
+    uint8_t result;                 // 0 if draw, 1 if the receiver's user won, 2 if it lost
+} RESULT_MSG;
+
+#define LINK_MSG_MAX UINT16_MAX     // a payload size must fit in a header
+#define SMALL_MSG 512               // messages built on the stack, if they fit
+
+// a message waiting for the worker of its link
+typedef struct queued_msg {
+    JEUX_PACKET_HEADER hdr;         // in host byte order
+    struct queued_msg *next;
+    char payload[];
+} QUEUED_MSG;
+
+typedef struct node {
+    char *host;
+    char *port;                     // where clients are served
+    char *link_port;                // where the other nodes dial
+    int out_fd;                     // the connection dialed to the node, or -1
+    pthread_mutex_t send_lock;      // protects out_fd; held while writing to it
+    int in_fd;                      // the connection the node dialed to us, or -1
+    pthread_mutex_t queue_lock;     // protects in_fd and the queue
+    pthread_cond_t queued;
+    QUEUED_MSG *head, *tail;        // for the worker
+} NODE;
+
+// a user logged in at another node, now or before; entries stay for good, like their shadows
+typedef struct remote_user {
+    PLAYER *shadow;                 // owns the name
+    uint32_t hash;
+    int node;
+    int online;
+    uint32_t epoch;                 // of the user's current login
+    int options;                    // JEUX_LOGIN_* of that login
+    CLIENT *proxy;                  // made on first lookup, or NULL
+    struct remote_user *next;       // in the same bucket
+} REMOTE_USER;
+
+#define USERS_INITIAL_BUCKETS 256
+
+// a thread waiting for a forwarded request to be done, or a request it gave up waiting for
+typedef struct waiter {
+    uint32_t seq;
+    int node;                       // that the request went to
+    int done;                       // -1 until DONE comes, then its role
+    pthread_cond_t cond;
+    CLIENT *client;                 // NULL while waited for; else to be refused if DONE says so
+    struct waiter *next;
+} WAITER;
+
+typedef struct ring_point {
+    uint32_t hash;
+    int node;
+} RING_POINT;
+
+static NODE nodes[CLUSTER_MAX_NODES];
+static int num_nodes;               // 0 if not in cluster mode
+static int self;
+static RING_POINT ring[CLUSTER_MAX_NODES * CLUSTER_VNODES];
+static int ring_size;
+
+static REMOTE_USER **buckets;
+static int num_buckets, num_users;
+static pthread_mutex_t users_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static pthread_mutex_t publish_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static WAITER *waiters;
+static pthread_mutex_t waiters_lock = PTHREAD_MUTEX_INITIALIZER;
+static atomic_uint next_seq;
+
+// the hash of the ring: FNV-1a, whose similar inputs give similar outputs, then mixed
+static uint32_t ring_hash(const char *s){
+    uint32_t h = hash_string(s);
+    h ^= h >> 16;
+    h *= 0x85ebca6bu;
+    h ^= h >> 13;
+    h *= 0xc2b2ae35u;
+    h ^= h >> 16;
+    return h;
+}
+
+static int compare_points(const void *a, const void *b){
+    const RING_POINT *p = a, *q = b;
+    if(p->hash != q->hash)
+        return p->hash < q->hash ? -1 : 1;
+    return p->node - q->node;
+}
+
+int cluster_configure(const char *list, int self_index){
+    char *copy = strdup(list), *save, *entry;
+    if(copy == NULL)
+        return -1;
+    int n = 0;
+    for(entry = strtok_r(copy, ",", &save); entry != NULL; entry = strtok_r(NULL, ",", &save)){
+        char *port = strchr(entry, ':');
+        char *link_port = port != NULL ? strchr(port + 1, ':') : NULL;
+        if(n == CLUSTER_MAX_NODES || link_port == NULL || port == entry
+           || link_port == port + 1 || link_port[1] == '\0' || strchr(link_port + 1, ':') != NULL){
+            free(copy);
+            return -1;
+        }
+        *port++ = '\0';
+        *link_port++ = '\0';
+        nodes[n].host = entry;
+        nodes[n].port = port;
+        nodes[n].link_port = link_port;
+        n++;
+    }
+    if(self_index < 0 || self_index >= n){
+        free(copy);
+        return -1;
+    }
+    // the strings stay in copy for good
+    ring_size = 0;
+    for(int i = 0; i < n; i++){
+        char point[128];
+        for(int v = 0; v < CLUSTER_VNODES; v++){
+            snprintf(point, sizeof(point), "%s:%s#%d", nodes[i].host, nodes[i].port, v);
+            ring[ring_size].hash = ring_hash(point);
+            ring[ring_size].node = i;
+            ring_size++;
+        }
+        nodes[i].out_fd = -1;
+        nodes[i].in_fd = -1;
+        nodes[i].head = nodes[i].tail = NULL;
+        pthread_mutex_init(&nodes[i].send_lock, NULL);
+        pthread_mutex_init(&nodes[i].queue_lock, NULL);
+        pthread_cond_init(&nodes[i].queued, NULL);
+    }
+    qsort(ring, ring_size, sizeof(RING_POINT), compare_points);
+    num_nodes = n;
+    self = self_index;
+    return 0;
+}
+
+int cluster_enabled(void){
+    return num_nodes > 0;
+}
+
+int cluster_owner(const char *name){
+    if(num_nodes == 0)
+        return 0;
+    // the first point at or after the hash, wrapping around
+    uint32_t h = ring_hash(name);
+    int lo = 0, hi = ring_size;
+    while(lo < hi){
+        int mid = (lo + hi) / 2;
+        if(ring[mid].hash < h)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return ring[lo == ring_size ? 0 : lo].node;
+}
+
+void cluster_id_range(int *lo, int *hi){
+    if(num_nodes == 0){
+        *lo = 0;
+        *hi = CLUSTER_IDS;
+        return;
+    }
+    int slice = CLUSTER_IDS / num_nodes;
+    *lo = self * slice;
+    *hi = *lo + slice;
+}
+
+int cluster_id_node(int id){
+    if(num_nodes == 0)
+        return 0;
+    int node = id / (CLUSTER_IDS / num_nodes);
+    return id >= 0 && node < num_nodes ? node : -1;
+}
+
+static int is_local(PLAYER *player){
+    return cluster_owner(player_get_name(player)) == self;
+}
+
+/*
+ * Sending on a link.  A message is written with a blocking writev under
+ * the link's send lock, so that messages from different threads are not
+ * interleaved; the other node's reader never blocks, so neither does the
+ * write for longer than the network takes.  If the write fails, the
+ * connection is dropped and the dialer makes a new one.
+ */
+static void drop_out_link(NODE *node){
+    if(node->out_fd != -1){
+        debug("cluster: link to %s:%s is down", node->host, node->link_port);
+        close(node->out_fd);
+        node->out_fd = -1;
+    }
+}
+
+// send a message with the send lock held
+static int send_locked(NODE *node, int type, int id, int role, void *payload, size_t len){
+    if(node->out_fd == -1 || len > LINK_MSG_MAX)
+        return -1;
+    JEUX_PACKET_HEADER hdr;
+    memset(&hdr, 0, sizeof(hdr));
+    hdr.type = type;
+    hdr.id = id;
+    hdr.role = role;
+    hdr.size = htons(len);
+    if(proto_send_packet(node->out_fd, &hdr, len > 0 ? payload : NULL) == -1){
+        drop_out_link(node);
+        return -1;
+    }
+    return 0;
+}
+
+static int link_send(int n, int type, int role, void *payload, size_t len){
+    NODE *node = &nodes[n];
+    pthread_mutex_lock(&node->send_lock);
+    int ret = send_locked(node, type, self, role, payload, len);
+    pthread_mutex_unlock(&node->send_lock);
+    return ret;
+}
+
+// storage for a message of len bytes: small if it fits, otherwise malloc'ed
+static char *msg_buffer(size_t len, char *small){
+    return len <= SMALL_MSG ? small : malloc(len);
+}
+
+static void free_msg_buffer(char *buf, char *small){
+    if(buf != small)
+        free(buf);
+}
+
+/*
+ * Presence.
+ */
+
+// the state of a local player, as the other nodes are to know it; call with the publish lock
+static size_t presence_of(PLAYER *player, char *buf, size_t size){
+    char *name = player_get_name(player);
+    size_t len = sizeof(PRESENCE_MSG) + strlen(name);
+    if(len > size)
+        return 0;
+    PRESENCE_MSG msg = { .rating = player_get_exact_rating(player) };
+    CLIENT *client = creg_lookup_local(client_registry, name);
+    if(client != NULL && client_is_logged_in(client)){
+        msg.online = 1;
+        msg.epoch = client_get_epoch(client);
+        msg.options = client_get_options(client);
+    }
+    client_unref(client, "presence published");
+    memcpy(buf, &msg, sizeof(msg));
+    memcpy(buf + sizeof(msg), name, len - sizeof(msg));
+    return len;
+}
+
+void cluster_publish(PLAYER *player){
+    if(num_nodes == 0 || !is_local(player))
+        return;
+    char buf[SMALL_MSG];
+    // read and sent under the lock, so the last state sent is the state now
+    pthread_mutex_lock(&publish_lock);
+    size_t len = presence_of(player, buf, sizeof(buf));
+    for(int i = 0; i < num_nodes && len > 0; i++){
+        if(i != self)
+            link_send(i, LINK_PRESENCE, 0, buf, len);
+    }
+    pthread_mutex_unlock(&publish_lock);
+}
+
+// tell a node that has just been dialed who is logged in here
+static void publish_all(int n){
+    PLAYER **players = creg_all_players(client_registry);
+    if(players == NULL)
+        return;
+    char buf[SMALL_MSG];
+    pthread_mutex_lock(&publish_lock);
+    for(PLAYER **p = players; *p != NULL; p++){
+        size_t len = presence_of(*p, buf, sizeof(buf));
+        if(len > 0 && link_send(n, LINK_PRESENCE, 0, buf, len) == -1)
+            break;
+    }
+    pthread_mutex_unlock(&publish_lock);
+    for(PLAYER **p = players; *p != NULL; p++)
+        player_unref(*p, "presence published");
+    free(players);
+}
+
+// the entry for a remote user, made if need be; call with the users lock
+static REMOTE_USER *find_user(const char *name, int create){
+    uint32_t hash = hash_string(name);
+    REMOTE_USER **link = buckets != NULL ? &buckets[hash & (num_buckets - 1)] : NULL;
+    for(REMOTE_USER *u = link != NULL ? *link : NULL; u != NULL; u = u->next){
+        if(u->hash == hash && strcmp(player_get_name(u->shadow), name) == 0)
+            return u;
+    }
+    if(!create)
+        return NULL;
+    if(buckets == NULL || num_users >= num_buckets){
+        int n = buckets == NULL ? USERS_INITIAL_BUCKETS : 2 * num_buckets;
+        REMOTE_USER **grown = calloc(n, sizeof(REMOTE_USER *));
+        if(grown == NULL && buckets == NULL)
+            return NULL;
+        if(grown != NULL){
+            for(int i = 0; i < num_buckets; i++){
+                while(buckets[i] != NULL){
+                    REMOTE_USER *u = buckets[i];
+                    buckets[i] = u->next;
+                    u->next = grown[u->hash & (n - 1)];
+                    grown[u->hash & (n - 1)] = u;
+                }
+            }
+            free(buckets);
+            buckets = grown;
+            num_buckets = n;
+        }
+        link = &buckets[hash & (num_buckets - 1)];
+    }
+    REMOTE_USER *u = calloc(1, sizeof(REMOTE_USER));
+    if(u == NULL || (u->shadow = player_create((char *) name)) == NULL){
+        free(u);
+        return NULL;
+    }
+    u->hash = hash;
+    u->node = cluster_owner(name);
+    u->next = *link;
+    *link = u;
+    num_users++;
+    return u;
+}
+
+// log out a proxy that was taken out of its entry, once no lock is held
+static void retire_proxy(CLIENT *proxy){
+    if(proxy == NULL)
+        return;
+    client_logout(proxy);
+    client_unref(proxy, "proxy retired");
+}
+
+static void apply_presence(int n, JEUX_PACKET_HEADER *hdr, char *payload){
+    if(hdr->size <= sizeof(PRESENCE_MSG))
+        return;
+    PRESENCE_MSG msg;
+    memcpy(&msg, payload, sizeof(msg));
+    size_t name_len = hdr->size - sizeof(msg);
+    char name[name_len + 1];
+    memcpy(name, payload + sizeof(msg), name_len);
+    name[name_len] = '\0';
+
+    CLIENT *retired = NULL;
+    pthread_mutex_lock(&users_lock);
+    REMOTE_USER *u = find_user(name, 1);
+    if(u == NULL || u->node != n){
+        pthread_mutex_unlock(&users_lock);
+        debug("cluster: presence of %s from node %d ignored", name, n);
+        return;
+    }
+    // a new login, or a logout, ends the proxy of the last one
+    if(!msg.online || msg.epoch != u->epoch){
+        retired = u->proxy;
+        u->proxy = NULL;
+    }
+    u->online = msg.online;
+    if(msg.online){
+        u->epoch = msg.epoch;
+        u->options = msg.options;
+    }
+    player_set_rating(u->shadow, msg.rating);
+    PLAYER *shadow = u->shadow;
+    pthread_mutex_unlock(&users_lock);
+    retire_proxy(retired);
+    users_cache_note(shadow);
+}
+
+// the users of a node whose link went down are logged out
+static void node_down(int n){
+    CLIENT **retired = NULL;
+    PLAYER **changed = NULL;
+    int count = 0;
+    pthread_mutex_lock(&users_lock);
+    if(num_users > 0){
+        retired = calloc(num_users, sizeof(CLIENT *));
+        changed = calloc(num_users, sizeof(PLAYER *));
+    }
+    for(int i = 0; i < num_buckets && retired != NULL && changed != NULL; i++){
+        for(REMOTE_USER *u = buckets[i]; u != NULL; u = u->next){
+            if(u->node != n || !u->online)
+                continue;
+            u->online = 0;
+            retired[count] = u->proxy;
+            changed[count++] = u->shadow;
+            u->proxy = NULL;
+        }
+    }
+    pthread_mutex_unlock(&users_lock);
+    debug("cluster: node %d is down; %d of its users logged out", n, count);
+    for(int i = 0; i < count; i++){
+        retire_proxy(retired[i]);
+        users_cache_note(changed[i]);
+    }
+    free(retired);
+    free(changed);
+}
+
+CLIENT *cluster_lookup(const char *name){
+    if(num_nodes == 0 || cluster_owner(name) == self)
+        return NULL;
+    CLIENT *proxy = NULL;
+    pthread_mutex_lock(&users_lock);
+    REMOTE_USER *u = find_user(name, 0);
+    if(u != NULL && u->online){
+        if(u->proxy == NULL)
+            u->proxy = client_create_remote(u->node, u->shadow, u->epoch, u->options);
+        proxy = client_ref(u->proxy, "remote user looked up");
+    }
+    pthread_mutex_unlock(&users_lock);
+    return proxy;
+}
+
+int cluster_is_shadow(PLAYER *player){
+    return num_nodes != 0 && !is_local(player);
+}
+
+int cluster_is_remote(const char *name){
+    if(num_nodes == 0)
+        return 0;
+    pthread_mutex_lock(&users_lock);
+    REMOTE_USER *u = find_user(name, 0);
+    int online = u != NULL && u->online;
+    pthread_mutex_unlock(&users_lock);
+    return online;
+}
+
+PLAYER **cluster_all_players(void){
+    if(num_nodes == 0)
+        return NULL;
+    pthread_mutex_lock(&users_lock);
+    PLAYER **players = malloc((num_users + 1) * sizeof(PLAYER *));
+    int n = 0;
+    for(int i = 0; i < num_buckets && players != NULL; i++){
+        for(REMOTE_USER *u = buckets[i]; u != NULL; u = u->next){
+            if(u->online)
+                players[n++] = player_ref(u->shadow, "remote player listed");
+        }
+    }
+    pthread_mutex_unlock(&users_lock);
+    if(players != NULL)
+        players[n] = NULL;
+    return players;
+}
+
+/*
+ * Requests forwarded to the node that holds their invitation.
+ */
+
+static void wake_waiter(uint32_t seq, int role){
+    WAITER *late = NULL;
+    pthread_mutex_lock(&waiters_lock);
+    for(WAITER **link = &waiters; *link != NULL; link = &(*link)->next){
+        WAITER *w = *link;
+        if(w->seq != seq)
+            continue;
+        if(w->client != NULL){
+            *link = w->next;
+            late = w;
+        }
+        else{
+            w->done = role;
+            pthread_cond_signal(&w->cond);
+        }
+        break;
+    }
+    pthread_mutex_unlock(&waiters_lock);
+    // the refusal that its thread could not wait for
+    if(late != NULL){
+        if(role == 0)
+            client_send_nack(late->client);
+        client_unref(late->client, "forwarded request done late");
+        free(late);
+    }
+}
+
+// the requests given up on at a node whose link went down will not be done, or said to be
+static void drop_late_waiters(int n){
+    WAITER *dropped = NULL;
+    pthread_mutex_lock(&waiters_lock);
+    for(WAITER **link = &waiters; *link != NULL; ){
+        WAITER *w = *link;
+        if(w->client != NULL && w->node == n){
+            *link = w->next;
+            w->next = dropped;
+            dropped = w;
+        }
+        else{
+            link = &w->next;
+        }
+    }
+    pthread_mutex_unlock(&waiters_lock);
+    while(dropped != NULL){
+        WAITER *w = dropped;
+        dropped = w->next;
+        client_unref(w->client, "forwarded request dropped");
+        free(w);
+    }
+}
+
+/*
+ * Send a request to the node of its ID and wait for it: 1 if it was run
+ * there, 0 if it was not, and -1 if it may still be, after the wait timed
+ * out.  The request is then left in the waiters, so that it is refused
+ * when the other node says it was not run.
+ */
+static int forward(JEUX_SESSION *session, int n, JEUX_PACKET_HEADER *hdr, void *payload){
+    char *name = player_get_name(client_get_player(session->client));
+    size_t name_len = strlen(name) + 1;
+    size_t len = sizeof(FORWARD_MSG) + name_len + hdr->size;
+    char small[SMALL_MSG];
+    char *buf = msg_buffer(len, small);
+    if(buf == NULL)
+        return 0;
+    FORWARD_MSG msg = {
+        .seq = atomic_fetch_add(&next_seq, 1),
+        .epoch = client_get_epoch(session->client),
+        .hdr = *hdr,
+    };
+    memcpy(buf, &msg, sizeof(msg));
+    memcpy(buf + sizeof(msg), name, name_len);
+    if(hdr->size > 0)
+        memcpy(buf + sizeof(msg) + name_len, payload, hdr->size);
+
+    WAITER w = { .seq = msg.seq, .node = n, .done = -1 };
+    pthread_cond_init(&w.cond, NULL);
+    pthread_mutex_lock(&waiters_lock);
+    w.next = waiters;
+    waiters = &w;
+    pthread_mutex_unlock(&waiters_lock);
+
+    int sent = link_send(n, LINK_FORWARD, 0, buf, len) == 0;
+    free_msg_buffer(buf, small);
+    struct timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += CLUSTER_FORWARD_TIMEOUT_MS / 1000;
+    deadline.tv_nsec += (CLUSTER_FORWARD_TIMEOUT_MS % 1000) * 1000000L;
+    if(deadline.tv_nsec >= 1000000000L){
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000L;
+    }
+    pthread_mutex_lock(&waiters_lock);
+    int timed_out = 0;
+    while(sent && w.done == -1 && !timed_out){
+        timed_out = pthread_cond_timedwait(&w.cond, &waiters_lock, &deadline) == ETIMEDOUT;
+    }
+    WAITER *late = timed_out && w.done == -1 ? malloc(sizeof(WAITER)) : NULL;
+    if(late != NULL){
+        *late = w;
+        late->client = client_ref(session->client, "forwarded request given up on");
+    }
+    WAITER **link = &waiters;
+    while(*link != &w)
+        link = &(*link)->next;
+    *link = late != NULL ? late : w.next;
+    pthread_mutex_unlock(&waiters_lock);
+    pthread_cond_destroy(&w.cond);
+    if(timed_out && w.done == -1){
+        debug("cluster: request %u to node %d timed out", w.seq, n);
+        return -1;
+    }
+    return w.done == 1;
+}
+
+// run a request forwarded by the node of its user, on the user's proxy
+static void run_forwarded(int n, JEUX_PACKET_HEADER *link_hdr, char *payload){
+    FORWARD_MSG msg;
+    char *name = payload + sizeof(msg);
+    char *end = payload + link_hdr->size;
+    char *nul = link_hdr->size > sizeof(msg) ? memchr(name, '\0', end - name) : NULL;
+    if(nul == NULL)
+        return;
+    memcpy(&msg, payload, sizeof(msg));
+    char *data = nul + 1;
+    int done = 0;
+    if(msg.hdr.size == end - data && cluster_owner(name) == n){
+        CLIENT *proxy = cluster_lookup(name);
+        // a request from an earlier login is not run for the current one
+        if(proxy != NULL && client_get_epoch(proxy) == msg.epoch){
+            JEUX_SESSION session = { .client = proxy, .fd = -1, .logged_in = 1 };
+            jeux_session_dispatch(&session, &msg.hdr, msg.hdr.size > 0 ? data : NULL);
+            done = 1;
+        }
+        client_unref(proxy, "forwarded request run");
+    }
+    // after the replies, on the same link, so they are queued before the waiter wakes
+    link_send(n, LINK_DONE, done, &msg.seq, sizeof(DONE_MSG));
+}
+
+int cluster_route(JEUX_SESSION *session, JEUX_PACKET_HEADER *hdr, void *payload){
+    if(num_nodes == 0)
+        return 0;
+    if(hdr->type == JEUX_LOGIN_PKT){
+        if(session->logged_in || hdr->size == 0)
+            return 0;
+        char name[hdr->size + 1];
+        memcpy(name, payload, hdr->size);
+        name[hdr->size] = '\0';
+        int owner = cluster_owner(name);
+        if(owner == self)
+            return 0;
+        // the user is told where to log in
+        char where[256];
+        int len = snprintf(where, sizeof(where), "%s:%s", nodes[owner].host, nodes[owner].port);
+        JEUX_PACKET_HEADER nack;
+        memset(&nack, 0, sizeof(nack));
+        nack.type = JEUX_NACK_PKT;
+        nack.size = htons(len);
+        client_send_packet(session->client, &nack, where);
+        return 1;
+    }
+    int carries_id;
+    switch(hdr->type){
+    case JEUX_REVOKE_PKT:
+    case JEUX_ACCEPT_PKT:
+    case JEUX_DECLINE_PKT:
+    case JEUX_MOVE_PKT:
+    case JEUX_RESIGN_PKT:
+    case JEUX_ANALYZE_PKT:
+        carries_id = 1;
+        break;
+    case JEUX_WATCH_PKT:
+        carries_id = hdr->role == WATCH_STOP;
+        break;
+    default:
+        carries_id = 0;
+        break;
+    }
+    int n = carries_id ? cluster_id_node(hdr->id) : self;
+    if(n == self || n == -1)
+        return 0;
+    if(forward(session, n, hdr, payload) == 0)
+        client_send_nack(session->client);
+    return 1;
+}
+
+/*
+ * Packets for local users, from proxies elsewhere.
+ */
+
+int cluster_deliver(int n, uint32_t epoch, const char *name,
+                    JEUX_PACKET_HEADER **hdrs, void **data, int count){
+    size_t name_len = strlen(name) + 1;
+    NODE *node = &nodes[n];
+    int ret = 0;
+    pthread_mutex_lock(&node->send_lock);
+    for(int i = 0; i < count && ret == 0; i++){
+        size_t size = ntohs(hdrs[i]->size);
+        size_t len = sizeof(DELIVER_MSG) + name_len + size;
+        char small[SMALL_MSG];
+        char *buf = msg_buffer(len, small);
+        if(buf == NULL){
+            ret = -1;
+            break;
+        }
+        DELIVER_MSG msg = { .epoch = epoch, .hdr = *hdrs[i] };
+        memcpy(buf, &msg, sizeof(msg));
+        memcpy(buf + sizeof(msg), name, name_len);
+        if(size > 0)
+            memcpy(buf + sizeof(msg) + name_len, data[i], size);
+        ret = send_locked(node, LINK_DELIVER, self, 0, buf, len);
+        free_msg_buffer(buf, small);
+    }
+    pthread_mutex_unlock(&node->send_lock);
+    return ret;
+}
+
+static void deliver_local(JEUX_PACKET_HEADER *link_hdr, char *payload){
+    DELIVER_MSG msg;
+    char *name = payload + sizeof(msg);
+    char *end = payload + link_hdr->size;
+    char *nul = link_hdr->size > sizeof(msg) ? memchr(name, '\0', end - name) : NULL;
+    if(nul == NULL)
+        return;
+    memcpy(&msg, payload, sizeof(msg));
+    char *data = nul + 1;
+    if(ntohs(msg.hdr.size) != end - data)
+        return;
+    CLIENT *client = creg_lookup_local(client_registry, name);
+    // packets for a login that has ended are dropped
+    if(client != NULL && client_get_epoch(client) == msg.epoch){
+        client_send_packet(client, &msg.hdr, msg.hdr.size != 0 ? data : NULL);
+    }
+    client_unref(client, "remote packet delivered");
+}
+
+/*
+ * Results of games between users of different nodes.
+ */
+
+void cluster_post_result(PLAYER *player1, PLAYER *player2, int result){
+    if(num_nodes == 0)
+        return;
+    PLAYER *players[] = { player1, player2 };
+    for(int i = 0; i < 2; i++){
+        PLAYER *remote = players[i], *local = players[1 - i];
+        if(is_local(remote))
+            continue;
+        char *remote_name = player_get_name(remote), *local_name = player_get_name(local);
+        size_t remote_len = strlen(remote_name) + 1, local_len = strlen(local_name) + 1;
+        char buf[SMALL_MSG];
+        if(sizeof(RESULT_MSG) + remote_len + local_len > sizeof(buf))
+            continue;
+        // the result as the remote user's node sees it
+        RESULT_MSG msg = {
+            .rating = player_get_exact_rating(local),
+            .result = result == 0 ? 0 : result == i + 1 ? 1 : 2,
+        };
+        memcpy(buf, &msg, sizeof(msg));
+        memcpy(buf + sizeof(msg), remote_name, remote_len);
+        memcpy(buf + sizeof(msg) + remote_len, local_name, local_len);
+        if(link_send(cluster_owner(remote_name), LINK_RESULT, 0, buf,
+                     sizeof(msg) + remote_len + local_len) == -1){
+            debug("cluster: the result of %s's game is lost", remote_name);
+        }
+    }
+}
+
+static void apply_remote_result(int n, JEUX_PACKET_HEADER *hdr, char *payload){
+    RESULT_MSG msg;
+    char *end = payload + hdr->size;
+    char *name = payload + sizeof(msg);
+    char *nul = hdr->size > sizeof(msg) ? memchr(name, '\0', end - name) : NULL;
+    char *opponent = nul != NULL ? nul + 1 : NULL;
+    if(opponent == NULL || opponent == end || memchr(opponent, '\0', end - opponent) == NULL)
+        return;
+    memcpy(&msg, payload, sizeof(msg));
+    if(cluster_owner(name) != self || cluster_owner(opponent) != n)
+        return;
+    PLAYER *player = preg_register(player_registry, name);
+    // rated against the opponent as it was rated at the other node, whose
+    // shadow here is left to LINK_PRESENCE; posted straight to the ratings
+    // worker, not back to the other node
+    if(player != NULL)
+        ratings_post_against(player, msg.rating, msg.result);
+    player_unref(player, "remote result posted");
+}
+
+/*
+ * The threads of the links: a dialer for all the connections this node
+ * sends on, a listener, a reader for each connection accepted, and a
+ * worker for each other node.
+ */
+
+static void enqueue(NODE *node, JEUX_PACKET_HEADER *hdr, void *payload){
+    QUEUED_MSG *m = malloc(sizeof(QUEUED_MSG) + hdr->size);
+    if(m == NULL){
+        debug("cluster: out of memory; message of type %d lost", hdr->type);
+        return;
+    }
+    m->hdr = *hdr;
+    m->next = NULL;
+    if(hdr->size > 0)
+        memcpy(m->payload, payload, hdr->size);
+    if(node->tail != NULL)
+        node->tail->next = m;
+    else
+        node->head = m;
+    node->tail = m;
+    pthread_cond_signal(&node->queued);
+}
+
+static void *worker_main(void *arg){
+    int n = (int) (intptr_t) arg;
+    NODE *node = &nodes[n];
+    for(;;){
+        pthread_mutex_lock(&node->queue_lock);
+        while(node->head == NULL)
+            pthread_cond_wait(&node->queued, &node->queue_lock);
+        QUEUED_MSG *m = node->head;
+        if((node->head = m->next) == NULL)
+            node->tail = NULL;
+        pthread_mutex_unlock(&node->queue_lock);
+        switch(m->hdr.type){
+        case LINK_PRESENCE:
+            apply_presence(n, &m->hdr, m->payload);
+            break;
+        case LINK_FORWARD:
+            run_forwarded(n, &m->hdr, m->payload);
+            break;
+        case LINK_RESULT:
+            apply_remote_result(n, &m->hdr, m->payload);
+            break;
+        case LINK_DOWN:
+            node_down(n);
+            drop_late_waiters(n);
+            break;
+        }
+        free(m);
+    }
+    return NULL;
+}
+
+static void *reader_main(void *arg){
+    int fd = (int) (intptr_t) arg;
+    PROTO_DECODER decoder;
+    JEUX_PACKET_HEADER hdr, down = { .type = LINK_DOWN };
+    void *payload;
+    int n = -1;
+    ssize_t got;
+    if(proto_decoder_init(&decoder, 0) == -1){
+        close(fd);
+        return NULL;
+    }
+    while((got = proto_decoder_fill(&decoder, fd, 0)) > 0 || (got == -1 && errno == EINTR)){
+        while(proto_decoder_next(&decoder, &hdr, &payload) == 1){
+            if(n == -1){
+                if(hdr.type != LINK_HELLO || hdr.id >= num_nodes || hdr.id == self)
+                    goto done;
+                n = hdr.id;
+                NODE *node = &nodes[n];
+                // a node that dialed again starts afresh; its old connection is finished with
+                pthread_mutex_lock(&node->queue_lock);
+                if(node->in_fd != -1)
+                    shutdown(node->in_fd, SHUT_RDWR);
+                node->in_fd = fd;
+                enqueue(node, &down, NULL);
+                pthread_mutex_unlock(&node->queue_lock);
+                debug("cluster: node %d dialed in", n);
+                continue;
+            }
+            switch(hdr.type){
+            case LINK_DELIVER:
+                deliver_local(&hdr, payload);
+                break;
+            case LINK_DONE:
+                if(hdr.size == sizeof(DONE_MSG)){
+                    DONE_MSG done;
+                    memcpy(&done, payload, sizeof(done));
+                    wake_waiter(done.seq, hdr.role);
+                }
+                break;
+            case LINK_PRESENCE:
+            case LINK_FORWARD:
+            case LINK_RESULT:
+                pthread_mutex_lock(&nodes[n].queue_lock);
+                enqueue(&nodes[n], &hdr, payload);
+                pthread_mutex_unlock(&nodes[n].queue_lock);
+                break;
+            default:
+                debug("cluster: unknown message of type %d from node %d", hdr.type, n);
+                break;
+            }
+        }
+    }
+done:
+    if(n != -1){
+        NODE *node = &nodes[n];
+        pthread_mutex_lock(&node->queue_lock);
+        if(node->in_fd == fd){
+            node->in_fd = -1;
+            enqueue(node, &down, NULL);
+        }
+        pthread_mutex_unlock(&node->queue_lock);
+    }
+    proto_decoder_fini(&decoder);
+    close(fd);
+    return NULL;
+}
+
+static void *listener_main(void *arg){
+    int listenfd = (int) (intptr_t) arg;
+    for(;;){
+        int fd = accept(listenfd, NULL, NULL);
+        if(fd == -1){
+            debug("cluster: accept failed");
+            usleep(10000);
+            continue;
+        }
+        if(spawn(NULL, NULL, reader_main, (void *) (intptr_t) fd) != 0)
+            close(fd);
+    }
+    return NULL;
+}
+
+// connect a socket within CLUSTER_DIAL_TIMEOUT_MS, leaving it blocking; 0, or -1
+static int connect_within(int fd, struct sockaddr *addr, socklen_t len){
+    int flags = fcntl(fd, F_GETFL);
+    if(flags == -1 || fcntl(fd, F_SETFL, flags | O_NONBLOCK) == -1)
+        return -1;
+    if(connect(fd, addr, len) == -1){
+        struct pollfd pfd = { .fd = fd, .events = POLLOUT };
+        int err = 0;
+        socklen_t err_len = sizeof(err);
+        if(errno != EINPROGRESS || poll(&pfd, 1, CLUSTER_DIAL_TIMEOUT_MS) != 1
+           || getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &err_len) == -1 || err != 0)
+            return -1;
+    }
+    return fcntl(fd, F_SETFL, flags);
+}
+
+// as open_clientfd(), but never waiting longer than CLUSTER_DIAL_TIMEOUT_MS for an address
+static int dial(const char *host, const char *port){
+    struct addrinfo hints = { .ai_socktype = SOCK_STREAM, .ai_flags = AI_NUMERICSERV | AI_ADDRCONFIG };
+    struct addrinfo *list;
+    if(getaddrinfo(host, port, &hints, &list) != 0)
+        return -1;
+    int fd = -1;
+    for(struct addrinfo *p = list; p != NULL && fd == -1; p = p->ai_next){
+        if((fd = socket(p->ai_family, p->ai_socktype, p->ai_protocol)) == -1)
+            continue;
+        if(connect_within(fd, p->ai_addr, p->ai_addrlen) == -1){
+            close(fd);
+            fd = -1;
+        }
+    }
+    freeaddrinfo(list);
+    return fd;
+}
+
+/*
+ * The dialer keeps a connection to every other node.  Nothing is ever
+ * received on them, so one becoming readable means the other end has
+ * closed it, and it is dialed again.  Only the dialer sets a connection
+ * up, and it dials without the send lock, so that a node that cannot be
+ * reached holds up no one sending to it, or publishing to all of them.
+ */
+static void *dialer_main(void *arg){
+    for(;;){
+        struct pollfd fds[CLUSTER_MAX_NODES];
+        int watched[CLUSTER_MAX_NODES], num_watched = 0;
+        for(int i = 0; i < num_nodes; i++){
+            if(i == self)
+                continue;
+            NODE *node = &nodes[i];
+            pthread_mutex_lock(&node->send_lock);
+            int down = node->out_fd == -1;
+            pthread_mutex_unlock(&node->send_lock);
+            int fd = down ? dial(node->host, node->link_port) : -1;
+            pthread_mutex_lock(&node->send_lock);
+            if(fd != -1){
+                node->out_fd = fd;
+                if(send_locked(node, LINK_HELLO, self, 0, NULL, 0) == 0){
+                    debug("cluster: dialed node %d", i);
+                    pthread_mutex_unlock(&node->send_lock);
+                    publish_all(i);
+                    pthread_mutex_lock(&node->send_lock);
+                }
+            }
+            if(node->out_fd != -1){
+                fds[num_watched].fd = node->out_fd;
+                fds[num_watched].events = POLLIN;
+                watched[num_watched++] = i;
+            }
+            pthread_mutex_unlock(&node->send_lock);
+        }
+        if(poll(fds, num_watched, CLUSTER_REDIAL_MS) <= 0){
+            if(num_watched == 0)
+                usleep(CLUSTER_REDIAL_MS * 1000);
+            continue;
+        }
+        for(int k = 0; k < num_watched; k++){
+            if(fds[k].revents == 0)
+                continue;
+            NODE *node = &nodes[watched[k]];
+            pthread_mutex_lock(&node->send_lock);
+            if(node->out_fd == fds[k].fd)
+                drop_out_link(node);
+            pthread_mutex_unlock(&node->send_lock);
+        }
+    }
+    return NULL;
+}
+
+int cluster_start(void){
+    if(num_nodes == 0)
+        return 0;
+    int listenfd = open_listenfd(nodes[self].link_port);
+    if(listenfd < 0)
+        return -1;
+    if(spawn(NULL, NULL, listener_main, (void *) (intptr_t) listenfd) != 0){
+        close(listenfd);
+        return -1;
+    }
+    for(int i = 0; i < num_nodes; i++){
+        if(i != self && spawn(NULL, NULL, worker_main, (void *) (intptr_t) i) != 0)
+            return -1;
+    }
+    return spawn(NULL, NULL, dialer_main, NULL) == 0 ? 0 : -1;
+}
@@ -0,0 +1,215 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <errno.h>
+#include <stdatomic.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+
+#include "protocol.h"
+#include "session.h"
+#include "proto_decoder.h"
+#include "event_loop.h"
+#include "uring_loop.h"
+#include "acceptor.h"
+#include "metrics.h"
+#include "upgrade.h"
+#include "spawn.h"
+#include "debug.h"
+
+#define EVL_MAX_EVENTS 64               // events fetched per epoll_wait
+
+typedef struct connection {
+    JEUX_SESSION session;       // service-loop state shared with the threaded mode
+    PROTO_DECODER decoder;      // reassembles packets from whatever recv returns
+} CONNECTION;
+
+typedef struct reactor {
+    int epfd;                   // epoll instance watching this reactor's connections
+    pthread_t tid;              // thread running reactor_main()
+} REACTOR;
+
+EVL_BACKEND evl_backend = EVL_EPOLL;
+
+static REACTOR *reactors;
+static int num_reactors;
+static atomic_uint next_reactor;    // for the round robin over the reactors
+static int pinned;                  // nonzero if reactor i runs on CPU slot i
+
+static void conn_free(CONNECTION *conn){
+    proto_decoder_fini(&conn->decoder);
+    free(conn);
+}
+
+static void conn_close(REACTOR *reactor, CONNECTION *conn){
+    debug("[%d] reactor closing connection", conn->session.fd);
+    epoll_ctl(reactor->epfd, EPOLL_CTL_DEL, conn->session.fd, NULL);
+    jeux_session_close(&conn->session);
+    conn_free(conn);
+}
+
+/*
+ * Receive whatever the socket has for us with a single non-blocking
+ * recv and dispatch every complete packet in it.  The socket itself
+ * stays in blocking mode, as in the threaded server; MSG_DONTWAIT makes
+ * just this read non-blocking, as the outbound queue does for its sends.
+ * Anything left over is
+ * picked up on the next wakeup, since the epoll set is level-triggered.
+ * Returns 0 if the connection should remain open, otherwise -1.
+ */
+static int conn_on_readable(CONNECTION *conn){
+    JEUX_PACKET_HEADER hdr;
+    void *payload;
+    ssize_t n = proto_decoder_fill(&conn->decoder, conn->session.fd, MSG_DONTWAIT);
+    metrics_syscall(METRICS_SYSCALL_RECV);
+    if(n == 0){
+        return -1;
+    }
+    if(n < 0){
+        return (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) ? 0 : -1;
+    }
+    while(proto_decoder_next(&conn->decoder, &hdr, &payload) == 1){
+        jeux_session_dispatch(&conn->session, &hdr, payload);
+    }
+    return 0;
+}
+
+static void *reactor_main(void *arg){
+    REACTOR *reactor = arg;
+    struct epoll_event events[EVL_MAX_EVENTS];
+
+    debug("reactor %ld started (epfd %d)", pthread_self(), reactor->epfd);
+    upgrade_reader_enter();
+    while(1){
+        // a hot upgrade stops the reactor here, between wakeups (see upgrade.h)
+        upgrade_checkpoint();
+        int n = epoll_wait(reactor->epfd, events, EVL_MAX_EVENTS, -1);
+        metrics_syscall(METRICS_SYSCALL_EPOLL_WAIT);
+        if(n < 0){
+            if(errno == EINTR)
+                continue;
+            debug("epoll_wait failed: %s", strerror(errno));
+            break;
+        }
+        for(int i = 0; i < n; i++){
+            CONNECTION *conn = events[i].data.ptr;
+            if(conn_on_readable(conn) == -1){
+                conn_close(reactor, conn);
+            }
+        }
+    }
+    return NULL;
+}
+
+int evl_start(int nreactors, int pin){
+    if(nreactors <= 0){
+        long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+        nreactors = ncpu > 0 ? ncpu : 1;
+    }
+    if(evl_backend == EVL_URING){
+        if((num_reactors = uring_start(nreactors, pin)) > 0){
+            pinned = pin;
+            return 0;
+        }
+        num_reactors = 0;
+        evl_backend = EVL_EPOLL;
+    }
+    if((reactors = calloc(nreactors, sizeof(REACTOR))) == NULL){
+        return -1;
+    }
+
+    pinned = pin;
+    for(num_reactors = 0; num_reactors < nreactors; num_reactors++){
+        REACTOR *reactor = &reactors[num_reactors];
+        if((reactor->epfd = epoll_create1(EPOLL_CLOEXEC)) < 0){
+            break;
+        }
+        pthread_attr_t attr;
+        pthread_attr_init(&attr);
+        if(pin && acceptor_pin(&attr, num_reactors) == -1){
+            pinned = 0;
+        }
+        upgrade_reader_expect();
+        int rc = spawn(&reactor->tid, &attr, reactor_main, reactor);
+        pthread_attr_destroy(&attr);
+        if(rc != 0){
+            upgrade_reader_leave();
+            close(reactor->epfd);
+            break;
+        }
+        pthread_detach(reactor->tid);
+    }
+
+    debug("started %d of %d reactors", num_reactors, nreactors);
+    return num_reactors > 0 ? 0 : -1;
+}
+
+/*
+ * Choose the reactor for a connection accepted on a CPU slot, or on no
+ * slot in particular if it is negative: one of those on the same CPU,
+ * if there are any, otherwise the next in turn.
+ */
+static int reactor_for(int slot){
+    unsigned int turn = atomic_fetch_add_explicit(&next_reactor, 1, memory_order_relaxed);
+    int ncpus = acceptor_cpus();
+    if(slot < 0 || !pinned || slot % ncpus >= num_reactors){
+        return turn % num_reactors;
+    }
+    // reactors slot, slot + ncpus, slot + 2 * ncpus, ... run on the CPU
+    slot %= ncpus;
+    int on_cpu = (num_reactors - slot + ncpus - 1) / ncpus;
+    return slot + (turn % on_cpu) * ncpus;
+}
+
+int evl_add_connection(int fd){
+    return evl_add_connection_on(fd, -1);
+}
+
+int evl_add_connection_on(int fd, int slot){
+    if(num_reactors == 0){
+        close(fd);
+        return -1;
+    }
+    if(evl_backend == EVL_URING){
+        return uring_add_connection(reactor_for(slot), fd);
+    }
+    CONNECTION *conn = calloc(1, sizeof(CONNECTION));
+    if(conn == NULL){
+        close(fd);
+        return -1;
+    }
+    if(proto_decoder_init(&conn->decoder, 0) == -1){
+        free(conn);
+        close(fd);
+        return -1;
+    }
+    conn->session.decoder = &conn->decoder;
+    if(jeux_session_open(&conn->session, fd) == -1){
+        conn_free(conn);
+        close(fd);
+        return -1;
+    }
+
+    REACTOR *reactor = &reactors[reactor_for(slot)];
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN | EPOLLRDHUP;
+    ev.data.ptr = conn;
+    if(epoll_ctl(reactor->epfd, EPOLL_CTL_ADD, fd, &ev) == -1){
+        debug("epoll_ctl failed: %s", strerror(errno));
+        jeux_session_close(&conn->session);
+        conn_free(conn);
+        return -1;
+    }
+    return 0;
+}
+
+size_t evl_connection_footprint(void){
+    if(evl_backend == EVL_URING)
+        return uring_connection_footprint();
+    return sizeof(CONNECTION);
+}
@@ -10,10 +10,16 @@
 #include <sys/socket.h>
 #include <getopt.h>
 #include <ctype.h>
+#include <stdint.h>
+#include <stdatomic.h>
 
 #include "debug.h"
 #include "csapp.h"
 #include "game.h"
+#include "game_ext.h"
+#include "pool.h"
+#include "metrics.h"
+#include "trace.h"
 
 /*
  * A GAME represents the current state of a game between participating
@@ -34,22 +40,332 @@
  * The details are up to you.  A GAME_MOVE is immutable.
  */
 #define MAX_BOARD_NUM 9
+#define FULL_BOARD 0x1ff    // every square taken
 
+/*
+ * Any other board is kept as two bitboards of BOARD_BITS bits, laid out
+ * so that a line of squares is a run of bits a fixed distance apart:
+ * each row is followed by a spare bit, and on a board of several layers
+ * each layer by a spare row, so that a line running off the side of the
+ * board meets an empty bit before it could come back on the other side.
+ * A line of k through a square is then found with a few shifts of the
+ * whole board for each direction (see scalar_run()), which AVX2 does
+ * in one register.
+ */
+#define BOARD_BITS 256
+#define BOARD_WORDS (BOARD_BITS / 64)
+#define MAX_DIRECTIONS 13           // the lines through a square of a cube
+
+typedef struct bitboard {
+    uint64_t w[BOARD_WORDS];    // bit i is w[i / 64] >> i % 64
+} BITBOARD;
+
+typedef struct board BOARD;
+
+// nonzero if taken has k in a row through bit, as laid out for board
+typedef int (*LINE_KERNEL)(const BITBOARD *taken, int bit, const BOARD *board);
+
+struct board {
+    GAME_VARIANT variant;
+    uint8_t num_moves;
+    uint16_t stride_y;          // bits from a square to the one in the next row
+    uint16_t stride_z;          // bits from a square to the one in the next layer
+    LINE_KERNEL lines;
+    BITBOARD taken[2];          // bits of the squares taken by X and by O
+    uint8_t history[];          // squares in the order they were taken
+};
+
+/*
+ * The classic board is kept as two bitboards, one per player: bit i of
+ * mask[p-1] is set if player p (1 for X, 2 for O) has taken square i+1.
+ * Whose turn it is follows from the counts, since X moves first and the
+ * players alternate.  Any other board is kept apart, so that a classic
+ * game is no bigger or slower for it.
+ */
 typedef struct game {
-   	int turn_X; // boolean val indicating if it's X's turn or not. 1 if yes 0 otherwise
-   	int num_turns;
-    int board[MAX_BOARD_NUM]; // 0 means space, 1 if X, and 2 if O
-    GAME_ROLE winner; // 0 if no winner, 1 if first person, 2 if second person
-    int terminated;
-    pthread_mutex_t lock;
-    int ref_count;
+    uint16_t mask[2];           // squares taken by X and by O
+    uint8_t winner;             // GAME_ROLE of the winner, NULL_ROLE if none (yet)
+    uint8_t terminated;         // nonzero once the game is over
+    uint8_t history[MAX_BOARD_NUM];     // squares (1-9) in the order they were taken
+    BOARD *board;               // any other board, or NULL for the classic one
+    atomic_int ref_count;       // changed without taking the lock
+    pthread_mutex_t lock;       // protects the board
 } GAME;
 
+const GAME_VARIANT game_classic = { 3, 3, 1, 3 };
+
+// the eight lines of three squares, as masks
+static const uint16_t lines[] = {
+    0007, 0070, 0700,       // rows
+    0111, 0222, 0444,       // columns
+    0421, 0124              // diagonals
+};
+
+// win_table[m] is nonzero if the squares in m contain a complete line
+static uint8_t win_table[1 << MAX_BOARD_NUM];
+static pthread_once_t win_table_once = PTHREAD_ONCE_INIT;
+
+static void init_win_table(void){
+    for(int m = 0; m < (1 << MAX_BOARD_NUM); m++){
+        for(int i = 0; i < sizeof(lines) / sizeof(lines[0]); i++){
+            if((m & lines[i]) == lines[i]){
+                win_table[m] = 1;
+                break;
+            }
+        }
+    }
+}
+
+static int num_squares(GAME *game){
+    if(game->board == NULL)
+        return MAX_BOARD_NUM;
+    const GAME_VARIANT *v = &game->board->variant;
+    return v->width * v->height * v->depth;
+}
+
+// the bit of square (from 1) on a board other than the classic one
+static int square_bit(const BOARD *board, int square){
+    int i = square - 1, w = board->variant.width, h = board->variant.height;
+    return i % w + i / w % h * board->stride_y + i / (w * h) * board->stride_z;
+}
+
+static int bit_set(const BITBOARD *b, int bit){
+    return b->w[bit / 64] >> bit % 64 & 1;
+}
+
+// 1 if it's X's turn, 0 if it's O's
+static int turn_X(GAME *game){
+    if(game->board != NULL)
+        return game->board->num_moves % 2 == 0;
+    return __builtin_popcount(game->mask[0]) == __builtin_popcount(game->mask[1]);
+}
+
+// 0 for an empty square, otherwise the player (1 or 2) who has taken it; i is from 0
+static int square_owner(GAME *game, int i){
+    if(game->board != NULL){
+        int bit = square_bit(game->board, i + 1);
+        return bit_set(&game->board->taken[0], bit) ? 1 : bit_set(&game->board->taken[1], bit) ? 2 : 0;
+    }
+    return (game->mask[0] >> i & 1) ? 1 : (game->mask[1] >> i & 1) ? 2 : 0;
+}
+
+/*
+ * Looking for lines, on plain 64-bit words or with AVX2, chosen when a
+ * game is created.  The functions below are inlined into the two
+ * kernels, which game.o is built with optimization for (see the
+ * Makefile).  Kernels made for the shapes of gomoku and qubic, with
+ * their directions and shifts as constants, were no faster.
+ */
+#define ALWAYS_INLINE static inline __attribute__((always_inline))
+
+/*
+ * The distances in bits to the next square along each line through a
+ * square: one direction of each pair of opposites, the one that makes
+ * the distance positive.  Returns how many there are.
+ */
+ALWAYS_INLINE int directions(int stride_y, int stride_z, int depth, int *dirs){
+    int n = 0;
+    int layers = depth > 1 ? 1 : 0;
+    for(int dz = -layers; dz <= layers; dz++){
+        for(int dy = -1; dy <= 1; dy++){
+            for(int dx = -1; dx <= 1; dx++){
+                int d = dx + dy * stride_y + dz * stride_z;
+                if(d > 0)
+                    dirs[n++] = d;
+            }
+        }
+    }
+    return n;
+}
+
+// bit i of the result is bit i + n of b
+ALWAYS_INLINE BITBOARD scalar_shr(const BITBOARD *b, int n){
+    BITBOARD r;
+    int q = n / 64, s = n % 64;
+    for(int i = 0; i < BOARD_WORDS; i++){
+        uint64_t lo = i + q < BOARD_WORDS ? b->w[i + q] : 0;
+        uint64_t hi = i + q + 1 < BOARD_WORDS ? b->w[i + q + 1] : 0;
+        r.w[i] = s == 0 ? lo : lo >> s | hi << (64 - s);
+    }
+    return r;
+}
+
+/*
+ * 1 if k squares in a row d bits apart, one of them at bit, are all
+ * taken.  After the loop bit q of t is set if the len squares from q on
+ * are, each step doubling len or making up what is left of k.
+ */
+ALWAYS_INLINE int scalar_run(const BITBOARD *taken, int bit, int d, int k){
+    BITBOARD t = *taken;
+    for(int len = 1, step; len < k; len += step){
+        step = len < k - len ? len : k - len;
+        BITBOARD u = scalar_shr(&t, step * d);
+        for(int i = 0; i < BOARD_WORDS; i++)
+            t.w[i] &= u.w[i];
+    }
+    for(int j = 0; j < k && bit - j * d >= 0; j++){
+        if(bit_set(&t, bit - j * d))
+            return 1;
+    }
+    return 0;
+}
+
+ALWAYS_INLINE int scalar_lines(const BITBOARD *taken, int bit, int stride_y, int stride_z, int depth, int k){
+    int dirs[MAX_DIRECTIONS];
+    int n = directions(stride_y, stride_z, depth, dirs);
+    for(int i = 0; i < n; i++){
+        if(scalar_run(taken, bit, dirs[i], k))
+            return 1;
+    }
+    return 0;
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+
+#define HAVE_AVX2 1
+#define AVX2 __attribute__((target("avx2")))
+
+// bit i of the result is bit i + n of b, a 32-bit lane at a time and then the bits between
+AVX2 ALWAYS_INLINE __m256i avx2_shr(__m256i b, int n){
+    __m256i past = _mm256_set1_epi32(8);
+    __m256i idx = _mm256_add_epi32(_mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7), _mm256_set1_epi32(n / 64 * 2));
+    __m256i lo = _mm256_and_si256(_mm256_permutevar8x32_epi32(b, idx), _mm256_cmpgt_epi32(past, idx));
+    idx = _mm256_add_epi32(idx, _mm256_set1_epi32(2));
+    __m256i hi = _mm256_and_si256(_mm256_permutevar8x32_epi32(b, idx), _mm256_cmpgt_epi32(past, idx));
+    // a shift by 64 gives zero, as the bits of hi need when n is a multiple of 64
+    return _mm256_or_si256(_mm256_srl_epi64(lo, _mm_cvtsi32_si128(n % 64)),
+                           _mm256_sll_epi64(hi, _mm_cvtsi32_si128(64 - n % 64)));
+}
+
+// as scalar_run()
+AVX2 ALWAYS_INLINE int avx2_run(__m256i taken, int bit, int d, int k){
+    __m256i t = taken;
+    for(int len = 1, step; len < k; len += step){
+        step = len < k - len ? len : k - len;
+        t = _mm256_and_si256(t, avx2_shr(t, step * d));
+    }
+    if(_mm256_testz_si256(t, t))
+        return 0;
+    BITBOARD runs;
+    _mm256_storeu_si256((__m256i *) runs.w, t);
+    for(int j = 0; j < k && bit - j * d >= 0; j++){
+        if(bit_set(&runs, bit - j * d))
+            return 1;
+    }
+    return 0;
+}
+
+AVX2 ALWAYS_INLINE int avx2_lines(const BITBOARD *taken, int bit, int stride_y, int stride_z, int depth, int k){
+    int dirs[MAX_DIRECTIONS];
+    int n = directions(stride_y, stride_z, depth, dirs);
+    __m256i b = _mm256_loadu_si256((const __m256i *) taken->w);
+    for(int i = 0; i < n; i++){
+        if(avx2_run(b, bit, dirs[i], k))
+            return 1;
+    }
+    return 0;
+}
+#endif
+
+#define FLAT_STRIDE_Z(w, h) (((w) + 1) * (h))
+#define LAYER_STRIDE_Z(w, h) (((w) + 1) * ((h) + 1))
+
+static int scalar_kernel(const BITBOARD *taken, int bit, const BOARD *board){
+    return scalar_lines(taken, bit, board->stride_y, board->stride_z, board->variant.depth, board->variant.k);
+}
+
+#ifdef HAVE_AVX2
+AVX2 static int avx2_kernel(const BITBOARD *taken, int bit, const BOARD *board){
+    return avx2_lines(taken, bit, board->stride_y, board->stride_z, board->variant.depth, board->variant.k);
+}
+#endif
+
+static atomic_int use_avx2 = -1;    // -1 until the CPU has been asked
+
+int game_use_avx2(int enable){
+    int avx2 = 0;
+#ifdef HAVE_AVX2
+    avx2 = enable && __builtin_cpu_supports("avx2");
+#endif
+    atomic_store(&use_avx2, avx2);
+    return avx2;
+}
+
+static LINE_KERNEL choose_kernel(void){
+    int avx2 = atomic_load(&use_avx2);
+    if(avx2 == -1)
+        avx2 = game_use_avx2(1);
+#ifdef HAVE_AVX2
+    if(avx2)
+        return avx2_kernel;
+#endif
+    return scalar_kernel;
+}
+
+// the bits a board needs, or more than BOARD_BITS if it is not one games can be played on
+static int variant_bits(const GAME_VARIANT *v){
+    int longest = v->width > v->height ? v->width : v->height;
+    longest = v->depth > longest ? v->depth : longest;
+    if(v->width < 1 || v->height < 1 || v->depth < 1 || longest > GAME_VARIANT_MAX_SIDE
+       || v->k < 2 || v->k > longest)
+        return BOARD_BITS + 1;
+    return v->depth > 1 ? LAYER_STRIDE_Z(v->width, v->height) * v->depth : FLAT_STRIDE_Z(v->width, v->height);
+}
+
+int game_variant_is_classic(const GAME_VARIANT *variant){
+    return memcmp(variant, &game_classic, sizeof(GAME_VARIANT)) == 0;
+}
+
+int game_parse_variant(const char *str, GAME_VARIANT *variant){
+    long nums[4];
+    int n = 0;
+    char *end;
+    // "<width>x<height>[x<depth>]", then ",<k>"
+    while(n < 3){
+        if(!isdigit((unsigned char) *str))
+            return -1;
+        nums[n++] = strtol(str, &end, 10);
+        str = end;
+        if(*str != 'x')
+            break;
+        str++;
+    }
+    if(n < 2 || *str++ != ',' || !isdigit((unsigned char) *str))
+        return -1;
+    nums[3] = strtol(str, &end, 10);
+    if(*end != '\0')
+        return -1;
+    if(n == 2)
+        nums[2] = 1;
+    for(int i = 0; i < 4; i++){
+        if(nums[i] > GAME_VARIANT_MAX_SIDE)
+            return -1;
+    }
+    GAME_VARIANT v = { nums[0], nums[1], nums[2], nums[3] };
+    if(variant_bits(&v) > BOARD_BITS)
+        return -1;
+    *variant = v;
+    return 0;
+}
+
+int game_unparse_variant(const GAME_VARIANT *variant, char *buf, size_t size){
+    int len;
+    if(variant->depth > 1)
+        len = snprintf(buf, size, "%dx%dx%d,%d", variant->width, variant->height, variant->depth, variant->k);
+    else
+        len = snprintf(buf, size, "%dx%d,%d", variant->width, variant->height, variant->k);
+    return len < size ? len : -1;
+}
+
 typedef struct game_move {
     int player; // Player making the move (1 or 2)
-    int square; // Square on the board (1-9)
+    int square; // Square on the board (from 1)
 } GAME_MOVE;
 
+static POOL game_pool = POOL_INITIALIZER("game", sizeof(GAME));
+static POOL move_pool = POOL_INITIALIZER("game move", sizeof(GAME_MOVE));
+
 /*
  * The GAME_ROLE type is an enumeration type whose value identify the
  * possible roles of players in a game.  For this assignment, we are
@@ -66,18 +382,11 @@ typedef struct game_move {
 // } GAME_ROLE;
 
 
-// return 1 if win, 0 otherwise
+// return 1 if win, 0 otherwise; lines on other boards are looked for as they are made
 int win(GAME *game, int player){
-	// Check for winning conditions
-    return ((game->board[0] == player && game->board[1] == player && game->board[2] == player) ||
-        (game->board[3] == player && game->board[4] == player && game->board[5] == player) ||
-        (game->board[6] == player && game->board[7] == player && game->board[8] == player) ||
-        (game->board[0] == player && game->board[3] == player && game->board[6] == player) ||
-        (game->board[1] == player && game->board[4] == player && game->board[7] == player) ||
-        (game->board[2] == player && game->board[5] == player && game->board[8] == player) ||
-        (game->board[0] == player && game->board[4] == player && game->board[8] == player) ||
-        (game->board[2] == player && game->board[4] == player && game->board[6] == player)) 
-    ? 1 : 0;
+    if(game->board != NULL)
+        return game->winner == player;
+    return win_table[game->mask[player - 1]];
 }
 /*
  * Create a new game in an initial state.  The returned game has a
@@ -87,36 +396,62 @@ int win(GAME *game, int player){
  * otherwise NULL.
  */
 GAME *game_create(void){
-    GAME *new_game = malloc(sizeof(GAME));
+    GAME *new_game = pool_alloc(&game_pool);
     if (new_game == NULL) {
         debug("oh no, malloc failed");
         return NULL;
     }
 
     if (pthread_mutex_init(&new_game->lock, NULL) != 0) {
-        free(new_game);
+        pool_free(&game_pool, new_game);
         return NULL;
     }
+    pthread_once(&win_table_once, init_win_table);
 
     pthread_mutex_lock(&new_game->lock);
 
-    new_game->turn_X = 1;
-    new_game->num_turns = 0;
+    new_game->mask[0] = 0;
+    new_game->mask[1] = 0;
     new_game->winner = NULL_ROLE;
     new_game->terminated = 0;
+    new_game->board = NULL;
 
-    for(int i = 0; i < MAX_BOARD_NUM; i++){
-        new_game->board[i] = 0;
-    }
-
-    new_game->ref_count = 1;
-    debug("INCREASED reference count for game from (%d - %d) by creating a new game",
-            new_game->ref_count-1, new_game->ref_count);
+    atomic_init(&new_game->ref_count, 1);
+    TRACE(TRACE_REF, TRACE_GAME, 1, new_game, "creating a new game");
     pthread_mutex_unlock(&new_game->lock);
+    metrics_gauge_add(METRICS_GAMES, 1);
 
     return new_game;
 }
 
+GAME *game_create_variant(const GAME_VARIANT *variant){
+    if(game_variant_is_classic(variant))
+        return game_create();
+    if(variant_bits(variant) > BOARD_BITS)
+        return NULL;
+    int squares = variant->width * variant->height * variant->depth;
+    BOARD *board = calloc(1, sizeof(BOARD) + squares);
+    if(board == NULL)
+        return NULL;
+    board->variant = *variant;
+    board->stride_y = variant->width + 1;
+    board->stride_z = variant->depth > 1 ? LAYER_STRIDE_Z(variant->width, variant->height)
+                                         : FLAT_STRIDE_Z(variant->width, variant->height);
+    board->lines = choose_kernel();
+    GAME *game = game_create();
+    if(game == NULL){
+        free(board);
+        return NULL;
+    }
+    // no one else has the game yet
+    game->board = board;
+    return game;
+}
+
+const GAME_VARIANT *game_get_variant(GAME *game){
+    return game->board != NULL ? &game->board->variant : &game_classic;
+}
+
 /*
  * Increase the reference count on a game by one.
  *
@@ -129,12 +464,8 @@ GAME *game_create(void){
 GAME *game_ref(GAME *game, char *why){
 	if(game == NULL)
 		return NULL;
-    pthread_mutex_lock(&game->lock);  // Acquire lock on INVITATION structure
-
-	game->ref_count++;
-    debug("INCREASED reference count for game from (%d - %d) %s",
-            game->ref_count-1, game->ref_count, why);
-    pthread_mutex_unlock(&game->lock); 
+    int old __attribute__((unused)) = atomic_fetch_add_explicit(&game->ref_count, 1, memory_order_relaxed);
+    TRACE(TRACE_REF, TRACE_GAME, old + 1, game, why);
 	return game;
 }
 
@@ -152,24 +483,21 @@ void game_unref(GAME *game, char *why){
 	if(game == NULL)
 		return;
 
-    pthread_mutex_lock(&game->lock);  // Acquire lock on GAME structure
-    
-    game->ref_count--;  // Decrease reference count
-    
-    if (game->ref_count == 0) {  // Reference count reached zero, free GAME contents
+    // the lock is no longer taken here, so it is never destroyed while held
+    int old = atomic_fetch_sub_explicit(&game->ref_count, 1, memory_order_acq_rel);
+    TRACE(TRACE_UNREF, TRACE_GAME, old - 1, game, why);
+    if (old == 1) {  // Reference count reached zero, free GAME contents
+        // a game given up on before it ended is no longer in progress either
+        if(!game->terminated){
+            metrics_gauge_add(METRICS_GAMES, -1);
+        }
         // Destroy the mutex
         pthread_mutex_destroy(&game->lock);
+        free(game->board);
         // Free the GAME structure itself
-        debug("DECREASED reference count for game from (1 - 0) %s", why);
-        free(game);
+        pool_free(&game_pool, game);
         debug("freed game");
-        return;
-    } else {
-        debug("DECREASED reference count for game from (%d - %d) %s",
-            game->ref_count+1, game->ref_count, why);
     }
-    
-    pthread_mutex_unlock(&game->lock); 
 }
 
 /*
@@ -181,43 +509,70 @@ void game_unref(GAME *game, char *why){
  * @return 0 if application of the move was successful, otherwise -1.
  */
 int game_apply_move(GAME *game, GAME_MOVE *move) {
+    return game_apply_move_ending(game, move) == -1 ? -1 : 0;
+}
+
+int game_apply_move_ending(GAME *game, GAME_MOVE *move) {
     // Ensure that the move is legal
     if (game == NULL || move == NULL){
         return -1;
     }
     pthread_mutex_lock(&game->lock);
 
-    if (move->square < 1 || move->square > 9 || game->board[move->square - 1] != 0
-    	|| (move->player == 1 && game->turn_X != 1) // if it's the first player and it's not their turn yet
-    	|| (move->player == 2 && game->turn_X != 0)
+    int x_to_move = turn_X(game);
+    if (move->square < 1 || move->square > num_squares(game)
+        || square_owner(game, move->square - 1) != 0
+    	|| (move->player == 1 && !x_to_move) // if it's the first player and it's not their turn yet
+    	|| (move->player == 2 && x_to_move)
+    	|| (move->player != 1 && move->player != 2)
     	|| game->terminated) {
         debug("invalid move || not the player's turn || game already terminated");
         pthread_mutex_unlock(&game->lock);
         return -1; // Illegal move
     }
-    char *move_str = game_unparse_move(move);
-    debug("[%s] is played by [%s]", move_str, game->turn_X ? "X": "O");
-    free(move_str);
-    // Apply the move to the board
-    game->board[move->square - 1] = move->player;
-    game->turn_X = game->turn_X ? 0 : 1;
-
-    if(win(game, 1)){
-    	game->winner = FIRST_PLAYER_ROLE;
-    	game->terminated = 1;
+    debug("[%d<-%s] is played by [%s]", move->square, move->player == 1 ? "X" : "O",
+          x_to_move ? "X": "O");
+    // Apply the move to the board; only the mover can have completed a line
+    int won, full;
+    if(game->board == NULL){
+        game->history[__builtin_popcount(game->mask[0] | game->mask[1])] = move->square;
+        uint16_t mask = game->mask[move->player - 1] |= 1 << (move->square - 1);
+        won = win_table[mask];
+        full = (game->mask[0] | game->mask[1]) == FULL_BOARD;
     }
-    if(win(game, 2)){
-    	game->winner = SECOND_PLAYER_ROLE;
+    else{
+        // and the line goes through the square just taken
+        BOARD *board = game->board;
+        BITBOARD *taken = &board->taken[move->player - 1];
+        int bit = square_bit(board, move->square);
+        board->history[board->num_moves++] = move->square;
+        taken->w[bit / 64] |= (uint64_t) 1 << bit % 64;
+        won = board->lines(taken, bit, board);
+        full = board->num_moves == num_squares(game);
+    }
+    if(won){
+    	game->winner = move->player == 1 ? FIRST_PLAYER_ROLE : SECOND_PLAYER_ROLE;
     	game->terminated = 1;
     }
-    game->num_turns++;
-    
+
     // all boards are filled
-    if(game->num_turns >= 9){
+    if(full){
     	game->terminated = 1;
     }
+    int ended = game->terminated;
     pthread_mutex_unlock(&game->lock);
-    return 0;
+    if(ended){
+        metrics_gauge_add(METRICS_GAMES, -1);
+    }
+    return ended;
+}
+
+int game_get_history(GAME *game, uint8_t *squares){
+    pthread_mutex_lock(&game->lock);
+    int n = game->board != NULL ? game->board->num_moves : __builtin_popcount(game->mask[0] | game->mask[1]);
+    memcpy(squares, game->board != NULL ? game->board->history : game->history, n);
+    pthread_mutex_unlock(&game->lock);
+    return n;
 }
 
 /*
@@ -229,14 +584,20 @@ int game_apply_move(GAME *game, GAME_MOVE *move) {
  * @return 0 if resignation was successful, otherwise -1.
  */
 int game_resign(GAME *game, GAME_ROLE role){
-	if(game == NULL || game->terminated){
+	if(game == NULL){
 		return -1;
 	}
     pthread_mutex_lock(&game->lock);
+    // checked under the lock, so that a resignation and a final move cannot both end the game
+    if(game->terminated){
+        pthread_mutex_unlock(&game->lock);
+        return -1;
+    }
 
     game->terminated = 1;
     game->winner = (role == FIRST_PLAYER_ROLE) ? SECOND_PLAYER_ROLE: FIRST_PLAYER_ROLE;
     pthread_mutex_unlock(&game->lock);
+    metrics_gauge_add(METRICS_GAMES, -1);
     return 0;
 }
 
@@ -252,44 +613,101 @@ int game_resign(GAME *game, GAME_ROLE role){
  */
 char *game_unparse_state(GAME *game) {
     // Allocate enough memory to store the state description
-    char *state_str = malloc(47 * sizeof(char) + 1);
+    char *state_str = malloc(GAME_STATE_MAX);
     if (state_str == NULL) {
         debug("Error: memory allocation failed");
         return NULL;
     }
-    memset(state_str, 0, 48);
-    
-    // Initialize state string to empty string
-    state_str[0] = '\0';
-
-    // Build the state string
-    state_str = strcat(state_str, game->board[0] == 0 ? " " : game->board[0] == 1 ? "X" : "O");
-    strcat(state_str, "|");
-    state_str = strcat(state_str, game->board[1] == 0 ? " " : game->board[1] == 1 ? "X" : "O");
-    strcat(state_str, "|");
-    state_str = strcat(state_str, game->board[2] == 0 ? " " : game->board[2] == 1 ? "X" : "O");
-    strcat(state_str, "\n");
-    strcat(state_str, "-----\n");
-    state_str = strcat(state_str, game->board[3] == 0 ? " " : game->board[3] == 1 ? "X" : "O");
-    strcat(state_str, "|");
-    state_str = strcat(state_str, game->board[4] == 0 ? " " : game->board[4] == 1 ? "X" : "O");
-    strcat(state_str, "|");
-    state_str = strcat(state_str, game->board[5] == 0 ? " " : game->board[5] == 1 ? "X" : "O");
-    strcat(state_str, "\n");
-    strcat(state_str, "-----\n");
-    state_str = strcat(state_str, game->board[6] == 0 ? " " : game->board[6] == 1 ? "X" : "O");
-    strcat(state_str, "|");
-    state_str = strcat(state_str, game->board[7] == 0 ? " " : game->board[7] == 1 ? "X" : "O");
-    strcat(state_str, "|");
-    state_str = strcat(state_str, game->board[8] == 0 ? " " : game->board[8] == 1 ? "X" : "O");
-    strcat(state_str, "\n");
-    debug("the length of it is %li", strlen(state_str));
-
-    strcat(state_str, "It's ");
-    strcat(state_str, game->turn_X ? "X" : "O");
-    strcat(state_str, "'s turn\n\0");
+    game_unparse_state_into(game, state_str, GAME_STATE_MAX);
     return state_str;
 }
+
+/*
+ * The description has the same shape for every state, so it is made by
+ * copying this template and filling in the nine squares and the turn.
+ */
+static const char state_template[] = " | | \n-----\n | | \n-----\n | | \nIt's X's turn\n";
+static const uint8_t square_offset[MAX_BOARD_NUM] = { 0, 2, 4, 12, 14, 16, 24, 26, 28 };
+#define TURN_OFFSET 35
+static const char marks[] = { ' ', 'X', 'O' };   // indexed by square_owner()
+
+// any other board is drawn the same way, with a blank line between layers
+static int unparse_board(GAME *game, char *buf, size_t size) {
+    static const char turn[] = "It's X's turn\n";
+    const GAME_VARIANT *v = &game->board->variant;
+    int row = 2 * v->width;         // squares, bars and the newline
+    size_t len = v->depth * (2 * v->height - 1) * row + v->depth - 1 + sizeof(turn) - 1;
+    if (size < len + 1) {
+        return -1;
+    }
+    char *p = buf;
+    pthread_mutex_lock(&game->lock);
+    for (int i = 0; i < num_squares(game); i++) {
+        int x = i % v->width, y = i / v->width % v->height;
+        if (x == 0 && y == 0 && i > 0) {
+            *p++ = '\n';
+        }
+        else if (x == 0 && y > 0) {
+            memset(p, '-', row - 1);
+            p[row - 1] = '\n';
+            p += row;
+        }
+        *p++ = marks[square_owner(game, i)];
+        *p++ = x < v->width - 1 ? '|' : '\n';
+    }
+    memcpy(p, turn, sizeof(turn));
+    p[5] = turn_X(game) ? 'X' : 'O';
+    pthread_mutex_unlock(&game->lock);
+    return len;
+}
+
+int game_unparse_state_into(GAME *game, char *buf, size_t size) {
+    if (game->board != NULL) {
+        return unparse_board(game, buf, size);
+    }
+    if (size < sizeof(state_template)) {
+        return -1;
+    }
+    memcpy(buf, state_template, sizeof(state_template));
+    pthread_mutex_lock(&game->lock);
+    for (int i = 0; i < MAX_BOARD_NUM; i++) {
+        buf[square_offset[i]] = marks[square_owner(game, i)];
+    }
+    buf[TURN_OFFSET] = turn_X(game) ? 'X' : 'O';
+    pthread_mutex_unlock(&game->lock);
+    return sizeof(state_template) - 1;
+}
+
+int game_unparse_state_binary(GAME *game, char *buf, size_t size) {
+    if (game->board != NULL) {
+        int squares = num_squares(game);
+        int bytes = (squares + 7) / 8;
+        if (size < 2 * bytes) {
+            return -1;
+        }
+        memset(buf, 0, 2 * bytes);
+        pthread_mutex_lock(&game->lock);
+        for (int i = 0; i < squares; i++) {
+            int owner = square_owner(game, i);
+            if (owner != 0) {
+                buf[(owner - 1) * bytes + bytes - 1 - i / 8] |= 1 << i % 8;
+            }
+        }
+        pthread_mutex_unlock(&game->lock);
+        return 2 * bytes;
+    }
+    if (size < GAME_STATE_BINARY_SIZE) {
+        return -1;
+    }
+    pthread_mutex_lock(&game->lock);
+    uint16_t x = game->mask[0], o = game->mask[1];
+    pthread_mutex_unlock(&game->lock);
+    buf[0] = x >> 8;
+    buf[1] = x & 0xff;
+    buf[2] = o >> 8;
+    buf[3] = o & 0xff;
+    return GAME_STATE_BINARY_SIZE;
+}
 /*
  * Determine if a specifed GAME has terminated.
  *
@@ -298,7 +716,10 @@ char *game_unparse_state(GAME *game) {
  */
 int game_is_over(GAME *game){
 	// if(game == NULL) // what to return. don't know
-	return game->terminated ? 1 : 0;
+    pthread_mutex_lock(&game->lock);
+    int over = game->terminated ? 1 : 0;
+    pthread_mutex_unlock(&game->lock);
+    return over;
 }
 
 /*
@@ -312,21 +733,24 @@ int game_is_over(GAME *game){
 GAME_ROLE game_get_winner(GAME *game){
 	if(game == NULL)
 		return NULL_ROLE;
+    pthread_mutex_lock(&game->lock);
+    GAME_ROLE winner = NULL_ROLE;
 	// winner
 	if(game->terminated)// a person could resign the game and win
-		return game->winner;
-	if(win(game,1))
-		return FIRST_PLAYER_ROLE;
-	if(win(game,2))
-		return SECOND_PLAYER_ROLE;
-	return NULL_ROLE;
+		winner = game->winner;
+	else if(win(game,1))
+		winner = FIRST_PLAYER_ROLE;
+	else if(win(game,2))
+		winner = SECOND_PLAYER_ROLE;
+    pthread_mutex_unlock(&game->lock);
+    return winner;
 }
 
 /*
  * Attempt to interpret a string as a move in the specified GAME.
  * If successful, a GAME_MOVE object representing the move is returned,
  * otherwise NULL is returned.  The caller is responsible for freeing
- * the returned GAME_MOVE when it is no longer needed.
+ * the returned GAME_MOVE with game_free_move() when it is no longer needed.
  * Refer to the assignment handout for the syntax that should be used
  * to specify a move.
  *
@@ -339,40 +763,40 @@ GAME_ROLE game_get_winner(GAME *game){
  * in fact be interpreted as a move, otherwise NULL.
  */
 GAME_MOVE *game_parse_move(GAME *game, GAME_ROLE role, char *str){
-    int square;
+    long square;
     int player;
-    int len = strlen(str);
+    char *end;
 
-    // role must agree with the role that's currently on the move in the game
-    if(role != NULL_ROLE && 
-    ( (role == FIRST_PLAYER_ROLE && !(game->turn_X) ) || (role == SECOND_PLAYER_ROLE && game->turn_X)) ){
-    	return NULL;
-    }
-    // Parse the move string
-    if (len == 1) {
-        // Single digit
-        if (str[0] < '1' || str[0] > '9') {
+    // role must agree with the role that's currently on the move in the game;
+    // the opponent may be moving, so the turn is read under the lock (and
+    // checked again when the move is applied)
+    if(role != NULL_ROLE){
+        pthread_mutex_lock(&game->lock);
+        int x_to_move = turn_X(game);
+        pthread_mutex_unlock(&game->lock);
+        if((role == FIRST_PLAYER_ROLE && !x_to_move) || (role == SECOND_PLAYER_ROLE && x_to_move))
             return NULL;
-        }
-        square = str[0] - '0';
+    }
+    // Parse the move string: a square of the board, from 1, with no leading zero
+    if (str[0] < '1' || str[0] > '9') {
+        return NULL;
+    }
+    square = strtol(str, &end, 10);
+    if (square > num_squares(game)) {
+        return NULL;
+    }
+    if (*end == '\0') {
         player = role == FIRST_PLAYER_ROLE ? 1 : 2;
-    } else if (len == 4) {
-        // Digit followed by "<-X" or "<-O"
-        if (str[0] < '1' || str[0] > '9') {
-            return NULL;
-        }
-        if (str[1] != '<' || str[2] != '-' || (str[3] != 'X' && str[3] != 'O')) {
-            return NULL;
-        }
-        square = str[0] - '0';
-        player = (str[3] == 'X') ? 1 : 2;
+    } else if (end[0] == '<' && end[1] == '-' && (end[2] == 'X' || end[2] == 'O') && end[3] == '\0') {
+        // followed by "<-X" or "<-O"
+        player = (end[2] == 'X') ? 1 : 2;
     } else {
         // Invalid move string
         return NULL;
     }
 
     // Create a new GAME_MOVE object and return it
-    GAME_MOVE *move = malloc(sizeof(GAME_MOVE));
+    GAME_MOVE *move = pool_alloc(&move_pool);
     if (move == NULL) {
         // Error allocating memory
         return NULL;
@@ -394,17 +818,19 @@ GAME_MOVE *game_parse_move(GAME *game, GAME_ROLE role, char *str){
  * @return  A string describing the specified GAME_MOVE.
  */
 char *game_unparse_move(GAME_MOVE *move) {
-    char *player_str = (move->player == 1) ? "X" : "O";
-    char *square_str = malloc(sizeof(char) * 3);
-    sprintf(square_str, "%d", move->square);
-    char *result = malloc(sizeof(char) * 5);
-    result[0] = '\0';
+    // at most "225<-X" and the terminator
+    char *result = malloc(sizeof(char) * 8);
     if(result == NULL){
         return NULL;
     }
-    strcat(result, square_str);
-    strcat(result, "<-");
-    strcat(result, player_str);
-    free(square_str);
+    snprintf(result, 8, "%d<-%s", move->square, (move->player == 1) ? "X" : "O");
     return result;
-}
\ No newline at end of file
+}
+
+size_t game_footprint(void) {
+    return sizeof(GAME);
+}
+
+void game_free_move(GAME_MOVE *move) {
+    pool_free(&move_pool, move);
+}
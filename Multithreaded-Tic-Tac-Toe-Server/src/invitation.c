@@ -1,21 +1,37 @@
 #include <stdbool.h>
 #include <pthread.h>
+#include <stdatomic.h>
 
 // #include "invitation.h"
 #include "debug.h"
 #include "client_registry.h"
 #include "csapp.h"
+#include "pool.h"
+#include "metrics.h"
+#include "trace.h"
+#include "invitation_ext.h"
+#include "client_ext.h"
 
 typedef struct invitation {
-    int ref_count;
+    atomic_int ref_count;       // changed without taking the lock
     CLIENT *sender;
     CLIENT *recipient;
     GAME_ROLE source_role;
     GAME_ROLE target_role;
+    GAME_VARIANT variant;       // the board of the game, set before the invitation is shared
+    int source_id;              // the source's ID for it, under the source's lock
+    int target_id;              // the target's ID for it, under the target's lock
     GAME *game;
     INVITATION_STATE state;
     pthread_mutex_t lock;
+    _Atomic(SPECTATORS *) spectators;   // made by the first WATCH of the game, or NULL
+    TIMER timer;                // for the invitation timeout and the move clock
+    _Atomic uint64_t touched;   // timer_ticks() when it was made, accepted or last moved in
 } INVITATION;
+
+static POOL inv_pool = POOL_INITIALIZER("invitation", sizeof(INVITATION));
+
+static void inv_timer_fired(void *arg);
 /*
  * An INVITATION records the status of an offer, made by one CLIENT
  * to another, to participate in a GAME.  The CLIENT that initiates
@@ -65,7 +81,7 @@ typedef struct invitation {
 INVITATION *inv_create(CLIENT *source, CLIENT *target,
 		       GAME_ROLE source_role, GAME_ROLE target_role){
 	// Allocate memory for the new INVITATION structure
-    INVITATION *inv = malloc(sizeof(INVITATION));
+    INVITATION *inv = pool_alloc(&inv_pool);
     if (inv == NULL) {
         return NULL;  // Allocation failed
     }
@@ -76,20 +92,26 @@ INVITATION *inv_create(CLIENT *source, CLIENT *target,
     inv->recipient = target;
     inv->source_role = source_role;
     inv->target_role = target_role;
-    inv->ref_count = 1;
+    inv->variant = game_classic;
+    inv->source_id = -1;
+    inv->target_id = -1;
+    atomic_init(&inv->ref_count, 1);
     inv->game = NULL;
     inv->state = INV_OPEN_STATE;
+    atomic_init(&inv->spectators, NULL);
+    timer_init(&inv->timer, inv_timer_fired, inv);
+    atomic_init(&inv->touched, timer_ticks());
 
-    debug("INCREASED reference count for invitation from (%d - %d) by creating new invitation",
-            inv->ref_count-1, inv->ref_count);
+    TRACE(TRACE_REF, TRACE_INVITATION, 1, inv, "creating new invitation");
 	if (pthread_mutex_init(&(inv->lock), NULL) != 0) {
         debug("create mutex lock counter failed");
-        free(inv);
+        pool_free(&inv_pool, inv);
         return NULL;
     }
     // Increment reference counts of source and target CLIENTs
     client_ref(source, "Creating new invitation");
     client_ref(target, "Creating new invitation");
+    metrics_gauge_add(METRICS_INVITATIONS, 1);
 
     return inv;  // Return pointer to new INVITATION structure
 }
@@ -106,12 +128,8 @@ INVITATION *inv_create(CLIENT *source, CLIENT *target,
 INVITATION *inv_ref(INVITATION *inv, char *why){
 	if(inv == NULL)
 		return NULL;
-    pthread_mutex_lock(&inv->lock);  // Acquire lock on INVITATION structure
-
-	inv->ref_count++;
-    debug("INCREASED reference count for invitation from (%d - %d) %s",
-            inv->ref_count-1, inv->ref_count, why);
-    pthread_mutex_unlock(&inv->lock); 
+    int old __attribute__((unused)) = atomic_fetch_add_explicit(&inv->ref_count, 1, memory_order_relaxed);
+    TRACE(TRACE_REF, TRACE_INVITATION, old + 1, inv, why);
 	return inv;
 
 }
@@ -130,12 +148,11 @@ INVITATION *inv_ref(INVITATION *inv, char *why){
 void inv_unref(INVITATION *inv, char *why){
 	if(inv == NULL)
 		return;
-    pthread_mutex_lock(&inv->lock);  // Acquire lock on INVITATION structure
-    inv->ref_count--;  // Decrease reference count
-    if (inv->ref_count == 0) {  // Reference count reached zero, free INVITATION contents
+    int old = atomic_fetch_sub_explicit(&inv->ref_count, 1, memory_order_acq_rel);
+    TRACE(TRACE_UNREF, TRACE_INVITATION, old - 1, inv, why);
+    if (old == 1) {  // Reference count reached zero, free INVITATION contents
         // Destroy the mutex
         // Free the INVITATION structure itself
-        debug("DECREASED reference count for invitation from (1 - 0) %s", why);
         // Release the client references
         if (inv->sender != NULL) {
             client_unref(inv->sender, "invitation is freed");
@@ -146,15 +163,14 @@ void inv_unref(INVITATION *inv, char *why){
         if (inv->game != NULL) {
             game_unref(inv->game, "invitation is freed");
         }
+        if (inv->state == INV_OPEN_STATE) {
+            metrics_gauge_add(METRICS_INVITATIONS, -1);
+        }
+        spectators_free(atomic_load(&inv->spectators));
         pthread_mutex_destroy(&inv->lock);
-        free(inv);
+        pool_free(&inv_pool, inv);
         debug("freed inv");
-        return;
-    } else {
-        debug("DECREASED reference count for invitation from (%d - %d) %s",
-            inv->ref_count+1, inv->ref_count, why);
     }
-    pthread_mutex_unlock(&inv->lock); 
 }
 
 /*
@@ -224,7 +240,10 @@ GAME_ROLE inv_get_target_role(INVITATION *inv){
 GAME *inv_get_game(INVITATION *inv){
 	if(inv == NULL)
 		return NULL;
-	return inv->game;
+    pthread_mutex_lock(&inv->lock);
+    GAME *game = inv->game;
+    pthread_mutex_unlock(&inv->lock);
+	return game;
 }
 
 /*
@@ -239,19 +258,24 @@ int inv_accept(INVITATION *inv){
 	if (inv == NULL) {
         return -1;
     }
+    // the game is made before taking the lock, which then covers just the change of state
+    GAME *game = game_create_variant(&inv->variant);  // Create new GAME
+    if (game == NULL) {
+        return -1;  // Failed to create new GAME, return error
+    }
     pthread_mutex_lock(&inv->lock);  // Acquire lock on INVITATION structure
 
     if (inv->state != INV_OPEN_STATE) {
         pthread_mutex_unlock(&inv->lock);  // Release lock on INVITATION structure
+        game_unref(game, "invitation was no longer open");
         return -1;  // INVITATION is not in the OPEN state, return error
     }
+    // an ACCEPTED invitation always has its game
+    inv->game = game;
     inv->state = INV_ACCEPTED_STATE;  // Change INVITATION state to ACCEPTED
-    inv->game = game_create();  // Create new GAME
-	if (inv->game == NULL) {
-    	pthread_mutex_unlock(&inv->lock);  // Release lock on INVITATION structure
-        return -1;  // Failed to create new GAME, return error
-    }
     pthread_mutex_unlock(&inv->lock);  // Release lock on INVITATION structure
+    inv_touch(inv);
+    metrics_gauge_add(METRICS_INVITATIONS, -1);
 
     return 0;  // Success
 }
@@ -271,22 +295,127 @@ int inv_accept(INVITATION *inv){
  * @return 0 if the INVITATION was successfully closed, otherwise -1.
  */
 int inv_close(INVITATION *inv, GAME_ROLE role){
-	 if (inv == NULL || (role == NULL_ROLE && inv->game != NULL)) {
+	 if (inv == NULL) {
         return -1;
     }
+    // the state is the arbiter between concurrent accepts, revokes, declines and resignations
     pthread_mutex_lock(&inv->lock);
     if (inv->state != INV_OPEN_STATE && inv->state != INV_ACCEPTED_STATE) {
         pthread_mutex_unlock(&inv->lock);
         return -1;
     }
-    if (inv->state == INV_ACCEPTED_STATE && inv->game != NULL) {
-        // A game is in progress, so resign the appropriate player
-        game_resign(inv->game, role);
+    if (inv->state == INV_ACCEPTED_STATE
+        && (role == NULL_ROLE || game_resign(inv->game, role) == -1)) {
+        // A game is in progress and may not be abandoned, or it is already over
+        pthread_mutex_unlock(&inv->lock);
+        return -1;
     }
 
+    int was_open = inv->state == INV_OPEN_STATE;
     inv->state = INV_CLOSED_STATE;
 
     pthread_mutex_unlock(&inv->lock);
+    if (was_open) {
+        metrics_gauge_add(METRICS_INVITATIONS, -1);
+    }
+    // the caller's reference keeps inv alive if the timer's is the last but one
+    inv_cancel_timer(inv);
     return 0; // success
 }
 
+
+int inv_get_client_id(INVITATION *inv, CLIENT *client){
+    if (inv == NULL) {
+        return -1;
+    }
+    // the source and target never change, so no lock is needed to choose
+    if (client == inv->sender) {
+        return inv->source_id;
+    }
+    if (client == inv->recipient) {
+        return inv->target_id;
+    }
+    return -1;
+}
+
+int inv_set_client_id(INVITATION *inv, CLIENT *client, int id){
+    if (inv == NULL) {
+        return -1;
+    }
+    if (client == inv->sender) {
+        inv->source_id = id;
+    } else if (client == inv->recipient) {
+        inv->target_id = id;
+    } else {
+        return -1;
+    }
+    return 0;
+}
+
+void inv_set_variant(INVITATION *inv, const GAME_VARIANT *variant){
+    inv->variant = *variant;
+}
+
+const GAME_VARIANT *inv_get_variant(INVITATION *inv){
+    return &inv->variant;
+}
+
+SPECTATORS *inv_get_spectators(INVITATION *inv, int create){
+    if (inv == NULL) {
+        return NULL;
+    }
+    SPECTATORS *s = atomic_load(&inv->spectators);
+    if (s != NULL || !create || (s = spectators_create()) == NULL) {
+        return s;
+    }
+    // two first watchers may make one each; the loser uses the winner's
+    SPECTATORS *none = NULL;
+    if (!atomic_compare_exchange_strong(&inv->spectators, &none, s)) {
+        spectators_free(s);
+        s = none;
+    }
+    return s;
+}
+
+static void inv_timer_fired(void *arg){
+    INVITATION *inv = arg;
+    // the timer's reference passes to whoever arms it next
+    unsigned ms = client_expire_invitation(inv);
+    if (ms == 0 || timer_arm(&inv->timer, ms) == -1) {
+        inv_unref(inv, "invitation timer expired");
+        return;
+    }
+    // closed while it was being armed again, after the cancel in inv_close() found nothing
+    pthread_mutex_lock(&inv->lock);
+    int closed = inv->state == INV_CLOSED_STATE;
+    pthread_mutex_unlock(&inv->lock);
+    if (closed) {
+        inv_cancel_timer(inv);
+    }
+}
+
+int inv_arm_timer(INVITATION *inv, unsigned ms){
+    if (inv == NULL) {
+        return -1;
+    }
+    inv_ref(inv, "held by its timer");
+    if (timer_arm(&inv->timer, ms) == -1) {
+        inv_unref(inv, "timer already armed");
+        return -1;
+    }
+    return 0;
+}
+
+void inv_cancel_timer(INVITATION *inv){
+    if (inv != NULL && timer_cancel(&inv->timer)) {
+        inv_unref(inv, "timer cancelled");
+    }
+}
+
+void inv_touch(INVITATION *inv){
+    atomic_store_explicit(&inv->touched, timer_ticks(), memory_order_relaxed);
+}
+
+uint64_t inv_get_touched(INVITATION *inv){
+    return atomic_load_explicit(&inv->touched, memory_order_relaxed);
+}
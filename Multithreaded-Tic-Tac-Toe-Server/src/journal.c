@@ -0,0 +1,467 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "debug.h"
+#include "journal.h"
+#include "player_ext.h"
+#include "player_registry_ext.h"
+#include "leaderboard.h"
+#include "spawn.h"
+
+#define SNAPSHOT_MAGIC "JEUXSNP1"
+#define INITIAL_PLAYERS 1024        // serials the table covers at first
+#define NO_SERIAL UINT32_MAX        // a player the journal could not take in
+
+// types of record
+#define RECORD_PLAYER 1
+#define RECORD_RESULT 2
+
+typedef struct record_header {
+    uint32_t crc;               // CRC-32 of the rest of the header and the payload
+    uint8_t type;
+    uint8_t unused;
+    uint16_t len;               // of the payload
+} RECORD_HEADER;
+
+typedef struct player_record {
+    uint32_t serial;
+    char name[];                // not NUL-terminated; the rest of the payload
+} PLAYER_RECORD;
+
+typedef struct result_record {
+    uint32_t serial1, serial2;
+    double rating1, rating2;    // after the game
+    uint32_t result;            // as for player_post_result()
+    uint32_t unused;
+} RESULT_RECORD;
+
+typedef struct snapshot_header {
+    char magic[8];
+    uint64_t count;             // # of entries, one for each serial
+    uint64_t names_size;        // bytes of names after the entries
+} SNAPSHOT_HEADER;
+
+typedef struct snapshot_entry {
+    double rating;
+    uint64_t name;              // offset of the NUL-terminated name in the names
+} SNAPSHOT_ENTRY;
+
+typedef struct journal {
+    pthread_mutex_t lock;           // protects everything below
+    pthread_cond_t posted;          // records were appended
+    pthread_cond_t written;         // the writer took a buffer, or made one durable
+    int open;                       // whether records are taken
+    int stopping;                   // the writer is to finish
+    pthread_t writer;
+    int fd;                         // of the journal file
+    char *buf;                      // records waiting for the writer
+    size_t len;
+    char *spare;                    // the buffer the writer is writing
+    unsigned long long appended;    // bytes ever appended
+    unsigned long long durable;     // of those, bytes written and synced
+    PLAYER **players;               // by serial
+    uint32_t count;
+    uint32_t capacity;
+    char *snapshot_path;
+    char *tmp_path;
+} JOURNAL;
+
+static JOURNAL journal = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .posted = PTHREAD_COND_INITIALIZER,
+    .written = PTHREAD_COND_INITIALIZER,
+    .fd = -1,
+};
+
+static uint32_t crc_table[256];
+static pthread_once_t crc_once = PTHREAD_ONCE_INIT;
+
+static void build_crc_table(void){
+    for(uint32_t i = 0; i < 256; i++){
+        uint32_t c = i;
+        for(int k = 0; k < 8; k++)
+            c = c & 1 ? 0xedb88320u ^ (c >> 1) : c >> 1;
+        crc_table[i] = c;
+    }
+}
+
+static uint32_t crc32_update(uint32_t crc, const void *data, size_t len){
+    const unsigned char *p = data;
+    while(len-- > 0)
+        crc = crc_table[(crc ^ *p++) & 0xff] ^ (crc >> 8);
+    return crc;
+}
+
+// the CRC of a record read back: everything after the crc field of the header, then the payload
+static uint32_t record_crc(RECORD_HEADER *hdr, const void *payload){
+    pthread_once(&crc_once, build_crc_table);
+    uint32_t crc = crc32_update(~0u, (char *) hdr + sizeof(hdr->crc), sizeof(*hdr) - sizeof(hdr->crc));
+    return ~crc32_update(crc, payload, hdr->len);
+}
+
+static char *path_in(char *dir, char *file){
+    char *path = malloc(strlen(dir) + strlen(file) + 2);
+    if(path != NULL)
+        sprintf(path, "%s/%s", dir, file);
+    return path;
+}
+
+// give a player the next serial; call with the lock if the journal is open
+static int take_player(PLAYER *player){
+    if(journal.count == journal.capacity){
+        uint32_t capacity = journal.capacity > 0 ? 2 * journal.capacity : INITIAL_PLAYERS;
+        PLAYER **players = realloc(journal.players, capacity * sizeof(PLAYER *));
+        if(players == NULL){
+            player_set_serial(player, NO_SERIAL);
+            return -1;
+        }
+        journal.players = players;
+        journal.capacity = capacity;
+    }
+    player_set_serial(player, journal.count);
+    journal.players[journal.count++] = player;
+    return 0;
+}
+
+// copy a record, whose payload is in two pieces, into the buffer; call with the lock
+static void append_locked(int type, void *part1, size_t len1, void *part2, size_t len2){
+    RECORD_HEADER hdr = { .type = type, .len = len1 + len2 };
+    pthread_once(&crc_once, build_crc_table);
+    uint32_t crc = crc32_update(~0u, (char *) &hdr + sizeof(hdr.crc), sizeof(hdr) - sizeof(hdr.crc));
+    crc = crc32_update(crc, part1, len1);
+    hdr.crc = ~(len2 > 0 ? crc32_update(crc, part2, len2) : crc);
+    size_t size = sizeof(hdr) + hdr.len;
+    // the buffer only fills up if the disk cannot keep up
+    while(journal.len + size > JOURNAL_BUFFER_MAX && journal.len > 0){
+        pthread_cond_wait(&journal.written, &journal.lock);
+    }
+    char *out = journal.buf + journal.len;
+    memcpy(out, &hdr, sizeof(hdr));
+    memcpy(out + sizeof(hdr), part1, len1);
+    if(len2 > 0)
+        memcpy(out + sizeof(hdr) + len1, part2, len2);
+    journal.len += size;
+    journal.appended += size;
+    pthread_cond_signal(&journal.posted);
+}
+
+void journal_log_player(PLAYER *player){
+    char *name = player_get_name(player);
+    size_t name_len = strlen(name);
+    PLAYER_RECORD rec;
+
+    pthread_mutex_lock(&journal.lock);
+    // serials are given under the lock, so that they are in the order of the records
+    if(journal.open && name_len <= UINT16_MAX - sizeof(rec) && take_player(player) == 0){
+        rec.serial = player_get_serial(player);
+        append_locked(RECORD_PLAYER, &rec, sizeof(rec), name, name_len);
+    }
+    else{
+        player_set_serial(player, NO_SERIAL);
+    }
+    pthread_mutex_unlock(&journal.lock);
+}
+
+void journal_log_result(PLAYER *player1, PLAYER *player2, int result, double rating1, double rating2){
+    RESULT_RECORD rec = {
+        .serial1 = player_get_serial(player1),
+        .serial2 = player2 != NULL ? player_get_serial(player2) : NO_SERIAL,
+        .rating1 = rating1,
+        .rating2 = rating2,
+        .result = result,
+    };
+    // a game against a user of another node (see cluster.h) rates one player only
+    if(rec.serial1 == NO_SERIAL && rec.serial2 == NO_SERIAL)
+        return;
+    pthread_mutex_lock(&journal.lock);
+    if(journal.open)
+        append_locked(RECORD_RESULT, &rec, sizeof(rec), NULL, 0);
+    pthread_mutex_unlock(&journal.lock);
+}
+
+void journal_sync(void){
+    pthread_mutex_lock(&journal.lock);
+    unsigned long long target = journal.appended;
+    while(journal.open && journal.durable < target){
+        pthread_cond_wait(&journal.written, &journal.lock);
+    }
+    pthread_mutex_unlock(&journal.lock);
+}
+
+static int write_all(int fd, char *buf, size_t len){
+    while(len > 0){
+        ssize_t n = write(fd, buf, len);
+        if(n == -1){
+            if(errno == EINTR)
+                continue;
+            return -1;
+        }
+        buf += n;
+        len -= n;
+    }
+    return 0;
+}
+
+// the group commit: whatever was appended while the last batch was being written is the next batch
+static void *writer_main(void *arg){
+    pthread_mutex_lock(&journal.lock);
+    for(;;){
+        while(journal.len == 0 && !journal.stopping){
+            pthread_cond_wait(&journal.posted, &journal.lock);
+        }
+        if(journal.len == 0)
+            break;
+        char *batch = journal.buf;
+        size_t len = journal.len;
+        journal.buf = journal.spare;
+        journal.spare = batch;
+        journal.len = 0;
+        pthread_cond_broadcast(&journal.written);
+        pthread_mutex_unlock(&journal.lock);
+
+        if(write_all(journal.fd, batch, len) == -1 || fdatasync(journal.fd) == -1){
+            debug("journal: %zu bytes may not have reached the disk", len);
+        }
+
+        pthread_mutex_lock(&journal.lock);
+        journal.durable += len;
+        pthread_cond_broadcast(&journal.written);
+    }
+    pthread_mutex_unlock(&journal.lock);
+    return NULL;
+}
+
+// register a saved player, which must be the next serial
+static PLAYER *load_player(PLAYER_REGISTRY *preg, char *name, double rating){
+    PLAYER *player = preg_load(preg, name, rating);
+    if(player == NULL || take_player(player) == -1)
+        return NULL;
+    return player;
+}
+
+// load the snapshot, if any; -1 if it is there but unusable
+static int load_snapshot(PLAYER_REGISTRY *preg){
+    int fd = open(journal.snapshot_path, O_RDONLY);
+    if(fd == -1)
+        return errno == ENOENT ? 0 : -1;
+    struct stat st;
+    if(fstat(fd, &st) == -1 || (size_t) st.st_size < sizeof(SNAPSHOT_HEADER)){
+        close(fd);
+        return -1;
+    }
+    char *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if(map == MAP_FAILED)
+        return -1;
+    madvise(map, st.st_size, MADV_SEQUENTIAL);
+
+    SNAPSHOT_HEADER *hdr = (SNAPSHOT_HEADER *) map;
+    SNAPSHOT_ENTRY *entries = (SNAPSHOT_ENTRY *) (hdr + 1);
+    char *names = NULL;
+    int ret = -1;
+    if(memcmp(hdr->magic, SNAPSHOT_MAGIC, sizeof(hdr->magic)) == 0
+       && hdr->count <= (st.st_size - sizeof(*hdr)) / sizeof(SNAPSHOT_ENTRY)
+       && sizeof(*hdr) + hdr->count * sizeof(SNAPSHOT_ENTRY) + hdr->names_size == (size_t) st.st_size){
+        names = (char *) (entries + hdr->count);
+        if(hdr->names_size == 0 || names[hdr->names_size - 1] == '\0')
+            ret = 0;
+    }
+    if(ret == 0){
+        preg_reserve(preg, hdr->count);
+        leaderboard_reserve(hdr->count);
+    }
+    for(uint64_t i = 0; ret == 0 && i < hdr->count; i++){
+        if(entries[i].name >= hdr->names_size || load_player(preg, names + entries[i].name, entries[i].rating) == NULL)
+            ret = -1;
+    }
+    munmap(map, st.st_size);
+    return ret;
+}
+
+// apply a record read back from the journal; -1 if it does not fit what was loaded before it
+static int replay_record(PLAYER_REGISTRY *preg, RECORD_HEADER *hdr, char *payload){
+    if(hdr->type == RECORD_PLAYER && hdr->len > sizeof(PLAYER_RECORD)){
+        PLAYER_RECORD *rec = (PLAYER_RECORD *) payload;
+        size_t name_len = hdr->len - sizeof(PLAYER_RECORD);
+        char name[name_len + 1];
+        memcpy(name, rec->name, name_len);
+        name[name_len] = '\0';
+        if(rec->serial < journal.count)     // also in the snapshot
+            return strcmp(player_get_name(journal.players[rec->serial]), name) == 0 ? 0 : -1;
+        if(rec->serial > journal.count)
+            return -1;
+        return load_player(preg, name, PLAYER_INITIAL_RATING) == NULL ? -1 : 0;
+    }
+    if(hdr->type == RECORD_RESULT && hdr->len == sizeof(RESULT_RECORD)){
+        RESULT_RECORD rec;
+        memcpy(&rec, payload, sizeof(rec));
+        if((rec.serial1 >= journal.count && rec.serial1 != NO_SERIAL)
+           || (rec.serial2 >= journal.count && rec.serial2 != NO_SERIAL))
+            return -1;
+        if(rec.serial1 != NO_SERIAL)
+            player_set_rating(journal.players[rec.serial1], rec.rating1);
+        if(rec.serial2 != NO_SERIAL)
+            player_set_rating(journal.players[rec.serial2], rec.rating2);
+        return 0;
+    }
+    return -1;
+}
+
+// replay the journal up to its first bad record, and cut it there; the number of records, or -1
+static long replay_journal(PLAYER_REGISTRY *preg, int *rerated){
+    struct stat st;
+    if(fstat(journal.fd, &st) == -1)
+        return -1;
+    size_t size = st.st_size;
+    if(size == 0)
+        return 0;
+    char *map = mmap(NULL, size, PROT_READ, MAP_PRIVATE, journal.fd, 0);
+    if(map == MAP_FAILED)
+        return -1;
+    madvise(map, size, MADV_SEQUENTIAL);
+    size_t pos = 0;
+    long n = 0;
+    while(pos + sizeof(RECORD_HEADER) <= size){
+        RECORD_HEADER hdr;
+        memcpy(&hdr, map + pos, sizeof(hdr));
+        char *payload = map + pos + sizeof(hdr);
+        if(pos + sizeof(hdr) + hdr.len > size || record_crc(&hdr, payload) != hdr.crc
+           || replay_record(preg, &hdr, payload) == -1)
+            break;
+        pos += sizeof(hdr) + hdr.len;
+        *rerated |= hdr.type == RECORD_RESULT;
+        n++;
+    }
+    munmap(map, size);
+    if(pos < size){
+        debug("journal: the last %zu bytes are incomplete or corrupt, and are cut", size - pos);
+        if(ftruncate(journal.fd, pos) == -1)
+            return -1;
+    }
+    return n;
+}
+
+// save every player through a temporary file, then empty the journal
+static int write_snapshot(void){
+    FILE *f = fopen(journal.tmp_path, "w");
+    if(f == NULL)
+        return -1;
+    SNAPSHOT_HEADER hdr = { .count = journal.count };
+    memcpy(hdr.magic, SNAPSHOT_MAGIC, sizeof(hdr.magic));
+    for(uint32_t i = 0; i < journal.count; i++)
+        hdr.names_size += strlen(player_get_name(journal.players[i])) + 1;
+    int ok = fwrite(&hdr, sizeof(hdr), 1, f) == 1;
+    uint64_t offset = 0;
+    for(uint32_t i = 0; ok && i < journal.count; i++){
+        SNAPSHOT_ENTRY entry = { player_get_exact_rating(journal.players[i]), offset };
+        offset += strlen(player_get_name(journal.players[i])) + 1;
+        ok = fwrite(&entry, sizeof(entry), 1, f) == 1;
+    }
+    for(uint32_t i = 0; ok && i < journal.count; i++){
+        char *name = player_get_name(journal.players[i]);
+        ok = fwrite(name, strlen(name) + 1, 1, f) == 1;
+    }
+    ok = ok && fflush(f) == 0 && fsync(fileno(f)) == 0;
+    if(fclose(f) != 0 || !ok || rename(journal.tmp_path, journal.snapshot_path) == -1){
+        unlink(journal.tmp_path);
+        return -1;
+    }
+    // only once the snapshot has replaced the old one can the journal go
+    if(ftruncate(journal.fd, 0) == -1 || fdatasync(journal.fd) == -1)
+        return -1;
+    return 0;
+}
+
+static void reset(void){
+    if(journal.fd != -1)
+        close(journal.fd);
+    journal.fd = -1;
+    free(journal.buf);
+    free(journal.spare);
+    free(journal.players);
+    free(journal.snapshot_path);
+    free(journal.tmp_path);
+    journal.buf = journal.spare = NULL;
+    journal.players = NULL;
+    journal.snapshot_path = journal.tmp_path = NULL;
+    journal.count = journal.capacity = 0;
+    journal.len = 0;
+    journal.appended = journal.durable = 0;
+    journal.stopping = 0;
+}
+
+int journal_open(char *dir, PLAYER_REGISTRY *preg){
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    if(mkdir(dir, 0755) == -1 && errno != EEXIST)
+        return -1;
+    char *journal_path = path_in(dir, "journal");
+    journal.snapshot_path = path_in(dir, "snapshot");
+    journal.tmp_path = path_in(dir, "snapshot.tmp");
+    journal.buf = malloc(JOURNAL_BUFFER_MAX);
+    journal.spare = malloc(JOURNAL_BUFFER_MAX);
+    if(journal_path == NULL || journal.snapshot_path == NULL || journal.tmp_path == NULL
+       || journal.buf == NULL || journal.spare == NULL
+       || (journal.fd = open(journal_path, O_RDWR | O_CREAT | O_APPEND, 0644)) == -1){
+        free(journal_path);
+        reset();
+        return -1;
+    }
+    free(journal_path);
+
+    long replayed = -1;
+    int rerated = 0;
+    if(load_snapshot(preg) == -1 || (replayed = replay_journal(preg, &rerated)) == -1){
+        debug("journal: the snapshot or the journal in %s cannot be read", dir);
+        reset();
+        return -1;
+    }
+    // players are ranked at the rating they are loaded with, but results replayed move them
+    if(rerated)
+        leaderboard_update(journal.players, journal.count);
+    if(replayed > 0 && write_snapshot() == -1){
+        debug("journal: the snapshot could not be written; the journal is kept");
+    }
+
+    if(spawn(&journal.writer, NULL, writer_main, NULL) != 0){
+        reset();
+        return -1;
+    }
+    pthread_mutex_lock(&journal.lock);
+    journal.open = 1;
+    int count = journal.count;
+    pthread_mutex_unlock(&journal.lock);
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    double ms __attribute__((unused)) = (end.tv_sec - start.tv_sec) * 1e3 + (end.tv_nsec - start.tv_nsec) / 1e6;
+    debug("journal: %d players loaded from %s, %ld records replayed, in %.1f ms", count, dir, replayed, ms);
+    return count;
+}
+
+void journal_fini(void){
+    pthread_mutex_lock(&journal.lock);
+    if(!journal.open){
+        pthread_mutex_unlock(&journal.lock);
+        return;
+    }
+    journal.open = 0;
+    journal.stopping = 1;
+    pthread_cond_signal(&journal.posted);
+    pthread_cond_broadcast(&journal.written);
+    pthread_mutex_unlock(&journal.lock);
+    pthread_join(journal.writer, NULL);
+
+    if(write_snapshot() == -1){
+        debug("journal: the snapshot could not be written; the journal is kept");
+    }
+    reset();
+}
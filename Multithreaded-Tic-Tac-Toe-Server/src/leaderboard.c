@@ -0,0 +1,254 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "debug.h"
+#include "leaderboard.h"
+#include "player_ext.h"
+#include "hash.h"
+
+#define INDEX_INITIAL_SIZE 64   // chains in the name index at first
+#define MAX_NUMBER_LEN 12       // digits of an int, its sign, and the TAB
+
+typedef struct leaderboard_entry {
+    PLAYER *player;
+    uint32_t hash;                              // of the player's name
+    int rating;                                 // the rating it is ranked by
+    struct leaderboard_entry *prev, *next;      // in its bucket
+    struct leaderboard_entry *chain;            // in the name index
+} LEADERBOARD_ENTRY;
+
+typedef struct leaderboard {
+    pthread_rwlock_t lock;                          // protects everything below
+    int tree[LEADERBOARD_BUCKETS + 1];              // Fenwick tree of the bucket sizes, from 1
+    LEADERBOARD_ENTRY *buckets[LEADERBOARD_BUCKETS];
+    int count;                                      // # of players
+    LEADERBOARD_ENTRY **index;                      // chains by hash of the name
+    int index_size;                                 // a power of two
+} LEADERBOARD;
+
+static LEADERBOARD board = { .lock = PTHREAD_RWLOCK_INITIALIZER };
+
+static int bucket_of(int rating){
+    return rating < 0 ? 0 : rating >= LEADERBOARD_BUCKETS ? LEADERBOARD_BUCKETS - 1 : rating;
+}
+
+static void tree_add(int bucket, int delta){
+    for(int i = bucket + 1; i <= LEADERBOARD_BUCKETS; i += i & -i){
+        board.tree[i] += delta;
+    }
+}
+
+// the number of players in buckets 0 to bucket
+static int tree_prefix(int bucket){
+    int sum = 0;
+    for(int i = bucket + 1; i > 0; i -= i & -i){
+        sum += board.tree[i];
+    }
+    return sum;
+}
+
+// the lowest bucket b with tree_prefix(b) >= target, for 1 <= target <= count
+static int tree_find(int target){
+    int pos = 0;
+    for(int step = LEADERBOARD_BUCKETS; step > 0; step >>= 1){
+        if(pos + step <= LEADERBOARD_BUCKETS && board.tree[pos + step] < target){
+            pos += step;
+            target -= board.tree[pos];
+        }
+    }
+    return pos;
+}
+
+static void bucket_insert(LEADERBOARD_ENTRY *entry){
+    int bucket = bucket_of(entry->rating);
+    entry->prev = NULL;
+    entry->next = board.buckets[bucket];
+    if(entry->next != NULL)
+        entry->next->prev = entry;
+    board.buckets[bucket] = entry;
+    tree_add(bucket, 1);
+}
+
+static void bucket_remove(LEADERBOARD_ENTRY *entry){
+    int bucket = bucket_of(entry->rating);
+    if(entry->prev != NULL)
+        entry->prev->next = entry->next;
+    else
+        board.buckets[bucket] = entry->next;
+    if(entry->next != NULL)
+        entry->next->prev = entry->prev;
+    tree_add(bucket, -1);
+}
+
+static int rank_of(LEADERBOARD_ENTRY *entry){
+    return board.count - tree_prefix(bucket_of(entry->rating)) + 1;
+}
+
+static LEADERBOARD_ENTRY **chain_for(uint32_t hash){
+    return &board.index[hash & (board.index_size - 1)];
+}
+
+static LEADERBOARD_ENTRY *find_player(PLAYER *player){
+    if(board.index == NULL)
+        return NULL;
+    LEADERBOARD_ENTRY *entry = *chain_for(player_get_hash(player));
+    while(entry != NULL && entry->player != player){
+        entry = entry->chain;
+    }
+    return entry;
+}
+
+static LEADERBOARD_ENTRY *find_name(char *name){
+    if(board.index == NULL)
+        return NULL;
+    uint32_t hash = hash_string(name);
+    LEADERBOARD_ENTRY *entry = *chain_for(hash);
+    while(entry != NULL && (entry->hash != hash || strcmp(player_get_name(entry->player), name) != 0)){
+        entry = entry->chain;
+    }
+    return entry;
+}
+
+// double the name index once it is fully loaded; call with the write lock
+static void grow_index(void){
+    int size = board.index_size > 0 ? 2 * board.index_size : INDEX_INITIAL_SIZE;
+    LEADERBOARD_ENTRY **index = calloc(size, sizeof(LEADERBOARD_ENTRY *));
+    if(index == NULL){
+        return;         // keep the old index; chains just get longer
+    }
+    LEADERBOARD_ENTRY **old = board.index;
+    int old_size = board.index_size;
+    board.index = index;
+    board.index_size = size;
+    for(int i = 0; i < old_size; i++){
+        LEADERBOARD_ENTRY *entry = old[i];
+        while(entry != NULL){
+            LEADERBOARD_ENTRY *chain = entry->chain;
+            LEADERBOARD_ENTRY **head = chain_for(entry->hash);
+            entry->chain = *head;
+            *head = entry;
+            entry = chain;
+        }
+    }
+    free(old);
+}
+
+int leaderboard_add(PLAYER *player){
+    LEADERBOARD_ENTRY *entry = malloc(sizeof(LEADERBOARD_ENTRY));
+    if(entry == NULL){
+        return -1;
+    }
+    entry->player = player;
+    entry->hash = player_get_hash(player);
+    entry->rating = player_get_rating(player);
+
+    pthread_rwlock_wrlock(&board.lock);
+    if(board.count >= board.index_size){
+        grow_index();
+    }
+    if(board.index == NULL){
+        pthread_rwlock_unlock(&board.lock);
+        free(entry);
+        return -1;
+    }
+    LEADERBOARD_ENTRY **head = chain_for(entry->hash);
+    entry->chain = *head;
+    *head = entry;
+    bucket_insert(entry);
+    int count __attribute__((unused)) = ++board.count;
+    pthread_rwlock_unlock(&board.lock);
+    debug("leaderboard: %s added, %d players", player_get_name(player), count);
+    return 0;
+}
+
+void leaderboard_reserve(int n){
+    pthread_rwlock_wrlock(&board.lock);
+    while(board.index_size < n){
+        int size = board.index_size;
+        grow_index();
+        if(board.index_size == size)
+            break;      // out of memory; it grows as players are added instead
+    }
+    pthread_rwlock_unlock(&board.lock);
+}
+
+void leaderboard_update(PLAYER **players, int n){
+    pthread_rwlock_wrlock(&board.lock);
+    for(int i = 0; i < n; i++){
+        LEADERBOARD_ENTRY *entry = find_player(players[i]);
+        int rating = player_get_rating(players[i]);
+        if(entry == NULL || entry->rating == rating)
+            continue;
+        bucket_remove(entry);
+        entry->rating = rating;
+        bucket_insert(entry);
+    }
+    pthread_rwlock_unlock(&board.lock);
+}
+
+char *leaderboard_top(int k, size_t *lenp){
+    pthread_rwlock_rdlock(&board.lock);
+    int n = k < board.count ? (k < 0 ? 0 : k) : board.count;
+    LEADERBOARD_ENTRY **top = malloc((n + 1) * sizeof(LEADERBOARD_ENTRY *));
+    int *ranks = malloc((n + 1) * sizeof(int));
+    char *reply = NULL;
+    if(top != NULL && ranks != NULL){
+        // down the non-empty buckets; remaining counts the players below those visited
+        int remaining = board.count;
+        int taken = 0;
+        size_t cap = 1;
+        while(taken < n){
+            int bucket = tree_find(remaining);
+            int rank = board.count - remaining + 1;
+            for(LEADERBOARD_ENTRY *entry = board.buckets[bucket]; entry != NULL && taken < n; entry = entry->next){
+                cap += strlen(player_get_name(entry->player)) + 2 * MAX_NUMBER_LEN;
+                ranks[taken] = rank;
+                top[taken++] = entry;
+            }
+            remaining = tree_prefix(bucket - 1);
+        }
+        if((reply = malloc(cap)) != NULL){
+            char *out = reply;
+            for(int i = 0; i < n; i++){
+                out += sprintf(out, "%d\t%s\t%d\n", ranks[i], player_get_name(top[i]->player), top[i]->rating);
+            }
+            *lenp = out - reply;
+        }
+    }
+    pthread_rwlock_unlock(&board.lock);
+    free(top);
+    free(ranks);
+    return reply;
+}
+
+char *leaderboard_rank(char *name, size_t *lenp){
+    pthread_rwlock_rdlock(&board.lock);
+    LEADERBOARD_ENTRY *entry = find_name(name);
+    char *reply = NULL;
+    if(entry != NULL && (reply = malloc(strlen(name) + 2 * MAX_NUMBER_LEN + 1)) != NULL){
+        *lenp = sprintf(reply, "%d\t%s\t%d\n", rank_of(entry), name, entry->rating);
+    }
+    pthread_rwlock_unlock(&board.lock);
+    return reply;
+}
+
+void leaderboard_fini(void){
+    pthread_rwlock_wrlock(&board.lock);
+    for(int i = 0; i < board.index_size; i++){
+        LEADERBOARD_ENTRY *entry = board.index[i];
+        while(entry != NULL){
+            LEADERBOARD_ENTRY *chain = entry->chain;
+            free(entry);
+            entry = chain;
+        }
+    }
+    free(board.index);
+    board.index = NULL;
+    board.index_size = 0;
+    board.count = 0;
+    memset(board.tree, 0, sizeof(board.tree));
+    memset(board.buckets, 0, sizeof(board.buckets));
+    pthread_rwlock_unlock(&board.lock);
+}
@@ -6,8 +6,10 @@
 #include <errno.h>
 #include <signal.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <arpa/inet.h>
 #include <sys/socket.h>
+#include <sys/resource.h>
 #include <getopt.h>
 #include <ctype.h>
 
@@ -15,8 +17,26 @@
 #include "protocol.h"
 #include "server.h"
 #include "client_registry.h"
+#include "client_registry_ext.h"
+#include "client_ext.h"
+#include "proto_decoder.h"
 #include "player_registry.h"
 #include "jeux_globals.h"
+#include "event_loop.h"
+#include "acceptor.h"
+#include "outq.h"
+#include "users_cache.h"
+#include "oracle.h"
+#include "ratings.h"
+#include "leaderboard.h"
+#include "matchmaker.h"
+#include "journal.h"
+#include "metrics.h"
+#include "timer.h"
+#include "trace.h"
+#include "cluster.h"
+#include "upgrade.h"
+#include "spawn.h"
 #include "csapp.h"
 
 #ifdef DEBUG
@@ -24,8 +44,14 @@ int _debug_packets_ = 1;
 #endif
 
 #define PORT_OPTION                 0x1
+#define EVENT_LOOP_OPTION           0x2
+#define NODELAY_OPTION              0x4
 int global_options = 0;
 
+#define SERVICE_STACK_SIZE  (256 * 1024)    // stack of a thread serving one connection
+#define RESERVED_FDS        64              // descriptors needed besides the clients
+#define MAX_TIMEOUT_SECS    1000000         // well within the reach of the timer wheel
+
 static void terminate(int status);
 int *connfdp;
 
@@ -50,12 +76,210 @@ int my_atoi(char *str){
     return atoi(str);
 }
 
+/*
+ * Start a detached service thread for a connection.  SIGHUP is blocked in
+ * the new thread so that it is always the main thread that runs terminate().
+ * With a CPU slot that is not negative, the thread runs only on that CPU.
+ */
+static void spawn_service_thread(int *fdp, int slot){
+    pthread_t tid;
+    pthread_attr_t attr;
+    // the default (typically 8MB) stack would limit how many threads fit
+    pthread_attr_init(&attr);
+    pthread_attr_setstacksize(&attr, SERVICE_STACK_SIZE);
+    if(slot >= 0 && acceptor_pin(&attr, slot) == -1){
+        debug("service thread for fd %d is not pinned", *fdp);
+    }
+    upgrade_reader_expect();
+    if(spawn(&tid, &attr, jeux_client_service, fdp) != 0){
+        debug("pthread_create failed");
+        upgrade_reader_leave();
+        close(*fdp);
+        free(fdp);
+    }
+    pthread_attr_destroy(&attr);
+}
+
+/*
+ * Raise the soft limit on open files so that max_clients connections can
+ * be accepted, as far as the hard limit allows.
+ */
+static void raise_fd_limit(int max_clients){
+    struct rlimit rl;
+    rlim_t want = (rlim_t) max_clients + RESERVED_FDS;
+    if(getrlimit(RLIMIT_NOFILE, &rl) == -1 || rl.rlim_cur >= want){
+        return;
+    }
+    rl.rlim_cur = (rl.rlim_max == RLIM_INFINITY || want <= rl.rlim_max) ? want : rl.rlim_max;
+    if(setrlimit(RLIMIT_NOFILE, &rl) == -1 || rl.rlim_cur < want){
+        fprintf(stderr, "Warning: open file limit %lu is too low for %d clients\n",
+                (unsigned long) rl.rlim_cur, max_clients);
+    }
+}
+
+/*
+ * Report how much user-space memory an idle connection costs in the
+ * selected service mode; kernel socket buffers come on top of this.
+ */
+static void report_footprint(int max_clients){
+    size_t common = client_footprint() + sizeof(CLIENT *) + PROTO_DECODER_DEFAULT_CAPACITY;
+    size_t per_conn;
+    if(global_options & EVENT_LOOP_OPTION){
+        per_conn = common + evl_connection_footprint();
+        fprintf(stderr, "Up to %d clients; %zu bytes per idle connection (event loop)\n",
+                max_clients, per_conn);
+    }
+    else{
+        per_conn = common + SERVICE_STACK_SIZE;
+        fprintf(stderr, "Up to %d clients; %zu bytes per idle connection "
+                "(thread per connection, %d KB of it reserved stack)\n",
+                max_clients, per_conn, SERVICE_STACK_SIZE / 1024);
+    }
+}
+
+/*
+ * Apply per-connection socket options to a newly accepted connection.
+ * With -N, Nagle's algorithm is disabled so that small notifications
+ * (ACK, MOVED, ENDED) are not held back waiting for a delayed ACK.
+ */
+static void configure_connection(int fd){
+    if(global_options & NODELAY_OPTION){
+        int one = 1;
+        if(setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one)) == -1){
+            debug("setsockopt(TCP_NODELAY) failed on fd %d", fd);
+        }
+    }
+}
+
+/*
+ * What the acceptors of -a do with a connection, in either service mode:
+ * serve it on the CPU it was accepted on.
+ */
+static void hand_to_thread(int fd, int slot){
+    int *fdp = malloc(sizeof(int));
+    if(fdp == NULL){
+        close(fd);
+        return;
+    }
+    *fdp = fd;
+    configure_connection(fd);
+    spawn_service_thread(fdp, slot);
+}
+
+static void hand_to_reactor(int fd, int slot){
+    configure_connection(fd);
+    evl_add_connection_on(fd, slot);
+}
+
+/*
+ * Parse the timeouts of -t, a list such as "login=10,idle=300" of
+ * timeouts in seconds, possibly fractional, into client_timeouts.
+ *
+ * @return  0 if the list was valid, -1 otherwise.
+ */
+static int parse_timeouts(char *arg){
+    char *const names[] = { "login", "idle", "invite", "move", NULL };
+    unsigned *timeouts[] = { &client_timeouts.login, &client_timeouts.idle,
+                             &client_timeouts.invite, &client_timeouts.move };
+    // getsubopt() cuts up the list, which is still wanted for the error message
+    char *list = strdup(arg), *opts = list, *value, *end;
+    int ret = list != NULL ? 0 : -1;
+    while(ret == 0 && *opts != '\0'){
+        int i = getsubopt(&opts, names, &value);
+        double secs = i == -1 || value == NULL ? -1 : strtod(value, &end);
+        if(secs < 0 || end == value || *end != '\0' || !(secs <= MAX_TIMEOUT_SECS)){
+            ret = -1;
+            break;
+        }
+        *timeouts[i] = (unsigned) (secs * 1000 + 0.5);
+    }
+    free(list);
+    return ret;
+}
+
+static struct option long_options[] = {
+    {"port",       required_argument, NULL, 'p'},
+    {"event-loop", no_argument,       NULL, 'e'},
+    {"reactors",   required_argument, NULL, 'r'},
+    {"nodelay",    no_argument,       NULL, 'N'},
+    {"queue-limit", required_argument, NULL, 'q'},
+    {"slow-policy", required_argument, NULL, 's'},
+    {"max-clients", required_argument, NULL, 'c'},
+    {"journal",    required_argument, NULL, 'j'},
+    {"metrics",    required_argument, NULL, 'm'},
+    {"trace",      required_argument, NULL, 'T'},
+    {"acceptors",  required_argument, NULL, 'a'},
+    {"backend",    required_argument, NULL, 'b'},
+    {"timeouts",   required_argument, NULL, 't'},
+    {"cluster",    required_argument, NULL, 'C'},
+    {"node",       required_argument, NULL, 'n'},
+    {"upgrade",    required_argument, NULL, 'U'},
+    {NULL, 0, NULL, 0}
+};
+
 int port = 0;
+int reactors = EVL_DEFAULT_REACTORS;
+int acceptors = 0;
+int max_clients = MAX_CLIENTS;
 char *host = "localhost";
+char *journal_dir = NULL;
+char *metrics_port = NULL;
+char *trace_file = NULL;
+char *cluster_list = NULL;
+int cluster_node = 0;
+char *upgrade_path = NULL;
 /*
  * "Jeux" game server.
  *
- * Usage: jeux <port>
+ * Usage: jeux -p <port> [-e] [-r <reactors>] [-N] [-q <limit>] [-s drop|coalesce]
+ *            [-c <max_clients>] [-j <dir>]
+ *            [-m <port>] [-T <file>] [-a <acceptors>] [-b epoll|uring]
+ *            [-t login=<s>,idle=<s>,invite=<s>,move=<s>]
+ *            [-C <host>:<port>:<link port>,... -n <index>] [-U <path>]
+ *
+ *   -p, --port <port>       port on which to listen (required)
+ *   -e, --event-loop        serve connections from epoll reactor threads
+ *                           instead of one thread per connection
+ *   -r, --reactors <n>      number of reactor threads (default: one per CPU)
+ *   -N, --nodelay           set TCP_NODELAY on accepted connections
+ *   -q, --queue-limit <n>   packets that may wait for a slow client
+ *                           (default: 256)
+ *   -s, --slow-policy <p>   what to do with a client over the limit: "drop"
+ *                           it (default), or "coalesce" superseded MOVED
+ *                           packets and drop it only at twice the limit
+ *   -c, --max-clients <n>   maximum number of simultaneous clients
+ *                           (default: 64)
+ *   -j, --journal <dir>     keep the players and their ratings in <dir>
+ *                           across restarts (see journal.h)
+ *   -m, --metrics <port>    serve the metrics (see metrics.h) over HTTP,
+ *                           for Prometheus, on a second port
+ *   -T, --trace <file>      trace from the start, into <file> (see trace.h);
+ *                           without it, SIGUSR1 starts and stops tracing
+ *   -a, --acceptors <n>     accept on n threads, each with its own
+ *                           SO_REUSEPORT socket and pinned to a CPU, and
+ *                           serve each connection on the CPU that accepted
+ *                           it (see acceptor.h); the reactors of -e are
+ *                           then pinned as well
+ *   -b, --backend <b>       what the reactors of -e wait with: "epoll"
+ *                           (default), or "uring" for io_uring (see
+ *                           uring_loop.h), falling back to epoll where the
+ *                           kernel lacks it; implies -e
+ *   -t, --timeouts <list>   enforce timeouts, in seconds (see client_ext.h):
+ *                           "login" to log in after connecting, "idle"
+ *                           between packets, "invite" for an invitation to
+ *                           be accepted before it is revoked, and "move"
+ *                           for a player to move before resigning; those
+ *                           not listed are not enforced (the default)
+ *   -C, --cluster <list>    run as a node of a cluster whose nodes, this
+ *                           one included, are listed in the same order at
+ *                           every node (see cluster.h); not with -e or -b
+ *   -n, --node <index>      the index of this node in the list of -C
+ *                           (default: 0)
+ *   -U, --upgrade <path>    take over the listening socket and the clients
+ *                           of the server started with the same -U, if it
+ *                           is running, and hand them over in turn to the
+ *                           next one (see upgrade.h); not with -a, -C or
+ *                           io_uring
  */
 int main(int argc, char* argv[]){
     // Option processing should be performed here.
@@ -63,7 +287,7 @@ int main(int argc, char* argv[]){
     // on which the server should listen.
     int opt;
     char *portstr;
-    while ((opt = getopt(argc, argv, "p:")) != -1) {
+    while ((opt = getopt_long(argc, argv, "p:er:Nq:s:c:j:m:T:a:b:t:C:n:U:", long_options, NULL)) != -1) {
         switch (opt) {
             case 'p':
                 global_options |= PORT_OPTION;
@@ -73,6 +297,92 @@ int main(int argc, char* argv[]){
                 }
                 portstr = optarg;
                 break;
+            case 'e':
+                global_options |= EVENT_LOOP_OPTION;
+                break;
+            case 'r':
+                if( (reactors = my_atoi(optarg)) == -1){
+                    fprintf(stderr, "Invalid number of reactors\n");
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 'N':
+                global_options |= NODELAY_OPTION;
+                break;
+            case 'q':
+                if( (outq_limit = my_atoi(optarg)) <= 0){
+                    fprintf(stderr, "Invalid queue limit\n");
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 's':
+                if(strcmp(optarg, "drop") == 0){
+                    outq_policy = OUTQ_DROP;
+                }
+                else if(strcmp(optarg, "coalesce") == 0){
+                    outq_policy = OUTQ_COALESCE;
+                }
+                else{
+                    fprintf(stderr, "Invalid slow-consumer policy: %s\n", optarg);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 'c':
+                if( (max_clients = my_atoi(optarg)) <= 0){
+                    fprintf(stderr, "Invalid maximum number of clients\n");
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 'j':
+                journal_dir = optarg;
+                break;
+            case 'm':
+                if(my_atoi(optarg) <= 0){
+                    fprintf(stderr, "Invalid metrics port\n");
+                    exit(EXIT_FAILURE);
+                }
+                metrics_port = optarg;
+                break;
+            case 'T':
+                trace_file = optarg;
+                break;
+            case 'b':
+                global_options |= EVENT_LOOP_OPTION;
+                if(strcmp(optarg, "epoll") == 0){
+                    evl_backend = EVL_EPOLL;
+                }
+                else if(strcmp(optarg, "uring") == 0){
+                    evl_backend = EVL_URING;
+                }
+                else{
+                    fprintf(stderr, "Invalid backend: %s\n", optarg);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 'a':
+                if( (acceptors = my_atoi(optarg)) <= 0){
+                    fprintf(stderr, "Invalid number of acceptors\n");
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 't':
+                if(parse_timeouts(optarg) == -1){
+                    fprintf(stderr, "Invalid timeouts: %s\n", optarg);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 'C':
+                cluster_list = optarg;
+                break;
+            case 'n':
+                if( (cluster_node = my_atoi(optarg)) == -1){
+                    fprintf(stderr, "Invalid node index\n");
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 'U':
+                upgrade_path = optarg;
+                break;
             default:
                 break;
         }
@@ -83,11 +393,61 @@ int main(int argc, char* argv[]){
         fprintf(stderr, "Missing required port option\n");
         exit(EXIT_FAILURE);
     }
+    if(cluster_list != NULL && cluster_configure(cluster_list, cluster_node) == -1){
+        fprintf(stderr, "Invalid cluster: %s (node %d)\n", cluster_list, cluster_node);
+        exit(EXIT_FAILURE);
+    }
+    // a request forwarded to another node is waited for on the thread that got it
+    if(cluster_list != NULL && (global_options & EVENT_LOOP_OPTION)){
+        fprintf(stderr, "-C cannot be used with -e or -b\n");
+        exit(EXIT_FAILURE);
+    }
+    // the sockets of -a, the links of -C and the rings of io_uring cannot be handed over
+    if(upgrade_path != NULL && (acceptors > 0 || cluster_list != NULL || evl_backend == EVL_URING)){
+        fprintf(stderr, "-U cannot be used with -a, -C or -b uring\n");
+        exit(EXIT_FAILURE);
+    }
+    if(upgrade_path != NULL && upgrade_configure(upgrade_path) == -1){
+        fprintf(stderr, "Invalid upgrade socket: %s\n", upgrade_path);
+        exit(EXIT_FAILURE);
+    }
+
+    // before any other thread exists, so that all of them leave SIGUSR1 to the tracer
+    if(trace_init(trace_file, trace_file != NULL) == -1){
+        fprintf(stderr, "Cannot start tracing\n");
+        exit(EXIT_FAILURE);
+    }
 
     // Perform required initializations of the client_registry and
     // player_registry.
     client_registry = creg_init();
     player_registry = preg_init();
+    creg_set_max_clients(client_registry, max_clients);
+    raise_fd_limit(max_clients);
+    report_footprint(max_clients);
+    // the perfect-play table is built before any game can need it
+    oracle_init();
+    if((client_timeouts.login || client_timeouts.idle || client_timeouts.invite || client_timeouts.move)
+       && timers_start() == -1){
+        fprintf(stderr, "Cannot start the timer thread\n");
+        exit(EXIT_FAILURE);
+    }
+
+    // the old server of -U waits from here on, so as little as possible is left to do
+    int listenfd = -1;
+    if(upgrade_begin(&listenfd) == -1){
+        fprintf(stderr, "Cannot take over from the server at %s\n", upgrade_path);
+        exit(EXIT_FAILURE);
+    }
+    if(journal_dir != NULL && journal_open(journal_dir, player_registry) == -1){
+        fprintf(stderr, "Cannot use the journal in %s\n", journal_dir);
+        exit(EXIT_FAILURE);
+    }
+    // on failure the old server carries on, with the sockets this one must not shut down
+    if(upgrade_finish() == -1){
+        fprintf(stderr, "Cannot take over from the server at %s\n", upgrade_path);
+        exit(EXIT_FAILURE);
+    }
 
     // In addition, you should install a SIGHUP handler, so that receipt of SIGHUP will perform a clean shutdown of the server.
     struct sigaction sa;
@@ -110,25 +470,73 @@ int main(int argc, char* argv[]){
         exit(EXIT_FAILURE);
     }
 
-    int listenfd;
-    socklen_t clientlen;
-    struct sockaddr_storage clientaddr;
-    listenfd = Open_listenfd(portstr);
-    pthread_t tid;
+    if(acceptors == 0 && listenfd < 0){
+        listenfd = Open_listenfd(portstr);
+    }
+    if(upgrade_listen() == -1){
+        fprintf(stderr, "Cannot listen for an upgrade at %s\n", upgrade_path);
+        terminate(EXIT_FAILURE);
+    }
+    if(metrics_port != NULL && metrics_serve(metrics_port) == -1){
+        fprintf(stderr, "Cannot serve metrics on port %s\n", metrics_port);
+        terminate(EXIT_FAILURE);
+    }
+    if(cluster_start() == -1){
+        fprintf(stderr, "Cannot start the cluster links\n");
+        terminate(EXIT_FAILURE);
+    }
+
+    if(global_options & EVENT_LOOP_OPTION){
+        EVL_BACKEND wanted = evl_backend;
+        if(evl_start(reactors, acceptors > 0) == -1){
+            fprintf(stderr, "Failed to start the event loop\n");
+            terminate(EXIT_FAILURE);
+        }
+        if(evl_backend != wanted){
+            fprintf(stderr, "Warning: io_uring is not available; using epoll\n");
+        }
+    }
+    upgrade_serve((global_options & EVENT_LOOP_OPTION) ? hand_to_reactor : hand_to_thread);
+    if(acceptors > 0){
+        ACCEPTOR_HANDOFF *handoff = (global_options & EVENT_LOOP_OPTION) ? hand_to_reactor : hand_to_thread;
+        if(acceptors_start(portstr, acceptors, handoff) == -1){
+            fprintf(stderr, "Cannot start %d acceptors on port %s\n", acceptors, portstr);
+            terminate(EXIT_FAILURE);
+        }
+        // the acceptors do the rest; this thread is left to take SIGHUP
+        while(1){
+            pause();
+        }
+    }
+
+    if(global_options & EVENT_LOOP_OPTION){
+        while(1){
+            int connfd = upgrade_accept(listenfd);
+            if(connfd < 0){
+                terminate(EXIT_FAILURE);
+            }
+            configure_connection(connfd);
+            evl_add_connection(connfd);
+        }
+    }
 
     while(1){
-        clientlen = sizeof(struct sockaddr_storage);
         connfdp = malloc(sizeof(int));
         if(connfdp == NULL){
             terminate(EXIT_FAILURE);
         }
         memset(connfdp, 0, sizeof(int));
-        *connfdp = Accept(listenfd, (struct sockaddr *)&clientaddr, &clientlen);
+        *connfdp = upgrade_accept(listenfd);
         if(*connfdp < 0){
             free(connfdp);
+            connfdp = NULL;
             terminate(EXIT_FAILURE);
         }
-        pthread_create(&tid,NULL,jeux_client_service,connfdp);
+        configure_connection(*connfdp);
+        // from here on the service thread owns (and frees) the descriptor's box
+        int *fdp = connfdp;
+        connfdp = NULL;
+        spawn_service_thread(fdp, -1);
         // break;
     }
 
@@ -143,6 +551,9 @@ int main(int argc, char* argv[]){
  * Function called to cleanly shut down the server.
  */
 static void terminate(int status) {
+    // No more connections come in from the acceptors of -a.
+    acceptors_stop();
+
     // Shutdown all client connections.
     // This will trigger the eventual termination of service threads.
     creg_shutdown_all(client_registry);
@@ -152,8 +563,14 @@ static void terminate(int status) {
     debug("%ld: All service threads terminated.", pthread_self());
 
     // Finalize modules.
+    matchmaker_fini();
     creg_fini(client_registry);
+    ratings_fini();
+    journal_fini();
+    leaderboard_fini();
     preg_fini(player_registry);
+    users_cache_fini();
+    trace_fini();
     debug("%ld: Jeux server terminating", pthread_self());
     exit(status);
 }
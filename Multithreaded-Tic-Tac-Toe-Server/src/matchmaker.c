@@ -0,0 +1,275 @@
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "debug.h"
+#include "matchmaker.h"
+#include "client_ext.h"
+#include "player.h"
+#include "pool.h"
+#include "upgrade.h"
+#include "spawn.h"
+
+#define INDEX_INITIAL_SIZE 64   // connections the seeker index covers at first
+#define RETRY_SECS 1            // how long unpaired seekers wait before another look
+
+typedef struct seeker {
+    CLIENT *client;                     // retained while in the pool
+    int rating;                         // when it started seeking
+    int band;                           // of that rating
+    unsigned long order;                // seekers are numbered as they arrive
+    double since;                       // when it started seeking, in seconds
+    struct seeker *prev, *next;         // in its band, oldest first
+} SEEKER;
+
+typedef struct matchmaker {
+    pthread_mutex_t lock;               // protects everything below
+    pthread_cond_t arrived;             // signaled when a seeker joins the pool
+    SEEKER *heads[MATCH_BANDS];         // oldest seeker of each band
+    SEEKER *tails[MATCH_BANDS];         // newest seeker of each band
+    SEEKER **index;                     // seeker of each connection, by file descriptor
+    int index_size;
+    int count;                          // # of seekers
+    unsigned long num_arrived;          // # of seekers ever, for their order
+} MATCHMAKER;
+
+typedef struct pair {
+    CLIENT *first, *second;             // the references held by their seekers
+} PAIR;
+
+static MATCHMAKER matchmaker = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .arrived = PTHREAD_COND_INITIALIZER,
+};
+static POOL seeker_pool = POOL_INITIALIZER("seeker", sizeof(SEEKER));
+static pthread_once_t matcher_once = PTHREAD_ONCE_INIT;
+
+static double now_secs(void){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int band_of(int rating){
+    int band = rating / MATCH_BAND_WIDTH;
+    return band < 0 ? 0 : band >= MATCH_BANDS ? MATCH_BANDS - 1 : band;
+}
+
+// call with the lock for the rest of these
+static void band_append(SEEKER *s){
+    s->next = NULL;
+    s->prev = matchmaker.tails[s->band];
+    if(s->prev != NULL)
+        s->prev->next = s;
+    else
+        matchmaker.heads[s->band] = s;
+    matchmaker.tails[s->band] = s;
+}
+
+// take a seeker out of its band and the index; its reference goes to the caller
+static CLIENT *band_remove(SEEKER *s){
+    if(s->prev != NULL)
+        s->prev->next = s->next;
+    else
+        matchmaker.heads[s->band] = s->next;
+    if(s->next != NULL)
+        s->next->prev = s->prev;
+    else
+        matchmaker.tails[s->band] = s->prev;
+    matchmaker.index[client_get_fd(s->client)] = NULL;
+    matchmaker.count--;
+    CLIENT *client = s->client;
+    pool_free(&seeker_pool, s);
+    return client;
+}
+
+// make room in the index for a file descriptor
+static int index_cover(int fd){
+    if(fd < matchmaker.index_size)
+        return 0;
+    int size = matchmaker.index_size > 0 ? matchmaker.index_size : INDEX_INITIAL_SIZE;
+    while(size <= fd)
+        size *= 2;
+    SEEKER **index = realloc(matchmaker.index, size * sizeof(SEEKER *));
+    if(index == NULL)
+        return -1;
+    memset(index + matchmaker.index_size, 0, (size - matchmaker.index_size) * sizeof(SEEKER *));
+    matchmaker.index = index;
+    matchmaker.index_size = size;
+    return 0;
+}
+
+static SEEKER *find_seeker(CLIENT *client){
+    int fd = client_get_fd(client);
+    if(fd < 0 || fd >= matchmaker.index_size)
+        return NULL;
+    SEEKER *s = matchmaker.index[fd];
+    return s != NULL && s->client == client ? s : NULL;
+}
+
+int matchmaker_compatible(int rating1, int rating2, double waited){
+    int reach = (int) (waited / MATCH_WIDEN_SECS);
+    return abs(rating1 - rating2) <= MATCH_BAND_WIDTH * (1 + reach);
+}
+
+// whether two seekers may play, the longer waiter deciding how far apart they can be
+static int compatible(SEEKER *a, SEEKER *b, double now){
+    double since = a->since < b->since ? a->since : b->since;
+    return matchmaker_compatible(a->rating, b->rating, now - since);
+}
+
+/*
+ * One pass up the bands, oldest first within each, pairing every seeker
+ * with the next one compatible with it.  A seeker left unpaired in one
+ * band is carried to the next, where it is paired with the oldest there
+ * if their ratings are close enough, and otherwise stays for a later pass.
+ */
+static int match_batch(PAIR *pairs, double now){
+    int n = 0;
+    SEEKER *carry = NULL;
+    for(int band = 0; band < MATCH_BANDS && n < MATCH_MAX_BATCH; band++){
+        SEEKER *s = matchmaker.heads[band];
+        while(s != NULL && n < MATCH_MAX_BATCH){
+            SEEKER *next = s->next;
+            if(carry != NULL && compatible(carry, s, now)){
+                // whoever sought first plays first
+                int carry_first = carry->order < s->order;
+                CLIENT *c1 = band_remove(carry);
+                CLIENT *c2 = band_remove(s);
+                pairs[n].first = carry_first ? c1 : c2;
+                pairs[n++].second = carry_first ? c2 : c1;
+                carry = NULL;
+            }
+            else{
+                carry = s;
+            }
+            s = next;
+        }
+    }
+    return n;
+}
+
+// put a seeker in the pool, with the lock held; a reference to client is taken
+static int enter_pool(CLIENT *client, double since){
+    if(!client_is_logged_in(client) || find_seeker(client) != NULL)
+        return -1;
+    SEEKER *s;
+    if(index_cover(client_get_fd(client)) == -1 || (s = pool_alloc(&seeker_pool)) == NULL)
+        return -1;
+    s->client = client_ref(client, "seeking a game");
+    s->rating = player_get_rating(client_get_player(client));
+    s->band = band_of(s->rating);
+    s->order = matchmaker.num_arrived++;
+    s->since = since;
+    band_append(s);
+    matchmaker.index[client_get_fd(client)] = s;
+    matchmaker.count++;
+    pthread_cond_signal(&matchmaker.arrived);
+    return 0;
+}
+
+static void *matcher_main(void *arg){
+    static PAIR pairs[MATCH_MAX_BATCH];
+    for(;;){
+        pthread_mutex_lock(&matchmaker.lock);
+        while(matchmaker.count < 2){
+            pthread_cond_wait(&matchmaker.arrived, &matchmaker.lock);
+        }
+        pthread_mutex_unlock(&matchmaker.lock);
+        // seekers taken from the pool are in no game until they are started,
+        // so a hot upgrade must not come in between (see upgrade.h)
+        upgrade_enter();
+        pthread_mutex_lock(&matchmaker.lock);
+        double now = now_secs();
+        int n = match_batch(pairs, now);
+        if(n == 0){
+            upgrade_leave();
+            // nobody is close enough yet; the bands widen as they wait
+            struct timespec until;
+            clock_gettime(CLOCK_REALTIME, &until);
+            until.tv_sec += RETRY_SECS;
+            pthread_cond_timedwait(&matchmaker.arrived, &matchmaker.lock, &until);
+        }
+        pthread_mutex_unlock(&matchmaker.lock);
+        if(n > 0)
+            debug("matchmaker: %d games to start", n);
+
+        for(int i = 0; i < n; i++){
+            if(client_start_matched_game(pairs[i].first, pairs[i].second) == -1){
+                // one of them is logging out; the other goes back, as if it had just arrived
+                double since = now_secs();
+                pthread_mutex_lock(&matchmaker.lock);
+                enter_pool(pairs[i].first, since);
+                enter_pool(pairs[i].second, since);
+                pthread_mutex_unlock(&matchmaker.lock);
+            }
+            client_unref(pairs[i].first, "matched");
+            client_unref(pairs[i].second, "matched");
+        }
+        if(n > 0)
+            upgrade_leave();
+    }
+    return NULL;
+}
+
+static void matcher_start(void){
+    if(spawn(NULL, NULL, matcher_main, NULL) != 0){
+        debug("matchmaker: no matcher thread; seekers will wait forever");
+    }
+}
+
+int matchmaker_seek(CLIENT *client){
+    if(client == NULL)
+        return -1;
+    pthread_once(&matcher_once, matcher_start);
+    double since = now_secs();
+    pthread_mutex_lock(&matchmaker.lock);
+    int ret = enter_pool(client, since);
+    int count __attribute__((unused)) = matchmaker.count;
+    pthread_mutex_unlock(&matchmaker.lock);
+    if(ret == 0)
+        debug("matchmaker: %d seeking", count);
+    return ret;
+}
+
+int matchmaker_withdraw(CLIENT *client){
+    if(client == NULL)
+        return -1;
+    pthread_mutex_lock(&matchmaker.lock);
+    SEEKER *s = find_seeker(client);
+    if(s != NULL)
+        band_remove(s);
+    pthread_mutex_unlock(&matchmaker.lock);
+    if(s == NULL)
+        return -1;
+    client_unref(client, "no longer seeking");
+    return 0;
+}
+
+int matchmaker_is_seeking(CLIENT *client){
+    pthread_mutex_lock(&matchmaker.lock);
+    int seeking = find_seeker(client) != NULL;
+    pthread_mutex_unlock(&matchmaker.lock);
+    return seeking;
+}
+
+void matchmaker_fini(void){
+    pthread_mutex_lock(&matchmaker.lock);
+    int n = 0;
+    CLIENT **clients = malloc((matchmaker.count + 1) * sizeof(CLIENT *));
+    for(int band = 0; band < MATCH_BANDS; band++){
+        while(matchmaker.heads[band] != NULL){
+            CLIENT *client = band_remove(matchmaker.heads[band]);
+            if(clients != NULL)
+                clients[n++] = client;
+        }
+    }
+    free(matchmaker.index);
+    matchmaker.index = NULL;
+    matchmaker.index_size = 0;
+    pthread_mutex_unlock(&matchmaker.lock);
+    for(int i = 0; i < n; i++)
+        client_unref(clients[i], "matchmaker finished");
+    free(clients);
+}
@@ -0,0 +1,458 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <stdatomic.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+
+#include "debug.h"
+#include "csapp.h"
+#include "metrics.h"
+#include "protocol_ext.h"
+#include "trace.h"
+#include "spawn.h"
+
+#define NUM_TYPES (JEUX_WATCH_PKT + 1)
+#define REQUEST_MAX 1024            // bytes of an HTTP request that are looked at
+#define HTTP_TIMEOUT_SECS 1         // how long a scraper may take to send its request
+
+typedef struct histogram {
+    _Atomic uint64_t counts[METRICS_HIST_SIZE];
+    _Atomic uint64_t sum;                       // of the values, in nanoseconds
+} HISTOGRAM;
+
+typedef struct shard {
+    atomic_int shared;                          // updated by more than one thread
+    HISTOGRAM requests[NUM_TYPES];              // handling times, by packet type
+    _Atomic uint64_t acquired[METRICS_NUM_LOCKS];
+    _Atomic uint64_t syscalls[METRICS_NUM_SYSCALLS];
+    HISTOGRAM waits[METRICS_NUM_LOCKS];         // of the acquisitions that had to wait
+    struct shard *next_free;                    // when no thread holds it
+} SHARD;
+
+static const char *type_names[NUM_TYPES] = {
+    [JEUX_LOGIN_PKT] = "login",
+    [JEUX_USERS_PKT] = "users",
+    [JEUX_INVITE_PKT] = "invite",
+    [JEUX_REVOKE_PKT] = "revoke",
+    [JEUX_ACCEPT_PKT] = "accept",
+    [JEUX_DECLINE_PKT] = "decline",
+    [JEUX_MOVE_PKT] = "move",
+    [JEUX_RESIGN_PKT] = "resign",
+    [JEUX_ANALYZE_PKT] = "analyze",
+    [JEUX_LEADERBOARD_PKT] = "leaderboard",
+    [JEUX_SEEK_PKT] = "seek",
+    [JEUX_STATS_PKT] = "stats",
+    [JEUX_WATCH_PKT] = "watch",
+};
+
+static const char *lock_names[METRICS_NUM_LOCKS] = {
+    [METRICS_LOCK_CREG] = "client_registry",
+    [METRICS_LOCK_PREG] = "player_registry",
+    [METRICS_LOCK_CLIENT] = "client",
+};
+
+static const char *syscall_names[METRICS_NUM_SYSCALLS] = {
+    [METRICS_SYSCALL_RECV] = "recv",
+    [METRICS_SYSCALL_SEND] = "send",
+    [METRICS_SYSCALL_EPOLL_WAIT] = "epoll_wait",
+    [METRICS_SYSCALL_URING_ENTER] = "io_uring_enter",
+};
+
+static const char *timeout_names[METRICS_NUM_TIMEOUTS] = {
+    [METRICS_TIMEOUT_LOGIN] = "login",
+    [METRICS_TIMEOUT_IDLE] = "idle",
+    [METRICS_TIMEOUT_INVITE] = "invite",
+    [METRICS_TIMEOUT_MOVE] = "move",
+};
+static _Atomic uint64_t timeouts[METRICS_NUM_TIMEOUTS];
+
+static const struct {
+    const char *name, *help;
+} gauge_info[METRICS_NUM_GAUGES] = {
+    [METRICS_CLIENTS] = { "jeux_clients", "Connections registered." },
+    [METRICS_PLAYERS] = { "jeux_players_logged_in", "Clients logged in." },
+    [METRICS_INVITATIONS] = { "jeux_invitations_open", "Invitations neither accepted nor closed." },
+    [METRICS_GAMES] = { "jeux_games_active", "Games in progress." },
+    [METRICS_SPECTATORS] = { "jeux_spectators", "Clients watching games, once for each game watched." },
+};
+
+static atomic_long gauges[METRICS_NUM_GAUGES];
+
+static SHARD *shards[METRICS_MAX_SHARDS];       // every shard ever made, for reports
+static int num_shards;
+static SHARD *free_shards;                      // shards of threads that have exited
+static unsigned int next_shared;                // the shard to be shared next
+static SHARD fallback = { .shared = 1 };        // if no shard can be allocated at all
+static pthread_mutex_t shards_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static __thread SHARD *my_shard;
+static pthread_key_t shard_key;
+static pthread_once_t shard_once = PTHREAD_ONCE_INIT;
+
+// key destructor: a thread is exiting, and its shard goes to the next one
+static void shard_release(void *arg){
+    SHARD *shard = arg;
+    pthread_mutex_lock(&shards_lock);
+    shard->next_free = free_shards;
+    free_shards = shard;
+    pthread_mutex_unlock(&shards_lock);
+}
+
+static void shard_key_create(void){
+    pthread_key_create(&shard_key, shard_release);
+}
+
+static SHARD *claim_shard(void){
+    pthread_once(&shard_once, shard_key_create);
+    pthread_mutex_lock(&shards_lock);
+    SHARD *shard = free_shards;
+    if(shard != NULL){
+        free_shards = shard->next_free;
+    }
+    else if(num_shards < METRICS_MAX_SHARDS && (shard = calloc(1, sizeof(SHARD))) != NULL){
+        shards[num_shards++] = shard;
+    }
+    if(shard != NULL){
+        pthread_mutex_unlock(&shards_lock);
+        pthread_setspecific(shard_key, shard);
+        return shard;
+    }
+    // too many threads: join one that already has a shard
+    shard = num_shards > 0 ? shards[next_shared++ % num_shards] : &fallback;
+    atomic_store_explicit(&shard->shared, 1, memory_order_relaxed);
+    pthread_mutex_unlock(&shards_lock);
+    debug("metrics: a thread shares a shard (%d exist)", num_shards);
+    return shard;
+}
+
+static SHARD *get_shard(void){
+    SHARD *shard = my_shard;
+    if(shard == NULL){
+        shard = my_shard = claim_shard();
+    }
+    return shard;
+}
+
+/*
+ * Add to a counter of a shard.  The owner of an unshared shard is the
+ * only writer, so it needs no read-modify-write; readers may see a count
+ * a moment old, but never a torn one.  (An increment in flight when the
+ * shard becomes shared may be lost.)
+ */
+static void bump(SHARD *shard, _Atomic uint64_t *counter, uint64_t n){
+    if(atomic_load_explicit(&shard->shared, memory_order_relaxed)){
+        atomic_fetch_add_explicit(counter, n, memory_order_relaxed);
+    }
+    else{
+        atomic_store_explicit(counter, atomic_load_explicit(counter, memory_order_relaxed) + n,
+                              memory_order_relaxed);
+    }
+}
+
+static int hist_index(uint64_t ns){
+    if(ns > METRICS_HIST_MAX_NS){
+        ns = METRICS_HIST_MAX_NS;
+    }
+    if(ns < METRICS_HIST_SUB){
+        return ns;
+    }
+    int shift = 63 - __builtin_clzll(ns) - METRICS_HIST_SUB_BITS;
+    return (shift + 1) * METRICS_HIST_SUB + (int) (ns >> shift) - METRICS_HIST_SUB;
+}
+
+// the middle of a bucket
+static double hist_value(int i){
+    if(i < METRICS_HIST_SUB){
+        return i;
+    }
+    int shift = i / METRICS_HIST_SUB - 1;
+    uint64_t low = (uint64_t) (METRICS_HIST_SUB + i % METRICS_HIST_SUB) << shift;
+    return low + ((1ull << shift) - 1) / 2.0;
+}
+
+static void hist_record(SHARD *shard, HISTOGRAM *hist, uint64_t ns){
+    bump(shard, &hist->counts[hist_index(ns)], 1);
+    bump(shard, &hist->sum, ns);
+}
+
+uint64_t metrics_now(void){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+void metrics_packet(int type, uint64_t start){
+    if(type < 0 || type >= NUM_TYPES){
+        return;
+    }
+    SHARD *shard = get_shard();
+    hist_record(shard, &shard->requests[type], metrics_now() - start);
+}
+
+void metrics_syscall(METRICS_SYSCALL call){
+    SHARD *shard = get_shard();
+    bump(shard, &shard->syscalls[call], 1);
+}
+
+void metrics_timeout(METRICS_TIMEOUT timeout){
+    atomic_fetch_add_explicit(&timeouts[timeout], 1, memory_order_relaxed);
+}
+
+void metrics_gauge_add(METRICS_GAUGE gauge, int delta){
+    atomic_fetch_add_explicit(&gauges[gauge], delta, memory_order_relaxed);
+}
+
+long metrics_gauge_get(METRICS_GAUGE gauge){
+    return atomic_load_explicit(&gauges[gauge], memory_order_relaxed);
+}
+
+void metrics_mutex_lock(pthread_mutex_t *mutex, METRICS_LOCK lock){
+    SHARD *shard = get_shard();
+    bump(shard, &shard->acquired[lock], 1);
+    if(pthread_mutex_trylock(mutex) == 0){
+        TRACE(TRACE_LOCK, lock, 0, mutex, 0);
+        return;
+    }
+    uint64_t start = metrics_now();
+    pthread_mutex_lock(mutex);
+    uint64_t waited = metrics_now() - start;
+    hist_record(shard, &shard->waits[lock], waited);
+    TRACE(TRACE_LOCK, lock, 0, mutex, waited);
+}
+
+void metrics_rdlock(pthread_rwlock_t *rwlock, METRICS_LOCK lock){
+    SHARD *shard = get_shard();
+    bump(shard, &shard->acquired[lock], 1);
+    if(pthread_rwlock_tryrdlock(rwlock) == 0){
+        TRACE(TRACE_LOCK, lock, 1, rwlock, 0);
+        return;
+    }
+    uint64_t start = metrics_now();
+    pthread_rwlock_rdlock(rwlock);
+    uint64_t waited = metrics_now() - start;
+    hist_record(shard, &shard->waits[lock], waited);
+    TRACE(TRACE_LOCK, lock, 1, rwlock, waited);
+}
+
+void metrics_wrlock(pthread_rwlock_t *rwlock, METRICS_LOCK lock){
+    SHARD *shard = get_shard();
+    bump(shard, &shard->acquired[lock], 1);
+    if(pthread_rwlock_trywrlock(rwlock) == 0){
+        TRACE(TRACE_LOCK, lock, 2, rwlock, 0);
+        return;
+    }
+    uint64_t start = metrics_now();
+    pthread_rwlock_wrlock(rwlock);
+    uint64_t waited = metrics_now() - start;
+    hist_record(shard, &shard->waits[lock], waited);
+    TRACE(TRACE_LOCK, lock, 2, rwlock, waited);
+}
+
+/*
+ * The histograms at the same place in every shard, added up.  Call with
+ * shards_lock held.  offset locates the histogram within a SHARD.
+ */
+static void hist_total(size_t offset, uint64_t *counts, uint64_t *sum){
+    memset(counts, 0, METRICS_HIST_SIZE * sizeof(uint64_t));
+    *sum = 0;
+    for(int s = 0; s <= num_shards; s++){
+        SHARD *shard = s < num_shards ? shards[s] : &fallback;
+        HISTOGRAM *hist = (HISTOGRAM *) ((char *) shard + offset);
+        for(int i = 0; i < METRICS_HIST_SIZE; i++){
+            counts[i] += atomic_load_explicit(&hist->counts[i], memory_order_relaxed);
+        }
+        *sum += atomic_load_explicit(&hist->sum, memory_order_relaxed);
+    }
+}
+
+// call with total > 0
+static double percentile(uint64_t *counts, uint64_t total, double p){
+    uint64_t rank = (uint64_t) (p * total);
+    if(rank >= total){
+        rank = total - 1;
+    }
+    uint64_t seen = 0;
+    int i = 0;
+    while((seen += counts[i]) <= rank){
+        i++;
+    }
+    return hist_value(i);
+}
+
+// the lines of one series of a summary, in seconds
+static void print_summary(FILE *out, char *name, char *labels, size_t offset){
+    static const double quantiles[] = { 0.5, 0.99, 0.999 };
+    uint64_t counts[METRICS_HIST_SIZE], sum, total = 0;
+    hist_total(offset, counts, &sum);
+    for(int i = 0; i < METRICS_HIST_SIZE; i++){
+        total += counts[i];
+    }
+    for(int q = 0; q < sizeof(quantiles) / sizeof(quantiles[0]); q++){
+        // as Prometheus clients do, a quantile of nothing is NaN
+        if(total == 0){
+            fprintf(out, "%s{%s,quantile=\"%g\"} NaN\n", name, labels, quantiles[q]);
+        }
+        else{
+            fprintf(out, "%s{%s,quantile=\"%g\"} %.9g\n", name, labels, quantiles[q],
+                    percentile(counts, total, quantiles[q]) / 1e9);
+        }
+    }
+    fprintf(out, "%s_sum{%s} %.9g\n", name, labels, sum / 1e9);
+    fprintf(out, "%s_count{%s} %llu\n", name, labels, (unsigned long long) total);
+}
+
+char *metrics_report(size_t *lenp){
+    char *report;
+    char labels[64];
+    FILE *out = open_memstream(&report, lenp);
+    if(out == NULL){
+        return NULL;
+    }
+    pthread_mutex_lock(&shards_lock);
+
+    fprintf(out, "# HELP jeux_request_seconds Time to handle a request, by packet type.\n"
+            "# TYPE jeux_request_seconds summary\n");
+    for(int type = 0; type < NUM_TYPES; type++){
+        if(type_names[type] != NULL){
+            snprintf(labels, sizeof(labels), "type=\"%s\"", type_names[type]);
+            print_summary(out, "jeux_request_seconds", labels, offsetof(SHARD, requests[type]));
+        }
+    }
+
+    for(int g = 0; g < METRICS_NUM_GAUGES; g++){
+        fprintf(out, "# HELP %s %s\n# TYPE %s gauge\n%s %ld\n", gauge_info[g].name, gauge_info[g].help,
+                gauge_info[g].name, gauge_info[g].name,
+                metrics_gauge_get(g));
+    }
+
+    fprintf(out, "# HELP jeux_syscalls_total System calls made to receive and send packets.\n"
+            "# TYPE jeux_syscalls_total counter\n");
+    for(int call = 0; call < METRICS_NUM_SYSCALLS; call++){
+        uint64_t made = 0;
+        for(int s = 0; s <= num_shards; s++){
+            SHARD *shard = s < num_shards ? shards[s] : &fallback;
+            made += atomic_load_explicit(&shard->syscalls[call], memory_order_relaxed);
+        }
+        fprintf(out, "jeux_syscalls_total{call=\"%s\"} %llu\n", syscall_names[call],
+                (unsigned long long) made);
+    }
+
+    fprintf(out, "# HELP jeux_timeouts_total Timeouts enforced.\n"
+            "# TYPE jeux_timeouts_total counter\n");
+    for(int t = 0; t < METRICS_NUM_TIMEOUTS; t++){
+        fprintf(out, "jeux_timeouts_total{timeout=\"%s\"} %llu\n", timeout_names[t],
+                (unsigned long long) atomic_load_explicit(&timeouts[t], memory_order_relaxed));
+    }
+
+    fprintf(out, "# HELP jeux_lock_acquisitions_total Times a lock was taken.\n"
+            "# TYPE jeux_lock_acquisitions_total counter\n");
+    for(int lock = 0; lock < METRICS_NUM_LOCKS; lock++){
+        uint64_t acquired = 0;
+        for(int s = 0; s <= num_shards; s++){
+            SHARD *shard = s < num_shards ? shards[s] : &fallback;
+            acquired += atomic_load_explicit(&shard->acquired[lock], memory_order_relaxed);
+        }
+        fprintf(out, "jeux_lock_acquisitions_total{lock=\"%s\"} %llu\n", lock_names[lock],
+                (unsigned long long) acquired);
+    }
+    fprintf(out, "# HELP jeux_lock_wait_seconds Time spent waiting for a lock that was not free.\n"
+            "# TYPE jeux_lock_wait_seconds summary\n");
+    for(int lock = 0; lock < METRICS_NUM_LOCKS; lock++){
+        snprintf(labels, sizeof(labels), "lock=\"%s\"", lock_names[lock]);
+        print_summary(out, "jeux_lock_wait_seconds", labels, offsetof(SHARD, waits[lock]));
+    }
+
+    pthread_mutex_unlock(&shards_lock);
+    if(fclose(out) != 0){
+        free(report);
+        return NULL;
+    }
+    return report;
+}
+
+static int send_all(int fd, const char *buf, size_t len){
+    while(len > 0){
+        ssize_t n = send(fd, buf, len, MSG_NOSIGNAL);
+        if(n <= 0){
+            return -1;
+        }
+        buf += n;
+        len -= n;
+    }
+    return 0;
+}
+
+// answer one HTTP request; only its first line matters
+static void serve_scrape(int fd){
+    char request[REQUEST_MAX + 1];
+    size_t len = 0;
+    ssize_t n;
+    while(len < REQUEST_MAX && (n = recv(fd, request + len, REQUEST_MAX - len, 0)) > 0){
+        len += n;
+        request[len] = '\0';
+        if(strstr(request, "\r\n\r\n") != NULL || strstr(request, "\n\n") != NULL){
+            break;
+        }
+    }
+    request[len] = '\0';
+    char header[160];
+    char *report = NULL;
+    size_t report_len = 0;
+    if(strncmp(request, "GET / ", 6) == 0 || strncmp(request, "GET /metrics ", 13) == 0
+       || strncmp(request, "GET /metrics?", 13) == 0){
+        report = metrics_report(&report_len);
+    }
+    if(report != NULL){
+        int hlen = snprintf(header, sizeof(header), "HTTP/1.0 200 OK\r\n"
+                            "Content-Type: text/plain; version=0.0.4\r\n"
+                            "Content-Length: %zu\r\nConnection: close\r\n\r\n", report_len);
+        if(send_all(fd, header, hlen) == 0){
+            send_all(fd, report, report_len);
+        }
+        free(report);
+    }
+    else{
+        const char *status = strncmp(request, "GET ", 4) == 0 ? "404 Not Found" : "400 Bad Request";
+        int hlen = snprintf(header, sizeof(header), "HTTP/1.0 %s\r\nContent-Length: 0\r\n"
+                            "Connection: close\r\n\r\n", status);
+        send_all(fd, header, hlen);
+    }
+}
+
+static void *scrape_main(void *arg){
+    int listenfd = *(int *) arg;
+    free(arg);
+    for(;;){
+        int fd = accept(listenfd, NULL, NULL);
+        if(fd == -1){
+            debug("metrics: accept failed");
+            usleep(10000);
+            continue;
+        }
+        // a scraper that never finishes its request does not hold up the next one for long
+        struct timeval timeout = { .tv_sec = HTTP_TIMEOUT_SECS };
+        setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+        setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+        serve_scrape(fd);
+        close(fd);
+    }
+    return NULL;
+}
+
+int metrics_serve(char *port){
+    int *fdp = malloc(sizeof(int));
+    if(fdp == NULL || (*fdp = open_listenfd(port)) < 0){
+        free(fdp);
+        return -1;
+    }
+    int listenfd = *fdp;
+    if(spawn(NULL, NULL, scrape_main, fdp) != 0){
+        close(listenfd);
+        free(fdp);
+        return -1;
+    }
+    return 0;
+}
@@ -0,0 +1,169 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "debug.h"
+#include "oracle.h"
+
+#define NUM_SQUARES 9
+#define NUM_BOARDS 19683        // 3^9 ways of filling the squares
+#define FULL_BOARD 0x1ff
+
+/*
+ * An entry of the table: the optimal squares in the low nine bits, the
+ * outcome (a GAME_ROLE) above them, and a flag telling whether the
+ * position has been searched, i.e. whether it is reachable.
+ */
+#define BEST_MASK     0x1ff
+#define OUTCOME_SHIFT 9
+#define REACHABLE     0x8000
+
+// ternary[m] is the sum of 3^i over the bits i set in m
+static uint16_t ternary[1 << NUM_SQUARES];
+static uint16_t table[NUM_BOARDS];
+static pthread_once_t table_once = PTHREAD_ONCE_INIT;
+
+// the eight lines of three squares, as masks
+static const uint16_t lines[] = {
+    0007, 0070, 0700,       // rows
+    0111, 0222, 0444,       // columns
+    0421, 0124              // diagonals
+};
+
+static int board_index(uint16_t x, uint16_t o){
+    return ternary[x] + 2 * ternary[o];
+}
+
+static int has_line(uint16_t m){
+    for(int i = 0; i < sizeof(lines) / sizeof(lines[0]); i++){
+        if((m & lines[i]) == lines[i])
+            return 1;
+    }
+    return 0;
+}
+
+// scores are from X's side: 1 if X wins, -1 if O wins, 0 for a draw
+static GAME_ROLE score_role(int score){
+    return score > 0 ? FIRST_PLAYER_ROLE : score < 0 ? SECOND_PLAYER_ROLE : NULL_ROLE;
+}
+
+static int role_score(GAME_ROLE role){
+    return role == FIRST_PLAYER_ROLE ? 1 : role == SECOND_PLAYER_ROLE ? -1 : 0;
+}
+
+// minimax over the positions reachable from (x, o), memoized in the table
+static int search(uint16_t x, uint16_t o){
+    uint16_t *entry = &table[board_index(x, o)];
+    if(*entry & REACHABLE)
+        return role_score((*entry >> OUTCOME_SHIFT) & 3);
+
+    int x_to_move = __builtin_popcount(x) == __builtin_popcount(o);
+    uint16_t best = 0;
+    int score;
+    if(has_line(x))
+        score = 1;
+    else if(has_line(o))
+        score = -1;
+    else if((x | o) == FULL_BOARD)
+        score = 0;
+    else{
+        score = x_to_move ? -2 : 2;
+        for(int i = 0; i < NUM_SQUARES; i++){
+            uint16_t bit = 1 << i;
+            if((x | o) & bit)
+                continue;
+            int s = x_to_move ? search(x | bit, o) : search(x, o | bit);
+            if(s == score){
+                best |= bit;
+            }
+            else if(x_to_move ? s > score : s < score){
+                score = s;
+                best = bit;
+            }
+        }
+    }
+    *entry = REACHABLE | score_role(score) << OUTCOME_SHIFT | best;
+    return score;
+}
+
+static void build_table(void){
+    for(int m = 0; m < (1 << NUM_SQUARES); m++){
+        int t = 0;
+        for(int i = NUM_SQUARES - 1; i >= 0; i--){
+            t = 3 * t + (m >> i & 1);
+        }
+        ternary[m] = t;
+    }
+    search(0, 0);
+    int reachable = 0;
+    for(int i = 0; i < NUM_BOARDS; i++){
+        reachable += (table[i] & REACHABLE) != 0;
+    }
+    debug("oracle: %d reachable positions", reachable);
+}
+
+void oracle_init(void){
+    pthread_once(&table_once, build_table);
+}
+
+// the entry of a position, 0 if it is not reachable
+static uint16_t lookup(uint16_t x, uint16_t o){
+    oracle_init();
+    if((x | o) > FULL_BOARD || (x & o))
+        return 0;
+    return table[board_index(x, o)];
+}
+
+int oracle_outcome(uint16_t x, uint16_t o){
+    uint16_t entry = lookup(x, o);
+    if(!(entry & REACHABLE))
+        return -1;
+    return (entry >> OUTCOME_SHIFT) & 3;
+}
+
+uint16_t oracle_best_moves(uint16_t x, uint16_t o){
+    return lookup(x, o) & BEST_MASK;
+}
+
+// the squares in a mask as a string of digits
+static char *squares_string(uint16_t mask, char *buf){
+    char *out = buf;
+    for(int i = 0; i < NUM_SQUARES; i++){
+        if(mask >> i & 1)
+            *out++ = '1' + i;
+    }
+    *out = '\0';
+    return buf;
+}
+
+int oracle_analyze(const uint8_t *squares, int num_moves, char *buf, size_t size){
+    static const char *outcomes[] = { "draw", "X", "O" };     // indexed by GAME_ROLE
+    char best_str[NUM_SQUARES + 1];
+    uint16_t x = 0, o = 0;
+    size_t len = 0;
+    int n;
+
+    for(int i = 0; i < num_moves; i++){
+        if(squares[i] < 1 || squares[i] > NUM_SQUARES)
+            return -1;
+        uint16_t best = oracle_best_moves(x, o);
+        uint16_t bit = 1 << (squares[i] - 1);
+        // no optimal move means the game was already over
+        if(((x | o) & bit) || best == 0)
+            return -1;
+        n = snprintf(buf + len, size - len, "%c\t%d\t%s\t%s\n", i % 2 ? 'O' : 'X', squares[i],
+                     best & bit ? "ok" : "blunder", squares_string(best, best_str));
+        if(n < 0 || (len += n) >= size)
+            return -1;
+        if(i % 2)
+            o |= bit;
+        else
+            x |= bit;
+    }
+    n = snprintf(buf + len, size - len, "=\t%s\t%s\n", outcomes[oracle_outcome(x, o)],
+                 squares_string(oracle_best_moves(x, o), best_str));
+    if(n < 0 || (len += n) >= size)
+        return -1;
+    return len;
+}
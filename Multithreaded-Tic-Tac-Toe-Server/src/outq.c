@@ -0,0 +1,485 @@
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <pthread.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/epoll.h>
+
+#include "outq.h"
+#include "protocol_ext.h"
+#include "pool.h"
+#include "metrics.h"
+#include "debug.h"
+#include "spawn.h"
+
+#define WRITER_MAX_EVENTS 64            // events fetched per epoll_wait
+#define SMALL_PACKET 128                // wire images up to this size come from the pool
+
+int outq_limit = OUTQ_DEFAULT_LIMIT;
+OUTQ_POLICY outq_policy = OUTQ_DROP;
+__thread OUTQ_SUBMIT *outq_submit;
+
+static int writer_epfd = -1;
+static pthread_once_t writer_once = PTHREAD_ONCE_INIT;
+
+// every ACK, NACK and MOVED fits; only long USERS lists and names do not
+static POOL packet_pool = POOL_INITIALIZER("packet", sizeof(OUT_PACKET) + SMALL_PACKET);
+
+/*
+ * The MPSC queue is the intrusive one due to Vyukov: producers only swap
+ * themselves into the tail and then link the previous tail to
+ * themselves; the consumer walks from the head.  A stub node keeps the
+ * queue non-empty so that neither side ever has to touch the other's end.
+ */
+static void mpsc_push(OUTQ *q, OUTQ_NODE *node){
+    atomic_store_explicit(&node->next, NULL, memory_order_relaxed);
+    OUTQ_NODE *prev = atomic_exchange_explicit(&q->tail, node, memory_order_acq_rel);
+    atomic_store_explicit(&prev->next, node, memory_order_release);
+}
+
+// returns NULL if the queue is empty or a push is still in progress
+static OUTQ_NODE *mpsc_pop(OUTQ *q){
+    OUTQ_NODE *head = q->head;
+    OUTQ_NODE *next = atomic_load_explicit(&head->next, memory_order_acquire);
+    if(head == &q->stub){
+        if(next == NULL){
+            return NULL;
+        }
+        q->head = next;
+        head = next;
+        next = atomic_load_explicit(&head->next, memory_order_acquire);
+    }
+    if(next != NULL){
+        q->head = next;
+        return head;
+    }
+    if(head != atomic_load_explicit(&q->tail, memory_order_acquire)){
+        return NULL;
+    }
+    // head is the last node: put the stub behind it so it can be taken
+    mpsc_push(q, &q->stub);
+    next = atomic_load_explicit(&head->next, memory_order_acquire);
+    if(next != NULL){
+        q->head = next;
+        return head;
+    }
+    return NULL;
+}
+
+// bytes of the wire image held in pkt->data
+static size_t stored_len(OUT_PACKET *pkt){
+    return pkt->shared != NULL ? sizeof(JEUX_PACKET_HEADER) : pkt->len;
+}
+
+// allocate a packet able to hold len bytes of wire image in its data
+static OUT_PACKET *alloc_packet(size_t len){
+    return len <= SMALL_PACKET ? pool_alloc(&packet_pool) : malloc(sizeof(OUT_PACKET) + len);
+}
+
+static void release_packet(OUTQ *q, OUT_PACKET *pkt){
+    outq_shared_unref(pkt->shared);
+    if(stored_len(pkt) <= SMALL_PACKET){
+        pool_free(&packet_pool, pkt);
+    }
+    else{
+        free(pkt);
+    }
+    atomic_fetch_sub(&q->length, 1);
+}
+
+// drop a pending MOVED for the same invitation, which pkt supersedes
+static void coalesce(OUTQ *q, OUT_PACKET *pkt){
+    JEUX_PACKET_HEADER *hdr = (JEUX_PACKET_HEADER *) pkt->data;
+    if(hdr->type != JEUX_MOVED_PKT){
+        return;
+    }
+    // packets in a submitted send, or the first one if it is partly on
+    // the wire, must stay as they are
+    OUT_PACKET **pp = &q->pending;
+    int keep = q->inflight > 0 ? q->inflight : q->sent > 0;
+    while(keep-- > 0 && *pp != NULL){
+        pp = &(*pp)->next;
+    }
+    // only the last packet for the ID can be replaced: after an ENDED or
+    // RESIGNED, the ID may be that of another game, whose MOVED does not
+    // supersede the last board of the one before
+    OUT_PACKET **last = NULL;
+    for(; *pp != NULL; pp = &(*pp)->next){
+        if(((JEUX_PACKET_HEADER *) (*pp)->data)->id == hdr->id){
+            last = pp;
+        }
+    }
+    if(last == NULL || ((JEUX_PACKET_HEADER *) (*last)->data)->type != JEUX_MOVED_PKT){
+        return;
+    }
+    OUT_PACKET *old = *last;
+    *last = old->next;
+    if(q->pending_tail == &old->next){
+        q->pending_tail = last;
+    }
+    debug("coalesced MOVED for invitation %d", hdr->id);
+    release_packet(q, old);
+}
+
+// move everything pushed so far to the pending list
+static void take_queued(OUTQ *q){
+    OUTQ_NODE *node;
+    while((node = mpsc_pop(q)) != NULL){
+        OUT_PACKET *pkt = (OUT_PACKET *) node;
+        atomic_fetch_sub(&q->queued, 1);
+        pkt->next = NULL;
+        if(outq_policy == OUTQ_COALESCE){
+            coalesce(q, pkt);
+        }
+        *q->pending_tail = pkt;
+        q->pending_tail = &pkt->next;
+    }
+}
+
+static void discard_pending(OUTQ *q){
+    take_queued(q);
+    while(q->pending != NULL){
+        OUT_PACKET *pkt = q->pending;
+        q->pending = pkt->next;
+        release_packet(q, pkt);
+    }
+    q->pending_tail = &q->pending;
+    q->sent = 0;
+}
+
+void outq_init(OUTQ *q, void (*on_writable)(void *owner), void *owner){
+    memset(q, 0, sizeof(OUTQ));
+    atomic_init(&q->stub.next, NULL);
+    atomic_init(&q->tail, &q->stub);
+    atomic_init(&q->length, 0);
+    atomic_init(&q->queued, 0);
+    atomic_init(&q->closed, 0);
+    q->head = &q->stub;
+    q->pending = NULL;
+    q->pending_tail = &q->pending;
+    q->on_writable = on_writable;
+    q->owner = owner;
+}
+
+void outq_fini(OUTQ *q){
+    discard_pending(q);
+}
+
+// count a packet against the queue's limit; undone by release_packet()
+static int reserve(OUTQ *q){
+    if(atomic_load(&q->closed)){
+        errno = EPIPE;
+        return -1;
+    }
+    int cap = outq_policy == OUTQ_COALESCE ? 2 * outq_limit : outq_limit;
+    if(atomic_fetch_add(&q->length, 1) >= cap){
+        atomic_fetch_sub(&q->length, 1);
+        debug("outbound queue over its limit of %d packets", cap);
+        errno = ENOBUFS;
+        return -1;
+    }
+    return 0;
+}
+
+static void enqueue(OUTQ *q, OUT_PACKET *pkt, JEUX_PACKET_HEADER *hdr){
+    proto_stamp_header(hdr);
+    memcpy(pkt->data, hdr, sizeof(JEUX_PACKET_HEADER));
+    debug("queued packet TYPE = %d ID = %d SIZE = %zu", hdr->type, hdr->id,
+          pkt->len - sizeof(JEUX_PACKET_HEADER));
+    mpsc_push(q, &pkt->node);
+    atomic_fetch_add(&q->queued, 1);
+}
+
+int outq_push(OUTQ *q, JEUX_PACKET_HEADER *hdr, void *data){
+    size_t size = ntohs(hdr->size);
+    if((size == 0 && data != NULL) || (size != 0 && data == NULL)){
+        debug("Error: payload_size 0 and there's data or there's size but no payload");
+        errno = EINVAL;
+        return -1;
+    }
+    if(reserve(q) == -1){
+        return -1;
+    }
+    size_t len = sizeof(JEUX_PACKET_HEADER) + size;
+    OUT_PACKET *pkt = alloc_packet(len);
+    if(pkt == NULL){
+        atomic_fetch_sub(&q->length, 1);
+        return -1;
+    }
+    pkt->len = len;
+    pkt->shared = NULL;
+    pkt->payload = NULL;
+    if(size > 0){
+        memcpy(pkt->data + sizeof(JEUX_PACKET_HEADER), data, size);
+    }
+    enqueue(q, pkt, hdr);
+    return 0;
+}
+
+int outq_push_shared(OUTQ *q, JEUX_PACKET_HEADER *hdr, OUTQ_SHARED *buf, size_t off){
+    size_t size = ntohs(hdr->size);
+    if(size == 0){
+        return outq_push(q, hdr, NULL);
+    }
+    if(buf == NULL || off > buf->len || size > buf->len - off){
+        debug("Error: payload is not inside the shared buffer");
+        errno = EINVAL;
+        return -1;
+    }
+    if(reserve(q) == -1){
+        return -1;
+    }
+    OUT_PACKET *pkt = alloc_packet(sizeof(JEUX_PACKET_HEADER));
+    if(pkt == NULL){
+        atomic_fetch_sub(&q->length, 1);
+        return -1;
+    }
+    pkt->len = sizeof(JEUX_PACKET_HEADER) + size;
+    pkt->shared = outq_shared_ref(buf);
+    pkt->payload = buf->data + off;
+    enqueue(q, pkt, hdr);
+    return 0;
+}
+
+OUTQ_SHARED *outq_shared_create(size_t len){
+    OUTQ_SHARED *buf = malloc(sizeof(OUTQ_SHARED) + len);
+    if(buf == NULL){
+        return NULL;
+    }
+    atomic_init(&buf->refs, 1);
+    buf->len = len;
+    return buf;
+}
+
+OUTQ_SHARED *outq_shared_ref(OUTQ_SHARED *buf){
+    atomic_fetch_add_explicit(&buf->refs, 1, memory_order_relaxed);
+    return buf;
+}
+
+void outq_shared_unref(OUTQ_SHARED *buf){
+    if(buf != NULL && atomic_fetch_sub_explicit(&buf->refs, 1, memory_order_acq_rel) == 1){
+        free(buf);
+    }
+}
+
+// describe the unsent part of a packet, starting off bytes in; returns the iovecs used
+static int packet_iov(OUT_PACKET *pkt, size_t off, struct iovec *iov){
+    size_t head = stored_len(pkt);
+    int n = 0;
+    if(off < head){
+        iov[n].iov_base = pkt->data + off;
+        iov[n].iov_len = head - off;
+        n++;
+        off = 0;
+    }
+    else{
+        off -= head;
+    }
+    if(pkt->shared != NULL){
+        iov[n].iov_base = (char *) pkt->payload + off;
+        iov[n].iov_len = pkt->len - head - off;
+        n++;
+    }
+    return n;
+}
+
+// the send of n bytes, or of none if n is negative, with errno set, is done
+static int account(OUTQ *q, int fd, ssize_t n){
+    if(n < 0){
+        if(errno == EINTR)
+            return OUTQ_DONE;
+        if(errno == EAGAIN || errno == EWOULDBLOCK){
+            q->blocked = 1;
+            return OUTQ_BLOCKED;
+        }
+        debug("[%d] send failed: %s", fd, strerror(errno));
+        q->failed = 1;
+        atomic_store(&q->closed, 1);
+        discard_pending(q);
+        return -1;
+    }
+    // free the packets that went out completely
+    size_t done = n;
+    while(q->pending != NULL && done >= q->pending->len - q->sent){
+        OUT_PACKET *pkt = q->pending;
+        done -= pkt->len - q->sent;
+        q->sent = 0;
+        q->pending = pkt->next;
+        release_packet(q, pkt);
+    }
+    q->sent += done;
+    if(q->pending == NULL){
+        q->pending_tail = &q->pending;
+        take_queued(q);
+    }
+    return OUTQ_DONE;
+}
+
+int outq_flush(OUTQ *q, int fd){
+    if(q->failed){
+        discard_pending(q);
+        return -1;
+    }
+    take_queued(q);
+    if(q->blocked){
+        return OUTQ_BLOCKED;
+    }
+    while(q->pending != NULL){
+        struct iovec iov[PROTO_MAX_BATCH];
+        int iovcnt = 0, count = 0;
+        size_t off = q->sent;
+        // a packet takes two iovecs if its payload is shared
+        for(OUT_PACKET *pkt = q->pending; pkt != NULL && iovcnt + 2 <= PROTO_MAX_BATCH; pkt = pkt->next){
+            iovcnt += packet_iov(pkt, off, iov + iovcnt);
+            off = 0;
+            count++;
+        }
+        if(outq_submit != NULL && outq_submit(q, fd, iov, iovcnt) == 0){
+            q->inflight = count;
+            q->blocked = 1;
+            return OUTQ_SUBMITTED;
+        }
+        struct msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = iov;
+        msg.msg_iovlen = iovcnt;
+        ssize_t n = sendmsg(fd, &msg, MSG_DONTWAIT | MSG_NOSIGNAL);
+        metrics_syscall(METRICS_SYSCALL_SEND);
+        int res = account(q, fd, n);
+        if(res != OUTQ_DONE){
+            return res;
+        }
+    }
+    return OUTQ_DONE;
+}
+
+void outq_unblock(OUTQ *q){
+    if(q->inflight > 0){
+        q->inflight = 0;
+        errno = q->result < 0 ? -q->result : 0;
+        // a failure leaves the queue failed, and the next flush reports it
+        account(q, -1, q->result);
+    }
+    q->blocked = 0;
+}
+
+void outq_complete(OUTQ *q, ssize_t result){
+    q->result = result;
+    q->on_writable(q->owner);
+}
+
+int outq_has_queued(OUTQ *q){
+    return atomic_load(&q->queued) > 0;
+}
+
+void outq_close(OUTQ *q){
+    atomic_store(&q->closed, 1);
+}
+
+char *outq_save(OUTQ *q, size_t *lenp, size_t *sentp){
+    take_queued(q);
+    size_t len = 0;
+    for(OUT_PACKET *pkt = q->pending; pkt != NULL; pkt = pkt->next){
+        len += pkt->len;
+    }
+    *lenp = 0;
+    *sentp = q->sent;
+    char *data = len > 0 ? malloc(len) : NULL;
+    if(data == NULL){
+        if(len > 0)
+            errno = ENOMEM;
+        return NULL;
+    }
+    char *out = data;
+    for(OUT_PACKET *pkt = q->pending; pkt != NULL; pkt = pkt->next){
+        size_t head = stored_len(pkt);
+        memcpy(out, pkt->data, head);
+        if(pkt->shared != NULL){
+            memcpy(out + head, pkt->payload, pkt->len - head);
+        }
+        out += pkt->len;
+    }
+    *lenp = len;
+    return data;
+}
+
+int outq_adopt(OUTQ *q, const char *data, size_t len, size_t sent){
+    const char *end = data + len;
+    while(data < end){
+        JEUX_PACKET_HEADER hdr;
+        if((size_t) (end - data) < sizeof(hdr)){
+            return -1;
+        }
+        memcpy(&hdr, data, sizeof(hdr));
+        size_t plen = sizeof(hdr) + ntohs(hdr.size);
+        OUT_PACKET *pkt = (size_t) (end - data) >= plen ? alloc_packet(plen) : NULL;
+        if(pkt == NULL){
+            return -1;
+        }
+        pkt->len = plen;
+        pkt->shared = NULL;
+        pkt->payload = NULL;
+        pkt->next = NULL;
+        memcpy(pkt->data, data, plen);
+        *q->pending_tail = pkt;
+        q->pending_tail = &pkt->next;
+        atomic_fetch_add(&q->length, 1);
+        data += plen;
+    }
+    if(q->pending != NULL && sent >= q->pending->len){
+        return -1;
+    }
+    q->sent = q->pending != NULL ? sent : 0;
+    return 0;
+}
+
+static void *writer_main(void *arg){
+    struct epoll_event events[WRITER_MAX_EVENTS];
+
+    debug("writer thread %ld started (epfd %d)", pthread_self(), writer_epfd);
+    while(1){
+        int n = epoll_wait(writer_epfd, events, WRITER_MAX_EVENTS, -1);
+        metrics_syscall(METRICS_SYSCALL_EPOLL_WAIT);
+        if(n < 0){
+            if(errno == EINTR)
+                continue;
+            debug("epoll_wait failed: %s", strerror(errno));
+            break;
+        }
+        for(int i = 0; i < n; i++){
+            OUTQ *q = events[i].data.ptr;
+            q->on_writable(q->owner);
+        }
+    }
+    return NULL;
+}
+
+static void writer_start(void){
+    if((writer_epfd = epoll_create1(EPOLL_CLOEXEC)) < 0){
+        return;
+    }
+    if(spawn(NULL, NULL, writer_main, NULL) != 0){
+        close(writer_epfd);
+        writer_epfd = -1;
+    }
+}
+
+int outq_arm(OUTQ *q, int fd){
+    pthread_once(&writer_once, writer_start);
+    if(writer_epfd < 0){
+        return -1;
+    }
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLOUT | EPOLLONESHOT;
+    ev.data.ptr = q;
+    if(epoll_ctl(writer_epfd, q->registered ? EPOLL_CTL_MOD : EPOLL_CTL_ADD, fd, &ev) == -1){
+        debug("[%d] epoll_ctl failed: %s", fd, strerror(errno));
+        return -1;
+    }
+    q->registered = 1;
+    return 0;
+}
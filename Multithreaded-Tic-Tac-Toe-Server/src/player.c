@@ -3,6 +3,7 @@
 #include <string.h>
 #include <unistd.h>
 #include <pthread.h>
+#include <stdatomic.h>
 #include <errno.h>
 #include <signal.h>
 #include <netinet/in.h>
@@ -16,7 +17,12 @@
 #include "csapp.h"
 
 #include "player.h"
+#include "player_ext.h"
+#include "hash.h"
+#include "ratings.h"
 #include "protocol.h"
+#include "trace.h"
+#include "cluster.h"
 
 /*
  * A PLAYER represents a user of the system.  A player has a username,
@@ -39,9 +45,10 @@
  */
 typedef struct player {
     char* username;
-    double rating;
-    int ref_count;
-    pthread_mutex_t lock;
+    uint32_t hash;              // hash_string(username), fixed at creation
+    _Atomic double rating;      // only changed by the ratings worker (ratings.c)
+    atomic_int ref_count;       // changed without taking any lock
+    uint32_t serial;            // in the journal; set before anyone else can see the player
 } PLAYER;
 
 /*
@@ -75,13 +82,11 @@ PLAYER *player_create(char *name){
 
     // Initialize the fields of the PLAYER object.
     new_player->username = username;
-    new_player->rating = PLAYER_INITIAL_RATING;
-    new_player->ref_count = 1; // Set the reference count to 1.
-    debug("INCREASED reference count for player [%s] from (0 - 1) because the player is created", new_player->username);
-    if (pthread_mutex_init(&new_player->lock, NULL) != 0) {
-        debug("create mutex lock counter failed");
-        return NULL;
-    }
+    new_player->hash = hash_string(username);
+    atomic_init(&new_player->rating, PLAYER_INITIAL_RATING);
+    new_player->serial = UINT32_MAX;
+    atomic_init(&new_player->ref_count, 1); // Set the reference count to 1.
+    TRACE(TRACE_REF, TRACE_PLAYER, 1, new_player, "the player is created");
     return new_player;
 }
 
@@ -97,11 +102,8 @@ PLAYER *player_create(char *name){
 PLAYER *player_ref(PLAYER *player, char *why){
     if(player == NULL)
         return NULL;
-    pthread_mutex_lock(&player->lock);
-    player->ref_count++;
-    debug("INCREASED reference count for player [%s] from (%d - %d) %s",
-           player->username, player->ref_count-1, player->ref_count, why);
-    pthread_mutex_unlock(&player->lock);
+    int old __attribute__((unused)) = atomic_fetch_add_explicit(&player->ref_count, 1, memory_order_relaxed);
+    TRACE(TRACE_REF, TRACE_PLAYER, old + 1, player, why);
     return player;
 }
 
@@ -119,19 +121,13 @@ PLAYER *player_ref(PLAYER *player, char *why){
 void player_unref(PLAYER *player, char *why){
     if(player == NULL)
         return;
-    pthread_mutex_lock(&player->lock);
-    player->ref_count--;
-    debug("DECREASED reference count for **player [%s] from (%d - %d) %s",
-           player->username, player->ref_count+1, player->ref_count, why);
-    if (player->ref_count == 0) {
+    int old = atomic_fetch_sub_explicit(&player->ref_count, 1, memory_order_acq_rel);
+    TRACE(TRACE_UNREF, TRACE_PLAYER, old - 1, player, why);
+    if (old == 1) {
         debug("Freeing player %s (%s)\n", player->username, why);
         free(player->username);
-        pthread_mutex_unlock(&player->lock);
-        pthread_mutex_destroy(&player->lock);
         free(player);
-        return;
     }
-    pthread_mutex_unlock(&player->lock);
 }
 
 /*
@@ -146,6 +142,10 @@ char *player_get_name(PLAYER *player){
     return player->username;
 }
 
+uint32_t player_get_hash(PLAYER *player){
+    return player->hash;
+}
+
 /*
  * Get the rating of a player.
  *
@@ -155,7 +155,23 @@ char *player_get_name(PLAYER *player){
 int player_get_rating(PLAYER *player){
     if(player == NULL)
         return -1;
-    return player->rating;
+    return player_get_exact_rating(player);
+}
+
+double player_get_exact_rating(PLAYER *player){
+    return atomic_load_explicit(&player->rating, memory_order_relaxed);
+}
+
+void player_set_rating(PLAYER *player, double rating){
+    atomic_store_explicit(&player->rating, rating, memory_order_relaxed);
+}
+
+uint32_t player_get_serial(PLAYER *player){
+    return player->serial;
+}
+
+void player_set_serial(PLAYER *player, uint32_t serial){
+    player->serial = serial;
 }
 
 /*
@@ -172,41 +188,27 @@ int player_get_rating(PLAYER *player){
  * Update the players ratings to R1' and R2' using the formula:
  *     R1' = R1 + 32*(S1-E1)
  *     R2' = R2 + 32*(S2-E2)
+ * The update is made asynchronously, by the ratings worker (see ratings.h).
+ * In cluster mode, a player of another node is updated by that node only.
  *
  * @param player1  One of the PLAYERs that is to be updated.
  * @param player2  The other PLAYER that is to be updated.
  * @param result   0 if draw, 1 if player1 won, 2 if player2 won.
  */
 void player_post_result(PLAYER *player1, PLAYER *player2, int result){
-    // Compute the scores achieved by the two players.
-    double score1, score2;
-    if (result == 0) {
-        score1 = 0.5;
-        score2 = 0.5;
-    } else if (result == 1) {
-        score1 = 1.0;
-        score2 = 0.0;
-    } else if (result == 2) {
-        score1 = 0.0;
-        score2 = 1.0;
-    } else {
-        // Invalid result, do nothing.
+    if (player1 == NULL || player2 == NULL || result < 0 || result > 2) {
+        debug("Invalid result %d, nothing posted", result);
         return;
     }
-
-    // Compute the expected scores of the two players.
-    double rating_diff = player2->rating - player1->rating;
-    double exponent = rating_diff / 400.0;
-    double expected1 = 1.0 / (1.0 + pow(10.0, exponent));
-    double expected2 = 1.0 / (1.0 + pow(10.0, -exponent));
-
-    // Update the ratings of the two players.
-    double rating_change1 = 32.0 * (score1 - expected1);
-    double rating_change2 = 32.0 * (score2 - expected2);
-    pthread_mutex_lock(&player1->lock);
-    player1->rating += rating_change1;
-    pthread_mutex_unlock(&player1->lock);
-    pthread_mutex_lock(&player2->lock);
-    player2->rating += rating_change2;
-    pthread_mutex_unlock(&player2->lock);
+    // The ratings worker applies the update, in the order results are posted.
+    // The shadow of a user of another node is rated at that node alone.
+    int shadow1 = cluster_is_shadow(player1), shadow2 = cluster_is_shadow(player2);
+    if (!shadow1 && !shadow2)
+        ratings_post(player1, player2, result);
+    else if (!shadow1)
+        ratings_post_against(player1, player_get_exact_rating(player2), result);
+    else if (!shadow2)
+        ratings_post_against(player2, player_get_exact_rating(player1), result == 0 ? 0 : 3 - result);
+    // the node of a remote opponent rates it too (see cluster.h)
+    cluster_post_result(player1, player2, result);
 }
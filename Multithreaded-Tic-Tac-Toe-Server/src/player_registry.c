@@ -15,16 +15,13 @@
 #include "debug.h"
 #include "csapp.h"
 #include "player.h"
-
-char* copy_payload_v2(const char* payload, size_t size) {
-    char* new_string = (char*) malloc(size + 1);
-    if (new_string == NULL) {
-        return NULL; // Error: failed to allocate memory
-    }
-    memcpy(new_string, payload, size);
-    new_string[size] = '\0';
-    return new_string;
-}
+#include "player_registry.h"
+#include "player_registry_ext.h"
+#include "player_ext.h"
+#include "hash.h"
+#include "leaderboard.h"
+#include "journal.h"
+#include "metrics.h"
 
 /*
  * A player registry maintains a mapping from usernames to PLAYER objects.
@@ -39,98 +36,62 @@ char* copy_payload_v2(const char* payload, size_t size) {
  * concurrently are thread-safe.
  */
 
-#define MAX_PLAYERS 64
+/*
+ * The registry is a hash table split into independently locked shards
+ * (lock striping): the low bits of a name's hash select the shard and the
+ * remaining bits the bucket within it, so LOGINs of different users rarely
+ * contend and a lookup never scans more than one short chain.
+ */
+#define PREG_SHARD_BITS 6
+#define PREG_SHARDS (1 << PREG_SHARD_BITS)          // number of shards
+#define PREG_INITIAL_BUCKETS 16                     // buckets per shard at first
+
+typedef struct player_registry_entry {
+    PLAYER *player;                         // registered player (owns the name)
+    uint32_t hash;                          // hash of the player's name
+    struct player_registry_entry *next;     // next entry in the same bucket
+} PLAYER_REGISTRY_ENTRY;
 
-// Node in the player registry doubly linked list
-typedef struct player_registry_node {
-    char *name;                   // player name
-    PLAYER *player;              // player object
-    struct player_registry_node *prev;  // pointer to previous node
-    struct player_registry_node *next;  // pointer to next node
-} PLAYER_REGISTRY_NODE;
+typedef struct player_registry_shard {
+    pthread_mutex_t lock;                   // protects this shard only
+    PLAYER_REGISTRY_ENTRY **buckets;        // chains of entries
+    int num_buckets;                        // size of buckets, a power of two
+    int count;                              // # of entries in this shard
+} PLAYER_REGISTRY_SHARD;
 
 // Main structure for the player registry
 typedef struct player_registry {
-    pthread_mutex_t lock;           // Mutex for thread safety
-    PLAYER_REGISTRY_NODE *head;    // head of the linked list
+    PLAYER_REGISTRY_SHARD shards[PREG_SHARDS];
 } PLAYER_REGISTRY;
 
-void player_registry_insert(PLAYER_REGISTRY *pr, char *name, PLAYER *player) {
-    // Allocate memory for the new node
-    PLAYER_REGISTRY_NODE *new_node = malloc(sizeof(PLAYER_REGISTRY_NODE));
-    if (new_node == NULL) {
-        return;  // Allocation failed
-    }
-    // Initialize fields of new node
-    new_node->name = strdup(name);
-    new_node->player = player;
-    new_node->prev = NULL;
-    // Update pointers of existing nodes to include the new node
-    if (pr->head != NULL) {
-        pr->head->prev = new_node;
-    }
-    new_node->next = pr->head;
-    pr->head = new_node;
+static PLAYER_REGISTRY_ENTRY **bucket_for(PLAYER_REGISTRY_SHARD *shard, uint32_t hash){
+    return &shard->buckets[(hash >> PREG_SHARD_BITS) & (shard->num_buckets - 1)];
 }
 
-// Remove the node with the given player name from the linked list
-void player_registry_remove(PLAYER_REGISTRY *pr, char *name) {
-    PLAYER_REGISTRY_NODE *node = pr->head;
-    while (node != NULL) {
-        if (strcmp(node->name, name) == 0) {
-            // Found the node, update pointers of adjacent nodes to skip over it
-            if (node->prev != NULL) {
-                node->prev->next = node->next;
-            } else {
-                pr->head = node->next;
-            }
-            if (node->next != NULL) {
-                node->next->prev = node->prev;
-            }
-            // Free memory of the removed node
-            free(node->name);
-            player_unref(node->player, "Removing player from registry");
-            free(node);
-            break;
-        }
-        node = node->next;
+// double a shard's table once it is fully loaded; call with the shard lock
+static void grow_shard(PLAYER_REGISTRY_SHARD *shard){
+    int num_buckets = shard->num_buckets * 2;
+    PLAYER_REGISTRY_ENTRY **buckets = calloc(num_buckets, sizeof(PLAYER_REGISTRY_ENTRY *));
+    if(buckets == NULL){
+        return;         // keep the old table; chains just get longer
     }
-}
-
-// Free all nodes in the linked list and the registry itself
-void player_registry_free(PLAYER_REGISTRY *pr) {
-    // Acquire lock to modify the linked list
-    // Traverse the linked list and free each node
-    PLAYER_REGISTRY_NODE *node = pr->head;
-    while (node != NULL) {
-        PLAYER_REGISTRY_NODE *next_node = node->next;
-        free(node->name);
-        player_unref(node->player, "Freeing player registry node");
-        free(node);
-        node = next_node;
-    }
-    free(pr);
-}
-
-void player_registry_free_nodes(PLAYER_REGISTRY_NODE *head) {
-    while (head != NULL) {
-        PLAYER_REGISTRY_NODE *temp = head;
-        head = head->next;
-        free(temp->name);
-        player_unref(temp->player, "player registry node");
-        free(temp);
-    }
-}
-
-// return the index in which the player exist, otherwise -1
-int player_exists(PLAYER **players, char *name) {
-    for (int i = 0; i < MAX_PLAYERS; i++) {
-        if (players[i] != NULL && strcmp(player_get_name(players[i]), name) == 0) {
-            return i;
+    PLAYER_REGISTRY_ENTRY **old = shard->buckets;
+    int old_num = shard->num_buckets;
+    shard->buckets = buckets;
+    shard->num_buckets = num_buckets;
+    for(int i = 0; i < old_num; i++){
+        PLAYER_REGISTRY_ENTRY *entry = old[i];
+        while(entry != NULL){
+            PLAYER_REGISTRY_ENTRY *next = entry->next;
+            PLAYER_REGISTRY_ENTRY **bucket = bucket_for(shard, entry->hash);
+            entry->next = *bucket;
+            *bucket = entry;
+            entry = next;
         }
     }
-    return -1;
+    free(old);
 }
+
 /*
  * Initialize a new player registry.
  *
@@ -138,17 +99,25 @@ int player_exists(PLAYER **players, char *name) {
  * fails.
  */
 PLAYER_REGISTRY *preg_init(void){
-	PLAYER_REGISTRY *preg = malloc(sizeof(PLAYER_REGISTRY));
+	PLAYER_REGISTRY *preg = calloc(1, sizeof(PLAYER_REGISTRY));
     if (preg == NULL) {
         return NULL;
     }
 
-    if (pthread_mutex_init(&preg->lock, NULL) != 0) {
-        free(preg);
-        return NULL;
+    for (int i = 0; i < PREG_SHARDS; i++) {
+        PLAYER_REGISTRY_SHARD *shard = &preg->shards[i];
+        shard->num_buckets = PREG_INITIAL_BUCKETS;
+        shard->buckets = calloc(shard->num_buckets, sizeof(PLAYER_REGISTRY_ENTRY *));
+        if (shard->buckets == NULL || pthread_mutex_init(&shard->lock, NULL) != 0) {
+            free(shard->buckets);
+            while (--i >= 0) {
+                free(preg->shards[i].buckets);
+                pthread_mutex_destroy(&preg->shards[i].lock);
+            }
+            free(preg);
+            return NULL;
+        }
     }
-
-    preg->head = NULL;
     debug("Creating the player registry");
 
     return preg;
@@ -164,15 +133,68 @@ void preg_fini(PLAYER_REGISTRY *preg){
     if (preg == NULL) {
         return;
     }
-    pthread_mutex_lock(&preg->lock);
-    player_registry_free_nodes(preg->head);
-    pthread_mutex_unlock(&preg->lock);
-    pthread_mutex_destroy(&preg->lock);
+    for (int i = 0; i < PREG_SHARDS; i++) {
+        PLAYER_REGISTRY_SHARD *shard = &preg->shards[i];
+        metrics_mutex_lock(&shard->lock, METRICS_LOCK_PREG);
+        for (int b = 0; b < shard->num_buckets; b++) {
+            PLAYER_REGISTRY_ENTRY *entry = shard->buckets[b];
+            while (entry != NULL) {
+                PLAYER_REGISTRY_ENTRY *next = entry->next;
+                player_unref(entry->player, "Freeing player registry entry");
+                free(entry);
+                entry = next;
+            }
+        }
+        free(shard->buckets);
+        pthread_mutex_unlock(&shard->lock);
+        pthread_mutex_destroy(&shard->lock);
+    }
 
     // Free the PLAYER_REGISTRY itself
     free(preg);
 }
 
+// find the player of a name, or create it at a rating; call with the shard lock
+static PLAYER *find_or_create(PLAYER_REGISTRY_SHARD *shard, char *name, uint32_t hash, double rating){
+    // Check if player already exists
+    PLAYER_REGISTRY_ENTRY **bucket = bucket_for(shard, hash);
+    for (PLAYER_REGISTRY_ENTRY *entry = *bucket; entry != NULL; entry = entry->next) {
+        if (entry->hash == hash && strcmp(player_get_name(entry->player), name) == 0) {
+            debug("Player %s already exists in the registry", name);
+            return entry->player;
+        }
+    }
+    debug("Player %s does not exist in the registry", name);
+
+    // Player is not registered, so create a new player object
+    PLAYER *player = player_create(name);
+    if (player == NULL) {
+        return NULL;
+    }
+    player_set_rating(player, rating);
+
+    // Create new entry for the player
+    PLAYER_REGISTRY_ENTRY *entry = malloc(sizeof(PLAYER_REGISTRY_ENTRY));
+    if (entry == NULL) {
+        player_unref(player, "registering player"); // decrement reference count
+        return NULL;
+    }
+    entry->player = player;
+    entry->hash = hash;
+    entry->next = *bucket;
+    *bucket = entry;
+    if (++shard->count > shard->num_buckets) {
+        grow_shard(shard);
+    }
+    // ranked before anyone can find the player by name
+    if (leaderboard_add(player) == -1) {
+        debug("Player %s is left out of the leaderboard", name);
+    }
+    // and journaled before any result of its games can be
+    journal_log_player(player);
+    return player;
+}
+
 /*
  * Register a player with a specified user name.  If there is already
  * a player registered under that user name, then the existing registered
@@ -189,51 +211,65 @@ void preg_fini(PLAYER_REGISTRY *preg){
  */
 
 PLAYER *preg_register(PLAYER_REGISTRY *preg, char *name) {
-    if(preg == NULL)
+    if(preg == NULL || name == NULL)
         return NULL;
-    pthread_mutex_lock(&preg->lock); // acquire the lock
-
-    // Check if player already exists
-    PLAYER_REGISTRY_NODE *current = preg->head;
-    while (current != NULL) {
-        if (strcmp(current->name, name) == 0) {
-            debug("Player %s already exists in the registry", name);
-            player_ref(current->player, "registering existing player"); // increase reference count
-            pthread_mutex_unlock(&preg->lock); // release the lock
-            return current->player;
-        }
-        current = current->next;
-    }
-    debug("Player %s does not exist in the registry", name);
+    uint32_t hash = hash_string(name);
+    PLAYER_REGISTRY_SHARD *shard = &preg->shards[hash & (PREG_SHARDS - 1)];
+    metrics_mutex_lock(&shard->lock, METRICS_LOCK_PREG); // acquire the lock
+    PLAYER *player = find_or_create(shard, name, hash, PLAYER_INITIAL_RATING);
+    player_ref(player, "registering player"); // increase reference count
+    pthread_mutex_unlock(&shard->lock); // release the lock
+    return player;
+}
 
-    // Player is not registered, so create a new player object
-    PLAYER *player = player_create(name);
-    if (player == NULL) {
-        pthread_mutex_unlock(&preg->lock);
-        return NULL;
-    }
+PLAYER *preg_load(PLAYER_REGISTRY *preg, char *name, double rating) {
+    uint32_t hash = hash_string(name);
+    PLAYER_REGISTRY_SHARD *shard = &preg->shards[hash & (PREG_SHARDS - 1)];
+    metrics_mutex_lock(&shard->lock, METRICS_LOCK_PREG);
+    PLAYER *player = find_or_create(shard, name, hash, rating);
+    pthread_mutex_unlock(&shard->lock);
+    return player;
+}
 
-    // Create new node for the player
-    PLAYER_REGISTRY_NODE *new_node = malloc(sizeof(PLAYER_REGISTRY_NODE));
-    if (new_node == NULL) {
-        player_unref(player, "registering player"); // decrement reference count
-        pthread_mutex_unlock(&preg->lock);
-        return NULL;
+void preg_reserve(PLAYER_REGISTRY *preg, int n) {
+    for (int i = 0; i < PREG_SHARDS; i++) {
+        PLAYER_REGISTRY_SHARD *shard = &preg->shards[i];
+        metrics_mutex_lock(&shard->lock, METRICS_LOCK_PREG);
+        while (shard->num_buckets < n / PREG_SHARDS) {
+            int num_buckets = shard->num_buckets;
+            grow_shard(shard);
+            if (shard->num_buckets == num_buckets)
+                break;      // out of memory; it grows as it fills instead
+        }
+        pthread_mutex_unlock(&shard->lock);
     }
+}
 
-    new_node->name = copy_payload_v2(name, strlen(name));
-    new_node->player = player;
-    new_node->prev = NULL;
-    new_node->next = preg->head;
-    if (preg->head != NULL) {
-        preg->head->prev = new_node;
+PLAYER **preg_all_players(PLAYER_REGISTRY *preg, int *countp) {
+    int count = 0, cap = 0;
+    PLAYER **players = NULL;
+    for (int i = 0; i < PREG_SHARDS; i++) {
+        PLAYER_REGISTRY_SHARD *shard = &preg->shards[i];
+        metrics_mutex_lock(&shard->lock, METRICS_LOCK_PREG);
+        if (count + shard->count > cap) {
+            int new_cap = 2 * (count + shard->count);
+            PLAYER **bigger = realloc(players, new_cap * sizeof(PLAYER *));
+            if (bigger == NULL) {
+                pthread_mutex_unlock(&shard->lock);
+                free(players);
+                *countp = 0;
+                return NULL;
+            }
+            players = bigger;
+            cap = new_cap;
+        }
+        for (int b = 0; b < shard->num_buckets; b++) {
+            for (PLAYER_REGISTRY_ENTRY *entry = shard->buckets[b]; entry != NULL; entry = entry->next) {
+                players[count++] = entry->player;
+            }
+        }
+        pthread_mutex_unlock(&shard->lock);
     }
-    preg->head = new_node;
-
-    player_ref(player, "registering player"); // increase reference count
-    pthread_mutex_unlock(&preg->lock); // release the lock
-
-    // Return the newly created player
-    return player;
+    *countp = count;
+    return players;
 }
-
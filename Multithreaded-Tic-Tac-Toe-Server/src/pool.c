@@ -0,0 +1,173 @@
+#include <stdlib.h>
+#include <pthread.h>
+
+#include "pool.h"
+#include "debug.h"
+
+#ifdef NO_POOL
+
+void *pool_alloc(POOL *pool){
+    return malloc(pool->size);
+}
+
+void pool_free(POOL *pool, void *obj){
+    free(obj);
+}
+
+#else
+
+/*
+ * Free objects are linked through their first word, both in the
+ * per-thread lists and in the depot.
+ */
+typedef struct free_object {
+    struct free_object *next;
+} FREE_OBJECT;
+
+typedef struct pool_cache {
+    FREE_OBJECT *head;          // this thread's free objects of one pool
+    int count;                  // # of objects in head
+} POOL_CACHE;
+
+static POOL *pools[POOL_MAX];                   // registered pools, by id
+static int num_pools;
+static pthread_mutex_t pools_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static __thread POOL_CACHE caches[POOL_MAX];    // indexed by pool id
+static __thread int cache_in_use;               // the exit hook has been set
+
+static pthread_key_t cache_key;
+static pthread_once_t cache_once = PTHREAD_ONCE_INIT;
+
+// unlink up to n objects from the front of *listp; returns how many, with the last in *lastp
+static int take_batch(FREE_OBJECT **listp, int n, FREE_OBJECT **lastp){
+    FREE_OBJECT *last = NULL;
+    int count = 0;
+    for(FREE_OBJECT *obj = *listp; obj != NULL && count < n; obj = obj->next){
+        last = obj;
+        count++;
+    }
+    if(last != NULL){
+        *listp = last->next;
+        last->next = NULL;
+    }
+    *lastp = last;
+    return count;
+}
+
+// give a list of count objects, ending in last, to the pool's depot
+static void depot_put(POOL *pool, FREE_OBJECT *first, FREE_OBJECT *last, int count){
+    pthread_mutex_lock(&pool->lock);
+    last->next = pool->depot;
+    pool->depot = first;
+    pool->depot_count += count;
+    pthread_mutex_unlock(&pool->lock);
+}
+
+// key destructor: a thread is exiting, so its free objects go to the depots
+static void cache_flush(void *arg){
+    for(int id = 0; id < POOL_MAX; id++){
+        POOL_CACHE *cache = &caches[id];
+        if(cache->head == NULL){
+            continue;
+        }
+        FREE_OBJECT *last = cache->head;
+        while(last->next != NULL){
+            last = last->next;
+        }
+        depot_put(pools[id], cache->head, last, cache->count);
+        cache->head = NULL;
+        cache->count = 0;
+    }
+}
+
+static void cache_key_create(void){
+    pthread_key_create(&cache_key, cache_flush);
+}
+
+// get the calling thread's free list for a pool, registering the pool on first use
+static POOL_CACHE *get_cache(POOL *pool){
+    int id = atomic_load_explicit(&pool->id, memory_order_acquire);
+    if(id < 0){
+        pthread_mutex_lock(&pools_lock);
+        id = atomic_load_explicit(&pool->id, memory_order_relaxed);
+        if(id < 0 && num_pools < POOL_MAX){
+            id = num_pools++;
+            pools[id] = pool;
+            atomic_store_explicit(&pool->id, id, memory_order_release);
+            debug("pool %s (%zu-byte objects) has id %d", pool->name, pool->size, id);
+        }
+        pthread_mutex_unlock(&pools_lock);
+        if(id < 0){
+            debug("too many pools; %s cannot be registered", pool->name);
+            return NULL;
+        }
+    }
+    if(!cache_in_use){
+        pthread_once(&cache_once, cache_key_create);
+        pthread_setspecific(cache_key, caches);
+        cache_in_use = 1;
+    }
+    return &caches[id];
+}
+
+// fill an empty free list from the depot, or else from a new slab
+static int refill(POOL *pool, POOL_CACHE *cache){
+    FREE_OBJECT *last;
+    pthread_mutex_lock(&pool->lock);
+    cache->head = pool->depot;
+    int taken = take_batch((FREE_OBJECT **) &pool->depot, POOL_BATCH, &last);
+    pool->depot_count -= taken;
+    pthread_mutex_unlock(&pool->lock);
+    if(taken > 0){
+        cache->count = taken;
+        return 0;
+    }
+    char *slab = malloc(POOL_SLAB_OBJECTS * pool->size);
+    if(slab == NULL){
+        return -1;
+    }
+    debug("new slab of %d %s objects", POOL_SLAB_OBJECTS, pool->name);
+    for(int i = POOL_SLAB_OBJECTS - 1; i >= 0; i--){
+        FREE_OBJECT *obj = (FREE_OBJECT *) (slab + i * pool->size);
+        obj->next = cache->head;
+        cache->head = obj;
+    }
+    cache->count = POOL_SLAB_OBJECTS;
+    return 0;
+}
+
+void *pool_alloc(POOL *pool){
+    POOL_CACHE *cache = get_cache(pool);
+    if(cache == NULL){
+        return NULL;
+    }
+    if(cache->head == NULL && refill(pool, cache) == -1){
+        return NULL;
+    }
+    FREE_OBJECT *obj = cache->head;
+    cache->head = obj->next;
+    cache->count--;
+    return obj;
+}
+
+void pool_free(POOL *pool, void *obj){
+    if(obj == NULL){
+        return;
+    }
+    // an object was allocated from the pool, so the pool has an id
+    POOL_CACHE *cache = get_cache(pool);
+    FREE_OBJECT *fobj = obj;
+    fobj->next = cache->head;
+    cache->head = fobj;
+    cache->count++;
+    if(cache->count > 2 * POOL_BATCH){
+        FREE_OBJECT *first = cache->head;
+        FREE_OBJECT *last;
+        int taken = take_batch(&cache->head, POOL_BATCH, &last);
+        cache->count -= taken;
+        depot_put(pool, first, last, taken);
+    }
+}
+
+#endif
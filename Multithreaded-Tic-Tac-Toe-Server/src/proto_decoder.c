@@ -0,0 +1,203 @@
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <arpa/inet.h>
+
+#include "proto_decoder.h"
+#include "debug.h"
+
+#define HEADER_SIZE sizeof(JEUX_PACKET_HEADER)
+
+static size_t round_up_pow2(size_t n){
+    size_t p = 1;
+    while(p < n){
+        p <<= 1;
+    }
+    return p;
+}
+
+// copy len bytes starting at ring position pos, following the wrap-around
+static void ring_copy_out(PROTO_DECODER *dec, size_t pos, void *dst, size_t len){
+    size_t off = pos & (dec->capacity - 1);
+    size_t first = dec->capacity - off;
+    if(first >= len){
+        memcpy(dst, dec->buf + off, len);
+    }
+    else{
+        memcpy(dst, dec->buf + off, first);
+        memcpy((char *) dst + first, dec->buf, len - first);
+    }
+}
+
+// grow the ring to hold at least need bytes, moving pending bytes to the front
+static int ring_grow(PROTO_DECODER *dec, size_t need){
+    size_t used = dec->tail - dec->head;
+    size_t capacity = round_up_pow2(need);
+    char *buf = malloc(capacity);
+    if(buf == NULL){
+        return -1;
+    }
+    ring_copy_out(dec, dec->head, buf, used);
+    free(dec->buf);
+    dec->buf = buf;
+    dec->capacity = capacity;
+    dec->head = 0;
+    dec->tail = used;
+    debug("decoder ring grown to %zu bytes", capacity);
+    return 0;
+}
+
+// make sure there is room: the ring must be able to hold the packet at its head
+static int ring_reserve(PROTO_DECODER *dec){
+    size_t used = dec->tail - dec->head;
+    if(used == 0){
+        dec->head = dec->tail = 0;   // keep data contiguous whenever we can
+        return 0;
+    }
+    if(used < dec->capacity){
+        return 0;
+    }
+    if(used >= HEADER_SIZE){
+        JEUX_PACKET_HEADER hdr;
+        ring_copy_out(dec, dec->head, &hdr, HEADER_SIZE);
+        size_t need = HEADER_SIZE + ntohs(hdr.size);
+        if(need > dec->capacity){
+            return ring_grow(dec, need);
+        }
+    }
+    // full of complete packets that the caller has not extracted
+    errno = ENOBUFS;
+    return -1;
+}
+
+int proto_decoder_init(PROTO_DECODER *dec, size_t capacity){
+    if(capacity == 0){
+        capacity = PROTO_DECODER_DEFAULT_CAPACITY;
+    }
+    // a header must always fit, so that its size field can be inspected
+    capacity = round_up_pow2(capacity < HEADER_SIZE ? HEADER_SIZE : capacity);
+    memset(dec, 0, sizeof(PROTO_DECODER));
+    if((dec->buf = malloc(capacity)) == NULL){
+        return -1;
+    }
+    dec->capacity = capacity;
+    return 0;
+}
+
+void proto_decoder_fini(PROTO_DECODER *dec){
+    free(dec->buf);
+    free(dec->spill);
+    memset(dec, 0, sizeof(PROTO_DECODER));
+}
+
+ssize_t proto_decoder_fill(PROTO_DECODER *dec, int fd, int flags){
+    if(ring_reserve(dec) == -1){
+        return -1;
+    }
+    size_t mask = dec->capacity - 1;
+    size_t used = dec->tail - dec->head;
+    size_t t = dec->tail & mask;
+    size_t h = dec->head & mask;
+    struct iovec iov[2];
+    int iovcnt = 1;
+
+    iov[0].iov_base = dec->buf + t;
+    if(used == 0 || t > h){
+        // free space runs from the tail to the end, then wraps to the head
+        iov[0].iov_len = dec->capacity - t;
+        if(h > 0 && used != 0){
+            iov[1].iov_base = dec->buf;
+            iov[1].iov_len = h;
+            iovcnt = 2;
+        }
+    }
+    else{
+        iov[0].iov_len = h - t;
+    }
+
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = iov;
+    msg.msg_iovlen = iovcnt;
+    // an interrupted receive is left to the caller, which may have been
+    // interrupted on purpose (see upgrade.h)
+    ssize_t n = recvmsg(fd, &msg, flags);
+    if(n > 0){
+        dec->tail += n;
+    }
+    return n;
+}
+
+int proto_decoder_feed(PROTO_DECODER *dec, const void *data, size_t len){
+    while(len > 0){
+        if(ring_reserve(dec) == -1){
+            // the caller has not drained yet; make room rather than drop bytes
+            if(errno != ENOBUFS || ring_grow(dec, dec->capacity * 2) == -1){
+                return -1;
+            }
+        }
+        size_t off = dec->tail & (dec->capacity - 1);
+        size_t room = dec->capacity - (dec->tail - dec->head);
+        size_t chunk = dec->capacity - off;
+        if(chunk > room)
+            chunk = room;
+        if(chunk > len)
+            chunk = len;
+        memcpy(dec->buf + off, data, chunk);
+        dec->tail += chunk;
+        data = (const char *) data + chunk;
+        len -= chunk;
+    }
+    return 0;
+}
+
+size_t proto_decoder_unread(PROTO_DECODER *dec, void *buf, size_t size){
+    size_t avail = dec->tail - dec->head;
+    ring_copy_out(dec, dec->head, buf, avail < size ? avail : size);
+    return avail;
+}
+
+int proto_decoder_next(PROTO_DECODER *dec, JEUX_PACKET_HEADER *hdr, void **payloadp){
+    size_t avail = dec->tail - dec->head;
+    if(avail < HEADER_SIZE){
+        return 0;
+    }
+    JEUX_PACKET_HEADER h;
+    ring_copy_out(dec, dec->head, &h, HEADER_SIZE);
+    size_t size = ntohs(h.size);
+    if(avail < HEADER_SIZE + size){
+        return 0;
+    }
+
+    void *payload = NULL;
+    if(size > 0){
+        size_t off = (dec->head + HEADER_SIZE) & (dec->capacity - 1);
+        if(off + size <= dec->capacity){
+            payload = dec->buf + off;       // the common case: a view into the ring
+        }
+        else{
+            // the payload wraps around the end of the ring: linearize it
+            if(dec->spill_size < size){
+                char *spill = realloc(dec->spill, size);
+                if(spill == NULL){
+                    return 0;
+                }
+                dec->spill = spill;
+                dec->spill_size = size;
+            }
+            ring_copy_out(dec, dec->head + HEADER_SIZE, dec->spill, size);
+            payload = dec->spill;
+        }
+    }
+    dec->head += HEADER_SIZE + size;
+
+    // Convert multi-byte fields from network to host byte order
+    h.size = size;
+    h.timestamp_sec = ntohl(h.timestamp_sec);
+    h.timestamp_nsec = ntohl(h.timestamp_nsec);
+    *hdr = h;
+    *payloadp = payload;
+    return 1;
+}
@@ -10,10 +10,13 @@
 #include <sys/socket.h>
 #include <getopt.h>
 #include <ctype.h>
+#include <sys/uio.h>
 
 #include <protocol.h>
+#include "protocol_ext.h"
 #include "debug.h"
 #include "csapp.h"
+#include "trace.h"
 
 // typedef struct jeux_packet_header {
 //     uint8_t type;          // Type of the packet
@@ -24,66 +27,72 @@
 //     uint32_t timestamp_nsec;       // Nanoseconds field of time packet was sent
 // } JEUX_PACKET_HEADER;
 
-void print_debug_packet(char *preemble, JEUX_PACKET_HEADER *hdr, void **payloadp){
-    if(payloadp){
-        debug("%s packet time: %d.%d ID = %d TYPE = %d ROLE = %d SIZE = %u PAYLOAD = %s",
-        preemble, 
-        hdr->timestamp_sec, 
-        hdr->timestamp_nsec,
-        hdr->id,
-        hdr->type,
-        hdr->role,
-        hdr->size,
-        (char *) payloadp);
-    }
-    else{
-        debug("%s packet time: %d.%d ID = %d TYPE = %d ROLE = %d SIZE = %u PAYLOAD = NO PAYLOAD",
-        preemble, 
-        hdr->timestamp_sec, 
-        hdr->timestamp_nsec,
-        hdr->id,
-        hdr->type,
-        hdr->role,
-        hdr->size);
+void proto_stamp_header(JEUX_PACKET_HEADER *hdr){
+    struct timespec time;
+    clock_gettime(CLOCK_MONOTONIC ,&time);
+    hdr->timestamp_sec = htonl(time.tv_sec);
+    hdr->timestamp_nsec = htonl(time.tv_nsec);
+}
+
+// write out an iovec array completely, handling short counts and EINTR
+static int writev_fully(int fd, struct iovec *iov, int iovcnt){
+    while(iovcnt > 0){
+        ssize_t n = writev(fd, iov, iovcnt);
+        if(n < 0){
+            if(errno == EINTR)
+                continue;
+            return -1;
+        }
+        // skip past the iovecs that were written completely
+        while(iovcnt > 0 && (size_t) n >= iov->iov_len){
+            n -= iov->iov_len;
+            iov++;
+            iovcnt--;
+        }
+        if(iovcnt > 0){
+            iov->iov_base = (char *) iov->iov_base + n;
+            iov->iov_len -= n;
+        }
     }
+    return 0;
 }
 
 // when reading, it must be in host byte order, when storing, it must be network order
 int proto_send_packet(int fd, JEUX_PACKET_HEADER *hdr, void *data) {
-    errno = 0;
-    int header_size = sizeof(JEUX_PACKET_HEADER);
-    int payload_size = ntohs(hdr->size);
-
-    // invalid packet
-    if((payload_size == 0 && data != NULL) || (payload_size != 0 && data == NULL)){
-        debug("Error: payload_size 0 and there's data or there's size but no payload");
-        return -1;
-    }
+    return proto_send_packets(fd, &hdr, &data, 1);
+}
 
-    struct timespec time;
-    clock_gettime(CLOCK_MONOTONIC ,&time);
-    hdr->timestamp_sec = time.tv_sec;
-    hdr->timestamp_nsec = time.tv_nsec;
-    // hdr->size = htons(hdr->size); //Why does this line not work??
-    // hdr->role = htons(hdr->role);
-    // hdr->type = htons(hdr->type);
-    // hdr->id = htons(hdr->id);
-    hdr->timestamp_nsec = htonl(hdr->timestamp_nsec);
-    hdr->timestamp_sec = htonl(hdr->timestamp_sec);
-    // memset(hdr, 0, sizeof(JEUX_PACKET_HEADER));
-    // writing
-    if(rio_writen(fd, hdr, header_size) < 0){
-        debug("Error writing packet header to socket");
+int proto_send_packets(int fd, JEUX_PACKET_HEADER **hdrs, void **data, int count) {
+    errno = 0;
+    if(count < 0 || count > PROTO_MAX_BATCH){
+        errno = EINVAL;
         return -1;
     }
-    print_debug_packet("send: ", hdr, data);
-    // Write data to socket, if present
-    if (payload_size > 0 && data != NULL) {
-        errno = 0;
-        if(rio_writen(fd, data, payload_size) < 0){
-            debug("Error writing packet header to socket");
+    // header and payload of each packet go out in one writev
+    struct iovec iov[2 * PROTO_MAX_BATCH];
+    int iovcnt = 0;
+    for(int i = 0; i < count; i++){
+        int payload_size = ntohs(hdrs[i]->size);
+        // invalid packet
+        if((payload_size == 0 && data[i] != NULL) || (payload_size != 0 && data[i] == NULL)){
+            debug("Error: payload_size 0 and there's data or there's size but no payload");
+            errno = EINVAL;
             return -1;
         }
+        proto_stamp_header(hdrs[i]);
+        TRACE(TRACE_PACKET_OUT, hdrs[i]->type, fd, TRACE_HEADER_FIELDS(hdrs[i], payload_size), 0);
+        iov[iovcnt].iov_base = hdrs[i];
+        iov[iovcnt].iov_len = sizeof(JEUX_PACKET_HEADER);
+        iovcnt++;
+        if(payload_size > 0){
+            iov[iovcnt].iov_base = data[i];
+            iov[iovcnt].iov_len = payload_size;
+            iovcnt++;
+        }
+    }
+    if(writev_fully(fd, iov, iovcnt) < 0){
+        debug("Error writing packets to socket");
+        return -1;
     }
     // otherwise we success in writing, return 0
     return 0;
@@ -130,7 +139,7 @@ int proto_recv_packet(int fd, JEUX_PACKET_HEADER *hdr, void **payloadp) {
         *payloadp = NULL;
 
     }
-    print_debug_packet("recv:", hdr,payloadp);
+    TRACE(TRACE_PACKET_IN, hdr->type, fd, TRACE_HEADER_FIELDS(hdr, hdr->size), 0);
 
     return 0;
 }
\ No newline at end of file
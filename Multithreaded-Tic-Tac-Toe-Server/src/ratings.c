@@ -0,0 +1,208 @@
+#include <stdlib.h>
+#include <math.h>
+#include <sched.h>
+#include <pthread.h>
+#include <stdatomic.h>
+
+#include "debug.h"
+#include "ratings.h"
+#include "player_ext.h"
+#include "users_cache.h"
+#include "leaderboard.h"
+#include "journal.h"
+#include "spawn.h"
+
+typedef struct result {
+    PLAYER *player1;            // retained until the result is applied
+    PLAYER *player2;            // NULL if only player1 is rated
+    int result;                 // as for player_post_result()
+    double rating1, rating2;    // the ratings once it is applied, for the journal;
+                                // rating2 is the opponent's, as posted, if player2 is NULL
+} RESULT;
+
+typedef struct ratings_queue {
+    pthread_mutex_t lock;               // protects everything below
+    pthread_cond_t posted;              // the queue is no longer empty
+    pthread_cond_t taken;               // the worker made room in the queue
+    pthread_cond_t applied;             // the worker finished a batch
+    RESULT results[RATINGS_QUEUE_SIZE]; // results[n % RATINGS_QUEUE_SIZE] is the n-th posted
+    unsigned long num_posted;
+    unsigned long num_taken;            // by the worker
+    unsigned long num_applied;
+    int worker_running;
+} RATINGS_QUEUE;
+
+static RATINGS_QUEUE queue = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .posted = PTHREAD_COND_INITIALIZER,
+    .taken = PTHREAD_COND_INITIALIZER,
+    .applied = PTHREAD_COND_INITIALIZER,
+};
+static pthread_once_t worker_once = PTHREAD_ONCE_INIT;
+
+// odd while a batch is being applied
+static atomic_uint ratings_seq;
+
+// expected[RATING_DIFF_MAX + d]: expected score against an opponent rated d higher
+static double expected[2 * RATING_DIFF_MAX + 1];
+static pthread_once_t table_once = PTHREAD_ONCE_INIT;
+
+static void build_table(void){
+    for(int d = -RATING_DIFF_MAX; d <= RATING_DIFF_MAX; d++){
+        expected[RATING_DIFF_MAX + d] = 1.0 / (1.0 + pow(10.0, d / 400.0));
+    }
+}
+
+double ratings_expected_score(double diff){
+    pthread_once(&table_once, build_table);
+    long d = lrint(diff);
+    if(d > RATING_DIFF_MAX)
+        d = RATING_DIFF_MAX;
+    else if(d < -RATING_DIFF_MAX)
+        d = -RATING_DIFF_MAX;
+    return expected[RATING_DIFF_MAX + d];
+}
+
+// the Elo update of both players; whatever player1 gains, player2 loses
+static void apply_result(RESULT *r){
+    double rating1 = player_get_exact_rating(r->player1);
+    double rating2 = r->player2 != NULL ? player_get_exact_rating(r->player2) : r->rating2;
+    double score1 = r->result == 0 ? 0.5 : r->result == 1 ? 1.0 : 0.0;
+    double change = RATING_K * (score1 - ratings_expected_score(rating2 - rating1));
+    r->rating1 = rating1 + change;
+    player_set_rating(r->player1, r->rating1);
+    if(r->player2 != NULL){
+        r->rating2 = rating2 - change;
+        player_set_rating(r->player2, r->rating2);
+    }
+}
+
+// apply a batch in order, as one write section, then publish its players
+static void apply_batch(RESULT *batch, int n){
+    PLAYER *players[2 * RATINGS_QUEUE_SIZE];
+    int num_players = 0;
+    unsigned seq = atomic_load_explicit(&ratings_seq, memory_order_relaxed);
+    atomic_store_explicit(&ratings_seq, seq + 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+    for(int i = 0; i < n; i++){
+        apply_result(&batch[i]);
+        players[num_players++] = batch[i].player1;
+        if(batch[i].player2 != NULL)
+            players[num_players++] = batch[i].player2;
+    }
+    atomic_store_explicit(&ratings_seq, seq + 2, memory_order_release);
+    leaderboard_update(players, num_players);
+    for(int i = 0; i < n; i++){
+        journal_log_result(batch[i].player1, batch[i].player2, batch[i].result,
+                           batch[i].rating1, batch[i].rating2);
+        users_cache_note(batch[i].player1);
+        player_unref(batch[i].player1, "result applied");
+        if(batch[i].player2 != NULL){
+            users_cache_note(batch[i].player2);
+            player_unref(batch[i].player2, "result applied");
+        }
+    }
+}
+
+static void *worker_main(void *arg){
+    static RESULT batch[RATINGS_QUEUE_SIZE];
+    for(;;){
+        pthread_mutex_lock(&queue.lock);
+        while(queue.num_taken == queue.num_posted){
+            pthread_cond_wait(&queue.posted, &queue.lock);
+        }
+        int n = queue.num_posted - queue.num_taken;
+        for(int i = 0; i < n; i++){
+            batch[i] = queue.results[queue.num_taken++ % RATINGS_QUEUE_SIZE];
+        }
+        pthread_cond_broadcast(&queue.taken);
+        pthread_mutex_unlock(&queue.lock);
+
+        apply_batch(batch, n);
+        debug("ratings: batch of %d results applied", n);
+
+        pthread_mutex_lock(&queue.lock);
+        queue.num_applied += n;
+        pthread_cond_broadcast(&queue.applied);
+        pthread_mutex_unlock(&queue.lock);
+    }
+    return NULL;
+}
+
+static void worker_start(void){
+    if(spawn(NULL, NULL, worker_main, NULL) == 0){
+        queue.worker_running = 1;
+    }
+    else{
+        debug("ratings: no worker thread; results are applied as they are posted");
+    }
+}
+
+// queue a result whose references are already taken, or apply it if there is no worker
+static void post(RESULT r){
+    pthread_once(&worker_once, worker_start);
+    pthread_mutex_lock(&queue.lock);
+    if(!queue.worker_running){
+        // still in order, since the queue lock is held
+        apply_batch(&r, 1);
+        queue.num_posted++;
+        queue.num_taken++;
+        queue.num_applied++;
+        pthread_mutex_unlock(&queue.lock);
+        return;
+    }
+    while(queue.num_posted - queue.num_taken == RATINGS_QUEUE_SIZE){
+        pthread_cond_wait(&queue.taken, &queue.lock);
+    }
+    queue.results[queue.num_posted++ % RATINGS_QUEUE_SIZE] = r;
+    pthread_cond_signal(&queue.posted);
+    pthread_mutex_unlock(&queue.lock);
+}
+
+int ratings_post(PLAYER *player1, PLAYER *player2, int result){
+    if(player1 == NULL || player2 == NULL || result < 0 || result > 2)
+        return -1;
+    post((RESULT){
+        .player1 = player_ref(player1, "result posted"),
+        .player2 = player_ref(player2, "result posted"),
+        .result = result,
+    });
+    return 0;
+}
+
+int ratings_post_against(PLAYER *player, double opponent_rating, int result){
+    if(player == NULL || result < 0 || result > 2)
+        return -1;
+    post((RESULT){
+        .player1 = player_ref(player, "result posted"),
+        .result = result,
+        .rating2 = opponent_rating,
+    });
+    return 0;
+}
+
+void ratings_flush(void){
+    pthread_mutex_lock(&queue.lock);
+    unsigned long target = queue.num_posted;
+    while(queue.num_applied < target){
+        pthread_cond_wait(&queue.applied, &queue.lock);
+    }
+    pthread_mutex_unlock(&queue.lock);
+}
+
+unsigned ratings_read_begin(void){
+    unsigned seq;
+    while((seq = atomic_load_explicit(&ratings_seq, memory_order_acquire)) & 1){
+        sched_yield();      // a batch takes microseconds
+    }
+    return seq;
+}
+
+int ratings_read_retry(unsigned seq){
+    atomic_thread_fence(memory_order_acquire);
+    return atomic_load_explicit(&ratings_seq, memory_order_relaxed) != seq;
+}
+
+void ratings_fini(void){
+    ratings_flush();
+}
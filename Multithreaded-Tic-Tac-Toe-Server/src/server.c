@@ -4,7 +4,19 @@
 #include "csapp.h"
 #include "player.h"
 #include "game.h"
-#include "client_registry.h"
+#include "game_ext.h"
+#include "session.h"
+#include "client_ext.h"
+#include "proto_decoder.h"
+#include "users_cache.h"
+#include "oracle.h"
+#include "leaderboard.h"
+#include "matchmaker.h"
+#include "metrics.h"
+#include "trace.h"
+#include "cluster.h"
+#include "upgrade.h"
+#include "protocol_ext.h"
 
 
  /* Client-to-server requests:
@@ -90,12 +102,12 @@ extern CLIENT_REGISTRY *client_registry;
 extern PLAYER_REGISTRY *player_registry;
 
 
-JEUX_PACKET_HEADER *construct_packet(JEUX_PACKET_TYPE type, size_t size){
-    JEUX_PACKET_HEADER *pkt = Malloc(sizeof(JEUX_PACKET_HEADER));
+#define PAYLOAD_BUF_SIZE 64         // payloads shorter than this are copied onto the stack
+
+void construct_packet(JEUX_PACKET_HEADER *pkt, JEUX_PACKET_TYPE type, size_t size){
     memset(pkt, 0, sizeof(JEUX_PACKET_HEADER));
     pkt->type = type;
     pkt->size = size;
-    return pkt;
 }
 
 char* copy_payload(const char* payload, size_t size) {
@@ -113,299 +125,454 @@ char* copy_payload(const char* payload, size_t size) {
     return new_string;
 }
 
-int check_if_other_clients_logged_in_with_same_name(char *name){
-    PLAYER** player_list = creg_all_players(client_registry);
-    int result = 0;
-    for (int i = 0; player_list[i] != NULL; i++) {
-        player_unref(player_list[i], "Player remove from the player list");
-        if (strcmp(player_get_name(player_list[i]),name) == 0) {
-            result = 1;
+/*
+ * Get the payload as a NUL-terminated string, in buf if it fits there
+ * (the common case of a move or a username) and otherwise in malloc'ed
+ * storage.  Release it with free_payload_string().
+ */
+static char *payload_string(const void *payload, size_t size, char *buf, size_t bufsize){
+    if(size >= bufsize){
+        return copy_payload(payload, size);
+    }
+    memcpy(buf, payload, size);
+    buf[size] = '\0';
+    return buf;
+}
+
+static void free_payload_string(char *str, char *buf){
+    if(str != buf){
+        free(str);
+    }
+}
+
+/*
+ * Handlers for the client-to-server requests.  Each handler is invoked
+ * by jeux_session_dispatch() with the header (in host byte order) and
+ * payload of a single packet, and is responsible for sending the ACK or
+ * NACK that answers it.
+ */
+typedef void (*JEUX_HANDLER)(JEUX_SESSION *session, JEUX_PACKET_HEADER *hdr, void *payload);
+
+static void handle_login(JEUX_SESSION *session, JEUX_PACKET_HEADER *hdr, void *payload){
+    CLIENT *client = session->client;
+    debug("Received LOGIN packet: fd number is %d", session->fd);
+    // they should only honor the LOGIN packet if the user is not logged in
+    if(session->logged_in){
+        client_send_nack(client);
+        return;
+    }
+    // copy the payload, which is the pointer
+    char buf[PAYLOAD_BUF_SIZE];
+    char *p = payload_string(payload, hdr->size, buf, sizeof(buf));
+    if(p == NULL){
+        client_send_nack(client);
+        return;
+    }
+    // the otherwise unused role field holds the LOGIN options
+    if(client_set_options(client, hdr->role) == -1){
+        free_payload_string(p, buf);
+        client_send_nack(client);
+        return;
+    }
+    PLAYER *player = preg_register(player_registry, p);
+    if(player == NULL){
+        free_payload_string(p, buf);
+        client_send_nack(client);
+        return;
+    }
+    int val = client_login(client, player);
+    debug("client login is SUCC[0]/FAIL[-1] = %d", val);
+    // the client retains its own reference to the player
+    player_unref(player, "LOGIN handler discards the registry's returned reference");
+    free_payload_string(p, buf);
+
+    if(!val){   // successful -> ACK packet
+        client_send_ack(client, NULL, 0);
+        session->logged_in = 1;
+    }else{     // unsuccessful -> NACK packet
+        client_send_nack(client);
+    }
+}
+
+static void handle_users(JEUX_SESSION *session, JEUX_PACKET_HEADER *hdr, void *payload){
+    CLIENT *client = session->client;
+    debug("Received USERS packet: fd number is %d", session->fd);
+    // The server responds by sending an ACK packet whose payload consists of a text string in which
+    // each line gives the username of a currently logged in player, followed by
+    // a single TAB character, followed by the player's current rating.
+    // A client that sends the version of its last versioned reply gets only the changes.
+    int versioned = hdr->size > 0;
+    if(versioned){
+        char buf[PAYLOAD_BUF_SIZE];
+        char *end;
+        char *p = payload_string(payload, hdr->size, buf, sizeof(buf));
+        if(p == NULL){
+            client_send_nack(client);
+            return;
+        }
+        unsigned long since = strtoul(p, &end, 10);
+        int valid = *p >= '0' && *p <= '9' && *end == '\0' && since <= UINT32_MAX;
+        free_payload_string(p, buf);
+        if(!valid){
+            client_send_nack(client);
+            return;
+        }
+        size_t len;
+        char *delta = users_cache_delta(since, &len);
+        if(delta != NULL){
+            client_send_ack(client, delta, len);
+            free(delta);
+            return;
+        }
+    }
+    size_t prefix_len;
+    OUTQ_SHARED *listing = users_cache_snapshot(&prefix_len);
+    if(listing == NULL){
+        client_send_nack(client);
+        return;
+    }
+    // the cached listing is queued as it is; only unversioned replies skip the version line
+    size_t off = versioned ? 0 : prefix_len;
+    JEUX_PACKET_HEADER ack_pkt;
+    construct_packet(&ack_pkt, JEUX_ACK_PKT, htons(listing->len - off));
+    if(client_send_shared(client, &ack_pkt, listing, off) == -1){
+        debug("There's something wrong sending the ack packet");
+    }
+    outq_shared_unref(listing);
+}
+
+static void handle_invite(JEUX_SESSION *session, JEUX_PACKET_HEADER *hdr, void *payload){
+    CLIENT *client = session->client;
+    CLIENT *target_client;
+    debug("Received INVITE packet: fd number is %d", session->fd);
+    // look up the player who send the invitation with fd and look up the player who will receive it name
+    char buf[PAYLOAD_BUF_SIZE];
+    char *name = payload_string(payload, hdr->size, buf, sizeof(buf));
+    if(name == NULL){
+        client_send_nack(client);
+        return;
+    }
+    debug("The payload is %s", name);
+    // the board, if it is not the classic one, follows the name after a tab
+    GAME_VARIANT variant = game_classic;
+    char *board = strchr(name, '\t');
+    if(board != NULL){
+        *board++ = '\0';
+        if(game_parse_variant(board, &variant) == -1){
+            debug("No games are played on a board of %s", board);
+            free_payload_string(name, buf);
+            client_send_nack(client);
+            return;
         }
     }
-    free(player_list);
-    return result;
+
+    target_client = creg_lookup(client_registry, name);
+    if(target_client == NULL || target_client == client){
+        debug("Target client can't be found using name %s", name);
+        free_payload_string(name, buf);
+        client_unref(target_client, "client can't be looked up when invited");
+        client_send_nack(client);
+        return;
+    }
+    free_payload_string(name, buf);
+
+    // Role: (1 for first player to move, 2 for second player to move)
+    GAME_ROLE source_role;
+    GAME_ROLE target_role;
+    if(hdr->role == 1){
+        source_role = SECOND_PLAYER_ROLE;
+        target_role = FIRST_PLAYER_ROLE;
+    }
+    else if(hdr->role == 2){
+        source_role = FIRST_PLAYER_ROLE;
+        target_role = SECOND_PLAYER_ROLE;
+    }
+    else{
+        debug("game role invalid");
+        // if the header is not 1 or 2, then we don't know what to do
+        client_unref(target_client, "invalid role in invitation");
+        client_send_nack(client);
+        return;
+    }
+
+    int source_id = client_make_variant_invitation(client, target_client, source_role, target_role, &variant);
+    client_unref(target_client, "after invitation attempt");
+    if(source_id == -1){
+        debug("Invitation failed");
+        client_send_nack(client);
+        return;
+    }
+    // construct ACT PACKET AND SEND IT to the SOURCE CLIENT
+    JEUX_PACKET_HEADER ack_pkt;
+    construct_packet(&ack_pkt, JEUX_ACK_PKT, 0);
+    ack_pkt.id = source_id;
+    client_send_packet(client, &ack_pkt, 0);
+}
+
+static void handle_revoke(JEUX_SESSION *session, JEUX_PACKET_HEADER *hdr, void *payload){
+    debug("Received REVOKE packet: fd number is %d", session->fd);
+    if(client_revoke_invitation(session->client, hdr->id) == -1){
+        client_send_nack(session->client);
+        return;
+    }
+    client_send_ack(session->client, NULL, 0);
+}
+
+static void handle_decline(JEUX_SESSION *session, JEUX_PACKET_HEADER *hdr, void *payload){
+    debug("Received DECLINE packet: fd number is %d", session->fd);
+    if(client_decline_invitation(session->client, hdr->id) == -1){
+        client_send_nack(session->client);
+        return;
+    }
+    client_send_ack(session->client, NULL, 0);
+}
+
+static void handle_accept(JEUX_SESSION *session, JEUX_PACKET_HEADER *hdr, void *payload){
+    CLIENT *client = session->client;
+    int invite_id = hdr->id;
+    debug("Received ACCEPT packet: fd number is %d", session->fd);
+    debug("the id is %d", hdr->id);
+
+    char state_str[GAME_STATE_MAX];
+    int len = client_accept_invitation_into(client, invite_id, state_str, sizeof(state_str));
+    if(len == -1){
+        client_send_nack(client);
+        return;
+    }
+
+    JEUX_PACKET_HEADER ack_pkt;
+    // construct_packet() leaves the size in host order
+    construct_packet(&ack_pkt, JEUX_ACK_PKT, htons(len));
+    ack_pkt.id = invite_id;
+    client_send_packet(client, &ack_pkt, len > 0 ? state_str : NULL);
+    debug("Send out ACK packet: fd number is %d", session->fd);
+}
+
+static void handle_move(JEUX_SESSION *session, JEUX_PACKET_HEADER *hdr, void *payload){
+    debug("Received MOVE packet: fd number is %d", session->fd);
+    char buf[PAYLOAD_BUF_SIZE];
+    char *p = payload_string(payload, hdr->size, buf, sizeof(buf));
+    if(p == NULL || client_make_move(session->client, hdr->id, p) == -1){
+        free_payload_string(p, buf);
+        client_send_nack(session->client);
+        return;
+    }
+    free_payload_string(p, buf);
+    debug("MOVE success");
+    client_send_ack(session->client, NULL, 0);
+}
+
+static void handle_resign(JEUX_SESSION *session, JEUX_PACKET_HEADER *hdr, void *payload){
+    debug("Received RESIGN packet: fd number is %d", session->fd);
+    if(client_resign_game(session->client, hdr->id) == -1){
+        client_send_nack(session->client);
+        return;
+    }
+    client_send_ack(session->client, NULL, 0);
+}
+
+static void handle_analyze(JEUX_SESSION *session, JEUX_PACKET_HEADER *hdr, void *payload){
+    debug("Received ANALYZE packet: fd number is %d", session->fd);
+    char analysis[ORACLE_ANALYSIS_MAX];
+    int len = client_analyze_game(session->client, hdr->id, analysis, sizeof(analysis));
+    if(len == -1){
+        client_send_nack(session->client);
+        return;
+    }
+    client_send_ack(session->client, analysis, len);
+}
+
+static void handle_leaderboard(JEUX_SESSION *session, JEUX_PACKET_HEADER *hdr, void *payload){
+    debug("Received LEADERBOARD packet: fd number is %d", session->fd);
+    size_t len;
+    char *reply;
+    if(hdr->size > 0){
+        char buf[PAYLOAD_BUF_SIZE];
+        char *name = payload_string(payload, hdr->size, buf, sizeof(buf));
+        if(name == NULL){
+            client_send_nack(session->client);
+            return;
+        }
+        reply = leaderboard_rank(name, &len);
+        free_payload_string(name, buf);
+    }
+    else{
+        reply = leaderboard_top(hdr->id != 0 ? hdr->id : LEADERBOARD_DEFAULT_K, &len);
+    }
+    if(reply == NULL){
+        client_send_nack(session->client);
+        return;
+    }
+    client_send_ack(session->client, reply, len);
+    free(reply);
+}
+
+static void handle_seek(JEUX_SESSION *session, JEUX_PACKET_HEADER *hdr, void *payload){
+    debug("Received SEEK packet: fd number is %d", session->fd);
+    int ret;
+    switch(hdr->role){
+    case SEEK_JOIN:
+        ret = matchmaker_seek(session->client);
+        break;
+    case SEEK_CANCEL:
+        ret = matchmaker_withdraw(session->client);
+        break;
+    default:
+        ret = -1;
+        break;
+    }
+    if(ret == -1){
+        client_send_nack(session->client);
+        return;
+    }
+    client_send_ack(session->client, NULL, 0);
+}
+
+static void handle_stats(JEUX_SESSION *session, JEUX_PACKET_HEADER *hdr, void *payload){
+    debug("Received STATS packet: fd number is %d", session->fd);
+    size_t len;
+    char *report = metrics_report(&len);
+    // the size of a payload must fit in its header
+    if(report == NULL || len > UINT16_MAX){
+        free(report);
+        client_send_nack(session->client);
+        return;
+    }
+    client_send_ack(session->client, report, len);
+    free(report);
+}
+
+static void handle_watch(JEUX_SESSION *session, JEUX_PACKET_HEADER *hdr, void *payload){
+    CLIENT *client = session->client;
+    debug("Received WATCH packet: fd number is %d", session->fd);
+    if(hdr->role == WATCH_STOP){
+        if(client_stop_watching(client, hdr->id) == -1){
+            client_send_nack(client);
+            return;
+        }
+        client_send_ack(client, NULL, 0);
+        return;
+    }
+    char buf[PAYLOAD_BUF_SIZE];
+    char *name = hdr->role == WATCH_START ? payload_string(payload, hdr->size, buf, sizeof(buf)) : NULL;
+    if(name == NULL){
+        client_send_nack(client);
+        return;
+    }
+    CLIENT *player = creg_lookup(client_registry, name);
+    free_payload_string(name, buf);
+    // the ACK, with the state of the game, is sent by client_watch_game()
+    int id = client_watch_game(client, player);
+    client_unref(player, "after watching attempt");
+    if(id == -1){
+        client_send_nack(client);
+    }
+}
+
+/*
+ * Dispatch table: PACKET TYPE -> HANDLER.  Types without an entry
+ * (JEUX_NO_PKT and the server-to-client types) are ignored.
+ */
+static const JEUX_HANDLER jeux_handlers[] = {
+    [JEUX_LOGIN_PKT]   = handle_login,
+    [JEUX_USERS_PKT]   = handle_users,
+    [JEUX_INVITE_PKT]  = handle_invite,
+    [JEUX_REVOKE_PKT]  = handle_revoke,
+    [JEUX_ACCEPT_PKT]  = handle_accept,
+    [JEUX_DECLINE_PKT] = handle_decline,
+    [JEUX_MOVE_PKT]    = handle_move,
+    [JEUX_RESIGN_PKT]  = handle_resign,
+    [JEUX_ANALYZE_PKT] = handle_analyze,
+    [JEUX_LEADERBOARD_PKT] = handle_leaderboard,
+    [JEUX_SEEK_PKT]    = handle_seek,
+    [JEUX_STATS_PKT]   = handle_stats,
+    [JEUX_WATCH_PKT]   = handle_watch,
+};
+
+int jeux_session_open(JEUX_SESSION *session, int fd){
+    session->fd = fd;
+    session->logged_in = 0;
+    if(!upgrade_adopt(session) && (session->client = creg_register(client_registry, fd)) == NULL){
+        return -1;
+    }
+    client_set_session(session->client, session);
+    client_start_timeouts(session->client);
+    debug("[%d] starting client service", fd);
+    return 0;
+}
+
+void jeux_session_dispatch(JEUX_SESSION *session, JEUX_PACKET_HEADER *hdr, void *payload){
+    TRACE(TRACE_PACKET_IN, hdr->type, session->fd, TRACE_HEADER_FIELDS(hdr, hdr->size), 0);
+    client_note_activity(session->client);
+    if(hdr->type >= sizeof(jeux_handlers) / sizeof(jeux_handlers[0]) || jeux_handlers[hdr->type] == NULL){
+        debug("Ignoring packet of type %d: fd number is %d", hdr->type, session->fd);
+        return;
+    }
+    // Until the client has logged in, only LOGIN packets are honored
+    if(hdr->type != JEUX_LOGIN_PKT && !session->logged_in){
+        client_send_nack(session->client);
+        return;
+    }
+    uint64_t start = metrics_now();
+    // in cluster mode, some packets are for another node
+    if(!cluster_route(session, hdr, payload))
+        jeux_handlers[hdr->type](session, hdr, payload);
+    metrics_packet(hdr->type, start);
+}
+
+void jeux_session_close(JEUX_SESSION *session){
+    debug("[%d]Ending client service", session->fd);
+    client_stop_timeouts(session->client);
+    client_logout(session->client);
+    client_finish_output(session->client);
+    client_set_session(session->client, NULL);
+    creg_unregister(client_registry, session->client);
+    session->client = NULL;
 }
 
 void *jeux_client_service(void *arg){
-    int logged_in = 0;
+    JEUX_SESSION session;
 
     int fd = *(int *) arg;
     debug("the client fd is %d", fd);
     free(arg);
 
     pthread_detach(pthread_self());  // detach
-    debug("[%d] starting client service", fd);
-    CLIENT *target_client, *client;
-    PLAYER *player = NULL;
-    if( (client = creg_register(client_registry,fd)) == NULL){
+    upgrade_reader_enter();
+    // Every packet that arrived with a single read is decoded and
+    // dispatched before the thread blocks in the next read.
+    PROTO_DECODER decoder;
+    if(proto_decoder_init(&decoder, 0) == -1){
+        close(fd);
+        upgrade_reader_leave();
         return NULL;
     }
-
-    JEUX_PACKET_HEADER* hdr = Malloc(sizeof(JEUX_PACKET_HEADER));
-    if (hdr == NULL){
+    session.decoder = &decoder;
+    if(jeux_session_open(&session, fd) == -1){
+        proto_decoder_fini(&decoder);
+        close(fd);
+        upgrade_reader_leave();
         return NULL;
     }
+
+    JEUX_PACKET_HEADER hdr;
     void* payload = NULL;
-    while(proto_recv_packet(fd, hdr, &payload) == 0){
-        switch(hdr->type){
-            /* Unused */
-            case JEUX_NO_PKT:
-                debug("Received JEUX_NO_PKT packet: fd number is %d", fd);
-                break;
-
-            /************************************* Client-to-server  **********************************/
-            case JEUX_LOGIN_PKT:
-                debug("Received LOGIN packet: fd number is %d", fd);
-                // they should only honor the LOGIN packet if the user is not logged in
-                if(!logged_in){ // if the client is already logged in
-                    // copy the payload, which is the pointer
-                    char* p = malloc( (hdr->size) +1);
-                    // char* temp_ptr = payload;
-                    memcpy(p, payload, hdr->size);
-                    // payload = temp_ptr;
-                    *(p + hdr->size) = '\0';
-
-                    if(check_if_other_clients_logged_in_with_same_name(p)){
-                        free(p);
-                        client_send_nack(client);
-                        break;
-                    }
-                    PLAYER *player = preg_register(player_registry, p);
-                    int val = client_login(client,player);
-                    debug("client login is SUCC[0]/FAIL[-1] = %d", val);
-                    free(p);
-
-                    if(!val){   // successful -> ACK packet
-                        client_send_ack(client, NULL, 0);
-                        logged_in = 1;
-                    }else{     // unsuccessful -> NACK packet
-                        client_send_nack(client);
-                        break;
-                    }
-                }else{
-                    client_send_nack(client);
-                }
-                break;
-            case JEUX_USERS_PKT:
-                debug("Received USERS packet: fd number is %d", fd);
-
-                if(!logged_in){// if the client is NOT logged in
-                    client_send_nack(client);
-                }
-                else{
-                    // The server responds by sending an ACK packet whose payload consists of a text string in which
-                    // each line gives the username of a currently logged in player, followed by
-                    // a single TAB character, followed by the player's current rating
-                    PLAYER ** player_list = creg_all_players(client_registry);
-                    debug("[%d] USERS", fd);
-                    size_t total_size = 0; // assuming null terminator is in there
-                    char * str_payload = NULL;
-                    int i = 0;
-                    for(PLAYER **player = player_list; *player; player++){
-                        player_unref(*player, "Player remove from the player list");
-                        char *name = player_get_name(*player);
-                        int rating = player_get_rating(*player);
-                        int line_size = strlen(name) + snprintf(NULL, 0, "%d", rating) + 3;
-                        total_size += line_size; // Calculate size of each line
-
-                        char *line = malloc(line_size);
-                        snprintf(line, line_size, "%s\t%d\n", name, rating);
-                        if (str_payload == NULL) {
-                            str_payload = strdup(line);
-                        } else {
-                            str_payload = realloc(str_payload, total_size);
-                            if(str_payload == NULL){
-                                client_send_nack(client);
-                            }
-                            strcat(str_payload, line);
-                        }
-                        free(line);  // free the line buffer
-                        // free(name);  // free the name buffer
-                        i++;
-                    }
-                    str_payload = realloc(str_payload, total_size - i + 5);
-                    if (str_payload == NULL) {
-                        free(player_list);// needs to free this
-                        client_send_nack(client);
-                        break;
-                    }
-                    str_payload[total_size] = '\0'; // Include null terminator
-                    if(client_send_ack(client, str_payload, total_size - i) == -1){
-                        debug("There's something wrong sending the ack packet");
-                    }
-                    free(str_payload);
-                    free(player_list);// needs to free this
-                }
-                break;
-            case JEUX_INVITE_PKT:
-                debug("Received INVITE packet: fd number is %d", fd);
-                // look up the player who send the invitation with fd and look up the player who will receive it name
-                if(!logged_in) {    // if the target client OR the source client is NOT logged in
-                    client_send_nack(client);
-                }
-                else{
-                    // char* p = malloc( (hdr->size) +1);
-                    // // char* temp_ptr = payload;
-                    // memcpy(p, payload, hdr->size);
-                    // // payload = temp_ptr;
-                    // *(p + hdr->size) = '\0';
-                    debug("The payload is %s", (char *) payload);
-
-                    if((target_client = creg_lookup(client_registry, payload)) == NULL || target_client == client){
-                        debug("Target client can't be found using name %s", (char *) payload);
-                        client_unref(target_client, "client can't be looked up when invited");
-                        client_send_nack(client);
-                        break;
-                    }
-
-                    // Role: (1 for first player to move, 2 for second player to move)
-                    GAME_ROLE source_role;
-                    GAME_ROLE target_role;
-                    if(hdr->role == 1){
-                        source_role = SECOND_PLAYER_ROLE;
-                        target_role = FIRST_PLAYER_ROLE;
-                    }
-                    else if(hdr->role == 2){
-                        source_role = FIRST_PLAYER_ROLE;
-                        target_role = SECOND_PLAYER_ROLE;
-                    }
-                    else{
-                        debug("game role invalid");
-                        // if the header is not 1 or 2, then we don't know what to do
-                        client_send_nack(client);
-                        break;
-                    }
-
-                    int source_id;
-                    if( (source_id = client_make_invitation(client, target_client, source_role, target_role)) == -1){
-                        debug("Invitation failed");
-                        client_send_nack(client);
-                        break;
-                    }
-                    client_unref(target_client, "after invitation attempt");
-                    // construct ACT PACKET AND SEND IT to the SOURCE CLIENT
-                    JEUX_PACKET_HEADER *ack_pkt = construct_packet(JEUX_ACK_PKT, 0);
-                    ack_pkt->id = source_id;
-                    client_send_packet(client, ack_pkt, 0);
-                    free(ack_pkt);
-                }
-                break;
-            case JEUX_REVOKE_PKT:
-                debug("Received REVOKE packet: fd number is %d", fd);
-                if( !logged_in){// if the client is NOT logged in
-                    client_send_nack(client);
-                }
-                else{
-                    int invite_id = hdr->id;
-                    int result;
-                    if( (result = client_revoke_invitation(client, invite_id)) == -1){
-                        client_send_nack(client);
-                        break;
-                    }
-                    client_send_ack(client, NULL, 0);
-                }
-                break;
-            case JEUX_DECLINE_PKT:
-                debug("Received DECLINE packet: fd number is %d", fd);
-                if(!logged_in){// if the client is NOT logged in
-                    client_send_nack(client);
-                }
-                else{
-                    int invite_id = hdr->id;
-                    int result;
-                    if( (result = client_decline_invitation(client, invite_id)) == -1){
-                        client_send_nack(client);
-                        break;
-                    }
-                    client_send_ack(client, NULL, 0);
-                }
-                break;
-            case JEUX_ACCEPT_PKT:
-                debug("Received ACCEPT packet: fd number is %d", fd);
-                if(!logged_in){// if the client is NOT logged in
-                    client_send_nack(client);
-                }
-                else{
-                    int invite_id = hdr->id;
-                    debug("the id is %d", hdr->id);
-
-                    char *str = NULL;
-                    int result;
-                    if( (result = client_accept_invitation(client, invite_id, &str)) == -1){
-                        if(str != NULL){
-                            free(str);
-                        }
-                        client_send_nack(client);
-                        break;
-                    }
-
-                    JEUX_PACKET_HEADER *ack_pkt = construct_packet(JEUX_ACK_PKT, 0);
-                    // only construct pkt did the htonsm we need to do it here
-                    ack_pkt->id = invite_id;
-                    if(str != NULL){
-                        ack_pkt->size = htons(strlen(str));
-                    }
-                    client_send_packet(client, ack_pkt, str);
-                    debug("Send out ACK packet: fd number is %d", fd);
-                    if(str != NULL){
-                        debug("free the str");
-                        free(str); //throws segfault probably
-                    }
-                    free(ack_pkt);
-                }
-                break;
-            case JEUX_MOVE_PKT:
-                debug("Received MOVE packet: fd number is %d", fd);
-                if(!logged_in){// if the client is NOT logged in
-                    client_send_nack(client);
-                }
-                else{
-                    int client_id = hdr->id;
-                    int result;
-                    void *p = copy_payload(payload, hdr->size);
-                    if((result = client_make_move(client, client_id, p)) == -1){
-                        if(p != NULL){
-                            free(p);
-                        }
-                        client_send_nack(client);
-                        break;
-                    }
-                    if(p != NULL){
-                        free(p);
-                    }
-                    debug("MOVE success");
-                    client_send_ack(client, NULL, 0);
-                }
-                break;
-            case JEUX_RESIGN_PKT:
-                debug("Received RESIGN packet: fd number is %d", fd);
-                if(!logged_in){// if the client is NOT logged in
-                    client_send_nack(client);
-                }
-                else{
-                    int client_id = hdr->id;
-                    int result;
-
-                    if((result = client_resign_game(client, client_id)) == -1){
-                        client_send_nack(client);
-                        break;
-                    }
-                    client_send_ack(client, NULL, 0);
-                }
-                break;
+    // a hot upgrade may have fed the decoder with packets already
+    for(;;){
+        while(proto_decoder_next(&decoder, &hdr, &payload) == 1){
+            jeux_session_dispatch(&session, &hdr, payload);
         }
-
-        if(payload != NULL){
-            free(payload);
+        // a hot upgrade stops the thread here, between packets (see upgrade.h)
+        upgrade_checkpoint();
+        ssize_t n = proto_decoder_fill(&decoder, fd, 0);
+        metrics_syscall(METRICS_SYSCALL_RECV);
+        if(n == 0 || (n < 0 && errno != EINTR)){
+            break;
         }
     }
 
-    debug("[%d]Ending client service", fd);
-    if(logged_in){
-        player_unref(player, "Server thread is closing while the client is logged in");
-    }
-    client_logout(client);
-    creg_unregister(client_registry, client);
-    free(hdr);
+    proto_decoder_fini(&decoder);
+    jeux_session_close(&session);
+    upgrade_reader_leave();
     return NULL;
 }
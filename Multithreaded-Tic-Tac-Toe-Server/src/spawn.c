@@ -0,0 +1,17 @@
+#include <signal.h>
+#include <pthread.h>
+
+#include "spawn.h"
+
+int spawn(pthread_t *tid, const pthread_attr_t *attr, void *(*start)(void *), void *arg){
+    pthread_t detached;
+    sigset_t block, saved;
+    sigemptyset(&block);
+    sigaddset(&block, SIGHUP);
+    pthread_sigmask(SIG_BLOCK, &block, &saved);
+    int err = pthread_create(tid != NULL ? tid : &detached, attr, start, arg);
+    pthread_sigmask(SIG_SETMASK, &saved, NULL);
+    if(err == 0 && tid == NULL)
+        pthread_detach(detached);
+    return err;
+}
@@ -0,0 +1,252 @@
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <arpa/inet.h>
+
+#include "debug.h"
+#include "protocol_ext.h"
+#include "spectators.h"
+#include "client_ext.h"
+#include "game_ext.h"
+#include "oracle.h"
+#include "outq.h"
+#include "metrics.h"
+
+typedef struct watcher {
+    CLIENT *client;                 // retained by the array
+    int id;                         // the client's ID for the game
+} WATCHER;
+
+typedef struct watchers {
+    atomic_int refs;                // the SPECTATORS' reference plus one per notification using it
+    int count;
+    WATCHER watchers[];
+} WATCHERS;
+
+struct spectators {
+    pthread_mutex_t lock;           // protects everything below
+    WATCHERS *current;              // the watchers now, or NULL if there are none
+    int moves;                      // moves in the last state sent
+    int ended;                      // nonzero once ENDED has been sent
+};
+
+// a copy of an array of watchers, with room for extra more; NULL if memory is exhausted
+static WATCHERS *watchers_copy(WATCHERS *old, int extra){
+    int count = old != NULL ? old->count : 0;
+    WATCHERS *w = malloc(sizeof(WATCHERS) + (count + extra) * sizeof(WATCHER));
+    if(w == NULL){
+        return NULL;
+    }
+    atomic_init(&w->refs, 1);
+    w->count = count;
+    for(int i = 0; i < count; i++){
+        w->watchers[i].client = client_ref(old->watchers[i].client, "kept in a new array of watchers");
+        w->watchers[i].id = old->watchers[i].id;
+    }
+    return w;
+}
+
+static WATCHERS *watchers_ref(WATCHERS *w){
+    atomic_fetch_add_explicit(&w->refs, 1, memory_order_relaxed);
+    return w;
+}
+
+static void watchers_unref(WATCHERS *w){
+    if(w == NULL || atomic_fetch_sub_explicit(&w->refs, 1, memory_order_acq_rel) != 1){
+        return;
+    }
+    for(int i = 0; i < w->count; i++){
+        client_unref(w->watchers[i].client, "array of watchers freed");
+    }
+    free(w);
+}
+
+// send, after letting go of the lock, what was queued for each of the watchers
+static void watchers_flush(WATCHERS *w){
+    for(int i = 0; i < w->count; i++){
+        client_flush(w->watchers[i].client);
+    }
+}
+
+// describe the state of game in the format the watcher asked for
+static int state_for(CLIENT *watcher, GAME *game, char *buf, size_t size){
+    if(client_get_options(watcher) & JEUX_LOGIN_BINARY_BOARD)
+        return game_unparse_state_binary(game, buf, size);
+    return game_unparse_state_into(game, buf, size);
+}
+
+SPECTATORS *spectators_create(void){
+    SPECTATORS *s = calloc(1, sizeof(SPECTATORS));
+    if(s == NULL){
+        return NULL;
+    }
+    if(pthread_mutex_init(&s->lock, NULL) != 0){
+        free(s);
+        return NULL;
+    }
+    return s;
+}
+
+void spectators_free(SPECTATORS *s){
+    if(s == NULL){
+        return;
+    }
+    if(s->current != NULL){
+        metrics_gauge_add(METRICS_SPECTATORS, -s->current->count);
+        watchers_unref(s->current);
+    }
+    pthread_mutex_destroy(&s->lock);
+    free(s);
+}
+
+// add a watcher, sending it the ACK of its WATCH if ack is set
+static int add_watcher(SPECTATORS *s, CLIENT *watcher, int id, GAME *game, int ack){
+    pthread_mutex_lock(&s->lock);
+    // once the game is over, ENDED has been or is about to be sent to the watchers it had
+    WATCHERS *w = s->ended || game_is_over(game) ? NULL : watchers_copy(s->current, 1);
+    if(w == NULL){
+        pthread_mutex_unlock(&s->lock);
+        return -1;
+    }
+    // the ACK is queued now, so that it comes before the first MOVED
+    char state[GAME_STATE_MAX];
+    int len = ack ? state_for(watcher, game, state, sizeof(state)) : 0;
+    JEUX_PACKET_HEADER ack_pkt;
+    memset(&ack_pkt, 0, sizeof(ack_pkt));
+    ack_pkt.type = JEUX_ACK_PKT;
+    ack_pkt.id = id;
+    ack_pkt.size = htons(len > 0 ? len : 0);
+    if(ack && client_send_packet(watcher, &ack_pkt, len > 0 ? state : NULL) == -1){
+        pthread_mutex_unlock(&s->lock);
+        watchers_unref(w);
+        return -1;
+    }
+    w->watchers[w->count].client = client_ref(watcher, "watching a game");
+    w->watchers[w->count++].id = id;
+    WATCHERS *old = s->current;
+    s->current = w;
+    pthread_mutex_unlock(&s->lock);
+    metrics_gauge_add(METRICS_SPECTATORS, 1);
+    watchers_unref(old);
+    return 0;
+}
+
+int spectators_add(SPECTATORS *s, CLIENT *watcher, int id, GAME *game){
+    return add_watcher(s, watcher, id, game, 1);
+}
+
+int spectators_restore(SPECTATORS *s, CLIENT *watcher, int id, GAME *game){
+    return add_watcher(s, watcher, id, game, 0);
+}
+
+int spectators_remove(SPECTATORS *s, CLIENT *watcher){
+    pthread_mutex_lock(&s->lock);
+    WATCHERS *old = s->current;
+    int i = 0;
+    while(old != NULL && i < old->count && old->watchers[i].client != watcher){
+        i++;
+    }
+    WATCHERS *w = NULL;
+    if(old == NULL || i == old->count || (old->count > 1 && (w = watchers_copy(old, 0)) == NULL)){
+        pthread_mutex_unlock(&s->lock);
+        return -1;
+    }
+    if(w != NULL){
+        client_unref(w->watchers[i].client, "no longer watching a game");
+        w->watchers[i] = w->watchers[--w->count];
+    }
+    s->current = w;
+    pthread_mutex_unlock(&s->lock);
+    metrics_gauge_add(METRICS_SPECTATORS, -1);
+    watchers_unref(old);
+    return 0;
+}
+
+void spectators_moved(SPECTATORS *s, GAME *game){
+    pthread_mutex_lock(&s->lock);
+    if(s->current == NULL){
+        pthread_mutex_unlock(&s->lock);
+        return;
+    }
+    // both formats in one buffer: the binary one first, then the text
+    char board[GAME_STATE_BINARY_MAX + GAME_STATE_MAX];
+    int binary_len = game_unparse_state_binary(game, board, GAME_STATE_BINARY_MAX);
+    int moves = 0;
+    for(int i = 0; i < binary_len; i++){
+        moves += __builtin_popcount((uint8_t) board[i]);
+    }
+    // the text is made second, so it is never older than the count
+    int len = moves > s->moves ? game_unparse_state_into(game, board + binary_len, GAME_STATE_MAX) : -1;
+    OUTQ_SHARED *buf = len > 0 ? outq_shared_create(binary_len + len) : NULL;
+    if(buf == NULL){
+        pthread_mutex_unlock(&s->lock);
+        return;
+    }
+    s->moves = moves;
+    memcpy(buf->data, board, binary_len + len);
+    WATCHERS *w = watchers_ref(s->current);
+    JEUX_PACKET_HEADER moved_pkt;
+    memset(&moved_pkt, 0, sizeof(moved_pkt));
+    moved_pkt.type = JEUX_MOVED_PKT;
+    // X moves first, so it made the last move if the count is odd
+    moved_pkt.role = moves % 2 ? FIRST_PLAYER_ROLE : SECOND_PLAYER_ROLE;
+    for(int i = 0; i < w->count; i++){
+        CLIENT *watcher = w->watchers[i].client;
+        int binary = client_get_options(watcher) & JEUX_LOGIN_BINARY_BOARD;
+        moved_pkt.id = w->watchers[i].id;
+        moved_pkt.size = htons(binary ? binary_len : len);
+        client_queue_shared(watcher, &moved_pkt, buf, binary ? 0 : binary_len);
+    }
+    pthread_mutex_unlock(&s->lock);
+    watchers_flush(w);
+    watchers_unref(w);
+    outq_shared_unref(buf);
+}
+
+void spectators_ended(SPECTATORS *s, GAME *game, INVITATION *inv){
+    pthread_mutex_lock(&s->lock);
+    s->ended = 1;
+    WATCHERS *w = s->current;
+    s->current = NULL;
+    if(w == NULL){
+        pthread_mutex_unlock(&s->lock);
+        return;
+    }
+    // the analysis is made once, if anyone wants it
+    OUTQ_SHARED *analysis = NULL;
+    for(int i = 0; i < w->count && analysis == NULL; i++){
+        if(client_get_options(w->watchers[i].client) & JEUX_LOGIN_ANALYSIS){
+            char text[ORACLE_ANALYSIS_MAX];
+            uint8_t squares[GAME_MAX_MOVES];
+            // the oracle knows the classic board only
+            int len = game_variant_is_classic(game_get_variant(game))
+                ? oracle_analyze(squares, game_get_history(game, squares), text, sizeof(text)) : -1;
+            if(len <= 0 || (analysis = outq_shared_create(len)) == NULL){
+                debug("the game could not be analyzed for its watchers");
+                break;
+            }
+            memcpy(analysis->data, text, len);
+        }
+    }
+    JEUX_PACKET_HEADER ended_pkt;
+    memset(&ended_pkt, 0, sizeof(ended_pkt));
+    ended_pkt.type = JEUX_ENDED_PKT;
+    ended_pkt.role = game_get_winner(game);
+    for(int i = 0; i < w->count; i++){
+        CLIENT *watcher = w->watchers[i].client;
+        int analyzed = analysis != NULL && (client_get_options(watcher) & JEUX_LOGIN_ANALYSIS);
+        ended_pkt.id = w->watchers[i].id;
+        ended_pkt.size = htons(analyzed ? analysis->len : 0);
+        client_queue_shared(watcher, &ended_pkt, analyzed ? analysis : NULL, 0);
+    }
+    pthread_mutex_unlock(&s->lock);
+    metrics_gauge_add(METRICS_SPECTATORS, -w->count);
+    watchers_flush(w);
+    for(int i = 0; i < w->count; i++){
+        client_end_watch(w->watchers[i].client, w->watchers[i].id, inv);
+    }
+    watchers_unref(w);
+    outq_shared_unref(analysis);
+}
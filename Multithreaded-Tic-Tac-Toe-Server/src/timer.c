@@ -0,0 +1,163 @@
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <errno.h>
+#include <time.h>
+#include <stdatomic.h>
+
+#include "debug.h"
+#include "timer.h"
+#include "upgrade.h"
+#include "spawn.h"
+
+#define SLOT_MASK (TIMER_SLOTS - 1)
+#define MAX_TICKS ((1ull << (TIMER_SLOT_BITS * TIMER_LEVELS)) - 1)
+
+typedef struct wheel {
+    pthread_mutex_t lock;
+    TIMER *slots[TIMER_LEVELS][TIMER_SLOTS];
+    TIMER *expiring;            // taken off the first wheel, to be fired
+    _Atomic uint64_t now;       // the next tick to be run; changed under the lock only
+    int running;                // nonzero once the thread has started
+} WHEEL;
+
+static WHEEL wheel = { .lock = PTHREAD_MUTEX_INITIALIZER };
+
+void timer_init(TIMER *timer, void (*fire)(void *arg), void *arg){
+    timer->next = NULL;
+    timer->pprev = NULL;
+    timer->expires = 0;
+    timer->fire = fire;
+    timer->arg = arg;
+}
+
+static void link_timer(TIMER **head, TIMER *timer){
+    timer->next = *head;
+    if(timer->next != NULL)
+        timer->next->pprev = &timer->next;
+    *head = timer;
+    timer->pprev = head;
+}
+
+static void unlink_timer(TIMER *timer){
+    *timer->pprev = timer->next;
+    if(timer->next != NULL)
+        timer->next->pprev = timer->pprev;
+    timer->next = NULL;
+    timer->pprev = NULL;
+}
+
+// put a timer in the slot of the lowest wheel that reaches its expiry; called with the lock held
+static void place(TIMER *timer){
+    uint64_t now = atomic_load_explicit(&wheel.now, memory_order_relaxed);
+    if(timer->expires < now)
+        timer->expires = now;
+    uint64_t delta = timer->expires - now;
+    int level = 0;
+    while(level < TIMER_LEVELS - 1 && delta >> (TIMER_SLOT_BITS * (level + 1)) != 0)
+        level++;
+    int slot = (timer->expires >> (TIMER_SLOT_BITS * level)) & SLOT_MASK;
+    link_timer(&wheel.slots[level][slot], timer);
+}
+
+// spread the timers of a slot over the wheels below; called with the lock held
+static void cascade(int level, int slot){
+    TIMER *timer;
+    while((timer = wheel.slots[level][slot]) != NULL){
+        unlink_timer(timer);
+        place(timer);
+    }
+}
+
+// take the timers that expire at the next tick off the wheel; called with the lock held
+static void run_tick(void){
+    uint64_t now = atomic_load_explicit(&wheel.now, memory_order_relaxed);
+    // each wheel above is cascaded when the one below it has come round
+    for(int level = 1; level < TIMER_LEVELS; level++){
+        if((now & ((1ull << (TIMER_SLOT_BITS * level)) - 1)) != 0)
+            break;
+        cascade(level, (now >> (TIMER_SLOT_BITS * level)) & SLOT_MASK);
+    }
+    TIMER *timer;
+    while((timer = wheel.slots[0][now & SLOT_MASK]) != NULL){
+        unlink_timer(timer);
+        link_timer(&wheel.expiring, timer);
+    }
+    atomic_store_explicit(&wheel.now, now + 1, memory_order_relaxed);
+}
+
+int timer_arm(TIMER *timer, unsigned ms){
+    uint64_t ticks = ((uint64_t) ms + TIMER_TICK_MS - 1) / TIMER_TICK_MS;
+    if(ticks > MAX_TICKS)
+        ticks = MAX_TICKS;
+    pthread_mutex_lock(&wheel.lock);
+    if(!wheel.running || timer->pprev != NULL){
+        pthread_mutex_unlock(&wheel.lock);
+        return -1;
+    }
+    timer->expires = atomic_load_explicit(&wheel.now, memory_order_relaxed) + ticks;
+    place(timer);
+    pthread_mutex_unlock(&wheel.lock);
+    return 0;
+}
+
+int timer_cancel(TIMER *timer){
+    pthread_mutex_lock(&wheel.lock);
+    int armed = timer->pprev != NULL;
+    if(armed)
+        unlink_timer(timer);
+    pthread_mutex_unlock(&wheel.lock);
+    return armed;
+}
+
+uint64_t timer_ticks(void){
+    return atomic_load_explicit(&wheel.now, memory_order_relaxed);
+}
+
+static void *timer_main(void *arg){
+    struct timespec next;
+    clock_gettime(CLOCK_MONOTONIC, &next);
+    while(1){
+        next.tv_nsec += TIMER_TICK_MS * 1000000L;
+        if(next.tv_nsec >= 1000000000L){
+            next.tv_sec++;
+            next.tv_nsec -= 1000000000L;
+        }
+        // after callbacks that took longer than a tick, the ticks missed are run without sleeping
+        while(clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next, NULL) == EINTR)
+            ;
+        // a hot upgrade waits for the callbacks of a tick (see upgrade.h)
+        upgrade_enter();
+        pthread_mutex_lock(&wheel.lock);
+        run_tick();
+        // one at a time, so that each can be cancelled until it is fired
+        TIMER *timer;
+        while((timer = wheel.expiring) != NULL){
+            unlink_timer(timer);
+            pthread_mutex_unlock(&wheel.lock);
+            timer->fire(timer->arg);
+            pthread_mutex_lock(&wheel.lock);
+        }
+        pthread_mutex_unlock(&wheel.lock);
+        upgrade_leave();
+    }
+    return NULL;
+}
+
+int timers_start(void){
+    pthread_mutex_lock(&wheel.lock);
+    if(wheel.running){
+        pthread_mutex_unlock(&wheel.lock);
+        return 0;
+    }
+    int rc = spawn(NULL, NULL, timer_main, NULL);
+    if(rc != 0){
+        pthread_mutex_unlock(&wheel.lock);
+        debug("timers: no timer thread: %s", strerror(rc));
+        return -1;
+    }
+    wheel.running = 1;
+    pthread_mutex_unlock(&wheel.lock);
+    debug("timers: started, with a tick of %d ms", TIMER_TICK_MS);
+    return 0;
+}
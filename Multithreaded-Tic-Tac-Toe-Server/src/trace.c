@@ -0,0 +1,268 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <signal.h>
+#include <pthread.h>
+
+#include "debug.h"
+#include "trace.h"
+#include "spawn.h"
+
+#define TRACE_WORDS 4                   // a TRACE_EVENT, as 64-bit words
+#define TRACE_PATH_MAX 256
+
+_Static_assert(sizeof(TRACE_EVENT) == TRACE_WORDS * sizeof(uint64_t), "events are four words");
+
+/*
+ * A ring has a single writer at a time, which announces each event in
+ * claimed before writing it and in committed after.  A reader takes the
+ * events up to committed, then drops those that claimed says might have
+ * been overwritten while it was copying them.
+ */
+typedef struct trace_ring {
+    _Atomic uint64_t claimed;
+    _Atomic uint64_t committed;
+    uint16_t thread;                            // of the thread that got it first
+    struct trace_ring *next_free;
+    _Atomic uint64_t words[TRACE_RING_EVENTS][TRACE_WORDS];
+} TRACE_RING;
+
+atomic_int trace_on;
+
+static TRACE_RING **rings;                      // every ring ever made, for dumps
+static int num_rings, rings_size;
+static TRACE_RING *free_rings;                  // rings of threads that have exited
+static pthread_mutex_t rings_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static __thread TRACE_RING *my_ring;
+static pthread_key_t ring_key;
+static pthread_once_t ring_once = PTHREAD_ONCE_INIT;
+
+static char trace_path[TRACE_PATH_MAX];
+
+// key destructor: a thread is exiting, and its ring goes to the next one
+static void ring_release(void *arg){
+    TRACE_RING *ring = arg;
+    pthread_mutex_lock(&rings_lock);
+    ring->next_free = free_rings;
+    free_rings = ring;
+    pthread_mutex_unlock(&rings_lock);
+}
+
+static void ring_key_create(void){
+    pthread_key_create(&ring_key, ring_release);
+}
+
+static TRACE_RING *claim_ring(void){
+    pthread_once(&ring_once, ring_key_create);
+    pthread_mutex_lock(&rings_lock);
+    TRACE_RING *ring = free_rings;
+    if(ring != NULL){
+        free_rings = ring->next_free;
+    }
+    else if(num_rings < UINT16_MAX){
+        if(num_rings == rings_size){
+            int size = rings_size > 0 ? 2 * rings_size : 16;
+            TRACE_RING **grown = realloc(rings, size * sizeof(TRACE_RING *));
+            if(grown != NULL){
+                rings = grown;
+                rings_size = size;
+            }
+        }
+        if(num_rings < rings_size && (ring = calloc(1, sizeof(TRACE_RING))) != NULL){
+            ring->thread = num_rings;
+            rings[num_rings++] = ring;
+        }
+    }
+    pthread_mutex_unlock(&rings_lock);
+    if(ring != NULL){
+        pthread_setspecific(ring_key, ring);
+    }
+    return ring;
+}
+
+void trace_record(int kind, int arg, uint32_t a, uint64_t b, uint64_t c){
+    TRACE_RING *ring = my_ring;
+    if(ring == NULL && (ring = my_ring = claim_ring()) == NULL){
+        return;
+    }
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    TRACE_EVENT event = {
+        .time = (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec,
+        .thread = ring->thread,
+        .kind = kind,
+        .arg = arg,
+        .a = a,
+        .b = b,
+        .c = c,
+    };
+    uint64_t words[TRACE_WORDS];
+    memcpy(words, &event, sizeof(words));
+
+    uint64_t i = atomic_load_explicit(&ring->committed, memory_order_relaxed);
+    atomic_store_explicit(&ring->claimed, i + 1, memory_order_relaxed);
+    // release, so that a reader who sees any of these words also sees the claim
+    _Atomic uint64_t *slot = ring->words[i & (TRACE_RING_EVENTS - 1)];
+    for(int w = 0; w < TRACE_WORDS; w++){
+        atomic_store_explicit(&slot[w], words[w], memory_order_release);
+    }
+    atomic_store_explicit(&ring->committed, i + 1, memory_order_release);
+}
+
+// copy out the events of a ring that are sure to be whole; returns how many
+static int ring_copy(TRACE_RING *ring, TRACE_EVENT *events){
+    uint64_t end = atomic_load_explicit(&ring->committed, memory_order_acquire);
+    uint64_t start = end > TRACE_RING_EVENTS ? end - TRACE_RING_EVENTS : 0;
+    for(uint64_t i = start; i < end; i++){
+        uint64_t words[TRACE_WORDS];
+        _Atomic uint64_t *slot = ring->words[i & (TRACE_RING_EVENTS - 1)];
+        for(int w = 0; w < TRACE_WORDS; w++){
+            words[w] = atomic_load_explicit(&slot[w], memory_order_acquire);
+        }
+        memcpy(&events[i - start], words, sizeof(words));
+    }
+    uint64_t claimed = atomic_load_explicit(&ring->claimed, memory_order_relaxed);
+    uint64_t overwritten = claimed > TRACE_RING_EVENTS ? claimed - TRACE_RING_EVENTS : 0;
+    if(overwritten <= start){
+        return end - start;
+    }
+    uint64_t lost = overwritten - start < end - start ? overwritten - start : end - start;
+    memmove(events, events + lost, (end - start - lost) * sizeof(TRACE_EVENT));
+    return end - start - lost;
+}
+
+// write the reasons of the ref and unref events, each once
+static int write_strings(FILE *out, TRACE_EVENT *events, int n){
+    const char **seen = malloc((n + 1) * sizeof(char *));
+    if(seen == NULL){
+        return -1;
+    }
+    int count = 0;
+    for(int i = 0; i < n; i++){
+        if((events[i].kind != TRACE_REF && events[i].kind != TRACE_UNREF) || events[i].c == 0){
+            continue;
+        }
+        const char *why = (const char *) (uintptr_t) events[i].c;
+        int j = 0;
+        while(j < count && seen[j] != why){
+            j++;
+        }
+        if(j < count){
+            continue;
+        }
+        seen[count++] = why;
+        uint64_t addr = events[i].c;
+        size_t len = strlen(why);
+        uint16_t len16 = len > UINT16_MAX ? UINT16_MAX : len;
+        fwrite(&addr, sizeof(addr), 1, out);
+        fwrite(&len16, sizeof(len16), 1, out);
+        fwrite(why, 1, len16, out);
+    }
+    free(seen);
+    return count;
+}
+
+int trace_dump(char *path){
+    pthread_mutex_lock(&rings_lock);
+    TRACE_EVENT *events = malloc(((size_t) num_rings * TRACE_RING_EVENTS + 1) * sizeof(TRACE_EVENT));
+    int n = 0;
+    if(events != NULL){
+        for(int r = 0; r < num_rings; r++){
+            n += ring_copy(rings[r], events + n);
+        }
+    }
+    pthread_mutex_unlock(&rings_lock);
+    if(events == NULL){
+        return -1;
+    }
+
+    char tmp[TRACE_PATH_MAX + 8];
+    snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+    FILE *out = fopen(tmp, "w");
+    if(out == NULL){
+        free(events);
+        return -1;
+    }
+    struct timespec mono, real;
+    clock_gettime(CLOCK_MONOTONIC, &mono);
+    clock_gettime(CLOCK_REALTIME, &real);
+    TRACE_FILE_HEADER header = {
+        .magic = TRACE_MAGIC,
+        .num_events = n,
+        .realtime_offset = (real.tv_sec - mono.tv_sec) * 1000000000LL + (real.tv_nsec - mono.tv_nsec),
+    };
+    // the string count is filled in once the strings are written
+    fwrite(&header, sizeof(header), 1, out);
+    fwrite(events, sizeof(TRACE_EVENT), n, out);
+    int strings = write_strings(out, events, n);
+    free(events);
+    header.num_strings = strings < 0 ? 0 : strings;
+    int err = strings < 0 || fseek(out, 0, SEEK_SET) != 0
+        || fwrite(&header, sizeof(header), 1, out) != 1;
+    if(fclose(out) != 0 || err || rename(tmp, path) == -1){
+        unlink(tmp);
+        return -1;
+    }
+    return n;
+}
+
+static void *control_main(void *arg){
+    sigset_t usr1;
+    sigemptyset(&usr1);
+    sigaddset(&usr1, SIGUSR1);
+    for(;;){
+        int sig;
+        if(sigwait(&usr1, &sig) != 0){
+            continue;
+        }
+        if(!atomic_load(&trace_on)){
+            atomic_store(&trace_on, 1);
+            fprintf(stderr, "Tracing on\n");
+            continue;
+        }
+        atomic_store(&trace_on, 0);
+        int n = trace_dump(trace_path);
+        if(n == -1){
+            fprintf(stderr, "Cannot write the trace to %s\n", trace_path);
+        }
+        else{
+            fprintf(stderr, "Tracing off: %d events in %s\n", n, trace_path);
+        }
+    }
+    return NULL;
+}
+
+int trace_init(char *path, int on){
+    if(path != NULL){
+        snprintf(trace_path, sizeof(trace_path), "%s", path);
+    }
+    else{
+        snprintf(trace_path, sizeof(trace_path), "jeux-%d.trace", (int) getpid());
+    }
+    // the control thread, which inherits the mask, is the only one to take SIGUSR1
+    sigset_t block;
+    sigemptyset(&block);
+    sigaddset(&block, SIGUSR1);
+    pthread_sigmask(SIG_BLOCK, &block, NULL);
+    if(spawn(NULL, NULL, control_main, NULL) != 0){
+        return -1;
+    }
+    atomic_store(&trace_on, on);
+    return 0;
+}
+
+void trace_fini(void){
+    if(!atomic_exchange(&trace_on, 0)){
+        return;
+    }
+    int n = trace_dump(trace_path);
+    if(n == -1){
+        fprintf(stderr, "Cannot write the trace to %s\n", trace_path);
+    }
+    else{
+        fprintf(stderr, "Trace: %d events in %s\n", n, trace_path);
+    }
+}
@@ -0,0 +1,943 @@
+#define _GNU_SOURCE                     // for SO_PEERCRED and the writer-preferring rwlock
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <errno.h>
+#include <signal.h>
+#include <poll.h>
+#include <time.h>
+#include <stdatomic.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "debug.h"
+#include "upgrade.h"
+#include "client_ext.h"
+#include "client_registry_ext.h"
+#include "player_registry_ext.h"
+#include "player_ext.h"
+#include "invitation_ext.h"
+#include "game_ext.h"
+#include "matchmaker.h"
+#include "users_cache.h"
+#include "ratings.h"
+#include "journal.h"
+#include "jeux_globals.h"
+
+/*
+ * Locking.  The gate is taken for reading by the timer thread and the
+ * matcher with none of the locks of the other modules held, and for
+ * writing by the main thread of a server handing over (once its readers
+ * have stopped) or taking over (until the old server has gone).  The
+ * readers' lock is a leaf.  A reader stops at upgrade_checkpoint() with
+ * nothing held, so everything can be locked and read once all of them
+ * have stopped.
+ *
+ * The messages, on a SOCK_SEQPACKET socket:
+ *
+ *   old -> new   an UPGRADE_HEADER
+ *   old -> new   the descriptors, as a uint32_t count with SCM_RIGHTS,
+ *                the listening socket first and then those of the
+ *                clients in the order of their CLIENT_RECORDs
+ *   old -> new   the body, in chunks of up to UPGRADE_CHUNK bytes: the
+ *                PLAYER_RECORDs, CLIENT_RECORDs, INVITATION_RECORDs and
+ *                WATCH_RECORDs, in that order
+ *   new -> old   UPGRADE_ACK, once all of it has been remade
+ *   old -> new   UPGRADE_BYE, after which the old server exits
+ *
+ * Clients are known in the body by their descriptors in the old server.
+ */
+
+#define UPGRADE_MAGIC "JEUXUPG1"
+#define UPGRADE_ACK 'A'
+#define UPGRADE_BYE 'B'
+
+typedef struct upgrade_header {
+    char magic[8];                  // UPGRADE_MAGIC
+    uint32_t num_fds;               // the listening socket and one for each client
+    uint32_t num_players;
+    uint32_t num_clients;
+    uint32_t num_invitations;
+    uint32_t num_watches;
+    uint32_t users_version;         // of the listing of USERS (see users_cache.h)
+    uint64_t length;                // of the body
+} UPGRADE_HEADER;
+
+// the name follows
+typedef struct player_record {
+    double rating;
+    uint32_t name_len;
+} PLAYER_RECORD;
+
+// the name of the user, the input not yet dispatched and the output not yet sent follow
+typedef struct client_record {
+    int32_t fd;
+    uint8_t logged_in;
+    uint8_t options;
+    uint8_t seeking;
+    uint32_t name_len;
+    uint32_t input_len;
+    uint64_t output_len;
+    uint64_t output_sent;
+} CLIENT_RECORD;
+
+// the squares of the moves made follow
+typedef struct invitation_record {
+    int32_t source_fd;
+    int32_t target_fd;
+    uint8_t source_id;
+    uint8_t target_id;
+    uint8_t source_role;
+    uint8_t target_role;
+    GAME_VARIANT variant;
+    uint8_t accepted;
+    uint16_t num_moves;
+} INVITATION_RECORD;
+
+typedef struct watch_record {
+    int32_t watcher_fd;
+    int32_t player_fd;              // the source of the invitation of the game
+    uint8_t watcher_id;
+    uint8_t player_id;
+} WATCH_RECORD;
+
+// a body being built
+typedef struct body {
+    char *data;
+    size_t len;
+    size_t size;
+    int failed;                     // memory was exhausted
+} BODY;
+
+// a body being parsed
+typedef struct cursor {
+    const char *p;
+    const char *end;
+} CURSOR;
+
+// a connection taken over, until it is served
+typedef struct adopted {
+    CLIENT *client;
+    int logged_in;
+    int seeking;
+    char *input;
+    size_t input_len;
+} ADOPTED;
+
+// a thread that reads from clients
+typedef struct reader {
+    pthread_t tid;
+    int parked;                     // stopped at upgrade_checkpoint()
+    struct reader *prev;
+    struct reader *next;
+} READER;
+
+static struct {
+    int configured;
+    struct sockaddr_un addr;
+    int listenfd;                   // for the next server, or -1
+    pthread_rwlock_t gate;
+    pthread_mutex_t lock;           // of the readers
+    pthread_cond_t stopped;         // a reader has stopped or left
+    pthread_cond_t thawed;          // the readers may carry on
+    atomic_int freezing;
+    int readers;                    // expected or entered
+    int parked;
+    READER *list;
+    // taken over from the old server
+    int conn;
+    int *fds;
+    UPGRADE_HEADER header;
+    char *body;
+    ADOPTED *adopted;               // indexed by descriptor
+    int num_adopted;                // entries in adopted
+    int unadopted;                  // connections not yet served
+} upgrade = {
+    .listenfd = -1,
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .stopped = PTHREAD_COND_INITIALIZER,
+    .thawed = PTHREAD_COND_INITIALIZER,
+    .conn = -1
+};
+
+static __thread READER *self;
+
+// nothing to do: the signal is there to interrupt a read
+static void on_upgrade_signal(int sig){
+}
+
+int upgrade_configure(const char *path){
+    if(strlen(path) >= sizeof(upgrade.addr.sun_path)){
+        return -1;
+    }
+    upgrade.addr.sun_family = AF_UNIX;
+    strcpy(upgrade.addr.sun_path, path);
+
+    // the timer thread and the matcher come back for the gate all the time
+    pthread_rwlockattr_t attr;
+    pthread_rwlockattr_init(&attr);
+    pthread_rwlockattr_setkind_np(&attr, PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+    pthread_rwlock_init(&upgrade.gate, &attr);
+    pthread_rwlockattr_destroy(&attr);
+
+    // without SA_RESTART, so that a blocked read fails with EINTR
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = on_upgrade_signal;
+    sigemptyset(&sa.sa_mask);
+    if(sigaction(SIGUSR2, &sa, NULL) == -1){
+        return -1;
+    }
+    upgrade.configured = 1;
+    return 0;
+}
+
+/*
+ * Stopping the readers, the timer thread and the matcher.
+ */
+
+void upgrade_enter(void){
+    if(upgrade.configured)
+        pthread_rwlock_rdlock(&upgrade.gate);
+}
+
+void upgrade_leave(void){
+    if(upgrade.configured)
+        pthread_rwlock_unlock(&upgrade.gate);
+}
+
+void upgrade_reader_expect(void){
+    if(!upgrade.configured)
+        return;
+    pthread_mutex_lock(&upgrade.lock);
+    upgrade.readers++;
+    pthread_mutex_unlock(&upgrade.lock);
+}
+
+void upgrade_reader_enter(void){
+    if(!upgrade.configured)
+        return;
+    // without a READER the thread cannot be interrupted, and stops only at its next read
+    READER *r = calloc(1, sizeof(READER));
+    pthread_mutex_lock(&upgrade.lock);
+    if(r != NULL){
+        r->tid = pthread_self();
+        r->next = upgrade.list;
+        if(upgrade.list != NULL)
+            upgrade.list->prev = r;
+        upgrade.list = r;
+    }
+    self = r;
+    pthread_mutex_unlock(&upgrade.lock);
+}
+
+void upgrade_reader_leave(void){
+    if(!upgrade.configured)
+        return;
+    pthread_mutex_lock(&upgrade.lock);
+    READER *r = self;
+    if(r != NULL){
+        if(r->prev != NULL)
+            r->prev->next = r->next;
+        else
+            upgrade.list = r->next;
+        if(r->next != NULL)
+            r->next->prev = r->prev;
+        self = NULL;
+    }
+    upgrade.readers--;
+    pthread_cond_broadcast(&upgrade.stopped);
+    pthread_mutex_unlock(&upgrade.lock);
+    free(r);
+}
+
+void upgrade_checkpoint(void){
+    if(!atomic_load_explicit(&upgrade.freezing, memory_order_acquire))
+        return;
+    pthread_mutex_lock(&upgrade.lock);
+    if(self != NULL)
+        self->parked = 1;
+    upgrade.parked++;
+    pthread_cond_broadcast(&upgrade.stopped);
+    while(atomic_load_explicit(&upgrade.freezing, memory_order_acquire))
+        pthread_cond_wait(&upgrade.thawed, &upgrade.lock);
+    upgrade.parked--;
+    if(self != NULL)
+        self->parked = 0;
+    pthread_mutex_unlock(&upgrade.lock);
+}
+
+static struct timespec deadline_after(int ms){
+    struct timespec t;
+    clock_gettime(CLOCK_REALTIME, &t);
+    t.tv_sec += ms / 1000;
+    t.tv_nsec += (long) (ms % 1000) * 1000000;
+    if(t.tv_nsec >= 1000000000){
+        t.tv_sec++;
+        t.tv_nsec -= 1000000000;
+    }
+    return t;
+}
+
+static int expired(const struct timespec *deadline){
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    return now.tv_sec > deadline->tv_sec
+           || (now.tv_sec == deadline->tv_sec && now.tv_nsec >= deadline->tv_nsec);
+}
+
+static void thaw_readers(void){
+    pthread_mutex_lock(&upgrade.lock);
+    atomic_store_explicit(&upgrade.freezing, 0, memory_order_release);
+    pthread_cond_broadcast(&upgrade.thawed);
+    pthread_mutex_unlock(&upgrade.lock);
+}
+
+/*
+ * Stop every reader at its checkpoint, then the timer thread and the
+ * matcher at the gate.  A reader blocked in a read is interrupted, again
+ * and again, as the signal may come just before it blocks.
+ */
+static int freeze(void){
+    struct timespec deadline = deadline_after(UPGRADE_TIMEOUT_MS);
+    int timed_out = 0;
+    atomic_store_explicit(&upgrade.freezing, 1, memory_order_release);
+    pthread_mutex_lock(&upgrade.lock);
+    while(upgrade.parked < upgrade.readers && !timed_out){
+        for(READER *r = upgrade.list; r != NULL; r = r->next){
+            if(!r->parked)
+                pthread_kill(r->tid, SIGUSR2);
+        }
+        struct timespec retry = deadline_after(UPGRADE_STOP_RETRY_MS);
+        pthread_cond_timedwait(&upgrade.stopped, &upgrade.lock, &retry);
+        timed_out = expired(&deadline);
+    }
+    pthread_mutex_unlock(&upgrade.lock);
+    if(timed_out || pthread_rwlock_timedwrlock(&upgrade.gate, &deadline) != 0){
+        debug("upgrade: the server could not be stopped");
+        thaw_readers();
+        return -1;
+    }
+    return 0;
+}
+
+static void thaw(void){
+    pthread_rwlock_unlock(&upgrade.gate);
+    thaw_readers();
+}
+
+/*
+ * Building and parsing the body.
+ */
+
+static void put(BODY *b, const void *data, size_t len){
+    if(b->failed || len == 0)
+        return;
+    if(b->len + len > b->size){
+        size_t size = b->size ? b->size : UPGRADE_CHUNK;
+        while(size < b->len + len)
+            size *= 2;
+        char *data = realloc(b->data, size);
+        if(data == NULL){
+            b->failed = 1;
+            return;
+        }
+        b->data = data;
+        b->size = size;
+    }
+    memcpy(b->data + b->len, data, len);
+    b->len += len;
+}
+
+static const void *take(CURSOR *c, size_t len){
+    if((size_t) (c->end - c->p) < len)
+        return NULL;
+    const void *p = c->p;
+    c->p += len;
+    return p;
+}
+
+// a record, copied out as the body has no alignment
+static int take_record(CURSOR *c, void *rec, size_t len){
+    const void *p = take(c, len);
+    if(p == NULL)
+        return -1;
+    memcpy(rec, p, len);
+    return 0;
+}
+
+// a string of the body, NUL-terminated, in malloc'ed storage
+static char *take_string(CURSOR *c, size_t len){
+    const char *p = take(c, len);
+    return p != NULL ? strndup(p, len) : NULL;
+}
+
+/*
+ * Sending and receiving.
+ */
+
+static int send_fds(int conn, const int *fds, uint32_t count){
+    union {
+        char buf[CMSG_SPACE(UPGRADE_FDS_PER_MSG * sizeof(int))];
+        struct cmsghdr align;
+    } control;
+    struct iovec iov = { .iov_base = &count, .iov_len = sizeof(count) };
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    memset(&control, 0, sizeof(control));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.buf;
+    msg.msg_controllen = CMSG_SPACE(count * sizeof(int));
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(count * sizeof(int));
+    memcpy(CMSG_DATA(cmsg), fds, count * sizeof(int));
+    return sendmsg(conn, &msg, MSG_NOSIGNAL) == sizeof(count) ? 0 : -1;
+}
+
+// receive up to max descriptors into fds; returns how many, or -1
+static int recv_fds(int conn, int *fds, int max){
+    union {
+        char buf[CMSG_SPACE(UPGRADE_FDS_PER_MSG * sizeof(int))];
+        struct cmsghdr align;
+    } control;
+    uint32_t count;
+    struct iovec iov = { .iov_base = &count, .iov_len = sizeof(count) };
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.buf;
+    msg.msg_controllen = sizeof(control.buf);
+    if(recvmsg(conn, &msg, MSG_CMSG_CLOEXEC) != sizeof(count))
+        return -1;
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    if(cmsg == NULL || cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS)
+        return -1;
+    int got = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+    int *received = (int *) CMSG_DATA(cmsg);
+    // descriptors that did not fit, past the limit on open files, are lost
+    if((msg.msg_flags & MSG_CTRUNC) || got != (int) count || got > max){
+        for(int i = 0; i < got; i++)
+            close(received[i]);
+        return -1;
+    }
+    memcpy(fds, received, got * sizeof(int));
+    return got;
+}
+
+// only a server run by the same user may take over or be taken over
+static int same_user(int conn){
+    struct ucred cred;
+    socklen_t len = sizeof(cred);
+    return getsockopt(conn, SOL_SOCKET, SO_PEERCRED, &cred, &len) == 0 && cred.uid == getuid();
+}
+
+static void set_timeouts(int conn){
+    struct timeval tv = { .tv_sec = UPGRADE_TIMEOUT_MS / 1000,
+                          .tv_usec = (UPGRADE_TIMEOUT_MS % 1000) * 1000 };
+    setsockopt(conn, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    setsockopt(conn, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+}
+
+static int send_byte(int conn, char c){
+    return send(conn, &c, 1, MSG_NOSIGNAL) == 1 ? 0 : -1;
+}
+
+static int recv_byte(int conn, char c){
+    char got;
+    return recv(conn, &got, 1, 0) == 1 && got == c ? 0 : -1;
+}
+
+/*
+ * Handing over, in the old server.
+ */
+
+// what the clients give up, to be taken back if handing over fails
+typedef struct handover {
+    CLIENT **clients;
+    int num_clients;
+    int num_saved;                  // whose send locks are held
+    int *fds;
+    UPGRADE_HEADER header;
+    BODY body;
+} HANDOVER;
+
+static void record_players(HANDOVER *h, BODY *players){
+    int count = 0;
+    PLAYER **all = preg_all_players(player_registry, &count);
+    for(int i = 0; i < count; i++){
+        char *name = player_get_name(all[i]);
+        PLAYER_RECORD rec = { .rating = player_get_exact_rating(all[i]), .name_len = strlen(name) };
+        put(players, &rec, sizeof(rec));
+        put(players, name, rec.name_len);
+    }
+    h->header.num_players = count;
+    free(all);
+}
+
+// the invitations of which the client is the source, and the games it watches
+static void record_invitations(HANDOVER *h, CLIENT *client, BODY *invitations, BODY *watches){
+    INVITATION *invs[CLIENT_MAX_IDS];
+    int ids[CLIENT_MAX_IDS], others[CLIENT_MAX_IDS], watched[CLIENT_MAX_IDS];
+    int n = client_get_invitations(client, invs, ids, others, watched);
+    for(int i = 0; i < n; i++){
+        INVITATION *inv = invs[i];
+        GAME *game = inv_get_game(inv);
+        // a game over is being closed, and is not taken over
+        if(others[i] < 0 || (game != NULL && game_is_over(game))){
+            inv_unref(inv, "not handed over");
+            continue;
+        }
+        if(watched[i]){
+            WATCH_RECORD rec = { .watcher_fd = client_get_fd(client),
+                                 .player_fd = client_get_fd(inv_get_source(inv)),
+                                 .watcher_id = ids[i], .player_id = others[i] };
+            put(watches, &rec, sizeof(rec));
+            h->header.num_watches++;
+        }
+        else if(inv_get_source(inv) == client){
+            uint8_t squares[GAME_MAX_MOVES];
+            int num_moves = game != NULL ? game_get_history(game, squares) : 0;
+            INVITATION_RECORD rec = { .source_fd = client_get_fd(client),
+                                      .target_fd = client_get_fd(inv_get_target(inv)),
+                                      .source_id = ids[i], .target_id = others[i],
+                                      .source_role = inv_get_source_role(inv),
+                                      .target_role = inv_get_target_role(inv),
+                                      .variant = *inv_get_variant(inv),
+                                      .accepted = game != NULL, .num_moves = num_moves };
+            put(invitations, &rec, sizeof(rec));
+            put(invitations, squares, num_moves);
+            h->header.num_invitations++;
+        }
+        inv_unref(inv, "handed over");
+    }
+}
+
+static void record_client(HANDOVER *h, CLIENT *client, BODY *clients){
+    JEUX_SESSION *session = client_get_session(client);
+    PLAYER *player = client_get_player(client);
+    char *name = player != NULL ? player_get_name(player) : "";
+    char none;
+    size_t input_len = session != NULL ? proto_decoder_unread(session->decoder, &none, 0) : 0;
+    char *input = input_len > 0 ? malloc(input_len) : NULL;
+    if(input_len > 0 && input == NULL){
+        clients->failed = 1;
+        return;
+    }
+    if(input != NULL)
+        proto_decoder_unread(session->decoder, input, input_len);
+    size_t output_len, output_sent;
+    errno = 0;
+    char *output = client_save_output(client, &output_len, &output_sent);
+    h->num_saved++;
+    if(output == NULL && errno == ENOMEM)
+        clients->failed = 1;
+
+    CLIENT_RECORD rec = { .fd = client_get_fd(client),
+                          .logged_in = client_is_logged_in(client),
+                          .options = client_get_options(client),
+                          .seeking = matchmaker_is_seeking(client),
+                          .name_len = strlen(name), .input_len = input_len,
+                          .output_len = output != NULL ? output_len : 0,
+                          .output_sent = output != NULL ? output_sent : 0 };
+    put(clients, &rec, sizeof(rec));
+    put(clients, name, rec.name_len);
+    put(clients, input, rec.input_len);
+    put(clients, output, rec.output_len);
+    free(input);
+    free(output);
+}
+
+// everything there is to hand over, with every client's sends held back
+static int record_state(HANDOVER *h, int listenfd){
+    BODY players = { 0 }, clients = { 0 }, invitations = { 0 }, watches = { 0 };
+    memcpy(h->header.magic, UPGRADE_MAGIC, sizeof(h->header.magic));
+    if((h->clients = creg_all_clients(client_registry)) == NULL)
+        return -1;
+    while(h->clients[h->num_clients] != NULL)
+        h->num_clients++;
+    if((h->fds = malloc((h->num_clients + 1) * sizeof(int))) == NULL)
+        return -1;
+    h->fds[0] = listenfd;
+    record_players(h, &players);
+    for(int i = 0; i < h->num_clients; i++){
+        h->fds[i + 1] = client_get_fd(h->clients[i]);
+        record_client(h, h->clients[i], &clients);
+        record_invitations(h, h->clients[i], &invitations, &watches);
+    }
+    h->header.num_fds = h->num_clients + 1;
+    h->header.num_clients = h->num_clients;
+    h->header.users_version = users_cache_version();
+
+    put(&h->body, players.data, players.len);
+    put(&h->body, clients.data, clients.len);
+    put(&h->body, invitations.data, invitations.len);
+    put(&h->body, watches.data, watches.len);
+    int failed = players.failed || clients.failed || invitations.failed || watches.failed || h->body.failed;
+    free(players.data);
+    free(clients.data);
+    free(invitations.data);
+    free(watches.data);
+    h->header.length = h->body.len;
+    return failed ? -1 : 0;
+}
+
+static int send_state(HANDOVER *h, int conn){
+    if(send(conn, &h->header, sizeof(h->header), MSG_NOSIGNAL) != sizeof(h->header))
+        return -1;
+    for(uint32_t i = 0; i < h->header.num_fds; i += UPGRADE_FDS_PER_MSG){
+        uint32_t count = h->header.num_fds - i;
+        if(send_fds(conn, h->fds + i, count < UPGRADE_FDS_PER_MSG ? count : UPGRADE_FDS_PER_MSG) == -1)
+            return -1;
+    }
+    for(size_t off = 0; off < h->body.len; off += UPGRADE_CHUNK){
+        size_t len = h->body.len - off < UPGRADE_CHUNK ? h->body.len - off : UPGRADE_CHUNK;
+        if(send(conn, h->body.data + off, len, MSG_NOSIGNAL) != (ssize_t) len)
+            return -1;
+    }
+    return 0;
+}
+
+/*
+ * Hand everything over to the new server on conn, and exit.  Returns,
+ * with everything as it was, only if that fails.
+ */
+static void hand_over(int listenfd, int conn){
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    if(freeze() == -1)
+        return;
+    // the new server reads the journal with every result in it
+    ratings_flush();
+    journal_sync();
+
+    HANDOVER h;
+    memset(&h, 0, sizeof(h));
+    if(record_state(&h, listenfd) == 0 && send_state(&h, conn) == 0
+       && recv_byte(conn, UPGRADE_ACK) == 0 && send_byte(conn, UPGRADE_BYE) == 0){
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        double ms __attribute__((unused)) = (end.tv_sec - start.tv_sec) * 1e3 + (end.tv_nsec - start.tv_nsec) / 1e6;
+        debug("upgrade: %d clients handed over in %.1f ms", h.num_clients, ms);
+        // the sockets are the new server's now: nothing here may shut them down
+        _exit(EXIT_SUCCESS);
+    }
+
+    debug("upgrade: handing over failed; carrying on");
+    for(int i = 0; i < h.num_clients; i++){
+        if(i < h.num_saved)
+            client_release_output(h.clients[i]);
+        client_unref(h.clients[i], "not handed over");
+    }
+    free(h.clients);
+    free(h.fds);
+    free(h.body.data);
+    thaw();
+}
+
+int upgrade_accept(int listenfd){
+    if(upgrade.listenfd < 0)
+        return accept_connection(listenfd);
+    struct pollfd fds[2] = { { .fd = listenfd, .events = POLLIN },
+                             { .fd = upgrade.listenfd, .events = POLLIN } };
+    for(;;){
+        if(poll(fds, 2, -1) == -1){
+            if(errno == EINTR)
+                continue;
+            return -1;
+        }
+        if(fds[1].revents & POLLIN){
+            int conn = accept4(upgrade.listenfd, NULL, NULL, SOCK_CLOEXEC);
+            if(conn >= 0){
+                if(same_user(conn)){
+                    set_timeouts(conn);
+                    hand_over(listenfd, conn);
+                }
+                close(conn);
+            }
+        }
+        if(fds[0].revents & (POLLIN | POLLERR | POLLHUP))
+            return accept_connection(listenfd);
+    }
+}
+
+int upgrade_listen(void){
+    if(!upgrade.configured)
+        return 0;
+    int fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+    if(fd < 0)
+        return -1;
+    // the old server's socket is gone with it
+    unlink(upgrade.addr.sun_path);
+    if(bind(fd, (struct sockaddr *) &upgrade.addr, sizeof(upgrade.addr)) == -1 || listen(fd, 1) == -1){
+        close(fd);
+        return -1;
+    }
+    upgrade.listenfd = fd;
+    return 0;
+}
+
+/*
+ * Taking over, in the new server.
+ */
+
+int upgrade_begin(int *listenfdp){
+    if(!upgrade.configured)
+        return 0;
+    int conn = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+    if(conn < 0)
+        return -1;
+    if(connect(conn, (struct sockaddr *) &upgrade.addr, sizeof(upgrade.addr)) == -1){
+        int err = errno;
+        close(conn);
+        return err == ENOENT || err == ECONNREFUSED ? 0 : -1;
+    }
+    set_timeouts(conn);
+    UPGRADE_HEADER *hdr = &upgrade.header;
+    if(!same_user(conn) || recv(conn, hdr, sizeof(*hdr), 0) != sizeof(*hdr)
+       || memcmp(hdr->magic, UPGRADE_MAGIC, sizeof(hdr->magic)) != 0
+       || hdr->num_fds != hdr->num_clients + 1
+       || (upgrade.fds = malloc(hdr->num_fds * sizeof(int))) == NULL
+       || (upgrade.body = malloc(hdr->length + 1)) == NULL){
+        close(conn);
+        return -1;
+    }
+    for(uint32_t i = 0; i < hdr->num_fds; ){
+        int got = recv_fds(conn, upgrade.fds + i, hdr->num_fds - i);
+        if(got <= 0){
+            close(conn);
+            return -1;
+        }
+        i += got;
+    }
+    for(uint64_t off = 0; off < hdr->length; ){
+        size_t len = hdr->length - off < UPGRADE_CHUNK ? hdr->length - off : UPGRADE_CHUNK;
+        if(recv(conn, upgrade.body + off, len, 0) != (ssize_t) len){
+            close(conn);
+            return -1;
+        }
+        off += len;
+    }
+    upgrade.conn = conn;
+    *listenfdp = upgrade.fds[0];
+    debug("upgrade: %u clients and %u players received", hdr->num_clients, hdr->num_players);
+    return 1;
+}
+
+// the CLIENTs of the body, by their descriptors in the old server
+typedef struct old_fds {
+    CLIENT **clients;
+    int size;
+} OLD_FDS;
+
+static int map_old_fd(OLD_FDS *map, int fd, CLIENT *client){
+    if(fd < 0)
+        return -1;
+    if(fd >= map->size){
+        int size = map->size ? map->size : 64;
+        while(size <= fd)
+            size *= 2;
+        CLIENT **clients = realloc(map->clients, size * sizeof(CLIENT *));
+        if(clients == NULL)
+            return -1;
+        memset(clients + map->size, 0, (size - map->size) * sizeof(CLIENT *));
+        map->clients = clients;
+        map->size = size;
+    }
+    if(map->clients[fd] != NULL)
+        return -1;
+    map->clients[fd] = client;
+    return 0;
+}
+
+static CLIENT *old_fd_client(OLD_FDS *map, int fd){
+    return fd >= 0 && fd < map->size ? map->clients[fd] : NULL;
+}
+
+static int restore_players(CURSOR *c){
+    for(uint32_t i = 0; i < upgrade.header.num_players; i++){
+        PLAYER_RECORD rec;
+        char *name;
+        if(take_record(c, &rec, sizeof(rec)) == -1 || (name = take_string(c, rec.name_len)) == NULL)
+            return -1;
+        PLAYER *player = preg_load(player_registry, name, rec.rating);
+        free(name);
+        if(player == NULL)
+            return -1;
+    }
+    return 0;
+}
+
+static int restore_client(CURSOR *c, int fd, OLD_FDS *map){
+    CLIENT_RECORD rec;
+    char *name = NULL;
+    const char *input, *output;
+    if(take_record(c, &rec, sizeof(rec)) == -1 || (name = take_string(c, rec.name_len)) == NULL
+       || (input = take(c, rec.input_len)) == NULL || (output = take(c, rec.output_len)) == NULL
+       || fd >= upgrade.num_adopted){
+        free(name);
+        return -1;
+    }
+    CLIENT *client = creg_register(client_registry, fd);
+    if(client == NULL || map_old_fd(map, rec.fd, client) == -1){
+        free(name);
+        return -1;
+    }
+    ADOPTED *a = &upgrade.adopted[fd];
+    a->client = client;
+    upgrade.unadopted++;
+    if(rec.logged_in){
+        PLAYER *player = preg_register(player_registry, name);
+        int ret = player != NULL && client_set_options(client, rec.options) == 0 ? client_login(client, player) : -1;
+        player_unref(player, "logged in again after an upgrade");
+        if(ret == -1){
+            free(name);
+            return -1;
+        }
+    }
+    free(name);
+    a->logged_in = rec.logged_in;
+    a->seeking = rec.seeking && rec.logged_in;
+    if(rec.input_len > 0){
+        if((a->input = malloc(rec.input_len)) == NULL)
+            return -1;
+        memcpy(a->input, input, rec.input_len);
+        a->input_len = rec.input_len;
+    }
+    if(rec.output_len > 0 && client_restore_output(client, output, rec.output_len, rec.output_sent) == -1)
+        return -1;
+    return 0;
+}
+
+static int restore_invitations(CURSOR *c, OLD_FDS *map){
+    for(uint32_t i = 0; i < upgrade.header.num_invitations; i++){
+        INVITATION_RECORD rec;
+        const uint8_t *squares;
+        if(take_record(c, &rec, sizeof(rec)) == -1 || rec.num_moves > GAME_MAX_MOVES
+           || (squares = take(c, rec.num_moves)) == NULL)
+            return -1;
+        CLIENT *source = old_fd_client(map, rec.source_fd), *target = old_fd_client(map, rec.target_fd);
+        if(source == NULL || target == NULL
+           || client_restore_invitation(source, rec.source_id, target, rec.target_id, rec.source_role,
+                                        rec.target_role, &rec.variant, rec.accepted, squares,
+                                        rec.num_moves) == -1)
+            return -1;
+    }
+    return 0;
+}
+
+static int restore_watches(CURSOR *c, OLD_FDS *map){
+    for(uint32_t i = 0; i < upgrade.header.num_watches; i++){
+        WATCH_RECORD rec;
+        if(take_record(c, &rec, sizeof(rec)) == -1)
+            return -1;
+        CLIENT *watcher = old_fd_client(map, rec.watcher_fd), *player = old_fd_client(map, rec.player_fd);
+        if(watcher == NULL || player == NULL
+           || client_restore_watch(watcher, rec.watcher_id, player, rec.player_id) == -1)
+            return -1;
+    }
+    return 0;
+}
+
+// everything the old server had, made again without a word to the clients
+static int restore_state(void){
+    CURSOR c = { .p = upgrade.body, .end = upgrade.body + upgrade.header.length };
+    OLD_FDS map = { 0 };
+    int max_fd = -1;
+    for(uint32_t i = 0; i < upgrade.header.num_fds; i++){
+        if(upgrade.fds[i] > max_fd)
+            max_fd = upgrade.fds[i];
+    }
+    upgrade.num_adopted = max_fd + 1;
+    if((upgrade.adopted = calloc(upgrade.num_adopted, sizeof(ADOPTED))) == NULL
+       || restore_players(&c) == -1){
+        return -1;
+    }
+    int ret = 0;
+    for(uint32_t i = 0; i < upgrade.header.num_clients && ret == 0; i++){
+        ret = restore_client(&c, upgrade.fds[i + 1], &map);
+    }
+    if(ret == 0 && (restore_invitations(&c, &map) == -1 || restore_watches(&c, &map) == -1 || c.p != c.end))
+        ret = -1;
+    free(map.clients);
+    if(ret == 0)
+        users_cache_resume(upgrade.header.users_version);
+    return ret;
+}
+
+int upgrade_finish(void){
+    if(upgrade.conn < 0)
+        return 0;
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    // until the old server has gone, not even a timer may send anything
+    pthread_rwlock_wrlock(&upgrade.gate);
+    int conn = upgrade.conn;
+    if(restore_state() == -1 || send_byte(conn, UPGRADE_ACK) == -1 || recv_byte(conn, UPGRADE_BYE) == -1){
+        debug("upgrade: taking over failed");
+        return -1;
+    }
+    // the old server has exited once its end of the socket is closed
+    char eof;
+    if(recv(conn, &eof, 1, 0) != 0){
+        return -1;
+    }
+    pthread_rwlock_unlock(&upgrade.gate);
+    close(conn);
+    upgrade.conn = -1;
+    free(upgrade.body);
+    upgrade.body = NULL;
+
+    for(int fd = 0; fd < upgrade.num_adopted; fd++){
+        ADOPTED *a = &upgrade.adopted[fd];
+        if(a->client == NULL)
+            continue;
+        client_flush(a->client);
+        if(a->seeking)
+            matchmaker_seek(a->client);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    double ms __attribute__((unused)) = (end.tv_sec - start.tv_sec) * 1e3 + (end.tv_nsec - start.tv_nsec) / 1e6;
+    debug("upgrade: %u clients taken over in %.1f ms", upgrade.header.num_clients, ms);
+    return 0;
+}
+
+void upgrade_serve(ACCEPTOR_HANDOFF *serve){
+    if(upgrade.fds == NULL)
+        return;
+    // the clients are served in the order they were handed over
+    for(uint32_t i = 1; i < upgrade.header.num_fds; i++)
+        serve(upgrade.fds[i], -1);
+    free(upgrade.fds);
+    upgrade.fds = NULL;
+}
+
+int upgrade_adopt(JEUX_SESSION *session){
+    if(!upgrade.configured)
+        return 0;
+    int fd = session->fd;
+    pthread_mutex_lock(&upgrade.lock);
+    if(upgrade.adopted == NULL || fd >= upgrade.num_adopted || upgrade.adopted[fd].client == NULL){
+        pthread_mutex_unlock(&upgrade.lock);
+        return 0;
+    }
+    ADOPTED a = upgrade.adopted[fd];
+    upgrade.adopted[fd].client = NULL;
+    if(--upgrade.unadopted == 0){
+        free(upgrade.adopted);
+        upgrade.adopted = NULL;
+        upgrade.num_adopted = 0;
+    }
+    pthread_mutex_unlock(&upgrade.lock);
+
+    session->client = a.client;
+    session->logged_in = a.logged_in;
+    if(a.input_len > 0)
+        proto_decoder_feed(session->decoder, a.input, a.input_len);
+    free(a.input);
+    return 1;
+}
@@ -0,0 +1,523 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <errno.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/eventfd.h>
+#include <linux/io_uring.h>
+
+#include "protocol.h"
+#include "protocol_ext.h"
+#include "session.h"
+#include "proto_decoder.h"
+#include "outq.h"
+#include "pool.h"
+#include "uring_loop.h"
+#include "acceptor.h"
+#include "metrics.h"
+#include "spawn.h"
+#include "debug.h"
+
+#define URING_SQ_ENTRIES 256
+#define URING_CQ_ENTRIES 4096           // multishot recvs complete many times each
+#define URING_BUFS 256                  // provided buffers per reactor, a power of two
+#define URING_BUF_SIZE 4096
+#define URING_BGID 0                    // the buffer group of the recvs
+#define URING_DISPATCH_MAX 32           // packets handled per connection between waits
+#define URING_BACKLOG_MAX (256 * 1024)  // bytes received ahead before a client is dropped
+
+// what a completion is for, in the low bits of its user_data
+#define TAG_RECV  0                     // a connection's recv
+#define TAG_SEND  1                     // a SEND_OP
+#define TAG_INBOX 2                     // the poll of the reactor's eventfd
+#define TAG_MASK  3
+
+typedef struct uring_conn {
+    JEUX_SESSION session;       // service-loop state shared with the threaded mode
+    PROTO_DECODER decoder;      // reassembles packets from the received buffers
+    struct uring_conn *next;    // in the inbox of the reactor, until it is armed,
+                                // then in its ready list
+    int ready;                  // in the ready list: more packets may be decoded
+    int eof;                    // the recv is over; close once the packets are handled
+} URING_CONN;
+
+// a sendmsg in flight; the kernel reads msg and iov until it completes
+typedef struct send_op {
+    OUTQ *q;                    // the queue whose packets are being sent
+    struct msghdr msg;
+    struct iovec iov[PROTO_MAX_BATCH];
+} SEND_OP;
+
+/*
+ * The rings shared with the kernel.  The reactor is the only one to
+ * write the SQ tail and the CQ head, and reads what the kernel writes
+ * with acquire loads (the rings are plain mapped memory, hence the
+ * __atomic builtins).
+ */
+typedef struct ring {
+    int fd;
+    unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    unsigned sq_entries;
+    unsigned sqe_tail;          // SQEs prepared
+    unsigned submitted;         // SQEs taken by the kernel
+    void *map;                  // the SQ and CQ rings
+    size_t map_size;
+    size_t sqes_size;
+} RING;
+
+typedef struct uring_reactor {
+    RING ring;
+    struct io_uring_buf_ring *bufs;     // provided buffers, for the recvs
+    uint16_t buf_tail;                  // buffers ever given to the kernel
+    char *buf_data;                     // URING_BUFS buffers of URING_BUF_SIZE
+    int efd;                            // written when the inbox is not empty
+    pthread_mutex_t inbox_lock;         // protects inbox
+    URING_CONN *inbox;                  // connections not yet received from
+    URING_CONN *ready;                  // connections with packets left to handle
+    pthread_t tid;
+} URING_REACTOR;
+
+static URING_REACTOR *reactors;
+static int num_reactors;
+static __thread URING_REACTOR *current;     // the calling thread's, if it is a reactor
+
+static POOL send_pool = POOL_INITIALIZER("uring send", sizeof(SEND_OP));
+
+static int ring_setup(RING *r){
+    struct io_uring_params p;
+    memset(&p, 0, sizeof(p));
+    p.flags = IORING_SETUP_CQSIZE | IORING_SETUP_COOP_TASKRUN;
+    p.cq_entries = URING_CQ_ENTRIES;
+    if((r->fd = syscall(__NR_io_uring_setup, URING_SQ_ENTRIES, &p)) < 0 && errno == EINVAL){
+        // before 5.19, completions interrupt the reactor instead
+        memset(&p, 0, sizeof(p));
+        p.flags = IORING_SETUP_CQSIZE;
+        p.cq_entries = URING_CQ_ENTRIES;
+        r->fd = syscall(__NR_io_uring_setup, URING_SQ_ENTRIES, &p);
+    }
+    if(r->fd < 0){
+        debug("io_uring_setup failed: %s", strerror(errno));
+        return -1;
+    }
+    if(!(p.features & IORING_FEAT_SINGLE_MMAP) || !(p.features & IORING_FEAT_NODROP)){
+        close(r->fd);
+        return -1;
+    }
+    size_t sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    size_t cq_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    r->map_size = sq_size > cq_size ? sq_size : cq_size;
+    r->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+    r->map = mmap(NULL, r->map_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQ_RING);
+    if(r->map == MAP_FAILED){
+        close(r->fd);
+        return -1;
+    }
+    r->sqes = mmap(NULL, r->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQES);
+    if(r->sqes == MAP_FAILED){
+        munmap(r->map, r->map_size);
+        close(r->fd);
+        return -1;
+    }
+    char *base = r->map;
+    r->sq_head = (unsigned *) (base + p.sq_off.head);
+    r->sq_tail = (unsigned *) (base + p.sq_off.tail);
+    r->sq_mask = (unsigned *) (base + p.sq_off.ring_mask);
+    r->sq_array = (unsigned *) (base + p.sq_off.array);
+    r->cq_head = (unsigned *) (base + p.cq_off.head);
+    r->cq_tail = (unsigned *) (base + p.cq_off.tail);
+    r->cq_mask = (unsigned *) (base + p.cq_off.ring_mask);
+    r->cqes = (struct io_uring_cqe *) (base + p.cq_off.cqes);
+    r->sq_entries = p.sq_entries;
+    r->sqe_tail = r->submitted = *r->sq_tail;
+    // SQE i always sits in slot i of the array
+    for(unsigned i = 0; i < p.sq_entries; i++){
+        r->sq_array[i] = i;
+    }
+    return 0;
+}
+
+static void ring_free(RING *r){
+    munmap(r->sqes, r->sqes_size);
+    munmap(r->map, r->map_size);
+    close(r->fd);
+}
+
+/*
+ * Submit whatever has been prepared and, if wait is nonzero, wait for a
+ * completion as well, in a single io_uring_enter().
+ */
+static int ring_enter(RING *r, int wait){
+    __atomic_store_n(r->sq_tail, r->sqe_tail, __ATOMIC_RELEASE);
+    unsigned to_submit = r->sqe_tail - r->submitted;
+    int n = syscall(__NR_io_uring_enter, r->fd, to_submit, wait ? 1 : 0, wait ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+    metrics_syscall(METRICS_SYSCALL_URING_ENTER);
+    if(n > 0){
+        r->submitted += n;
+    }
+    return n;
+}
+
+// a cleared SQE to be filled in, or NULL if the ring is full even after submitting
+static struct io_uring_sqe *ring_sqe(RING *r){
+    if(r->sqe_tail - __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE) >= r->sq_entries){
+        ring_enter(r, 0);
+        if(r->sqe_tail - __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE) >= r->sq_entries){
+            return NULL;
+        }
+    }
+    struct io_uring_sqe *sqe = &r->sqes[r->sqe_tail++ & *r->sq_mask];
+    memset(sqe, 0, sizeof(*sqe));
+    return sqe;
+}
+
+// give a provided buffer (back) to the kernel
+static void buf_recycle(URING_REACTOR *reactor, int bid){
+    struct io_uring_buf *buf = &reactor->bufs->bufs[reactor->buf_tail & (URING_BUFS - 1)];
+    buf->addr = (uintptr_t) (reactor->buf_data + (size_t) bid * URING_BUF_SIZE);
+    buf->len = URING_BUF_SIZE;
+    buf->bid = bid;
+    reactor->buf_tail++;
+    __atomic_store_n(&reactor->bufs->tail, reactor->buf_tail, __ATOMIC_RELEASE);
+}
+
+static int bufs_setup(URING_REACTOR *reactor){
+    reactor->bufs = mmap(NULL, URING_BUFS * sizeof(struct io_uring_buf), PROT_READ | PROT_WRITE,
+                         MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if(reactor->bufs == MAP_FAILED){
+        return -1;
+    }
+    if((reactor->buf_data = malloc((size_t) URING_BUFS * URING_BUF_SIZE)) == NULL){
+        munmap(reactor->bufs, URING_BUFS * sizeof(struct io_uring_buf));
+        return -1;
+    }
+    struct io_uring_buf_reg reg;
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr = (uintptr_t) reactor->bufs;
+    reg.ring_entries = URING_BUFS;
+    reg.bgid = URING_BGID;
+    if(syscall(__NR_io_uring_register, reactor->ring.fd, IORING_REGISTER_PBUF_RING, &reg, 1) != 0){
+        debug("IORING_REGISTER_PBUF_RING failed: %s", strerror(errno));
+        free(reactor->buf_data);
+        munmap(reactor->bufs, URING_BUFS * sizeof(struct io_uring_buf));
+        return -1;
+    }
+    reactor->buf_tail = 0;
+    for(int bid = 0; bid < URING_BUFS; bid++){
+        buf_recycle(reactor, bid);
+    }
+    return 0;
+}
+
+// the outq_submit of the reactors: prepare a sendmsg, submitted with the next wait
+static int submit_send(OUTQ *q, int fd, struct iovec *iov, int iovcnt){
+    SEND_OP *op = pool_alloc(&send_pool);
+    if(op == NULL){
+        return -1;
+    }
+    struct io_uring_sqe *sqe = ring_sqe(&current->ring);
+    if(sqe == NULL){
+        pool_free(&send_pool, op);
+        return -1;
+    }
+    op->q = q;
+    memcpy(op->iov, iov, iovcnt * sizeof(struct iovec));
+    memset(&op->msg, 0, sizeof(op->msg));
+    op->msg.msg_iov = op->iov;
+    op->msg.msg_iovlen = iovcnt;
+    sqe->opcode = IORING_OP_SENDMSG;
+    sqe->fd = fd;
+    sqe->addr = (uintptr_t) &op->msg;
+    sqe->len = 1;
+    sqe->msg_flags = MSG_NOSIGNAL;
+    sqe->user_data = (uintptr_t) op | TAG_SEND;
+    return 0;
+}
+
+static int arm_recv(URING_REACTOR *reactor, URING_CONN *conn){
+    struct io_uring_sqe *sqe = ring_sqe(&reactor->ring);
+    if(sqe == NULL){
+        return -1;
+    }
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = conn->session.fd;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = URING_BGID;
+    sqe->user_data = (uintptr_t) conn | TAG_RECV;
+    return 0;
+}
+
+static int arm_inbox(URING_REACTOR *reactor){
+    struct io_uring_sqe *sqe = ring_sqe(&reactor->ring);
+    if(sqe == NULL){
+        return -1;
+    }
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = reactor->efd;
+    sqe->poll32_events = POLLIN;
+    sqe->len = IORING_POLL_ADD_MULTI;
+    sqe->user_data = TAG_INBOX;
+    return 0;
+}
+
+static void conn_free(URING_CONN *conn){
+    proto_decoder_fini(&conn->decoder);
+    free(conn);
+}
+
+// only once the kernel is done with the connection's recv
+static void conn_close(URING_CONN *conn){
+    debug("[%d] io_uring reactor closing connection", conn->session.fd);
+    jeux_session_close(&conn->session);
+    conn_free(conn);
+}
+
+/*
+ * Handle the packets a connection has received, but no more than
+ * URING_DISPATCH_MAX of them, so that a client that sends many requests
+ * at once gets the replies to the first ones before it overflows its
+ * queue (the sends only go out at the next wait).  A connection that
+ * may have more is put in the ready list, and handled again after the
+ * next wait, which does not block while the list is not empty.
+ */
+static void conn_dispatch(URING_REACTOR *reactor, URING_CONN *conn){
+    JEUX_PACKET_HEADER hdr;
+    void *payload;
+    for(int i = 0; i < URING_DISPATCH_MAX; i++){
+        if(proto_decoder_next(&conn->decoder, &hdr, &payload) != 1){
+            if(conn->eof){
+                conn_close(conn);
+            }
+            return;
+        }
+        jeux_session_dispatch(&conn->session, &hdr, payload);
+    }
+    conn->ready = 1;
+    conn->next = reactor->ready;
+    reactor->ready = conn;
+}
+
+static void run_ready(URING_REACTOR *reactor){
+    URING_CONN *conn = reactor->ready;
+    reactor->ready = NULL;
+    while(conn != NULL){
+        URING_CONN *next = conn->next;
+        conn->ready = 0;
+        conn_dispatch(reactor, conn);
+        conn = next;
+    }
+}
+
+/*
+ * A completion of a connection's recv: res bytes in a provided buffer,
+ * 0 for EOF, or a negated errno.  A recv that is no longer multishot is
+ * armed again, unless the connection is done.
+ */
+static void conn_on_recv(URING_REACTOR *reactor, URING_CONN *conn, int res, unsigned flags){
+    if(res > 0 && (flags & IORING_CQE_F_BUFFER)){
+        int bid = flags >> IORING_CQE_BUFFER_SHIFT;
+        int fed = proto_decoder_feed(&conn->decoder, reactor->buf_data + (size_t) bid * URING_BUF_SIZE, res);
+        buf_recycle(reactor, bid);
+        if(fed == -1 || conn->decoder.tail - conn->decoder.head > URING_BACKLOG_MAX){
+            // the recv ends with the EOF this brings, and the connection with it
+            debug("[%d] client is too far ahead", conn->session.fd);
+            shutdown(conn->session.fd, SHUT_RD);
+        }
+        else if(!conn->ready){
+            conn_dispatch(reactor, conn);
+        }
+    }
+    if(flags & IORING_CQE_F_MORE){
+        return;
+    }
+    // ENOBUFS: every buffer was in use, but they have been given back since
+    if((res > 0 || res == -ENOBUFS) && arm_recv(reactor, conn) == 0){
+        return;
+    }
+    // the packets already received are still handled, as in the other modes
+    conn->eof = 1;
+    if(!conn->ready){
+        conn_dispatch(reactor, conn);
+    }
+}
+
+static void on_inbox(URING_REACTOR *reactor, unsigned flags){
+    uint64_t count;
+    if(read(reactor->efd, &count, sizeof(count)) < 0 && errno != EAGAIN){
+        debug("eventfd read failed: %s", strerror(errno));
+    }
+    pthread_mutex_lock(&reactor->inbox_lock);
+    URING_CONN *conn = reactor->inbox;
+    reactor->inbox = NULL;
+    pthread_mutex_unlock(&reactor->inbox_lock);
+    while(conn != NULL){
+        URING_CONN *next = conn->next;
+        if(arm_recv(reactor, conn) == -1){
+            conn_close(conn);
+        }
+        conn = next;
+    }
+    if(!(flags & IORING_CQE_F_MORE) && arm_inbox(reactor) == -1){
+        debug("io_uring reactor %ld can take no more connections", pthread_self());
+    }
+}
+
+static void on_completion(URING_REACTOR *reactor, uint64_t data, int res, unsigned flags){
+    void *ptr = (void *) (uintptr_t) (data & ~(uint64_t) TAG_MASK);
+    switch(data & TAG_MASK){
+    case TAG_RECV:
+        conn_on_recv(reactor, ptr, res, flags);
+        break;
+    case TAG_SEND: {
+        SEND_OP *op = ptr;
+        OUTQ *q = op->q;
+        pool_free(&send_pool, op);
+        outq_complete(q, res);
+        break;
+    }
+    case TAG_INBOX:
+        on_inbox(reactor, flags);
+        break;
+    }
+}
+
+static void *reactor_main(void *arg){
+    URING_REACTOR *reactor = arg;
+    RING *r = &reactor->ring;
+    current = reactor;
+    outq_submit = submit_send;
+
+    debug("io_uring reactor %ld started (ring fd %d)", pthread_self(), r->fd);
+    if(arm_inbox(reactor) == -1){
+        return NULL;
+    }
+    while(1){
+        // submits the sends of the last batch and waits for the next
+        if(ring_enter(r, reactor->ready == NULL) < 0 && errno != EINTR && errno != EAGAIN && errno != EBUSY){
+            debug("io_uring_enter failed: %s", strerror(errno));
+            break;
+        }
+        unsigned head = *r->cq_head;
+        unsigned tail = __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE);
+        while(head != tail){
+            struct io_uring_cqe *cqe = &r->cqes[head & *r->cq_mask];
+            uint64_t data = cqe->user_data;
+            int res = cqe->res;
+            unsigned flags = cqe->flags;
+            __atomic_store_n(r->cq_head, ++head, __ATOMIC_RELEASE);
+            on_completion(reactor, data, res, flags);
+            if(head == tail){
+                tail = __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE);
+            }
+        }
+        run_ready(reactor);
+    }
+    return NULL;
+}
+
+static int reactor_setup(URING_REACTOR *reactor){
+    if(ring_setup(&reactor->ring) == -1){
+        return -1;
+    }
+    if(bufs_setup(reactor) == -1){
+        ring_free(&reactor->ring);
+        return -1;
+    }
+    if((reactor->efd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK)) < 0){
+        free(reactor->buf_data);
+        munmap(reactor->bufs, URING_BUFS * sizeof(struct io_uring_buf));
+        ring_free(&reactor->ring);
+        return -1;
+    }
+    pthread_mutex_init(&reactor->inbox_lock, NULL);
+    reactor->inbox = NULL;
+    return 0;
+}
+
+static void reactor_free(URING_REACTOR *reactor){
+    close(reactor->efd);
+    pthread_mutex_destroy(&reactor->inbox_lock);
+    ring_free(&reactor->ring);
+    free(reactor->buf_data);
+    munmap(reactor->bufs, URING_BUFS * sizeof(struct io_uring_buf));
+}
+
+int uring_start(int nreactors, int pin){
+    if((reactors = calloc(nreactors, sizeof(URING_REACTOR))) == NULL){
+        return -1;
+    }
+    // every ring is made before any thread starts, so that failing leaves nothing running
+    for(int i = 0; i < nreactors; i++){
+        if(reactor_setup(&reactors[i]) == -1){
+            while(i-- > 0)
+                reactor_free(&reactors[i]);
+            free(reactors);
+            reactors = NULL;
+            return -1;
+        }
+    }
+
+    for(num_reactors = 0; num_reactors < nreactors; num_reactors++){
+        URING_REACTOR *reactor = &reactors[num_reactors];
+        pthread_attr_t attr;
+        pthread_attr_init(&attr);
+        if(pin && acceptor_pin(&attr, num_reactors) == -1){
+            debug("io_uring reactor %d is not pinned", num_reactors);
+        }
+        int rc = spawn(&reactor->tid, &attr, reactor_main, reactor);
+        pthread_attr_destroy(&attr);
+        if(rc != 0){
+            break;
+        }
+        pthread_detach(reactor->tid);
+    }
+    for(int i = num_reactors; i < nreactors; i++){
+        reactor_free(&reactors[i]);
+    }
+
+    debug("started %d of %d io_uring reactors", num_reactors, nreactors);
+    return num_reactors > 0 ? num_reactors : -1;
+}
+
+int uring_add_connection(int reactor, int fd){
+    URING_CONN *conn = calloc(1, sizeof(URING_CONN));
+    if(conn == NULL){
+        close(fd);
+        return -1;
+    }
+    if(proto_decoder_init(&conn->decoder, 0) == -1){
+        free(conn);
+        close(fd);
+        return -1;
+    }
+    conn->session.decoder = &conn->decoder;
+    if(jeux_session_open(&conn->session, fd) == -1){
+        conn_free(conn);
+        close(fd);
+        return -1;
+    }
+
+    URING_REACTOR *r = &reactors[reactor];
+    pthread_mutex_lock(&r->inbox_lock);
+    conn->next = r->inbox;
+    r->inbox = conn;
+    pthread_mutex_unlock(&r->inbox_lock);
+    uint64_t one = 1;
+    if(write(r->efd, &one, sizeof(one)) < 0){
+        debug("eventfd write failed: %s", strerror(errno));
+    }
+    return 0;
+}
+
+size_t uring_connection_footprint(void){
+    return sizeof(URING_CONN);
+}
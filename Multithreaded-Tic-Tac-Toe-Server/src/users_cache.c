@@ -0,0 +1,214 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "debug.h"
+#include "users_cache.h"
+#include "ratings.h"
+#include "protocol_ext.h"
+#include "client_registry.h"
+#include "client_registry_ext.h"
+#include "cluster.h"
+#include "jeux_globals.h"
+
+#define MAX_RATING_LEN 12       // digits of an int, its sign, and the TAB
+
+typedef struct users_cache {
+    pthread_mutex_t lock;               // protects everything below
+    uint32_t version;                   // bumped by every change
+    PLAYER *changes[USERS_HISTORY];     // player changed by version v is at v % USERS_HISTORY
+    OUTQ_SHARED *snapshot;              // listing as of snapshot_version, or NULL
+    uint32_t snapshot_version;
+    size_t prefix_len;                  // length of the "@<version>\tfull\n" line in snapshot
+    uint32_t oldest;                    // deltas are made only since this version or later
+} USERS_CACHE;
+
+// version 0 is what a client has before its first request, so it never gets a delta
+static USERS_CACHE cache = { .lock = PTHREAD_MUTEX_INITIALIZER, .version = 1 };
+
+void users_cache_note(PLAYER *player){
+    pthread_mutex_lock(&cache.lock);
+    uint32_t version = ++cache.version;
+    cache.changes[version % USERS_HISTORY] = player;
+    pthread_mutex_unlock(&cache.lock);
+    debug("USERS version %u: %s changed", version, player_get_name(player));
+    cluster_publish(player);
+}
+
+// the players logged in here and, in cluster mode, at the other nodes
+static PLAYER **all_players(void){
+    PLAYER **players = creg_all_players(client_registry);
+    PLAYER **remote = cluster_all_players();
+    if(players == NULL || remote == NULL || remote[0] == NULL){
+        for(PLAYER **p = remote; p != NULL && *p != NULL; p++){
+            player_unref(*p, "USERS listing built");
+        }
+        free(remote);
+        return players;
+    }
+    size_t n = 0, m = 0;
+    while(players[n] != NULL)
+        n++;
+    while(remote[m] != NULL)
+        m++;
+    PLAYER **all = realloc(players, (n + m + 1) * sizeof(PLAYER *));
+    if(all != NULL){
+        memcpy(all + n, remote, (m + 1) * sizeof(PLAYER *));
+    }
+    else{
+        all = players;
+        for(size_t i = 0; i < m; i++){
+            player_unref(remote[i], "USERS listing built");
+        }
+    }
+    free(remote);
+    return all;
+}
+
+// serialize the logged-in players into a new buffer tagged with version
+static OUTQ_SHARED *build_listing(uint32_t version, size_t *prefixp){
+    PLAYER **players = all_players();
+    if(players == NULL){
+        return NULL;
+    }
+    char prefix[32];
+    int prefix_len = snprintf(prefix, sizeof(prefix), "@%u\t" USERS_FULL_TAG "\n", version);
+    size_t cap = prefix_len;
+    for(PLAYER **p = players; *p != NULL; p++){
+        cap += strlen(player_get_name(*p)) + MAX_RATING_LEN + 1;
+    }
+    OUTQ_SHARED *buf = outq_shared_create(cap + 1);
+    if(buf != NULL){
+        char *out;
+        unsigned seq;
+        // the ratings of a listing are from whole batches of results
+        do{
+            seq = ratings_read_begin();
+            out = buf->data;
+            memcpy(out, prefix, prefix_len);
+            out += prefix_len;
+            for(PLAYER **p = players; *p != NULL; p++){
+                out += sprintf(out, "%s\t%d\n", player_get_name(*p), player_get_rating(*p));
+            }
+        } while(ratings_read_retry(seq));
+        buf->len = out - buf->data;
+        *prefixp = prefix_len;
+        debug("USERS version %u: listing of %zu bytes built", version, buf->len);
+    }
+    for(PLAYER **p = players; *p != NULL; p++){
+        player_unref(*p, "USERS listing built");
+    }
+    free(players);
+    return buf;
+}
+
+OUTQ_SHARED *users_cache_snapshot(size_t *prefixp){
+    pthread_mutex_lock(&cache.lock);
+    uint32_t version = cache.version;
+    if(cache.snapshot != NULL && cache.snapshot_version == version){
+        OUTQ_SHARED *buf = outq_shared_ref(cache.snapshot);
+        *prefixp = cache.prefix_len;
+        pthread_mutex_unlock(&cache.lock);
+        return buf;
+    }
+    pthread_mutex_unlock(&cache.lock);
+
+    // built without the lock; of two threads building at once, the newer listing is kept
+    size_t prefix_len;
+    OUTQ_SHARED *buf = build_listing(version, &prefix_len);
+    if(buf == NULL){
+        return NULL;
+    }
+    OUTQ_SHARED *old = NULL;
+    pthread_mutex_lock(&cache.lock);
+    if(cache.snapshot == NULL || cache.snapshot_version < version){
+        old = cache.snapshot;
+        cache.snapshot = outq_shared_ref(buf);
+        cache.snapshot_version = version;
+        cache.prefix_len = prefix_len;
+    }
+    pthread_mutex_unlock(&cache.lock);
+    outq_shared_unref(old);
+    *prefixp = prefix_len;
+    return buf;
+}
+
+char *users_cache_delta(uint32_t since, size_t *lenp){
+    PLAYER *changed[USERS_HISTORY];
+    int num_changed = 0;
+
+    pthread_mutex_lock(&cache.lock);
+    uint32_t version = cache.version;
+    if(since < cache.oldest || since == 0 || since > version || version - since > USERS_HISTORY){
+        pthread_mutex_unlock(&cache.lock);
+        return NULL;
+    }
+    // newest first, each player once
+    for(uint32_t v = version; v > since; v--){
+        PLAYER *player = cache.changes[v % USERS_HISTORY];
+        int seen = 0;
+        for(int i = 0; i < num_changed && !seen; i++){
+            seen = changed[i] == player;
+        }
+        if(!seen){
+            changed[num_changed++] = player;
+        }
+    }
+    pthread_mutex_unlock(&cache.lock);
+
+    size_t cap = 32;
+    for(int i = 0; i < num_changed; i++){
+        cap += strlen(player_get_name(changed[i])) + MAX_RATING_LEN + 2;
+    }
+    char *reply = malloc(cap);
+    if(reply == NULL){
+        return NULL;
+    }
+    char *out;
+    unsigned seq;
+    do{
+        seq = ratings_read_begin();
+        out = reply + sprintf(reply, "@%u\t" USERS_DELTA_TAG "\n", version);
+        for(int i = 0; i < num_changed; i++){
+            char *name = player_get_name(changed[i]);
+            // the registry, or the node the user belongs to, is the authority on who is logged in now
+            CLIENT *client = creg_lookup_local(client_registry, name);
+            if(client != NULL || cluster_is_remote(name)){
+                out += sprintf(out, "+%s\t%d\n", name, player_get_rating(changed[i]));
+                client_unref(client, "USERS delta built");
+            }
+            else{
+                out += sprintf(out, "-%s\n", name);
+            }
+        }
+    } while(ratings_read_retry(seq));
+    *lenp = out - reply;
+    return reply;
+}
+
+uint32_t users_cache_version(void){
+    pthread_mutex_lock(&cache.lock);
+    uint32_t version = cache.version;
+    pthread_mutex_unlock(&cache.lock);
+    return version;
+}
+
+void users_cache_resume(uint32_t version){
+    pthread_mutex_lock(&cache.lock);
+    // the changes noted here so far are the logins of the clients handed over
+    if(version > cache.version){
+        cache.version = version;
+    }
+    cache.oldest = ++cache.version;
+    memset(cache.changes, 0, sizeof(cache.changes));
+    pthread_mutex_unlock(&cache.lock);
+}
+
+void users_cache_fini(void){
+    pthread_mutex_lock(&cache.lock);
+    OUTQ_SHARED *buf = cache.snapshot;
+    cache.snapshot = NULL;
+    pthread_mutex_unlock(&cache.lock);
+    outq_shared_unref(buf);
+}
@@ -0,0 +1,90 @@
+#include <criterion/criterion.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "cluster.h"
+
+#define NUM_NAMES 4000
+
+#define THREE_NODES "a:1:2,b:1:2,c:1:2"
+#define FOUR_NODES  THREE_NODES ",d:1:2"
+
+static char names[NUM_NAMES][16];
+
+static void setup(void) {
+    for(int i = 0; i < NUM_NAMES; i++)
+	snprintf(names[i], sizeof(names[i]), "user%d", i);
+}
+
+Test(cluster_suite, 00_standalone, .timeout = 5) {
+    int lo, hi;
+    cr_assert(!cluster_enabled());
+    cr_assert_eq(cluster_owner("anyone"), 0);
+    cluster_id_range(&lo, &hi);
+    cr_assert_eq(lo, 0);
+    cr_assert_eq(hi, CLUSTER_IDS);
+    cr_assert_eq(cluster_id_node(CLUSTER_IDS - 1), 0);
+}
+
+Test(cluster_suite, 01_bad_lists, .timeout = 5) {
+    cr_assert_eq(cluster_configure("", 0), -1);
+    cr_assert_eq(cluster_configure("a:1", 0), -1);
+    cr_assert_eq(cluster_configure("a:1:", 0), -1);
+    cr_assert_eq(cluster_configure(":1:2", 0), -1);
+    cr_assert_eq(cluster_configure("a:1:2:3", 0), -1);
+    cr_assert_eq(cluster_configure(THREE_NODES, 3), -1);
+    cr_assert_eq(cluster_configure("a:1:2,b:1:2,c:1:2,d:1:2,e:1:2,f:1:2,g:1:2,h:1:2,i:1:2", 0), -1);
+    cr_assert(!cluster_enabled());
+    cr_assert_eq(cluster_configure(THREE_NODES, 2), 0);
+    cr_assert(cluster_enabled());
+}
+
+// every node gets a fair share of the names, the same at every node
+Test(cluster_suite, 02_spread, .init = setup, .timeout = 5) {
+    int owners[NUM_NAMES], counts[4] = { 0 };
+    cr_assert_eq(cluster_configure(FOUR_NODES, 0), 0);
+    for(int i = 0; i < NUM_NAMES; i++) {
+	owners[i] = cluster_owner(names[i]);
+	cr_assert(owners[i] >= 0 && owners[i] < 4);
+	counts[owners[i]]++;
+    }
+    for(int n = 0; n < 4; n++)
+	cr_assert(counts[n] > NUM_NAMES / 8 && counts[n] < NUM_NAMES * 3 / 8,
+		  "node %d owns %d of %d names", n, counts[n], NUM_NAMES);
+    cr_assert_eq(cluster_configure(FOUR_NODES, 3), 0);
+    for(int i = 0; i < NUM_NAMES; i++)
+	cr_assert_eq(cluster_owner(names[i]), owners[i]);
+}
+
+// a node added to the list takes names only for itself
+Test(cluster_suite, 03_add_node, .init = setup, .timeout = 5) {
+    int owners[NUM_NAMES], moved = 0;
+    cr_assert_eq(cluster_configure(THREE_NODES, 0), 0);
+    for(int i = 0; i < NUM_NAMES; i++)
+	owners[i] = cluster_owner(names[i]);
+    cr_assert_eq(cluster_configure(FOUR_NODES, 0), 0);
+    for(int i = 0; i < NUM_NAMES; i++) {
+	int owner = cluster_owner(names[i]);
+	if(owner != owners[i]) {
+	    cr_assert_eq(owner, 3, "%s moved from node %d to node %d", names[i], owners[i], owner);
+	    moved++;
+	}
+    }
+    cr_assert(moved > 0 && moved < NUM_NAMES / 2, "%d of %d names moved", moved, NUM_NAMES);
+}
+
+// the slices of the IDs are disjoint, and each is given out by its node only
+Test(cluster_suite, 04_id_slices, .timeout = 5) {
+    int lo, hi, covered = 0;
+    for(int self = 0; self < 3; self++) {
+	cr_assert_eq(cluster_configure(THREE_NODES, self), 0);
+	cluster_id_range(&lo, &hi);
+	cr_assert_eq(lo, covered);
+	cr_assert(hi > lo);
+	for(int id = lo; id < hi; id++)
+	    cr_assert_eq(cluster_id_node(id), self);
+	covered = hi;
+    }
+    for(int id = covered; id < CLUSTER_IDS; id++)
+	cr_assert_eq(cluster_id_node(id), -1);
+}
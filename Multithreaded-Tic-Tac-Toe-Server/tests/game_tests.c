@@ -0,0 +1,386 @@
+#include <criterion/criterion.h>
+#include <string.h>
+
+#include "game.h"
+#include "game_ext.h"
+#include "oracle.h"
+
+static GAME_MOVE *move(GAME *game, char *str) {
+    GAME_MOVE *mv = game_parse_move(game, NULL_ROLE, str);
+    cr_assert_not_null(mv, "\"%s\" was not parsed", str);
+    return mv;
+}
+
+// play the moves, alternating X and O, and return the game
+static GAME *play(const char *squares) {
+    GAME *game = game_create();
+    char str[8];
+    cr_assert_not_null(game);
+    for(int i = 0; squares[i] != '\0'; i++) {
+	snprintf(str, sizeof(str), "%c<-%c", squares[i], i % 2 ? 'O' : 'X');
+	GAME_MOVE *mv = move(game, str);
+	cr_assert_eq(game_apply_move(game, mv), 0, "move %s of \"%s\" rejected", str, squares);
+	game_free_move(mv);
+    }
+    return game;
+}
+
+// the winner by brute force over the digits of the squares played
+static GAME_ROLE naive_winner(const char *squares) {
+    static const char *lines[] = { "123", "456", "789", "147", "258", "369", "159", "357" };
+    for(int p = 0; p < 2; p++) {
+	int taken[10] = { 0 };
+	for(int i = 0; squares[i] != '\0'; i++) {
+	    if(i % 2 == p)
+		taken[squares[i] - '0'] = 1;
+	}
+	for(int l = 0; l < 8; l++) {
+	    if(taken[lines[l][0] - '0'] && taken[lines[l][1] - '0'] && taken[lines[l][2] - '0'])
+		return p == 0 ? FIRST_PLAYER_ROLE : SECOND_PLAYER_ROLE;
+	}
+    }
+    return NULL_ROLE;
+}
+
+Test(game_suite, 00_lines, .timeout = 5) {
+    // X completes one of the eight lines on its third move, O has two squares off it
+    char *games[] = { "14253", "41526", "74859", "12437", "21538", "31629", "12539", "31527" };
+    for(int i = 0; i < 8; i++) {
+	GAME *game = play(games[i]);
+	cr_assert(game_is_over(game), "game \"%s\" is not over", games[i]);
+	cr_assert_eq(game_get_winner(game), FIRST_PLAYER_ROLE, "game \"%s\"", games[i]);
+	game_unref(game, "test done");
+    }
+}
+
+Test(game_suite, 01_draw_and_second_player_win, .timeout = 5) {
+    GAME *game = play("123546879");
+    cr_assert(game_is_over(game), "a full board must end the game");
+    cr_assert_eq(game_get_winner(game), NULL_ROLE);
+    game_unref(game, "test done");
+
+    game = play("142576");
+    cr_assert(game_is_over(game));
+    cr_assert_eq(game_get_winner(game), SECOND_PLAYER_ROLE);
+    game_unref(game, "test done");
+}
+
+Test(game_suite, 02_illegal_moves, .timeout = 5) {
+    GAME *game = play("5");
+    GAME_MOVE *mv;
+
+    mv = move(game, "5<-O");
+    cr_assert_eq(game_apply_move(game, mv), -1, "an occupied square was taken");
+    game_free_move(mv);
+    mv = move(game, "1<-X");
+    cr_assert_eq(game_apply_move(game, mv), -1, "X moved twice in a row");
+    game_free_move(mv);
+    cr_assert_null(game_parse_move(game, FIRST_PLAYER_ROLE, "1"), "it is O's turn");
+    cr_assert_null(game_parse_move(game, NULL_ROLE, "0<-O"));
+    cr_assert_null(game_parse_move(game, NULL_ROLE, "12"));
+    game_unref(game, "test done");
+
+    game = play("14253");
+    mv = move(game, "9<-O");
+    cr_assert_eq(game_apply_move(game, mv), -1, "a move was made after the game ended");
+    game_free_move(mv);
+    game_unref(game, "test done");
+}
+
+Test(game_suite, 03_unparse_state, .timeout = 5) {
+    GAME *game = play("519");
+    char buf[GAME_STATE_MAX];
+    char *expected = "O| | \n-----\n |X| \n-----\n | |X\nIt's O's turn\n";
+
+    cr_assert_eq(game_unparse_state_into(game, buf, sizeof(buf)), (int) strlen(expected));
+    cr_assert_str_eq(buf, expected);
+    char *str = game_unparse_state(game);
+    cr_assert_str_eq(str, expected);
+    free(str);
+    cr_assert_eq(game_unparse_state_into(game, buf, 10), -1, "a short buffer was overrun");
+
+    // X has squares 5 and 9, O has square 1
+    cr_assert_eq(game_unparse_state_binary(game, buf, sizeof(buf)), GAME_STATE_BINARY_SIZE);
+    cr_assert_eq(memcmp(buf, "\x01\x10\x00\x01", GAME_STATE_BINARY_SIZE), 0);
+    cr_assert_eq(game_unparse_state_binary(game, buf, 3), -1, "a short buffer was overrun");
+    game_unref(game, "test done");
+}
+
+Test(game_suite, 04_resign, .timeout = 5) {
+    GAME *game = play("5");
+    cr_assert_eq(game_resign(game, SECOND_PLAYER_ROLE), 0);
+    cr_assert(game_is_over(game));
+    cr_assert_eq(game_get_winner(game), FIRST_PLAYER_ROLE);
+    cr_assert_eq(game_resign(game, FIRST_PLAYER_ROLE), -1, "a finished game was resigned");
+    game_unref(game, "test done");
+}
+
+// every order in which the squares can be played, each up to the end of its game
+static int explore(char *squares, int depth) {
+    int leaves = 0;
+    GAME *game = play(squares);
+    GAME_ROLE expected = naive_winner(squares);
+    cr_assert_eq(game_get_winner(game), expected, "winner of \"%s\"", squares);
+    cr_assert_eq(game_is_over(game), expected != NULL_ROLE || depth == 9, "end of \"%s\"", squares);
+    game_unref(game, "position checked");
+    if(expected != NULL_ROLE || depth == 9)
+	return 1;
+    for(char c = '1'; c <= '9'; c++) {
+	if(strchr(squares, c) != NULL)
+	    continue;
+	squares[depth] = c;
+	squares[depth + 1] = '\0';
+	leaves += explore(squares, depth + 1);
+	squares[depth] = '\0';
+    }
+    return leaves;
+}
+
+Test(game_suite, 05_exhaustive, .timeout = 60) {
+    char squares[10] = "";
+    // the number of distinct complete tic-tac-toe games
+    cr_assert_eq(explore(squares, 0), 255168);
+}
+
+Test(game_suite, 06_oracle, .timeout = 5) {
+    oracle_init();
+    // every opening move draws
+    cr_assert_eq(oracle_outcome(0, 0), NULL_ROLE);
+    cr_assert_eq(oracle_best_moves(0, 0), 0x1ff);
+    // after X in a corner, O must take the center
+    cr_assert_eq(oracle_best_moves(0001, 0), 0020);
+    cr_assert_eq(oracle_outcome(0001, 0002), FIRST_PLAYER_ROLE);
+    // a finished game has no moves left
+    cr_assert_eq(oracle_outcome(0007, 0030), FIRST_PLAYER_ROLE);
+    cr_assert_eq(oracle_best_moves(0007, 0030), 0);
+    // O cannot have moved more than X
+    cr_assert_eq(oracle_outcome(0, 0001), -1);
+}
+
+Test(game_suite, 07_analysis, .timeout = 5) {
+    GAME *game = play("1253");
+    uint8_t squares[GAME_MAX_MOVES];
+    char buf[ORACLE_ANALYSIS_MAX];
+    char *expected =
+	"X\t1\tok\t123456789\n"
+	"O\t2\tblunder\t5\n"
+	"X\t5\tok\t457\n"
+	"O\t3\tok\t346789\n"       // lost whatever O does
+	"=\tX\t4679\n";
+
+    cr_assert_eq(game_get_history(game, squares), 4);
+    cr_assert_eq(memcmp(squares, "\x01\x02\x05\x03", 4), 0);
+    cr_assert_eq(oracle_analyze(squares, 4, buf, sizeof(buf)), (int) strlen(expected));
+    cr_assert_str_eq(buf, expected);
+    game_unref(game, "test done");
+
+    // moves after the end of the game, or on a taken square
+    cr_assert_eq(oracle_analyze((uint8_t *) "\x01\x04\x02\x05\x03\x06", 6, buf, sizeof(buf)), -1);
+    cr_assert_eq(oracle_analyze((uint8_t *) "\x01\x01", 2, buf, sizeof(buf)), -1);
+}
+
+// play the squares, alternating X and O, on the board described by board, and return the game
+static GAME *play_on(const char *board, const int *squares, int n) {
+    GAME_VARIANT v;
+    char str[16];
+    cr_assert_eq(game_parse_variant(board, &v), 0, "\"%s\" was not parsed", board);
+    GAME *game = game_create_variant(&v);
+    cr_assert_not_null(game);
+    for(int i = 0; i < n; i++) {
+	snprintf(str, sizeof(str), "%d<-%c", squares[i], i % 2 ? 'O' : 'X');
+	GAME_MOVE *mv = move(game, str);
+	cr_assert_eq(game_apply_move(game, mv), 0, "move %s on %s rejected", str, board);
+	game_free_move(mv);
+    }
+    return game;
+}
+
+Test(game_suite, 08_variants, .timeout = 5) {
+    GAME_VARIANT v;
+    char buf[GAME_VARIANT_STR_MAX];
+
+    cr_assert_eq(game_parse_variant("15x15,5", &v), 0);
+    cr_assert(v.width == 15 && v.height == 15 && v.depth == 1 && v.k == 5);
+    cr_assert_eq(game_unparse_variant(&v, buf, sizeof(buf)), 7);
+    cr_assert_str_eq(buf, "15x15,5");
+    cr_assert_eq(game_parse_variant("4x4x4,4", &v), 0);
+    cr_assert_eq(game_unparse_variant(&v, buf, sizeof(buf)), 7);
+    cr_assert_str_eq(buf, "4x4x4,4");
+    cr_assert_eq(game_unparse_variant(&v, buf, 7), -1, "a short buffer was overrun");
+    cr_assert_eq(game_parse_variant("3x3,3", &v), 0);
+    cr_assert(game_variant_is_classic(&v));
+    GAME *game = play_on("3x3x1,2", NULL, 0);
+    cr_assert(!game_variant_is_classic(game_get_variant(game)));
+    game_unref(game, "test done");
+
+    // too big a side or k, too many layers for 256 bits, and malformed
+    char *bad[] = { "16x15,5", "15x15,16", "3x3,1", "3x3,4", "15x15x2,5", "7x7x5,4",
+		    "3x3", "3x3,", "x3,3", "3x3x3x3,3", "3x3,3 ", "-3x3,3", "0x3,3" };
+    for(int i = 0; i < sizeof(bad) / sizeof(bad[0]); i++)
+	cr_assert_eq(game_parse_variant(bad[i], &v), -1, "\"%s\" was accepted", bad[i]);
+    v = (GAME_VARIANT){ 15, 15, 2, 5 };
+    cr_assert_null(game_create_variant(&v));
+}
+
+Test(game_suite, 09_gomoku, .timeout = 5) {
+    // O's moves are on column 10, two rows apart, out of the way
+    int row_end[] = { 11, 100, 12, 130, 13, 160, 14, 190, 15 };
+    int wrapped[] = { 13, 100, 14, 130, 15, 160, 16, 190, 17 };
+    int anti[] = { 5, 100, 19, 130, 33, 160, 47, 190, 61 };
+    int anti_wrapped[] = { 3, 100, 17, 130, 31, 160, 45, 190, 59 };
+    int middle[] = { 1, 100, 2, 130, 4, 160, 5, 190, 3 };
+    GAME *game;
+
+    game = play_on("15x15,5", row_end, 9);
+    cr_assert_eq(game_get_winner(game), FIRST_PLAYER_ROLE, "five at the end of a row");
+    game_unref(game, "test done");
+    game = play_on("15x15,5", wrapped, 9);
+    cr_assert(!game_is_over(game), "a row ran on into the next");
+    game_unref(game, "test done");
+    game = play_on("15x15,5", anti, 9);
+    cr_assert_eq(game_get_winner(game), FIRST_PLAYER_ROLE, "five on a diagonal");
+    game_unref(game, "test done");
+    game = play_on("15x15,5", anti_wrapped, 9);
+    cr_assert(!game_is_over(game), "a diagonal ran off the side and back");
+    game_unref(game, "test done");
+    game = play_on("15x15,5", middle, 9);
+    cr_assert(game_is_over(game), "five made in the middle");
+    cr_assert_eq(game_get_winner(game), FIRST_PLAYER_ROLE);
+
+    cr_assert_null(game_parse_move(game, NULL_ROLE, "226"));
+    cr_assert_null(game_parse_move(game, NULL_ROLE, "01"));
+    cr_assert_null(game_parse_move(game, NULL_ROLE, "12<-Z"));
+    cr_assert_null(game_parse_move(game, NULL_ROLE, "12<-X "));
+    GAME_MOVE *mv = move(game, "225<-O");
+    char *str = game_unparse_move(mv);
+    cr_assert_str_eq(str, "225<-O");
+    free(str);
+    game_free_move(mv);
+    game_unref(game, "test done");
+}
+
+Test(game_suite, 10_qubic, .timeout = 5) {
+    // square 1 + x + 4y + 16z is at (x, y, z)
+    int space_diagonal[] = { 1, 2, 22, 3, 43, 8, 64 };
+    int pillar[] = { 6, 1, 22, 2, 38, 3, 54 };
+    int last_row[] = { 13, 1, 14, 6, 15, 27, 16 };
+    int wrapped[] = { 15, 1, 16, 6, 17, 27, 18 };
+    int through_layers[] = { 4, 1, 23, 6, 42, 27, 61 };
+    GAME *game;
+
+    game = play_on("4x4x4,4", space_diagonal, 7);
+    cr_assert_eq(game_get_winner(game), FIRST_PLAYER_ROLE, "four on a diagonal of the cube");
+    game_unref(game, "test done");
+    game = play_on("4x4x4,4", pillar, 7);
+    cr_assert_eq(game_get_winner(game), FIRST_PLAYER_ROLE, "four straight through the layers");
+    game_unref(game, "test done");
+    game = play_on("4x4x4,4", last_row, 7);
+    cr_assert_eq(game_get_winner(game), FIRST_PLAYER_ROLE, "four in the last row of a layer");
+    game_unref(game, "test done");
+    game = play_on("4x4x4,4", wrapped, 7);
+    cr_assert(!game_is_over(game), "a row ran on into the next layer");
+    game_unref(game, "test done");
+    game = play_on("4x4x4,4", through_layers, 7);
+    cr_assert_eq(game_get_winner(game), FIRST_PLAYER_ROLE, "four on a diagonal through the layers");
+    game_unref(game, "test done");
+}
+
+// 1 if the player at square has k in a row through it, walking the board one square at a time
+static int naive_line(const GAME_VARIANT *v, const int *owner, int square) {
+    int i = square - 1, x = i % v->width, y = i / v->width % v->height, z = i / (v->width * v->height);
+    for(int dz = -1; dz <= 1; dz++) {
+	for(int dy = -1; dy <= 1; dy++) {
+	    for(int dx = -1; dx <= 1; dx++) {
+		if(dx == 0 && dy == 0 && dz == 0)
+		    continue;
+		int run = 0;
+		for(int sign = -1; sign <= 1; sign += 2) {
+		    int cx = x, cy = y, cz = z;
+		    while(cx >= 0 && cx < v->width && cy >= 0 && cy < v->height && cz >= 0 && cz < v->depth
+			  && owner[cx + cy * v->width + cz * v->width * v->height] == owner[i]) {
+			run++;
+			cx += sign * dx;
+			cy += sign * dy;
+			cz += sign * dz;
+		    }
+		}
+		if(run - 1 >= v->k)
+		    return 1;
+	    }
+	}
+    }
+    return 0;
+}
+
+// random games on each board, with each kernel, judged by naive_line() after every move
+Test(game_suite, 11_random_games, .timeout = 60) {
+    char *boards[] = { "15x15,5", "4x4x4,4", "7x6,4", "5x5x3,3", "3x3x3,3", "15x3x4,3", "1x15,15" };
+    int owner[GAME_MAX_SQUARES], order[GAME_MAX_SQUARES];
+    char str[16];
+
+    srand(1);
+    for(int avx2 = 0; avx2 <= 1; avx2++) {
+	game_use_avx2(avx2);
+	for(int b = 0; b < sizeof(boards) / sizeof(boards[0]); b++) {
+	    GAME_VARIANT v;
+	    cr_assert_eq(game_parse_variant(boards[b], &v), 0);
+	    int n = v.width * v.height * v.depth;
+	    for(int g = 0; g < 200; g++) {
+		for(int i = 0; i < n; i++) {
+		    int j = rand() % (i + 1);
+		    order[i] = order[j];
+		    order[j] = i + 1;
+		    owner[i] = 0;
+		}
+		GAME *game = game_create_variant(&v);
+		GAME_ROLE expected = NULL_ROLE;
+		for(int i = 0; i < n && expected == NULL_ROLE; i++) {
+		    snprintf(str, sizeof(str), "%d<-%c", order[i], i % 2 ? 'O' : 'X');
+		    GAME_MOVE *mv = move(game, str);
+		    cr_assert_eq(game_apply_move(game, mv), 0, "move %s on %s rejected", str, boards[b]);
+		    game_free_move(mv);
+		    owner[order[i] - 1] = i % 2 + 1;
+		    if(naive_line(&v, owner, order[i]))
+			expected = i % 2 ? SECOND_PLAYER_ROLE : FIRST_PLAYER_ROLE;
+		    cr_assert_eq(game_get_winner(game), expected, "move %d (%s) of game %d on %s, avx2 %d",
+				 i, str, g, boards[b], avx2);
+		    cr_assert_eq(game_is_over(game), expected != NULL_ROLE || i == n - 1);
+		}
+		game_unref(game, "game checked");
+	    }
+	}
+    }
+    game_use_avx2(1);
+}
+
+Test(game_suite, 12_unparse_board, .timeout = 5) {
+    int squares[] = { 1, 24, 6 };
+    GAME *game = play_on("4x3x2,3", squares, 3);
+    char buf[GAME_STATE_MAX];
+    uint8_t history[GAME_MAX_MOVES];
+    char *expected =
+	"X| | | \n-------\n |X| | \n-------\n | | | \n"
+	"\n"
+	" | | | \n-------\n | | | \n-------\n | | |O\n"
+	"It's O's turn\n";
+
+    cr_assert_eq(game_unparse_state_into(game, buf, sizeof(buf)), (int) strlen(expected));
+    cr_assert_str_eq(buf, expected);
+    cr_assert_eq(game_unparse_state_into(game, buf, strlen(expected)), -1, "a short buffer was overrun");
+    // X has squares 1 and 6, O has square 24, in three bytes each
+    cr_assert_eq(game_unparse_state_binary(game, buf, sizeof(buf)), 6);
+    cr_assert_eq(memcmp(buf, "\x00\x00\x21\x80\x00\x00", 6), 0);
+    cr_assert_eq(game_unparse_state_binary(game, buf, 5), -1, "a short buffer was overrun");
+    cr_assert_eq(game_get_history(game, history), 3);
+    cr_assert_eq(memcmp(history, "\x01\x18\x06", 3), 0);
+    game_unref(game, "test done");
+
+    // the biggest board fits
+    int corner[] = { 225 };
+    game = play_on("15x15,5", corner, 1);
+    cr_assert_eq(game_unparse_state_into(game, buf, sizeof(buf)), 29 * 30 + 14);
+    cr_assert_eq(buf[29 * 30 - 2], 'X');
+    cr_assert_eq(game_unparse_state_binary(game, buf, GAME_STATE_BINARY_MAX), 58);
+    cr_assert_eq(buf[0], 1);
+    game_unref(game, "test done");
+}
@@ -0,0 +1,105 @@
+#include <criterion/criterion.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "player.h"
+#include "player_ext.h"
+#include "player_registry.h"
+#include "ratings.h"
+#include "leaderboard.h"
+#include "journal.h"
+
+#define NUM_PLAYERS 20
+#define NUM_GAMES 100
+
+static char dir[32];
+static PLAYER_REGISTRY *preg;
+static double saved[NUM_PLAYERS];
+
+static void setup(void) {
+    strcpy(dir, "/tmp/journal_testsXXXXXX");
+    cr_assert_not_null(mkdtemp(dir));
+    preg = preg_init();
+    cr_assert_not_null(preg);
+    cr_assert_eq(journal_open(dir, preg), 0, "a new journal is not empty");
+}
+
+static void teardown(void) {
+    char cmd[64];
+    snprintf(cmd, sizeof(cmd), "rm -rf %s", dir);
+    system(cmd);
+}
+
+static PLAYER *player(int i) {
+    char name[16];
+    snprintf(name, sizeof(name), "p%d", i);
+    PLAYER *player = preg_register(preg, name);
+    cr_assert_not_null(player);
+    player_unref(player, "test done with it");
+    return player;
+}
+
+// play random games and note the ratings they end with
+static void play(void) {
+    srand(1);
+    for(int g = 0; g < NUM_GAMES; g++) {
+	int i = rand() % NUM_PLAYERS, j = (i + 1 + rand() % (NUM_PLAYERS - 1)) % NUM_PLAYERS;
+	cr_assert_eq(ratings_post(player(i), player(j), rand() % 3), 0);
+    }
+    ratings_flush();
+    for(int i = 0; i < NUM_PLAYERS; i++)
+	saved[i] = player_get_exact_rating(player(i));
+    journal_sync();
+}
+
+// start over from what is on disk
+static void restart(int expected) {
+    leaderboard_fini();
+    preg_fini(preg);
+    preg = preg_init();
+    cr_assert_not_null(preg);
+    cr_assert_eq(journal_open(dir, preg), expected);
+    for(int i = 0; i < NUM_PLAYERS; i++)
+	cr_assert_eq(player_get_exact_rating(player(i)), saved[i], "p%d is not as saved", i);
+}
+
+static void copy_file(char *from, char *to) {
+    char buf[4096];
+    size_t n;
+    FILE *in = fopen(from, "r"), *out = fopen(to, "w");
+    cr_assert(in != NULL && out != NULL);
+    while((n = fread(buf, 1, sizeof(buf), in)) > 0)
+	cr_assert_eq(fwrite(buf, 1, n, out), n);
+    fclose(in);
+    fclose(out);
+}
+
+Test(journal_suite, 00_restart, .init = setup, .fini = teardown, .timeout = 5) {
+    play();
+    journal_fini();
+    restart(NUM_PLAYERS);
+    journal_fini();
+}
+
+Test(journal_suite, 01_crash, .init = setup, .fini = teardown, .timeout = 5) {
+    char path[64], copy[64];
+    snprintf(path, sizeof(path), "%s/journal", dir);
+    snprintf(copy, sizeof(copy), "%s/journal.copy", dir);
+    play();
+    copy_file(path, copy);
+    // as if the server died after the snapshot, but before emptying the journal
+    journal_fini();
+    cr_assert_eq(rename(copy, path), 0);
+    // and in the middle of writing a record
+    FILE *f = fopen(path, "a");
+    cr_assert_not_null(f);
+    cr_assert_gt(ftell(f), 0, "nothing was journaled");
+    fwrite("\x12\x34\x56\x78\x01", 5, 1, f);
+    fclose(f);
+    restart(NUM_PLAYERS);
+    journal_fini();
+    restart(NUM_PLAYERS);
+    journal_fini();
+}
@@ -0,0 +1,99 @@
+#include <criterion/criterion.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "player.h"
+#include "player_ext.h"
+#include "leaderboard.h"
+
+#define NUM_PLAYERS 200
+
+static PLAYER *players[NUM_PLAYERS];
+
+static void setup(void) {
+    char name[16];
+    for(int i = 0; i < NUM_PLAYERS; i++) {
+	snprintf(name, sizeof(name), "p%d", i);
+	players[i] = player_create(name);
+	cr_assert_not_null(players[i]);
+	cr_assert_eq(leaderboard_add(players[i]), 0);
+    }
+}
+
+static void teardown(void) {
+    leaderboard_fini();
+    for(int i = 0; i < NUM_PLAYERS; i++)
+	player_unref(players[i], "test done");
+}
+
+// ratings beyond the buckets rank with the nearest bucket
+static int clamped_rating(int i) {
+    int rating = player_get_rating(players[i]);
+    return rating < 0 ? 0 : rating >= LEADERBOARD_BUCKETS ? LEADERBOARD_BUCKETS - 1 : rating;
+}
+
+// the rank of player i by brute force: one more than the players rated higher
+static int naive_rank(int i) {
+    int rank = 1;
+    for(int j = 0; j < NUM_PLAYERS; j++)
+	rank += clamped_rating(j) > clamped_rating(i);
+    return rank;
+}
+
+static void check_ranks(void) {
+    char name[16], expected[64];
+    size_t len;
+    for(int i = 0; i < NUM_PLAYERS; i++) {
+	snprintf(name, sizeof(name), "p%d", i);
+	char *line = leaderboard_rank(name, &len);
+	cr_assert_not_null(line, "%s is not ranked", name);
+	snprintf(expected, sizeof(expected), "%d\t%s\t%d\n", naive_rank(i), name, player_get_rating(players[i]));
+	cr_assert_str_eq(line, expected);
+	cr_assert_eq(len, strlen(expected));
+	free(line);
+    }
+}
+
+Test(leaderboard_suite, 00_initial, .init = setup, .fini = teardown, .timeout = 5) {
+    size_t len;
+    // everyone shares the first rank at the initial rating
+    check_ranks();
+    char *top = leaderboard_top(3, &len);
+    cr_assert_not_null(top);
+    int lines = 0;
+    for(char *line = strtok(top, "\n"); line != NULL; line = strtok(NULL, "\n"), lines++)
+	cr_assert(strncmp(line, "1\tp", 3) == 0 && strstr(line, "\t1500") != NULL, "line \"%s\"", line);
+    cr_assert_eq(lines, 3);
+    free(top);
+    cr_assert_null(leaderboard_rank("nobody", &len), "an unknown player was ranked");
+}
+
+Test(leaderboard_suite, 01_random_ratings, .init = setup, .fini = teardown, .timeout = 5) {
+    srand(1);
+    for(int round = 0; round < 20; round++) {
+	// change some ratings, including past the ends of the buckets
+	PLAYER *changed[NUM_PLAYERS / 4];
+	for(int c = 0; c < NUM_PLAYERS / 4; c++) {
+	    changed[c] = players[rand() % NUM_PLAYERS];
+	    player_set_rating(changed[c], rand() % (LEADERBOARD_BUCKETS + 400) - 200);
+	}
+	leaderboard_update(changed, NUM_PLAYERS / 4);
+	check_ranks();
+    }
+
+    // the top lines, best first, agree with the ranks
+    size_t len;
+    char *top = leaderboard_top(NUM_PLAYERS + 10, &len);
+    cr_assert_not_null(top);
+    int lines = 0, last_rank = 0;
+    for(char *line = strtok(top, "\n"); line != NULL; line = strtok(NULL, "\n"), lines++) {
+	int rank, rating, i;
+	cr_assert_eq(sscanf(line, "%d\tp%d\t%d", &rank, &i, &rating), 3, "bad line \"%s\"", line);
+	cr_assert_eq(rating, player_get_rating(players[i]), "line \"%s\"", line);
+	cr_assert_eq(rank, naive_rank(i), "line \"%s\"", line);
+	cr_assert_geq(rank, last_rank, "line \"%s\" is out of order", line);
+	last_rank = rank;
+    }
+    cr_assert_eq(lines, NUM_PLAYERS);
+    free(top);
+}
@@ -0,0 +1,22 @@
+#include <criterion/criterion.h>
+
+#include "matchmaker.h"
+
+// seekers either side of a band's edge are as close as their ratings
+Test(matchmaker_suite, 00_band_edge, .timeout = 5) {
+    int edge = 15 * MATCH_BAND_WIDTH;
+    cr_assert(matchmaker_compatible(edge - 1, edge, 0));
+    cr_assert(matchmaker_compatible(edge - MATCH_BAND_WIDTH / 2, edge + MATCH_BAND_WIDTH / 2, 0));
+    cr_assert(!matchmaker_compatible(edge - MATCH_BAND_WIDTH, edge + 1, 0));
+    // the two ends of one band
+    cr_assert(matchmaker_compatible(edge, edge + MATCH_BAND_WIDTH - 1, 0));
+}
+
+// the reach widens by a band's width every MATCH_WIDEN_SECS
+Test(matchmaker_suite, 01_widening, .timeout = 5) {
+    int far = 3 * MATCH_BAND_WIDTH;
+    cr_assert(!matchmaker_compatible(1500, 1500 + far, 0));
+    cr_assert(!matchmaker_compatible(1500, 1500 + far, 2 * MATCH_WIDEN_SECS - 0.5));
+    cr_assert(matchmaker_compatible(1500, 1500 + far, 2 * MATCH_WIDEN_SECS));
+    cr_assert(matchmaker_compatible(1500 + far, 1500, 2 * MATCH_WIDEN_SECS));
+}
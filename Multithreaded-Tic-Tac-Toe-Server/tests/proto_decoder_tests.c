@@ -0,0 +1,123 @@
+#include <criterion/criterion.h>
+#include <string.h>
+#include <arpa/inet.h>
+
+#include "proto_decoder.h"
+
+static size_t make_packet(char *buf, JEUX_PACKET_TYPE type, uint8_t id, char *payload) {
+    JEUX_PACKET_HEADER hdr;
+    size_t size = payload ? strlen(payload) : 0;
+    memset(&hdr, 0, sizeof(hdr));
+    hdr.type = type;
+    hdr.id = id;
+    hdr.size = htons(size);
+    hdr.timestamp_sec = htonl(17);
+    memcpy(buf, &hdr, sizeof(hdr));
+    if(size)
+	memcpy(buf + sizeof(hdr), payload, size);
+    return sizeof(hdr) + size;
+}
+
+Test(decoder_suite, 00_partial_header, .timeout = 5) {
+    PROTO_DECODER dec;
+    JEUX_PACKET_HEADER hdr;
+    void *payload;
+    char buf[64];
+    size_t len = make_packet(buf, JEUX_LOGIN_PKT, 0, "alice");
+
+    cr_assert_eq(proto_decoder_init(&dec, 0), 0);
+    for(size_t i = 0; i < len - 1; i++) {
+	cr_assert_eq(proto_decoder_feed(&dec, buf + i, 1), 0);
+	cr_assert_eq(proto_decoder_next(&dec, &hdr, &payload), 0,
+		     "packet reported complete after %zu of %zu bytes", i + 1, len);
+    }
+    cr_assert_eq(proto_decoder_feed(&dec, buf + len - 1, 1), 0);
+    cr_assert_eq(proto_decoder_next(&dec, &hdr, &payload), 1);
+    cr_assert_eq(hdr.type, JEUX_LOGIN_PKT);
+    cr_assert_eq(hdr.size, 5, "size was not converted to host byte order");
+    cr_assert_eq(hdr.timestamp_sec, 17);
+    cr_assert(memcmp(payload, "alice", 5) == 0);
+    proto_decoder_fini(&dec);
+}
+
+Test(decoder_suite, 01_pipelined_packets, .timeout = 5) {
+    PROTO_DECODER dec;
+    JEUX_PACKET_HEADER hdr;
+    void *payload;
+    char buf[256];
+    size_t len = 0;
+
+    len += make_packet(buf + len, JEUX_USERS_PKT, 0, NULL);
+    len += make_packet(buf + len, JEUX_MOVE_PKT, 3, "5");
+    len += make_packet(buf + len, JEUX_RESIGN_PKT, 4, NULL);
+    cr_assert_eq(proto_decoder_init(&dec, 0), 0);
+    cr_assert_eq(proto_decoder_feed(&dec, buf, len), 0);
+
+    cr_assert_eq(proto_decoder_next(&dec, &hdr, &payload), 1);
+    cr_assert_eq(hdr.type, JEUX_USERS_PKT);
+    cr_assert_null(payload);
+    cr_assert_eq(proto_decoder_next(&dec, &hdr, &payload), 1);
+    cr_assert_eq(hdr.type, JEUX_MOVE_PKT);
+    cr_assert_eq(hdr.id, 3);
+    cr_assert_eq(*(char *) payload, '5');
+    cr_assert_eq(proto_decoder_next(&dec, &hdr, &payload), 1);
+    cr_assert_eq(hdr.type, JEUX_RESIGN_PKT);
+    cr_assert_eq(proto_decoder_next(&dec, &hdr, &payload), 0);
+    proto_decoder_fini(&dec);
+}
+
+Test(decoder_suite, 02_wrap_and_grow, .timeout = 5) {
+    PROTO_DECODER dec;
+    JEUX_PACKET_HEADER hdr;
+    void *payload;
+    char buf[4096];
+    char name[2048];
+
+    // a small ring forces payloads to straddle the end and large ones to grow it
+    cr_assert_eq(proto_decoder_init(&dec, 64), 0);
+    for(int i = 0; i < 100; i++) {
+	snprintf(name, sizeof(name), "player-%d", i);
+	size_t len = make_packet(buf, JEUX_INVITE_PKT, i, name);
+	cr_assert_eq(proto_decoder_feed(&dec, buf, len), 0);
+	cr_assert_eq(proto_decoder_next(&dec, &hdr, &payload), 1);
+	cr_assert_eq(hdr.id, i);
+	cr_assert_eq(hdr.size, strlen(name));
+	cr_assert(memcmp(payload, name, hdr.size) == 0, "payload %d corrupted", i);
+    }
+    memset(name, 'x', sizeof(name) - 1);
+    name[sizeof(name) - 1] = '\0';
+    size_t len = make_packet(buf, JEUX_LOGIN_PKT, 0, name);
+    cr_assert_eq(proto_decoder_feed(&dec, buf, len), 0);
+    cr_assert_eq(proto_decoder_next(&dec, &hdr, &payload), 1);
+    cr_assert_eq(hdr.size, sizeof(name) - 1);
+    cr_assert(memcmp(payload, name, hdr.size) == 0);
+    proto_decoder_fini(&dec);
+}
+
+// what is left over moves to another decoder, as in a hot upgrade, and decodes the same there
+Test(decoder_suite, 03_unread, .timeout = 5) {
+    PROTO_DECODER dec, next;
+    JEUX_PACKET_HEADER hdr;
+    void *payload;
+    char buf[256], left[256];
+    size_t first = make_packet(buf, JEUX_USERS_PKT, 0, NULL);
+    size_t len = first + make_packet(buf + first, JEUX_MOVE_PKT, 7, "9");
+
+    cr_assert_eq(proto_decoder_init(&dec, 64), 0);
+    cr_assert_eq(proto_decoder_feed(&dec, buf, len - 3), 0);
+    cr_assert_eq(proto_decoder_next(&dec, &hdr, &payload), 1);
+    cr_assert_eq(proto_decoder_next(&dec, &hdr, &payload), 0);
+    cr_assert_eq(proto_decoder_unread(&dec, left, 4), len - 3 - first);
+    cr_assert(memcmp(left, buf + first, 4) == 0);
+    cr_assert_eq(proto_decoder_unread(&dec, left, sizeof(left)), len - 3 - first);
+
+    cr_assert_eq(proto_decoder_init(&next, 0), 0);
+    cr_assert_eq(proto_decoder_feed(&next, left, len - 3 - first), 0);
+    cr_assert_eq(proto_decoder_feed(&next, buf + len - 3, 3), 0);
+    cr_assert_eq(proto_decoder_next(&next, &hdr, &payload), 1);
+    cr_assert_eq(hdr.type, JEUX_MOVE_PKT);
+    cr_assert_eq(hdr.id, 7);
+    cr_assert_eq(*(char *) payload, '9');
+    proto_decoder_fini(&dec);
+    proto_decoder_fini(&next);
+}
@@ -0,0 +1,168 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include <getopt.h>
+
+#include "protocol.h"
+#include "protocol_ext.h"
+#include "metrics.h"
+#include "trace.h"
+
+/*
+ * Print a trace dumped by the Jeux server (see trace.h) as a timeline,
+ * one line per event, oldest first:
+ *
+ *     <wall clock time> <microseconds since the first event> T<thread> <event>
+ *
+ * Options pick out the events of one thread (-t), one connection (-f,
+ * packets only) or one object (-o, a CLIENT, PLAYER, GAME or INVITATION
+ * or a lock, by the address in the other lines), e.g. to follow the
+ * reference count of an object that is leaked or freed too early.
+ *
+ * usage: jtrace [-t <thread>] [-f <fd>] [-o <address>] <trace file>
+ */
+
+typedef struct reason {
+    uint64_t addr;
+    char *text;
+} REASON;
+
+static const char *packet_names[] = {
+    [JEUX_NO_PKT] = "NO", [JEUX_LOGIN_PKT] = "LOGIN", [JEUX_USERS_PKT] = "USERS",
+    [JEUX_INVITE_PKT] = "INVITE", [JEUX_REVOKE_PKT] = "REVOKE", [JEUX_ACCEPT_PKT] = "ACCEPT",
+    [JEUX_DECLINE_PKT] = "DECLINE", [JEUX_MOVE_PKT] = "MOVE", [JEUX_RESIGN_PKT] = "RESIGN",
+    [JEUX_ACK_PKT] = "ACK", [JEUX_NACK_PKT] = "NACK", [JEUX_INVITED_PKT] = "INVITED",
+    [JEUX_REVOKED_PKT] = "REVOKED", [JEUX_ACCEPTED_PKT] = "ACCEPTED",
+    [JEUX_DECLINED_PKT] = "DECLINED", [JEUX_MOVED_PKT] = "MOVED", [JEUX_RESIGNED_PKT] = "RESIGNED",
+    [JEUX_ENDED_PKT] = "ENDED", [JEUX_ANALYZE_PKT] = "ANALYZE",
+    [JEUX_LEADERBOARD_PKT] = "LEADERBOARD", [JEUX_SEEK_PKT] = "SEEK", [JEUX_STATS_PKT] = "STATS",
+    [JEUX_WATCH_PKT] = "WATCH",
+};
+#define NUM_PACKET_NAMES (sizeof(packet_names) / sizeof(packet_names[0]))
+
+static const char *object_names[] = {
+    [TRACE_CLIENT] = "client", [TRACE_PLAYER] = "player",
+    [TRACE_GAME] = "game", [TRACE_INVITATION] = "invitation",
+};
+
+static const char *lock_names[] = {
+    [METRICS_LOCK_CREG] = "client registry", [METRICS_LOCK_PREG] = "player registry",
+    [METRICS_LOCK_CLIENT] = "client",
+};
+
+static REASON *reasons;
+static uint32_t num_reasons;
+
+static const char *name_of(const char **names, size_t count, unsigned int i){
+    return i < count && names[i] != NULL ? names[i] : "?";
+}
+
+static const char *reason_of(uint64_t addr){
+    for(uint32_t i = 0; i < num_reasons; i++){
+        if(reasons[i].addr == addr)
+            return reasons[i].text;
+    }
+    return "?";
+}
+
+static int by_time(const void *a, const void *b){
+    const TRACE_EVENT *x = a, *y = b;
+    if(x->time != y->time)
+        return x->time < y->time ? -1 : 1;
+    return (int) x->thread - (int) y->thread;
+}
+
+static void print_event(TRACE_EVENT *e){
+    switch(e->kind){
+    case TRACE_PACKET_IN:
+    case TRACE_PACKET_OUT:
+        printf("%-5s fd %u %s id=%u role=%u size=%u\n", e->kind == TRACE_PACKET_IN ? "in" : "out",
+               e->a, name_of(packet_names, NUM_PACKET_NAMES, e->arg), (unsigned int) (e->b & 0xff),
+               (unsigned int) (e->b >> 8 & 0xff), (unsigned int) (e->b >> 16 & 0xffff));
+        break;
+    case TRACE_REF:
+    case TRACE_UNREF:
+        printf("%-5s %s 0x%llx -> %u (%s)%s\n", e->kind == TRACE_REF ? "ref" : "unref",
+               name_of(object_names, 4, e->arg), (unsigned long long) e->b, e->a, reason_of(e->c),
+               e->kind == TRACE_UNREF && e->a == 0 ? " freed" : "");
+        break;
+    case TRACE_LOCK:
+        printf("lock  %s 0x%llx%s", name_of(lock_names, METRICS_NUM_LOCKS, e->arg),
+               (unsigned long long) e->b, e->a == 1 ? " read" : e->a == 2 ? " write" : "");
+        if(e->c > 0)
+            printf(", waited %.3f us", e->c / 1e3);
+        printf("\n");
+        break;
+    default:
+        printf("kind %u\n", e->kind);
+        break;
+    }
+}
+
+static void usage(char *prog){
+    fprintf(stderr, "usage: %s [-t <thread>] [-f <fd>] [-o <address>] <trace file>\n", prog);
+    exit(EXIT_FAILURE);
+}
+
+int main(int argc, char *argv[]){
+    long thread = -1, fd = -1;
+    unsigned long long object = 0;
+    int opt;
+    while((opt = getopt(argc, argv, "t:f:o:")) != -1){
+        switch(opt){
+        case 't': thread = atol(optarg); break;
+        case 'f': fd = atol(optarg); break;
+        case 'o': object = strtoull(optarg, NULL, 16); break;
+        default: usage(argv[0]);
+        }
+    }
+    if(optind != argc - 1)
+        usage(argv[0]);
+    FILE *in = fopen(argv[optind], "r");
+    if(in == NULL){
+        perror(argv[optind]);
+        exit(EXIT_FAILURE);
+    }
+    TRACE_FILE_HEADER header;
+    if(fread(&header, sizeof(header), 1, in) != 1 || memcmp(header.magic, TRACE_MAGIC, sizeof(header.magic)) != 0){
+        fprintf(stderr, "%s: not a Jeux trace\n", argv[optind]);
+        exit(EXIT_FAILURE);
+    }
+    TRACE_EVENT *events = malloc((header.num_events + 1) * sizeof(TRACE_EVENT));
+    reasons = malloc((header.num_strings + 1) * sizeof(REASON));
+    if(events == NULL || reasons == NULL || fread(events, sizeof(TRACE_EVENT), header.num_events, in) != header.num_events){
+        fprintf(stderr, "%s: truncated\n", argv[optind]);
+        exit(EXIT_FAILURE);
+    }
+    for(num_reasons = 0; num_reasons < header.num_strings; num_reasons++){
+        REASON *r = &reasons[num_reasons];
+        uint16_t len;
+        if(fread(&r->addr, sizeof(r->addr), 1, in) != 1 || fread(&len, sizeof(len), 1, in) != 1
+           || (r->text = calloc(len + 1, 1)) == NULL || fread(r->text, 1, len, in) != len){
+            fprintf(stderr, "%s: truncated\n", argv[optind]);
+            exit(EXIT_FAILURE);
+        }
+    }
+    fclose(in);
+
+    qsort(events, header.num_events, sizeof(TRACE_EVENT), by_time);
+    for(uint32_t i = 0; i < header.num_events; i++){
+        TRACE_EVENT *e = &events[i];
+        int packet = e->kind == TRACE_PACKET_IN || e->kind == TRACE_PACKET_OUT;
+        if((thread >= 0 && e->thread != thread) || (fd >= 0 && (!packet || e->a != fd))
+           || (object != 0 && (packet || e->b != object)))
+            continue;
+        uint64_t real = e->time + header.realtime_offset;
+        time_t secs = real / 1000000000;
+        struct tm tm;
+        char clock[16];
+        localtime_r(&secs, &tm);
+        strftime(clock, sizeof(clock), "%H:%M:%S", &tm);
+        printf("%s.%09llu %12.3f T%-4u ", clock, (unsigned long long) (real % 1000000000),
+               (e->time - events[0].time) / 1e3, e->thread);
+        print_event(e);
+    }
+    return EXIT_SUCCESS;
+}